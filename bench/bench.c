@@ -0,0 +1,402 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "fat32_api.h"
+#include "fat32_io.h"
+#include "fat32_bufcache.h"
+#include "fat32_shell.h"
+#include "fat32_mkfs.h"
+
+// ------------------------------------------------------------------------------------------------ //
+
+// End-to-end benchmarks: standard workloads run through the shell functions against a freshly generated image
+
+// Timings collected for one kind of operation
+struct OpStats {
+    const char *workload;
+    const char *operation;
+    uint64_t *samples;    // Latency of every operation in nanoseconds
+    uint32_t count;
+    uint32_t capacity;
+    uint64_t totalNs;
+    uint64_t bytes;       // Bytes moved by data operations (0 for metadata operations)
+};
+
+// Settings for a benchmark run
+struct BenchConfig {
+    const char *imagePath;
+    uint64_t imageBytes;
+    uint32_t sectorsPerCluster;
+    uint32_t fileCount;
+    uint32_t treeDepth;
+    uint32_t treeFanout;
+    uint32_t bigFileBytes;
+    uint32_t chunkBytes;
+    uint32_t randomOps;
+    uint32_t lsRepeats;
+    enum ImageBackend backend;
+    uint32_t cacheCapacity;
+    bool deferFlushes;
+    bool journaled;
+    bool keepImage;
+};
+
+static FILE *report;
+static struct FAT32Volume *volume;
+static uint64_t randomState = 0x9E3779B97F4A7C15ull;
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Benchmark helper functions
+
+// Function to read a monotonic clock in nanoseconds
+static uint64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Function to get the next number from a fixed-seed xorshift generator so every run does the same work
+static uint64_t nextRandom() {
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 7;
+    randomState ^= randomState << 17;
+    return randomState;
+}
+
+// Function to record how long one operation took
+static void recordSample(struct OpStats *stats, uint64_t startNs, uint64_t bytes) {
+    uint64_t elapsed = nowNs() - startNs;
+
+    if (stats->count == stats->capacity) {
+        uint32_t capacity = stats->capacity ? stats->capacity * 2 : 1024;
+        uint64_t *samples = realloc(stats->samples, capacity * sizeof(uint64_t));
+        if (!samples) {
+            return;
+        }
+        stats->samples = samples;
+        stats->capacity = capacity;
+    }
+
+    stats->samples[stats->count++] = elapsed;
+    stats->totalNs += elapsed;
+    stats->bytes += bytes;
+}
+
+// Function to order samples for the percentile calculation
+static int compareSamples(const void *a, const void *b) {
+    uint64_t first = *(const uint64_t *)a;
+    uint64_t second = *(const uint64_t *)b;
+    return (first > second) - (first < second);
+}
+
+// Function to print one line of the results table and release the samples
+static void reportStats(struct OpStats *stats) {
+    if (stats->count == 0) {
+        return;
+    }
+
+    qsort(stats->samples, stats->count, sizeof(uint64_t), compareSamples);
+    double seconds = stats->totalNs / 1e9;
+    double p50 = stats->samples[(stats->count - 1) * 50 / 100] / 1e3;
+    double p99 = stats->samples[(stats->count - 1) * 99 / 100] / 1e3;
+
+    fprintf(report, "%-12s %-10s %8u %12.1f ", stats->workload, stats->operation, stats->count, stats->count / seconds);
+    if (stats->bytes > 0) {
+        fprintf(report, "%9.1f ", stats->bytes / 1e6 / seconds);
+    }
+    else {
+        fprintf(report, "%9s ", "-");
+    }
+    fprintf(report, "%10.1f %10.1f\n", p50, p99);
+
+    free(stats->samples);
+    memset(stats, 0, sizeof(*stats));
+}
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Workloads
+
+// Function to create many files in one directory, list it repeatedly, then remove every file
+static void benchManyFiles(const struct BenchConfig *config) {
+    struct OpStats createStats = { "many-files", "creat" };
+    struct OpStats lsStats = { "many-files", "ls" };
+    struct OpStats rmStats = { "many-files", "rm" };
+    char path[64];
+
+    shellMkdir(volume, "/many");
+    for (uint32_t i = 0; i < config->fileCount; i++) {
+        snprintf(path, sizeof(path), "/many/f%u.txt", i);
+        uint64_t start = nowNs();
+        shellCreat(volume, path);
+        recordSample(&createStats, start, 0);
+    }
+
+    for (uint32_t i = 0; i < config->lsRepeats; i++) {
+        uint64_t start = nowNs();
+        shellLs(volume, "/many");
+        recordSample(&lsStats, start, 0);
+    }
+
+    for (uint32_t i = 0; i < config->fileCount; i++) {
+        snprintf(path, sizeof(path), "/many/f%u.txt", i);
+        uint64_t start = nowNs();
+        shellRm(volume, path);
+        recordSample(&rmStats, start, 0);
+    }
+
+    reportStats(&createStats);
+    reportStats(&lsStats);
+    reportStats(&rmStats);
+}
+
+// Function to build a directory tree breadth first with paths, then remove it with rm -r
+static void benchDirectoryTree(const struct BenchConfig *config) {
+    struct OpStats mkdirStats = { "dir-tree", "mkdir" };
+    struct OpStats rmrStats = { "dir-tree", "rm -r" };
+    char path[256];
+
+    shellMkdir(volume, "/tree");
+
+    // Number the directories of each level and turn every number into its path digit by digit
+    uint32_t levelSize = 1;
+    for (uint32_t depth = 1; depth <= config->treeDepth; depth++) {
+        levelSize *= config->treeFanout;
+        for (uint32_t node = 0; node < levelSize; node++) {
+            int length = snprintf(path, sizeof(path), "/tree");
+            uint32_t divisor = levelSize / config->treeFanout;
+            for (uint32_t level = 0; level < depth && length < (int)sizeof(path) - 8; level++) {
+                length += snprintf(path + length, sizeof(path) - length, "/d%u", (node / divisor) % config->treeFanout);
+                divisor = divisor > 1 ? divisor / config->treeFanout : 1;
+            }
+
+            uint64_t start = nowNs();
+            shellMkdir(volume, path);
+            recordSample(&mkdirStats, start, 0);
+        }
+    }
+
+    uint64_t start = nowNs();
+    shellRmr(volume, "/tree");
+    recordSample(&rmrStats, start, 0);
+
+    reportStats(&mkdirStats);
+    reportStats(&rmrStats);
+}
+
+// Function to write a large file sequentially, read it back, then do random reads and writes inside it
+static void benchLargeFile(const struct BenchConfig *config) {
+    struct OpStats seqWriteStats = { "large-file", "seq-write" };
+    struct OpStats seqReadStats = { "large-file", "seq-read" };
+    struct OpStats randWriteStats = { "large-file", "rand-write" };
+    struct OpStats randReadStats = { "large-file", "rand-read" };
+    char path[] = "/big.bin";
+
+    char *chunk = malloc(config->chunkBytes + 1);
+    if (!chunk) {
+        return;
+    }
+    memset(chunk, 'x', config->chunkBytes);
+    chunk[config->chunkBytes] = '\0';
+
+    shellCreat(volume, path);
+    shellOpen(volume, path, "-rw");
+
+    uint32_t chunkCount = config->bigFileBytes / config->chunkBytes;
+    for (uint32_t i = 0; i < chunkCount; i++) {
+        uint64_t start = nowNs();
+        shellWrite(volume, path, chunk);
+        recordSample(&seqWriteStats, start, config->chunkBytes);
+    }
+
+    shellLseek(volume, path, 0);
+    for (uint32_t i = 0; i < chunkCount; i++) {
+        uint64_t start = nowNs();
+        shellRead(volume, path, config->chunkBytes);
+        recordSample(&seqReadStats, start, config->chunkBytes);
+    }
+
+    // Random operations are chunk aligned so they never grow the file
+    for (uint32_t i = 0; i < config->randomOps && chunkCount > 0; i++) {
+        uint32_t offset = (nextRandom() % chunkCount) * config->chunkBytes;
+        uint64_t start = nowNs();
+        shellLseek(volume, path, offset);
+        shellWrite(volume, path, chunk);
+        recordSample(&randWriteStats, start, config->chunkBytes);
+    }
+
+    for (uint32_t i = 0; i < config->randomOps && chunkCount > 0; i++) {
+        uint32_t offset = (nextRandom() % chunkCount) * config->chunkBytes;
+        uint64_t start = nowNs();
+        shellLseek(volume, path, offset);
+        shellRead(volume, path, config->chunkBytes);
+        recordSample(&randReadStats, start, config->chunkBytes);
+    }
+
+    shellClose(volume, path);
+    shellRm(volume, path);
+    free(chunk);
+
+    reportStats(&seqWriteStats);
+    reportStats(&seqReadStats);
+    reportStats(&randWriteStats);
+    reportStats(&randReadStats);
+}
+
+// Function to stream a large host file into the image with import and back out with export
+static void benchHostCopy(const struct BenchConfig *config) {
+    struct OpStats importStats = { "host-copy", "import" };
+    struct OpStats exportStats = { "host-copy", "export" };
+    char hostPath[512];
+    char path[] = "/copy.bin";
+
+    // The host file sits next to the image and is filled in chunk-sized writes
+    snprintf(hostPath, sizeof(hostPath), "%s.host", config->imagePath);
+    FILE *host = fopen(hostPath, "wb");
+    char *chunk = malloc(config->chunkBytes);
+    if (!host || !chunk) {
+        if (host) fclose(host);
+        free(chunk);
+        return;
+    }
+    memset(chunk, 'x', config->chunkBytes);
+    for (uint32_t written = 0; written < config->bigFileBytes; written += config->chunkBytes) {
+        fwrite(chunk, 1, config->chunkBytes, host);
+    }
+    fclose(host);
+    free(chunk);
+    uint64_t hostBytes = (uint64_t)(config->bigFileBytes / config->chunkBytes) * config->chunkBytes;
+
+    uint64_t start = nowNs();
+    shellImport(volume, hostPath, path);
+    recordSample(&importStats, start, hostBytes);
+
+    start = nowNs();
+    shellExport(volume, path, hostPath);
+    recordSample(&exportStats, start, hostBytes);
+
+    shellRm(volume, path);
+    remove(hostPath);
+
+    reportStats(&importStats);
+    reportStats(&exportStats);
+}
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Function to read a numeric option, rejecting zero
+static int parsePositive(const char *text, uint32_t *value) {
+    char *end;
+    unsigned long parsed = strtoul(text, &end, 10);
+    if (*end != '\0' || parsed == 0) {
+        return -1;
+    }
+    *value = (uint32_t)parsed;
+    return 0;
+}
+
+// Main function
+int main(int argc, char *argv[]) {
+    struct BenchConfig config = {
+        "bin/bench.img", 256ull << 20, 8, 2000, 4, 4, 8u << 20, 4096, 2000, 20,
+        IO_BACKEND_MMAP, BUFFER_CACHE_DEFAULT_CAPACITY, false, false, false
+    };
+    uint32_t imageMB = 256;
+
+    // An optional image path comes first, followed by option pairs
+    int first = (argc >= 2 && argv[1][0] != '-') ? 2 : 1;
+    if ((argc - first) % 2 != 0) {
+        printf("To run the benchmarks, try: ./bin/bench [IMAGE] [-size MB] [-spc SECTORS] [-files N] [-depth N] [-fanout N]\n"
+               "                            [-filesize MB] [-chunk BYTES] [-ops N] [-ls N] [-io mmap|stdio|uring] [-cache CLUSTERS]\n"
+               "                            [-flush each|defer] [-journal yes|no] [-keep yes|no]\n");
+        return 1;
+    }
+
+    if (first == 2) {
+        config.imagePath = argv[1];
+    }
+
+    for (int i = first; i < argc; i += 2) {
+        uint32_t value = 0;
+        int error = 0;
+
+        if (strcmp(argv[i], "-size") == 0) { error = parsePositive(argv[i + 1], &imageMB); }
+        else if (strcmp(argv[i], "-spc") == 0) { error = parsePositive(argv[i + 1], &config.sectorsPerCluster); }
+        else if (strcmp(argv[i], "-files") == 0) { error = parsePositive(argv[i + 1], &config.fileCount); }
+        else if (strcmp(argv[i], "-depth") == 0) { error = parsePositive(argv[i + 1], &config.treeDepth); }
+        else if (strcmp(argv[i], "-fanout") == 0) { error = parsePositive(argv[i + 1], &config.treeFanout); }
+        else if (strcmp(argv[i], "-filesize") == 0) { error = parsePositive(argv[i + 1], &value); config.bigFileBytes = value << 20; }
+        else if (strcmp(argv[i], "-chunk") == 0) { error = parsePositive(argv[i + 1], &config.chunkBytes); }
+        else if (strcmp(argv[i], "-ops") == 0) { error = parsePositive(argv[i + 1], &config.randomOps); }
+        else if (strcmp(argv[i], "-ls") == 0) { error = parsePositive(argv[i + 1], &config.lsRepeats); }
+        else if (strcmp(argv[i], "-cache") == 0) { error = parsePositive(argv[i + 1], &config.cacheCapacity); }
+        else if (strcmp(argv[i], "-io") == 0) { error = parseImageBackend(argv[i + 1], &config.backend); }
+        else if (strcmp(argv[i], "-flush") == 0) { config.deferFlushes = strcmp(argv[i + 1], "defer") == 0; }
+        else if (strcmp(argv[i], "-journal") == 0) { config.journaled = strcmp(argv[i + 1], "yes") == 0; }
+        else if (strcmp(argv[i], "-keep") == 0) { config.keepImage = strcmp(argv[i + 1], "yes") == 0; }
+        else { error = -1; }
+
+        if (error) {
+            printf("Invalid option '%s %s'.\n", argv[i], argv[i + 1]);
+            return 1;
+        }
+    }
+    config.imageBytes = (uint64_t)imageMB << 20;
+
+    struct MkfsOptions mkfsOptions;
+    defaultMkfsOptions(&mkfsOptions);
+    mkfsOptions.sizeBytes = config.imageBytes;
+    mkfsOptions.sectorsPerCluster = config.sectorsPerCluster;
+    strcpy(mkfsOptions.volumeLabel, "BENCH");
+    if (formatImage(config.imagePath, &mkfsOptions) != 0) {
+        printf("Unable to create the benchmark image '%s'.\n", config.imagePath);
+        return 1;
+    }
+    int result = fat32Mount(config.imagePath, config.backend, config.cacheCapacity, &volume);
+    if (result != FAT32_OK) {
+        printf("Unable to mount the benchmark image '%s': %s.\n", config.imagePath, fat32StrError(result));
+        return 1;
+    }
+    fat32SetDeferredFlush(volume, config.deferFlushes);
+    if (config.journaled && fat32SetJournal(volume, true) != FAT32_OK) {
+        printf("Unable to start the journal of '%s'.\n", config.imagePath);
+        fat32Unmount(volume);
+        return 1;
+    }
+
+    struct FAT32VolumeInfo volumeInfo;
+    fat32GetVolumeInfo(volume, &volumeInfo);
+
+    printf("Image: %s (%u MB, %u-byte clusters, %s I/O, %u cached clusters, %s flushes%s)\n",
+           config.imagePath, imageMB, config.sectorsPerCluster * 512, volumeInfo.backendName,
+           config.cacheCapacity, config.deferFlushes ? "deferred" : "per-operation", config.journaled ? ", journaled" : "");
+    printf("%-12s %-10s %8s %12s %9s %10s %10s\n", "workload", "op", "count", "ops/sec", "MB/s", "p50(us)", "p99(us)");
+    fflush(stdout);
+
+    // The shell functions report every step on stdout, so results go to the real stdout and the chatter is discarded
+    report = stdout;
+    stdout = fopen("/dev/null", "w");
+    if (!stdout) {
+        stdout = report;
+        printf("Unable to open /dev/null.\n");
+        fat32Unmount(volume);
+        return 1;
+    }
+
+    benchManyFiles(&config);
+    benchDirectoryTree(&config);
+    benchLargeFile(&config);
+    benchHostCopy(&config);
+
+    fclose(stdout);
+    stdout = report;
+    fat32Unmount(volume);
+
+    if (!config.keepImage) {
+        remove(config.imagePath);
+    }
+    return 0;
+}
@@ -0,0 +1,353 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "fat32_structs.h"
+#include "fat32_utils.h"
+#include "fat32_fatcache.h"
+#include "fat32_alloc.h"
+#include "fat32_io.h"
+#include "fat32_bufcache.h"
+#include "fat32_dirindex.h"
+#include "fat32_dirscan.h"
+#include "fat32_path.h"
+#include "fat32_mount.h"
+#include "fat32_mkfs.h"
+#include "fat32_api.h"
+#include "globals.h"
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Microbenchmarks: ns/op of the primitives every shell command funnels through, on a generated image
+
+// Number of clusters in the scattered chain walked by the getNextCluster benchmark (a power of two)
+#define CHAIN_LENGTH 65536
+
+// One primitive to measure; runs it 'iterations' times and returns a value derived from the results
+struct Microbench {
+    const char *name;
+    uint64_t (*run)(uint32_t iterations);
+};
+
+// Measured cost of one primitive
+struct MicroResult {
+    const char *name;
+    double medianNs;
+    double minNs;
+    uint32_t iterations;     // Calls per repetition
+    uint32_t repetitions;
+};
+
+// Inputs shared by the benchmarks
+static uint32_t chainStart;
+static uint32_t scanDirCluster;
+static uint32_t firstFreeCluster;
+static struct DirScanKey lastNameKey;
+static struct FAT32Volume *volume;
+static volatile uint64_t sink;
+
+static const char rawNames[16][12] = {
+    "FILE    TXT", "README     ", "A          ", "LONGNAMETXT", "DATA0001BIN", "X       Y  ", "NOTES   MD ", "ABCDEFGHIJK",
+    "IMAGE   PNG", "SRC        ", "MAIN    C  ", "MAKEFILE   ", "Q       Z  ", "TEMP    TMP", "LOG     1  ", "ARCHIVE ZIP"
+};
+
+static const char *inputNames[16] = {
+    "file.txt", "readme", "a", "longname.txt", "data0001.bin", "x.y", "notes.md", "abcdefghijk",
+    "image.png", "src", "main.c", "Makefile", "q.z", "temp.tmp", "log.1", "archive.zip"
+};
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Microbenchmark helper functions
+
+// Function to read a monotonic clock in nanoseconds
+static uint64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Function to read a numeric option, rejecting zero
+static int parsePositive(const char *text, uint32_t *value) {
+    char *end;
+    unsigned long parsed = strtoul(text, &end, 10);
+    if (*end != '\0' || parsed == 0) {
+        return -1;
+    }
+    *value = (uint32_t)parsed;
+    return 0;
+}
+
+// Function to order per-repetition timings for the median
+static int compareDoubles(const void *a, const void *b) {
+    double first = *(const double *)a;
+    double second = *(const double *)b;
+    return (first > second) - (first < second);
+}
+
+// Function to measure one primitive: calibrate the calls per repetition until a repetition takes at least
+// 'minTimeNs' (which also warms the caches up), then time 'repetitions' repetitions
+static struct MicroResult measure(const struct Microbench *bench, uint32_t repetitions, uint64_t minTimeNs) {
+    struct MicroResult result = { bench->name, 0, 0, 1000, repetitions };
+
+    for (;;) {
+        uint64_t start = nowNs();
+        sink += bench->run(result.iterations);
+        if (nowNs() - start >= minTimeNs || result.iterations >= (1u << 30)) break;
+        result.iterations *= 2;
+    }
+
+    double *timings = malloc(repetitions * sizeof(double));
+    if (!timings) {
+        return result;
+    }
+
+    for (uint32_t r = 0; r < repetitions; r++) {
+        uint64_t start = nowNs();
+        sink += bench->run(result.iterations);
+        timings[r] = (double)(nowNs() - start) / result.iterations;
+    }
+
+    qsort(timings, repetitions, sizeof(double), compareDoubles);
+    result.medianNs = timings[repetitions / 2];
+    result.minNs = timings[0];
+    free(timings);
+    return result;
+}
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Primitives
+
+static uint64_t runGetNextCluster(uint32_t iterations) {
+    uint64_t sum = 0;
+    uint32_t cluster = chainStart;
+    for (uint32_t i = 0; i < iterations; i++) {
+        cluster = getNextCluster(cluster);
+        if (cluster == 0xFFFFFFFF) cluster = chainStart;
+        sum += cluster;
+    }
+    return sum;
+}
+
+// Every cluster before the free one is in use, so each call scans the used half of the bitmap
+static uint64_t runFindFreeClusterScan(uint32_t iterations) {
+    uint64_t sum = 0;
+    activeVolume->allocator.nextFree = 2;
+    for (uint32_t i = 0; i < iterations; i++) {
+        sum += findFreeCluster();
+    }
+    return sum;
+}
+
+// The hint points straight at the free cluster, the common case after an allocation
+static uint64_t runFindFreeClusterHint(uint32_t iterations) {
+    uint64_t sum = 0;
+    activeVolume->allocator.nextFree = firstFreeCluster;
+    for (uint32_t i = 0; i < iterations; i++) {
+        sum += findFreeCluster();
+    }
+    return sum;
+}
+
+static uint64_t runGetFirstSectorOfCluster(uint32_t iterations) {
+    uint64_t sum = 0;
+    for (uint32_t i = 0; i < iterations; i++) {
+        sum += getFirstSectorOfCluster(2 + (i & (CHAIN_LENGTH - 1)));
+    }
+    return sum;
+}
+
+static uint64_t runFormatDirName(uint32_t iterations) {
+    uint64_t sum = 0;
+    char formatted[13];
+    for (uint32_t i = 0; i < iterations; i++) {
+        formatDirName(rawNames[i & 15], formatted);
+        sum += formatted[0];
+    }
+    return sum;
+}
+
+static uint64_t runToFAT32Name(uint32_t iterations) {
+    uint64_t sum = 0;
+    char fat32Name[12];
+    for (uint32_t i = 0; i < iterations; i++) {
+        toFAT32Name(inputNames[i & 15], fat32Name);
+        sum += fat32Name[0];
+    }
+    return sum;
+}
+
+// Indexing a directory reads every entry of its (cached) cluster once
+static uint64_t runDirectoryScan(uint32_t iterations) {
+    uint64_t sum = 0;
+    for (uint32_t i = 0; i < iterations; i++) {
+        dropDirIndex(scanDirCluster);
+        struct DirIndex *index = getDirIndex(scanDirCluster);
+        sum += index ? index->liveCount : 0;
+    }
+    return sum;
+}
+
+// Looking up the last name of a full cluster with the scan kernel, without building an index
+static uint64_t runDirScanKernel(uint32_t iterations) {
+    uint32_t entriesPerCluster = activeVolume->bootSector.sectorsPerCluster * (activeVolume->bootSector.bytesPerSector / sizeof(struct FAT32DirectoryEntry));
+    const struct FAT32DirectoryEntry *entries = (const struct FAT32DirectoryEntry *)getCluster(scanDirCluster);
+    struct DirScanResult scan;
+    uint64_t sum = 0;
+    for (uint32_t i = 0; i < iterations; i++) {
+        scanDirEntries(entries, entriesPerCluster, &lastNameKey, NULL, NULL, &scan);
+        sum += scan.matchIndex;
+    }
+    return sum;
+}
+
+static const struct Microbench benchmarks[] = {
+    { "getNextCluster", runGetNextCluster },
+    { "findFreeCluster/scan", runFindFreeClusterScan },
+    { "findFreeCluster/hint", runFindFreeClusterHint },
+    { "getFirstSectorOfCluster", runGetFirstSectorOfCluster },
+    { "formatDirName", runFormatDirName },
+    { "toFAT32Name", runToFAT32Name },
+    { "directoryScan/cluster", runDirectoryScan },
+    { "dirScanKernel/cluster", runDirScanKernel },
+};
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Function to set up the inputs: a scattered cluster chain, a half-full bitmap and a directory with one full cluster
+static int prepareImage() {
+    uint32_t entriesPerCluster = activeVolume->bootSector.sectorsPerCluster * (activeVolume->bootSector.bytesPerSector / sizeof(struct FAT32DirectoryEntry));
+    char path[32];
+
+    if (activeVolume->allocator.clusterCount < 2 * CHAIN_LENGTH + 8) {
+        printf("The image needs at least %u clusters.\n", 2 * CHAIN_LENGTH + 8);
+        return -1;
+    }
+
+    // A directory whose only cluster is completely full ('.' and '..' take two entries)
+    fat32Mkdir(volume, "/scan");
+    for (uint32_t i = 0; i < entriesPerCluster - 2; i++) {
+        snprintf(path, sizeof(path), "/scan/f%u", i);
+        fat32Creat(volume, path);
+    }
+    scanDirCluster = resolveDirectory(activeVolume->bootSector.rootCluster, "/scan");
+
+    // The last name in the cluster, so a lookup by scanning has to look at every entry
+    char fat32Name[12];
+    snprintf(path, sizeof(path), "f%u", entriesPerCluster - 3);
+    toFAT32Name(path, fat32Name);
+    packDirScanKey(fat32Name, &lastNameKey);
+
+    // A chain through CHAIN_LENGTH clusters visited in a scattered order (the step is odd, so it visits all of them)
+    uint32_t base = activeVolume->allocator.clusterCount - CHAIN_LENGTH;
+    chainStart = base;
+    for (uint32_t i = 0; i < CHAIN_LENGTH; i++) {
+        uint32_t cluster = base + (uint32_t)(((uint64_t)i * 40503) & (CHAIN_LENGTH - 1));
+        uint32_t next = base + (uint32_t)(((uint64_t)(i + 1) * 40503) & (CHAIN_LENGTH - 1));
+        setFATEntry(cluster, i + 1 < CHAIN_LENGTH ? next : 0x0FFFFFFF);
+    }
+
+    // Use up the first half of the data region so a search from the start has to skip it
+    firstFreeCluster = activeVolume->allocator.clusterCount / 2;
+    for (uint32_t cluster = 2; cluster < firstFreeCluster; cluster++) {
+        markClusterUsed(cluster);
+    }
+    return 0;
+}
+
+// Main function
+int main(int argc, char *argv[]) {
+    const char *imagePath = "bin/microbench.img";
+    bool json = false;
+    uint32_t repetitions = 15;
+    uint32_t minTimeMs = 20;
+    uint64_t imageBytes = 1ull << 30;
+    enum ImageBackend backend = IO_BACKEND_MMAP;
+
+    // An optional image path comes first, followed by option pairs
+    int first = (argc >= 2 && argv[1][0] != '-') ? 2 : 1;
+    if ((argc - first) % 2 != 0) {
+        printf("To run the microbenchmarks, try: ./bin/microbench [IMAGE] [-format csv|json] [-reps N] [-mintime MS] [-size SIZE] [-io mmap|stdio|uring]\n");
+        return 1;
+    }
+    if (first == 2) {
+        imagePath = argv[1];
+    }
+
+    for (int i = first; i < argc; i += 2) {
+        int error = 0;
+
+        if (strcmp(argv[i], "-format") == 0) { json = strcmp(argv[i + 1], "json") == 0; error = !json && strcmp(argv[i + 1], "csv") != 0; }
+        else if (strcmp(argv[i], "-reps") == 0) { error = parsePositive(argv[i + 1], &repetitions); }
+        else if (strcmp(argv[i], "-mintime") == 0) { error = parsePositive(argv[i + 1], &minTimeMs); }
+        else if (strcmp(argv[i], "-size") == 0) { error = parseSize(argv[i + 1], &imageBytes); }
+        else if (strcmp(argv[i], "-io") == 0) { error = parseImageBackend(argv[i + 1], &backend); }
+        else { error = -1; }
+
+        if (error) {
+            printf("Invalid option '%s %s'.\n", argv[i], argv[i + 1]);
+            return 1;
+        }
+    }
+
+    // The setup and the shell functions report on stdout, so only the results go to the real stdout
+    FILE *results = stdout;
+    stdout = fopen("/dev/null", "w");
+    if (!stdout) {
+        stdout = results;
+        printf("Unable to open /dev/null.\n");
+        return 1;
+    }
+
+    struct MkfsOptions mkfsOptions;
+    defaultMkfsOptions(&mkfsOptions);
+    mkfsOptions.sizeBytes = imageBytes;
+    mkfsOptions.sectorsPerCluster = 8;
+    strcpy(mkfsOptions.volumeLabel, "MICROBENCH");
+    if (formatImage(imagePath, &mkfsOptions) != 0 || fat32Mount(imagePath, backend, 0, &volume) != FAT32_OK) {
+        fclose(stdout);
+        stdout = results;
+        printf("Unable to create the microbenchmark image '%s'.\n", imagePath);
+        return 1;
+    }
+    fat32SetDeferredFlush(volume, true);
+
+    int status = prepareImage();
+    size_t benchCount = sizeof(benchmarks) / sizeof(benchmarks[0]);
+    struct MicroResult measured[sizeof(benchmarks) / sizeof(benchmarks[0])];
+    for (size_t i = 0; i < benchCount && status == 0; i++) {
+        measured[i] = measure(&benchmarks[i], repetitions, (uint64_t)minTimeMs * 1000000);
+    }
+
+    // Nothing measured here needs to reach the image
+    fat32SetDeferredFlush(volume, false);
+    fat32Unmount(volume);
+    remove(imagePath);
+    fclose(stdout);
+    stdout = results;
+
+    if (status != 0) {
+        printf("Unable to prepare the microbenchmark image.\n");
+        return 1;
+    }
+
+    if (json) {
+        printf("[\n");
+        for (size_t i = 0; i < benchCount; i++) {
+            printf("  {\"benchmark\": \"%s\", \"ns_per_op_median\": %.3f, \"ns_per_op_min\": %.3f, \"iterations\": %u, \"repetitions\": %u}%s\n",
+                   measured[i].name, measured[i].medianNs, measured[i].minNs, measured[i].iterations, measured[i].repetitions,
+                   i + 1 < benchCount ? "," : "");
+        }
+        printf("]\n");
+    }
+    else {
+        printf("benchmark,ns_per_op_median,ns_per_op_min,iterations,repetitions\n");
+        for (size_t i = 0; i < benchCount; i++) {
+            printf("%s,%.3f,%.3f,%u,%u\n", measured[i].name, measured[i].medianNs, measured[i].minNs,
+                   measured[i].iterations, measured[i].repetitions);
+        }
+    }
+    return 0;
+}
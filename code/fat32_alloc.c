@@ -0,0 +1,362 @@
+#include "fat32_structs.h"
+#include "fat32_alloc.h"
+#include "fat32_fatcache.h"
+#include "fat32_io.h"
+#include "fat32_journal.h"
+#include "fat32_utils.h"
+#include "globals.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Allocator implementations
+
+// Function to build the free-space bitmap from the cached FAT and load the FSInfo hints
+int initAllocator() {
+    freeAllocator();
+
+    activeVolume->allocator.clusterCount = activeVolume->fatCache.clusterCount;
+    activeVolume->allocator.wordCount = (activeVolume->allocator.clusterCount + 63) / 64;
+    activeVolume->allocator.bitmap = calloc(activeVolume->allocator.wordCount, sizeof(uint64_t));
+    if (!activeVolume->allocator.bitmap) {
+        return -1;
+    }
+
+    // Clusters 0 and 1 are reserved, and the bits past the last cluster must never look free
+    activeVolume->allocator.bitmap[0] |= 0x3;
+    for (uint32_t i = activeVolume->allocator.clusterCount; i < activeVolume->allocator.wordCount * 64; i++) {
+        activeVolume->allocator.bitmap[i / 64] |= (uint64_t)1 << (i % 64);
+    }
+
+    activeVolume->allocator.freeCount = 0;
+    activeVolume->allocator.reservedCount = 0;
+    for (uint32_t i = 2; i < activeVolume->allocator.clusterCount; i++) {
+        if (getFATEntry(i) != 0) {
+            activeVolume->allocator.bitmap[i / 64] |= (uint64_t)1 << (i % 64);
+        }
+        else {
+            activeVolume->allocator.freeCount++;
+        }
+    }
+
+    // Read the FSInfo sector to pick up the next free hint
+    struct FAT32FSInfo fsInfo;
+    activeVolume->allocator.nextFree = 2;
+    activeVolume->allocator.hasFSInfo = false;
+    activeVolume->allocator.fsInfoDirty = false;
+
+    if (activeVolume->bootSector.FSInfo != 0 && activeVolume->bootSector.FSInfo != 0xFFFF && activeVolume->bootSector.bytesPerSector >= sizeof(fsInfo)) {
+        if (readImage((uint64_t)activeVolume->bootSector.FSInfo * activeVolume->bootSector.bytesPerSector, &fsInfo, sizeof(fsInfo)) == sizeof(fsInfo) &&
+            fsInfo.leadSignature == FSINFO_LEAD_SIGNATURE &&
+            fsInfo.structSignature == FSINFO_STRUCT_SIGNATURE &&
+            fsInfo.trailSignature == FSINFO_TRAIL_SIGNATURE) {
+            activeVolume->allocator.hasFSInfo = true;
+
+            if (fsInfo.nextFree >= 2 && fsInfo.nextFree < activeVolume->allocator.clusterCount) {
+                activeVolume->allocator.nextFree = fsInfo.nextFree;
+            }
+
+            // The stored count is only a hint, so correct it if it disagrees with the FAT
+            if (fsInfo.freeCount != activeVolume->allocator.freeCount) {
+                activeVolume->allocator.fsInfoDirty = true;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Function to release the free-space bitmap
+void freeAllocator() {
+    free(activeVolume->allocator.bitmap);
+    memset(&activeVolume->allocator, 0, sizeof(activeVolume->allocator));
+}
+
+// Function to check whether a cluster is free according to the bitmap
+bool isClusterFree(uint32_t cluster) {
+    if (cluster < 2 || cluster >= activeVolume->allocator.clusterCount) {
+        return false;
+    }
+    return (activeVolume->allocator.bitmap[cluster / 64] & ((uint64_t)1 << (cluster % 64))) == 0;
+}
+
+// Function to record that a cluster is now in use
+void markClusterUsed(uint32_t cluster) {
+    if (!isClusterFree(cluster)) {
+        return;
+    }
+    activeVolume->allocator.bitmap[cluster / 64] |= (uint64_t)1 << (cluster % 64);
+    activeVolume->allocator.freeCount--;
+    activeVolume->allocator.fsInfoDirty = true;
+}
+
+// Function to record that a cluster has been released
+void markClusterFree(uint32_t cluster) {
+    if (cluster < 2 || cluster >= activeVolume->allocator.clusterCount || isClusterFree(cluster)) {
+        return;
+    }
+    activeVolume->allocator.bitmap[cluster / 64] &= ~((uint64_t)1 << (cluster % 64));
+    activeVolume->allocator.freeCount++;
+    activeVolume->allocator.fsInfoDirty = true;
+
+    // Keep the hint pointing at the lowest known free cluster so the volume fills from the front
+    if (cluster < activeVolume->allocator.nextFree) {
+        activeVolume->allocator.nextFree = cluster;
+    }
+}
+
+// Function to find the next free cluster, starting at the next free hint and wrapping around once
+uint32_t findFreeCluster() {
+    if (activeVolume->allocator.freeCount == 0) {
+        return 0xFFFFFFFF;
+    }
+
+    uint32_t startWord = activeVolume->allocator.nextFree / 64;
+
+    for (uint32_t n = 0; n <= activeVolume->allocator.wordCount; n++) {
+        uint32_t word = (startWord + n) % activeVolume->allocator.wordCount;
+        uint64_t bits = activeVolume->allocator.bitmap[word];
+
+        // Ignore the clusters before the hint on the first pass through the starting word
+        if (n == 0) {
+            bits |= ((uint64_t)1 << (activeVolume->allocator.nextFree % 64)) - 1;
+        }
+
+        if (bits != 0xFFFFFFFFFFFFFFFFULL) {
+            return word * 64 + __builtin_ctzll(~bits);
+        }
+    }
+
+    // If this far, no free cluster found
+    return 0xFFFFFFFF;
+}
+
+// Function to promise free clusters to data that will be allocated later. Reserved clusters stay free, but other
+// allocations cannot take them. Returns false if not enough unreserved clusters are left.
+bool reserveClusters(uint32_t count) {
+    if (count > activeVolume->allocator.freeCount - activeVolume->allocator.reservedCount) {
+        return false;
+    }
+    activeVolume->allocator.reservedCount += count;
+    return true;
+}
+
+// Function to give back clusters reserved with reserveClusters (done right before they are allocated, or if the
+// data they were reserved for is dropped)
+void releaseClusters(uint32_t count) {
+    activeVolume->allocator.reservedCount -= count < activeVolume->allocator.reservedCount ? count : activeVolume->allocator.reservedCount;
+}
+
+// Function to free whole cluster chains in one pass: every FAT entry is cleared in the FAT cache (so the dirty sectors
+// are written back together) and the free count and hint are updated once at the end. Returns the clusters freed.
+uint32_t freeClusterChains(const uint32_t *firstClusters, uint32_t count) {
+    uint32_t freed = 0;
+    uint32_t lowest = activeVolume->allocator.nextFree;
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t cluster = firstClusters[i];
+        while (cluster >= 2 && cluster < activeVolume->allocator.clusterCount) {
+            // A cluster that is already free ends the walk, which also stops a chain that loops back on itself
+            uint32_t next = getFATEntry(cluster);
+            if (next == 0) {
+                break;
+            }
+
+            setFATEntry(cluster, 0);
+            if (!isClusterFree(cluster)) {
+                activeVolume->allocator.bitmap[cluster / 64] &= ~((uint64_t)1 << (cluster % 64));
+                freed++;
+                if (cluster < lowest) {
+                    lowest = cluster;
+                }
+            }
+            cluster = next < 0x0FFFFFF8 ? next : 0;
+        }
+    }
+
+    if (freed > 0) {
+        activeVolume->allocator.freeCount += freed;
+        activeVolume->allocator.nextFree = lowest;
+        activeVolume->allocator.fsInfoDirty = true;
+    }
+    return freed;
+}
+
+// Function to claim a free cluster and terminate it as a one-cluster chain
+uint32_t allocateCluster() {
+    if (activeVolume->allocator.freeCount <= activeVolume->allocator.reservedCount) {
+        return 0xFFFFFFFF;
+    }
+
+    uint32_t cluster = findFreeCluster();
+    if (cluster == 0xFFFFFFFF) {
+        return cluster;
+    }
+
+    updateFATChain(cluster, 0x0FFFFFF8);
+    activeVolume->allocator.nextFree = cluster + 1 < activeVolume->allocator.clusterCount ? cluster + 1 : 2;
+    return cluster;
+}
+
+// Function to find a run of free clusters in [from, to) at least 'wanted' long, or else the longest run there
+static uint32_t findFreeRunInRange(uint32_t from, uint32_t to, uint32_t wanted, uint32_t *runLength) {
+    uint32_t bestStart = 0xFFFFFFFF, bestLength = 0;
+    uint32_t runStart = 0, length = 0;
+    uint32_t cluster = from;
+
+    while (cluster < to) {
+        uint64_t bits = activeVolume->allocator.bitmap[cluster / 64];
+
+        // Skip or swallow whole words at once when the cluster is word aligned
+        if (cluster % 64 == 0 && cluster + 64 <= to && (bits == 0xFFFFFFFFFFFFFFFFULL || bits == 0)) {
+            if (bits == 0) {
+                if (length == 0) runStart = cluster;
+                length += 64;
+            }
+            else {
+                length = 0;
+            }
+            cluster += 64;
+        }
+        else {
+            if (isClusterFree(cluster)) {
+                if (length == 0) runStart = cluster;
+                length++;
+            }
+            else {
+                length = 0;
+            }
+            cluster++;
+        }
+
+        if (length > bestLength) {
+            bestStart = runStart;
+            bestLength = length;
+            if (bestLength >= wanted) break;
+        }
+    }
+
+    *runLength = bestLength;
+    return bestStart;
+}
+
+// Function to find a free run that satisfies 'wanted' clusters, or the largest free run on the volume
+static uint32_t findFreeRun(uint32_t wanted, uint32_t *runLength) {
+    uint32_t tailLength = 0, headLength = 0;
+    uint32_t tailStart = findFreeRunInRange(activeVolume->allocator.nextFree, activeVolume->allocator.clusterCount, wanted, &tailLength);
+    if (tailLength >= wanted) {
+        *runLength = tailLength;
+        return tailStart;
+    }
+
+    uint32_t headStart = findFreeRunInRange(2, activeVolume->allocator.nextFree, wanted, &headLength);
+    if (headLength > tailLength) {
+        *runLength = headLength;
+        return headStart;
+    }
+
+    *runLength = tailLength;
+    return tailStart;
+}
+
+// Function to claim 'count' clusters as a single terminated chain, built from as few contiguous runs as possible.
+// Clusters directly after 'after' are taken first so a growing file stays in one piece; returns the first cluster.
+uint32_t allocateExtent(uint32_t after, uint32_t count) {
+    uint32_t first = 0xFFFFFFFF;
+    uint32_t tail = 0;
+    uint32_t remaining = count;
+
+    if (count == 0 || count > activeVolume->allocator.freeCount - activeVolume->allocator.reservedCount) {
+        return 0xFFFFFFFF;
+    }
+
+    // Extend in place while the clusters following the current end are free
+    if (after >= 2) {
+        for (uint32_t cluster = after + 1; remaining > 0 && isClusterFree(cluster); cluster++) {
+            if (tail != 0) updateFATChain(tail, cluster);
+            else first = cluster;
+            markClusterUsed(cluster);
+            tail = cluster;
+            remaining--;
+        }
+    }
+
+    // Take the rest from the largest runs available until the request is satisfied
+    while (remaining > 0) {
+        uint32_t runLength = 0;
+        uint32_t runStart = findFreeRun(remaining, &runLength);
+        if (runStart == 0xFFFFFFFF || runLength == 0) {
+            break;
+        }
+
+        uint32_t take = runLength < remaining ? runLength : remaining;
+        for (uint32_t cluster = runStart; cluster < runStart + take; cluster++) {
+            if (tail != 0) updateFATChain(tail, cluster);
+            else first = cluster;
+            markClusterUsed(cluster);
+            tail = cluster;
+        }
+        remaining -= take;
+        activeVolume->allocator.nextFree = runStart + take < activeVolume->allocator.clusterCount ? runStart + take : 2;
+    }
+
+    // The bitmap and free count disagreed, so give back what was taken
+    if (remaining > 0) {
+        if (first != 0xFFFFFFFF) {
+            updateFATChain(tail, 0x0FFFFFF8);
+            freeClusters(first);
+        }
+        return 0xFFFFFFFF;
+    }
+
+    updateFATChain(tail, 0x0FFFFFF8);
+    return first;
+}
+
+// Function to claim 'count' physically contiguous clusters as a single terminated chain, returning the first cluster,
+// or 0xFFFFFFFF if the volume has no free run that long (nothing is claimed then)
+uint32_t allocateRun(uint32_t count) {
+    uint32_t runLength = 0;
+
+    if (count == 0 || count > activeVolume->allocator.freeCount - activeVolume->allocator.reservedCount) {
+        return 0xFFFFFFFF;
+    }
+
+    uint32_t runStart = findFreeRun(count, &runLength);
+    if (runStart == 0xFFFFFFFF || runLength < count) {
+        return 0xFFFFFFFF;
+    }
+
+    for (uint32_t cluster = runStart; cluster < runStart + count; cluster++) {
+        markClusterUsed(cluster);
+        updateFATChain(cluster, cluster + 1 < runStart + count ? cluster + 1 : 0x0FFFFFF8);
+    }
+    activeVolume->allocator.nextFree = runStart + count < activeVolume->allocator.clusterCount ? runStart + count : 2;
+    return runStart;
+}
+
+// Function to write the free count and next free hint back to the FSInfo sector
+int flushFSInfo() {
+    struct FAT32FSInfo fsInfo;
+    uint64_t position = (uint64_t)activeVolume->bootSector.FSInfo * activeVolume->bootSector.bytesPerSector;
+
+    if (!activeVolume->allocator.hasFSInfo || !activeVolume->allocator.fsInfoDirty) {
+        return 0;
+    }
+
+    if (readImage(position, &fsInfo, sizeof(fsInfo)) != sizeof(fsInfo)) {
+        return -1;
+    }
+
+    fsInfo.freeCount = activeVolume->allocator.freeCount;
+    fsInfo.nextFree = activeVolume->allocator.nextFree;
+
+    if (journalWrite(position, &fsInfo, sizeof(fsInfo)) != 0) {
+        return -1;
+    }
+
+    activeVolume->allocator.fsInfoDirty = false;
+    return 0;
+}
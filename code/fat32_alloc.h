@@ -0,0 +1,39 @@
+#ifndef FAT32_ALLOC_H
+#define FAT32_ALLOC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define FSINFO_LEAD_SIGNATURE   0x41615252
+#define FSINFO_STRUCT_SIGNATURE 0x61417272
+#define FSINFO_TRAIL_SIGNATURE  0xAA550000
+#define FSINFO_UNKNOWN          0xFFFFFFFF
+
+// Free-space bitmap built from the FAT at mount, kept in sync with the FSInfo sector
+struct ClusterAllocator {
+    uint64_t *bitmap;        // One bit per cluster, set when the cluster is in use
+    uint32_t wordCount;      // Number of 64-bit words in the bitmap
+    uint32_t clusterCount;   // Highest usable cluster number + 1
+    uint32_t freeCount;      // Number of free clusters on the volume
+    uint32_t reservedCount;  // Free clusters promised to buffered writes that are not allocated yet
+    uint32_t nextFree;       // Cluster to start the next free-cluster search from
+    bool hasFSInfo;          // Whether the image has a valid FSInfo sector to keep updated
+    bool fsInfoDirty;        // Whether freeCount or nextFree changed since the last flush
+};
+
+// Allocator functions
+int initAllocator();
+void freeAllocator();
+uint32_t findFreeCluster();
+uint32_t allocateCluster();
+uint32_t allocateExtent(uint32_t after, uint32_t count);
+uint32_t allocateRun(uint32_t count);
+void markClusterUsed(uint32_t cluster);
+void markClusterFree(uint32_t cluster);
+bool isClusterFree(uint32_t cluster);
+bool reserveClusters(uint32_t count);
+void releaseClusters(uint32_t count);
+uint32_t freeClusterChains(const uint32_t *firstClusters, uint32_t count);
+int flushFSInfo();
+
+#endif
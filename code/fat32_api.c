@@ -0,0 +1,795 @@
+#include "fat32_structs.h"
+#include "fat32_api.h"
+#include "fat32_utils.h"
+#include "fat32_fatcache.h"
+#include "fat32_alloc.h"
+#include "fat32_extent.h"
+#include "fat32_io.h"
+#include "fat32_bufcache.h"
+#include "fat32_dirindex.h"
+#include "fat32_dirscan.h"
+#include "fat32_path.h"
+#include "fat32_filetable.h"
+#include "fat32_readahead.h"
+#include "fat32_writebuf.h"
+#include "fat32_mount.h"
+#include "globals.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Library helper functions
+
+// Function to find the directory a new entry goes in and make sure the name is not taken there yet
+static int prepareNewEntry(const char *path, uint32_t *parentCluster, char *fat32Name) {
+    char leaf[256];
+
+    if (resolveParent(activeVolume->currentDirCluster, path, parentCluster, leaf, sizeof(leaf)) != 0) {
+        return FAT32_ERR_NOT_FOUND;
+    }
+    toFAT32Name(leaf, fat32Name);
+
+    // Make sure the directory can be read before checking it for the name
+    if (!getDirIndex(*parentCluster)) {
+        return FAT32_ERR_IO;
+    }
+    if (lookupDirIndex(*parentCluster, fat32Name)) {
+        return FAT32_ERR_EXISTS;
+    }
+    return FAT32_OK;
+}
+
+// Function to claim a slot for a new entry in a directory, growing the directory by a cluster if it is full
+static int claimEntrySlot(uint32_t dirCluster, struct DirSlot *slot) {
+    if (takeDirSlot(dirCluster, slot) == 0) {
+        return FAT32_OK;
+    }
+
+    struct DirIndex *index = getDirIndex(dirCluster);
+    if (!index) {
+        return FAT32_ERR_IO;
+    }
+
+    uint32_t newCluster = allocateCluster();
+    if (newCluster == 0xFFFFFFFF) {
+        return FAT32_ERR_NO_SPACE;
+    }
+
+    // Link the new cluster onto the directory and clear out whatever it held before
+    updateFATChain(index->lastCluster, newCluster);
+    zeroCluster(newCluster);
+    appendDirIndexCluster(dirCluster, newCluster);
+
+    // Use the first entry of the new cluster
+    return takeDirSlot(dirCluster, slot) == 0 ? FAT32_OK : FAT32_ERR_IO;
+}
+
+// Function to write a new entry into a claimed slot and add it to the directory's index
+static int writeNewEntry(uint32_t parentCluster, const struct DirSlot *slot, const char *fat32Name, uint8_t attributes, uint32_t firstCluster) {
+    struct FAT32DirectoryEntry *entries = (struct FAT32DirectoryEntry *)getCluster(slot->cluster);
+    if (!entries) {
+        return FAT32_ERR_IO;
+    }
+
+    struct FAT32DirectoryEntry *dirEntry = &entries[slot->index];
+    memset(dirEntry, 0, sizeof(*dirEntry));
+    memcpy(dirEntry->name, fat32Name, 11);
+    dirEntry->attributes = attributes;
+    dirEntry->firstClusterHi = (firstCluster >> 16) & 0xFFFF;
+    dirEntry->firstClusterLo = firstCluster & 0xFFFF;
+    dirEntry->fileSize = 0;
+
+    markClusterDirty(slot->cluster);
+    addDirIndexEntry(parentCluster, fat32Name, attributes, slot->cluster, slot->index, firstCluster);
+    return FAT32_OK;
+}
+
+// Function to find an existing entry from a path, returning the directory it is in and its FAT32 name
+static int findPathEntry(const char *path, uint32_t *parentCluster, char *fat32Name, struct FAT32DirectoryEntry *dirEntry) {
+    char leaf[256];
+
+    if (resolveParent(activeVolume->currentDirCluster, path, parentCluster, leaf, sizeof(leaf)) != 0) {
+        return FAT32_ERR_NOT_FOUND;
+    }
+    toFAT32Name(leaf, fat32Name);
+
+    if (findDirectoryEntry(*parentCluster, leaf, dirEntry) != 0) {
+        return FAT32_ERR_NOT_FOUND;
+    }
+    return FAT32_OK;
+}
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Volume implementations
+
+// Function to mount an image as a new volume (a cache capacity of 0 picks the default)
+int fat32Mount(const char *path, enum ImageBackend backend, uint32_t cacheCapacity, struct FAT32Volume **volume) {
+    struct FAT32Volume *newVolume = calloc(1, sizeof(struct FAT32Volume));
+    if (!newVolume) {
+        return FAT32_ERR_NO_MEMORY;
+    }
+
+    int result = mountImage(newVolume, path, backend, cacheCapacity ? cacheCapacity : BUFFER_CACHE_DEFAULT_CAPACITY);
+    if (result != FAT32_OK) {
+        free(newVolume);
+        selectVolume(NULL);
+        return result;
+    }
+
+    *volume = newVolume;
+    return FAT32_OK;
+}
+
+// Function to write back every change, close the open files and release the volume
+int fat32Unmount(struct FAT32Volume *volume) {
+    int result = unmountImage(volume);
+    free(volume);
+    selectVolume(NULL);
+    return result;
+}
+
+// Function to write every pending change of a volume back to its image
+int fat32Sync(struct FAT32Volume *volume) {
+    selectVolume(volume);
+    return checkpointImage() == 0 ? FAT32_OK : FAT32_ERR_IO;
+}
+
+// Function to choose whether changes are written back after every operation or only on fat32Sync and unmount
+void fat32SetDeferredFlush(struct FAT32Volume *volume, bool deferred) {
+    selectVolume(volume);
+    activeVolume->flushPolicy.deferred = deferred;
+}
+
+// Function to turn the metadata journal of a volume on or off. Turning it off syncs the image and removes the journal file.
+int fat32SetJournal(struct FAT32Volume *volume, bool enabled) {
+    selectVolume(volume);
+
+    // Changes made so far are written back first, so the journal only ever covers what follows
+    if (checkpointImage() != 0) {
+        return FAT32_ERR_IO;
+    }
+    if (enabled) {
+        return startJournal() == 0 ? FAT32_OK : FAT32_ERR_HOST;
+    }
+    return stopJournal() == 0 ? FAT32_OK : FAT32_ERR_IO;
+}
+
+// Function to check whether a volume has deferred changes that have not been written back yet
+bool fat32HasPendingChanges(struct FAT32Volume *volume) {
+    selectVolume(volume);
+    return activeVolume->flushPolicy.pending;
+}
+
+// Function to describe the geometry and usage of a volume
+void fat32GetVolumeInfo(struct FAT32Volume *volume, struct FAT32VolumeInfo *info) {
+    selectVolume(volume);
+
+    info->bytesPerSector = activeVolume->bootSector.bytesPerSector;
+    info->sectorsPerCluster = activeVolume->bootSector.sectorsPerCluster;
+    info->rootCluster = activeVolume->bootSector.rootCluster;
+    info->dataClusters = (activeVolume->bootSector.totalSectors32 - activeVolume->bootSector.reservedSectorCount - (activeVolume->bootSector.numFATs * activeVolume->bootSector.FATSize32)) / activeVolume->bootSector.sectorsPerCluster;
+    info->fatEntries = activeVolume->bootSector.FATSize32 * activeVolume->bootSector.bytesPerSector / 4; // Each FAT entry is 4 bytes
+    info->freeClusters = activeVolume->allocator.freeCount;
+    info->imageBytes = (uint64_t)activeVolume->bootSector.totalSectors32 * activeVolume->bootSector.bytesPerSector;
+    info->backendName = activeVolume->imageIO.ops->name;
+    info->journaling = activeVolume->journal.file != NULL;
+    info->journalReplayed = activeVolume->journal.replayed;
+    info->journalCommits = activeVolume->journal.commits;
+}
+
+// Function to describe an error code
+const char *fat32StrError(int error) {
+    switch (error) {
+        case FAT32_OK: return "Success";
+        case FAT32_ERR_NOT_FOUND: return "No such file or directory";
+        case FAT32_ERR_EXISTS: return "Name already exists";
+        case FAT32_ERR_NOT_DIR: return "Not a directory";
+        case FAT32_ERR_IS_DIR: return "Is a directory";
+        case FAT32_ERR_NOT_EMPTY: return "Directory not empty";
+        case FAT32_ERR_BUSY: return "File or directory is in use";
+        case FAT32_ERR_NO_SPACE: return "No free clusters left";
+        case FAT32_ERR_IO: return "Error accessing the image";
+        case FAT32_ERR_INVALID: return "Invalid argument";
+        case FAT32_ERR_BAD_HANDLE: return "File is not open";
+        case FAT32_ERR_ACCESS: return "File is not open in a mode that allows this";
+        case FAT32_ERR_TOO_MANY_OPEN: return "Too many open files";
+        case FAT32_ERR_NO_MEMORY: return "Out of memory";
+        case FAT32_ERR_HOST: return "Error accessing the host file";
+        default: return "Unknown error";
+    }
+}
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Directory implementations
+
+// Function to change the current directory of a volume to an absolute or relative path
+int fat32Chdir(struct FAT32Volume *volume, const char *path) {
+    selectVolume(volume);
+
+    uint32_t cluster = resolveDirectory(activeVolume->currentDirCluster, path);
+    if (cluster == 0xFFFFFFFF) {
+        return FAT32_ERR_NOT_FOUND;
+    }
+    activeVolume->currentDirCluster = cluster;
+
+    // Fold the path given into the current path ("..", "." and absolute paths included)
+    joinPath(activeVolume->currentPath, path, activeVolume->currentPath, sizeof(activeVolume->currentPath));
+    return FAT32_OK;
+}
+
+// Function to get the absolute path of the current directory of a volume
+const char *fat32Getcwd(struct FAT32Volume *volume) {
+    selectVolume(volume);
+    return activeVolume->currentPath;
+}
+
+// Function to start listing a directory (NULL lists the current directory)
+int fat32OpenDir(struct FAT32Volume *volume, const char *path, struct FAT32DirCursor *cursor) {
+    selectVolume(volume);
+
+    uint32_t cluster = path ? resolveDirectory(activeVolume->currentDirCluster, path) : activeVolume->currentDirCluster;
+    if (cluster == 0xFFFFFFFF) {
+        return FAT32_ERR_NOT_FOUND;
+    }
+
+    cursor->cluster = cluster;
+    cursor->index = 0;
+    cursor->limit = 0xFFFFFFFF;
+    return FAT32_OK;
+}
+
+// Function to get the next entry of a directory listing. Returns 1 with the entry filled in, 0 at the end.
+// Deleted entries are skipped; everything else, '.' and '..' included, is returned.
+int fat32ReadDir(struct FAT32Volume *volume, struct FAT32DirCursor *cursor, struct FAT32DirInfo *info) {
+    selectVolume(volume);
+
+    uint32_t entriesPerCluster = activeVolume->bootSector.sectorsPerCluster * (activeVolume->bootSector.bytesPerSector / sizeof(struct FAT32DirectoryEntry));
+
+    while (cursor->cluster >= 2 && cursor->cluster < 0x0FFFFFF8) {
+        struct FAT32DirectoryEntry *entries = (struct FAT32DirectoryEntry *)getCluster(cursor->cluster);
+        if (!entries) {
+            return FAT32_ERR_IO;
+        }
+
+        // Find where the cluster's entries end in one pass when the listing first reaches it
+        if (cursor->limit == 0xFFFFFFFF) {
+            struct DirScanResult scan;
+            scanDirEntries(entries, entriesPerCluster, NULL, NULL, NULL, &scan);
+            cursor->limit = scan.endIndex != -1 ? (uint32_t)scan.endIndex : entriesPerCluster;
+        }
+
+        while (cursor->index < cursor->limit) {
+            struct FAT32DirectoryEntry *dirEntry = &entries[cursor->index++];
+            if (dirEntry->name[0] == 0xE5) {
+                continue;
+            }
+
+            formatDirName((const char *)dirEntry->name, info->name);
+            info->attributes = dirEntry->attributes;
+            info->firstCluster = (dirEntry->firstClusterHi << 16) | dirEntry->firstClusterLo;
+            info->size = dirEntry->fileSize;
+            return 1;
+        }
+
+        // The end-of-directory marker ends the listing
+        if (cursor->limit < entriesPerCluster) {
+            cursor->cluster = 0xFFFFFFFF;
+            return 0;
+        }
+
+        // Move to next cluster in the chain
+        cursor->cluster = getNextCluster(cursor->cluster);
+        cursor->index = 0;
+        cursor->limit = 0xFFFFFFFF;
+    }
+    return 0;
+}
+
+// Function to create an empty file (relative to the current directory unless the path starts with /)
+int fat32Creat(struct FAT32Volume *volume, const char *path) {
+    uint32_t parentCluster;
+    char fat32Name[12];
+    struct DirSlot slot;
+
+    selectVolume(volume);
+
+    int result = prepareNewEntry(path, &parentCluster, fat32Name);
+    if (result != FAT32_OK) {
+        return result;
+    }
+
+    // Find a free entry, allocating a new cluster for the directory if there is none
+    result = claimEntrySlot(parentCluster, &slot);
+    if (result != FAT32_OK) {
+        return result;
+    }
+
+    // A new file has no clusters until something is written to it
+    result = writeNewEntry(parentCluster, &slot, fat32Name, ATTR_ARCHIVE, 0);
+    if (result != FAT32_OK) {
+        returnDirSlot(parentCluster, &slot);
+        return result;
+    }
+
+    flushImage();
+    return FAT32_OK;
+}
+
+// Function to create a directory (relative to the current directory unless the path starts with /)
+int fat32Mkdir(struct FAT32Volume *volume, const char *path) {
+    uint32_t parentCluster;
+    char fat32Name[12];
+    struct DirSlot slot;
+
+    selectVolume(volume);
+
+    int result = prepareNewEntry(path, &parentCluster, fat32Name);
+    if (result != FAT32_OK) {
+        return result;
+    }
+
+    // Allocate the first cluster of the new directory itself before a slot is claimed for it
+    uint32_t newCluster = allocateCluster();
+    if (newCluster == 0xFFFFFFFF) {
+        return FAT32_ERR_NO_SPACE;
+    }
+
+    // Find a free entry, allocating a new cluster for the parent directory if there is none
+    result = claimEntrySlot(parentCluster, &slot);
+    if (result != FAT32_OK) {
+        freeClusters(newCluster);
+        return result;
+    }
+    zeroCluster(newCluster);
+
+    // Forget any index or cached components left over from a directory that used this cluster before
+    dropDirIndex(newCluster);
+    dropDentriesUnder(newCluster);
+
+    result = writeNewEntry(parentCluster, &slot, fat32Name, ATTR_DIRECTORY, newCluster);
+    if (result != FAT32_OK) {
+        returnDirSlot(parentCluster, &slot);
+        freeClusters(newCluster);
+        return result;
+    }
+
+    // Create '.' and '..' entries inside the new directory
+    struct FAT32DirectoryEntry *newEntries = (struct FAT32DirectoryEntry *)getCluster(newCluster);
+    if (!newEntries) {
+        return FAT32_ERR_IO;
+    }
+
+    // '.' entry
+    memcpy(newEntries[0].name, ".          ", 11);
+    newEntries[0].attributes = ATTR_DIRECTORY;
+    newEntries[0].firstClusterHi = (newCluster >> 16) & 0xFFFF;
+    newEntries[0].firstClusterLo = newCluster & 0xFFFF;
+
+    // '..' entry (a parent that is the root directory is recorded as cluster 0)
+    uint32_t dotDotCluster = (parentCluster == activeVolume->bootSector.rootCluster) ? 0 : parentCluster;
+    memcpy(newEntries[1].name, "..         ", 11);
+    newEntries[1].attributes = ATTR_DIRECTORY;
+    newEntries[1].firstClusterHi = (dotDotCluster >> 16) & 0xFFFF;
+    newEntries[1].firstClusterLo = dotDotCluster & 0xFFFF;
+
+    // The rest of the cluster was zeroed, so the End-of-Directory marker follows; commit the changes to the image file
+    markClusterDirty(newCluster);
+    flushImage();
+    return FAT32_OK;
+}
+
+// Function to delete a file that is not open
+int fat32Unlink(struct FAT32Volume *volume, const char *path) {
+    struct FAT32DirectoryEntry dirEntry;
+    uint32_t parentCluster;
+    char fat32Name[12];
+
+    selectVolume(volume);
+
+    if (findPathEntry(path, &parentCluster, fat32Name, &dirEntry) != FAT32_OK) {
+        return FAT32_ERR_NOT_FOUND;
+    }
+    if (isEntryOpen(parentCluster, fat32Name)) {
+        return FAT32_ERR_BUSY;
+    }
+    if (dirEntry.attributes & ATTR_DIRECTORY) {
+        return FAT32_ERR_IS_DIR;
+    }
+
+    // Free the chain before the entry goes, so both reach the image with the same flush
+    freeClusters((dirEntry.firstClusterHi << 16) | dirEntry.firstClusterLo);
+    removeDirectoryEntry(parentCluster, fat32Name);
+    flushImage();
+    return FAT32_OK;
+}
+
+// Function to remove an empty directory other than the current one
+int fat32Rmdir(struct FAT32Volume *volume, const char *path) {
+    struct FAT32DirectoryEntry dirEntry;
+    uint32_t parentCluster;
+    char fat32Name[12];
+
+    selectVolume(volume);
+
+    if (findPathEntry(path, &parentCluster, fat32Name, &dirEntry) != FAT32_OK) {
+        return FAT32_ERR_NOT_FOUND;
+    }
+    if (!(dirEntry.attributes & ATTR_DIRECTORY)) {
+        return FAT32_ERR_NOT_DIR;
+    }
+
+    uint32_t cluster = (dirEntry.firstClusterHi << 16) | dirEntry.firstClusterLo;
+    if (!isDirectoryEmpty(cluster)) {
+        return FAT32_ERR_NOT_EMPTY;
+    }
+
+    // The directory we are standing in cannot be removed
+    if (cluster == activeVolume->currentDirCluster) {
+        return FAT32_ERR_BUSY;
+    }
+
+    freeClusters(cluster);
+    removeDirectoryEntry(parentCluster, fat32Name);
+    dropDirIndex(cluster);
+    dropDentriesUnder(cluster);
+    flushImage();
+    return FAT32_OK;
+}
+
+// Function to remove a directory together with everything in it. Open files and the current directory are
+// left in place, in which case FAT32_ERR_BUSY is returned and the directories holding them remain.
+int fat32RemoveTree(struct FAT32Volume *volume, const char *path) {
+    struct FAT32DirectoryEntry dirEntry;
+    uint32_t parentCluster;
+    char fat32Name[12];
+
+    selectVolume(volume);
+
+    if (findPathEntry(path, &parentCluster, fat32Name, &dirEntry) != FAT32_OK) {
+        return FAT32_ERR_NOT_FOUND;
+    }
+    if (!(dirEntry.attributes & ATTR_DIRECTORY)) {
+        return FAT32_ERR_NOT_DIR;
+    }
+
+    // The directory we are standing in cannot be removed
+    uint32_t cluster = (dirEntry.firstClusterHi << 16) | dirEntry.firstClusterLo;
+    if (cluster == activeVolume->currentDirCluster) {
+        return FAT32_ERR_BUSY;
+    }
+
+    // Delete the directory and everything under it in one pass (nothing is deleted if any of it is in use)
+    return deleteTree(parentCluster, fat32Name, cluster);
+}
+
+// ------------------------------------------------------------------------------------------------ //
+
+// File implementations
+
+// Function to open a file in mode "r", "w", "rw" or "wr", returning a handle for the other file functions
+int fat32Open(struct FAT32Volume *volume, const char *path, const char *mode) {
+    uint32_t parentCluster;
+    char leaf[256];
+    char fat32Name[12];
+
+    selectVolume(volume);
+
+    if (strcmp(mode, "r") != 0 && strcmp(mode, "w") != 0 && strcmp(mode, "rw") != 0 && strcmp(mode, "wr") != 0) {
+        return FAT32_ERR_INVALID;
+    }
+
+    // Look the name up in the index of the directory it is in
+    const struct DirIndexEntry *indexed = NULL;
+    if (resolveParent(activeVolume->currentDirCluster, path, &parentCluster, leaf, sizeof(leaf)) == 0) {
+        toFAT32Name(leaf, fat32Name);
+        indexed = lookupDirIndex(parentCluster, fat32Name);
+    }
+
+    // Deleted or missing entries and directories cannot be opened
+    if (!indexed) {
+        return FAT32_ERR_NOT_FOUND;
+    }
+    if (indexed->attributes & ATTR_DIRECTORY) {
+        return FAT32_ERR_IS_DIR;
+    }
+    if (!(indexed->attributes & ATTR_ARCHIVE)) {
+        return FAT32_ERR_NOT_FOUND;
+    }
+
+    if (isEntryOpen(parentCluster, indexed->name)) {
+        return FAT32_ERR_BUSY;
+    }
+
+    uint32_t entryCluster = indexed->entryCluster;
+    uint32_t entryIndex = indexed->entryIndex;
+    struct FAT32DirectoryEntry *entries = (struct FAT32DirectoryEntry *)getCluster(entryCluster);
+    if (!entries) {
+        return FAT32_ERR_IO;
+    }
+    struct FAT32DirectoryEntry dirEntry = entries[entryIndex];
+
+    // Take a free slot in the open file table (it grows as needed)
+    int handle = allocOpenFile();
+    if (handle < 0) {
+        return handle;
+    }
+    struct OpenFile *file = &activeVolume->openFileTable.files[handle];
+
+    // Open files are tracked by their formatted name
+    formatDirName(indexed->name, file->filename);
+    strcpy(file->mode, mode);
+    file->fileCluster = (dirEntry.firstClusterHi << 16) | dirEntry.firstClusterLo;
+    file->offset = 0;
+
+    // Remember the real size and where the entry lives so the size can be written back later
+    file->fileSize = dirEntry.fileSize;
+    file->dirCluster = parentCluster;
+    file->entryCluster = entryCluster;
+    file->entryIndex = entryIndex;
+
+    // Map out the cluster chain once so reads and writes can find any offset directly
+    if (buildExtentMap(file) != 0) {
+        releaseOpenFile(handle);
+        return FAT32_ERR_NO_MEMORY;
+    }
+
+    // Remember the absolute path for lsof
+    joinPath(activeVolume->currentPath, path, file->path, sizeof(file->path));
+
+    insertOpenFile(handle);
+    return handle;
+}
+
+// Function to close an open file, writing its size and first cluster back to its directory entry
+int fat32Close(struct FAT32Volume *volume, int handle) {
+    selectVolume(volume);
+
+    struct OpenFile *file = getOpenFile(handle);
+    if (!file) {
+        return FAT32_ERR_BAD_HANDLE;
+    }
+
+    // Buffered data gets its clusters now that the final size is known
+    int result = flushWriteBuffer(file);
+    if (syncOpenFile(file) != 0 && result == FAT32_OK) {
+        result = FAT32_ERR_IO;
+    }
+    flushImage();
+
+    // Give the slot back to the table so its handle can be reused
+    releaseOpenFile(handle);
+    return result;
+}
+
+// Function to set the offset the next read or write of an open file starts at (at most the size of the file)
+int fat32Seek(struct FAT32Volume *volume, int handle, uint32_t offset) {
+    selectVolume(volume);
+
+    struct OpenFile *file = getOpenFile(handle);
+    if (!file) {
+        return FAT32_ERR_BAD_HANDLE;
+    }
+    if (offset > file->fileSize) {
+        return FAT32_ERR_INVALID;
+    }
+
+    file->offset = offset;
+    return FAT32_OK;
+}
+
+// Function to read up to 'size' bytes from the offset of an open file, returning the number of bytes read (0 at the end)
+int64_t fat32Read(struct FAT32Volume *volume, int handle, void *buffer, uint32_t size) {
+    selectVolume(volume);
+
+    struct OpenFile *file = getOpenFile(handle);
+    if (!file) {
+        return FAT32_ERR_BAD_HANDLE;
+    }
+    if (strchr(file->mode, 'r') == NULL) {
+        return FAT32_ERR_ACCESS;
+    }
+    if (file->offset >= file->fileSize) {
+        return 0;
+    }
+
+    uint32_t currentOffset = file->offset;
+    uint32_t clusterSize = activeVolume->bootSector.sectorsPerCluster * activeVolume->bootSector.bytesPerSector;
+    uint32_t bytesLeft = min(size, file->fileSize - file->offset);
+    uint32_t bytesRead = 0;
+
+    // Clusters of the file this read touches, and the end of the part of them already brought into the cache
+    uint32_t endCluster = min((uint32_t)(((uint64_t)currentOffset + bytesLeft + clusterSize - 1) / clusterSize), file->clusterCount);
+    uint32_t loadedEnd = 0;
+    bool mapped = isImageMapped();
+
+    // Read data one contiguous run of clusters at a time until all requested bytes are read
+    bool readError = false;
+    while (bytesLeft > 0 && !readError) {
+        uint32_t runRemaining;
+        uint32_t currentCluster = lookupCluster(file, currentOffset / clusterSize, &runRemaining);
+
+        // Past the allocated clusters the rest of the file is still in its write buffer
+        if (currentCluster == 0xFFFFFFFF) {
+            uint64_t bufferOffset = (uint64_t)currentOffset - (uint64_t)file->clusterCount * clusterSize;
+            if (bufferOffset >= file->writeBufferLength) break;
+
+            uint32_t bytesToRead = min(bytesLeft, file->writeBufferLength - (uint32_t)bufferOffset);
+            memcpy((uint8_t *)buffer + bytesRead, file->writeBuffer + bufferOffset, bytesToRead);
+            bytesRead += bytesToRead;
+            bytesLeft -= bytesToRead;
+            currentOffset += bytesToRead;
+            continue;
+        }
+
+        // Bring the clusters we still need into the cache, every run of them in one batch of image reads
+        // (a mapped image is copied from in place instead)
+        uint32_t logicalCluster = currentOffset / clusterSize;
+        if (mapped) {
+            loadedEnd = endCluster;
+        }
+        else if (logicalCluster >= loadedEnd) {
+            loadedEnd = loadFileClusters(file, logicalCluster, endCluster);
+            if (loadedEnd <= logicalCluster) {
+                readError = true;
+                break;
+            }
+        }
+
+        uint32_t clustersWanted = ((uint64_t)(currentOffset % clusterSize) + bytesLeft + clusterSize - 1) / clusterSize;
+        uint32_t clustersLoaded = min(min(runRemaining, clustersWanted), loadedEnd - logicalCluster);
+        for (uint32_t c = 0; c < clustersLoaded && bytesLeft > 0; c++) {
+            const uint8_t *data = peekCluster(currentCluster + c);
+            if (!data) {
+                readError = true;
+                break;
+            }
+
+            uint32_t clusterOffset = currentOffset % clusterSize;
+            uint32_t bytesToRead = min(bytesLeft, clusterSize - clusterOffset);
+            memcpy((uint8_t *)buffer + bytesRead, data + clusterOffset, bytesToRead);
+
+            bytesRead += bytesToRead;
+            bytesLeft -= bytesToRead;
+            currentOffset += bytesToRead;
+        }
+    }
+
+    if (readError && bytesRead == 0) {
+        return FAT32_ERR_IO;
+    }
+
+    // Let a sequential reader get ahead of itself, then update file offset after read
+    readAhead(file, file->offset, file->offset + bytesRead);
+    file->offset += bytesRead;
+    return bytesRead;
+}
+
+// Function to write 'length' bytes at the offset of an open file, growing the file as needed.
+// Returns the number of bytes written.
+int64_t fat32Write(struct FAT32Volume *volume, int handle, const void *data, uint32_t length) {
+    selectVolume(volume);
+
+    struct OpenFile *file = getOpenFile(handle);
+    if (!file) {
+        return FAT32_ERR_BAD_HANDLE;
+    }
+    if (strchr(file->mode, 'w') == NULL) {
+        return FAT32_ERR_ACCESS;
+    }
+
+    // FAT32 file sizes are 32-bit
+    uint32_t offset = file->offset;
+    if ((uint64_t)offset + length > 0xFFFFFFFFull) {
+        return FAT32_ERR_INVALID;
+    }
+
+    uint32_t clusterSize = activeVolume->bootSector.sectorsPerCluster * activeVolume->bootSector.bytesPerSector;
+    uint32_t bytesWritten = 0;
+    bool wroteClusters = false;
+
+    // While we have not written all of the bytes we need to, keep writing into the cached clusters
+    while (bytesWritten < length) {
+        uint64_t allocatedSize = (uint64_t)file->clusterCount * clusterSize;
+
+        // Data past the allocated clusters is collected in the write buffer, which only gets clusters (all at once)
+        // when the file is closed or flushed, or when the buffer fills up
+        if (offset >= allocatedSize) {
+            uint32_t position = (uint32_t)(offset - allocatedSize);
+            uint32_t bytesToWrite = min(length - bytesWritten, WRITE_BUFFER_MAX - position);
+            int result = bytesToWrite ? bufferWrite(file, position, (const uint8_t *)data + bytesWritten, bytesToWrite)
+                                      : flushWriteBuffer(file);
+            if (result != FAT32_OK) {
+                if (bytesWritten == 0) {
+                    return result;
+                }
+                break;
+            }
+
+            bytesWritten += bytesToWrite;
+            offset += bytesToWrite;
+            file->offset = offset;
+            continue;
+        }
+
+        uint32_t cluster = lookupCluster(file, offset / clusterSize, NULL);
+        if (cluster == 0xFFFFFFFF) {
+            return FAT32_ERR_IO;
+        }
+
+        uint32_t clusterOffset = offset % clusterSize;
+        uint32_t bytesToWrite = min(length - bytesWritten, clusterSize - clusterOffset);
+
+        // A cluster that is overwritten completely does not need to be read first
+        uint8_t *clusterData = (bytesToWrite == clusterSize) ? getNewCluster(cluster) : getCluster(cluster);
+        if (!clusterData) {
+            return FAT32_ERR_IO;
+        }
+
+        memcpy(clusterData + clusterOffset, (const uint8_t *)data + bytesWritten, bytesToWrite);
+        markClusterDirty(cluster);
+        wroteClusters = true;
+
+        bytesWritten += bytesToWrite;
+        offset += bytesToWrite;
+
+        // Update the file offset in the open file structure
+        file->offset = offset;
+    }
+
+    // Grow the cached size if we wrote past the end; the directory entry is updated at close or flush
+    if (offset > file->fileSize) {
+        file->fileSize = offset;
+        queueOpenFileSync(file);
+    }
+
+    // Buffered data waits for the file to be closed or flushed; anything written into clusters is flushed as usual
+    if (wroteClusters) {
+        flushImage();
+    }
+    else {
+        activeVolume->flushPolicy.pending = true;
+    }
+    return bytesWritten;
+}
+
+// Function to find the handle of an open file from its name or path. A plain name matches an open file of that name
+// in any directory, while a path only matches the file in the directory it leads to.
+int fat32FindOpen(struct FAT32Volume *volume, const char *path) {
+    selectVolume(volume);
+
+    int handle = findOpenFilePath(path);
+    return handle >= 0 ? handle : FAT32_ERR_BAD_HANDLE;
+}
+
+// Function to step through the open files: returns the first open handle after the one given (-1 to start), or
+// FAT32_ERR_BAD_HANDLE when there are no more
+int fat32NextOpenFile(struct FAT32Volume *volume, int handle) {
+    selectVolume(volume);
+
+    int next = nextOpenFile(handle < -1 ? -1 : handle);
+    return next >= 0 ? next : FAT32_ERR_BAD_HANDLE;
+}
+
+// Function to describe an open file
+int fat32GetFileInfo(struct FAT32Volume *volume, int handle, struct FAT32FileInfo *info) {
+    selectVolume(volume);
+
+    struct OpenFile *file = getOpenFile(handle);
+    if (!file) {
+        return FAT32_ERR_BAD_HANDLE;
+    }
+
+    strcpy(info->name, file->filename);
+    strcpy(info->mode, file->mode);
+    strcpy(info->path, file->path);
+    info->offset = file->offset;
+    info->size = file->fileSize;
+    info->allocatedBytes = (uint64_t)(file->clusterCount + writeBufferClusters(file)) * activeVolume->bootSector.sectorsPerCluster * activeVolume->bootSector.bytesPerSector;
+    return FAT32_OK;
+}
@@ -0,0 +1,149 @@
+#ifndef FAT32_API_H
+#define FAT32_API_H
+
+#include "fat32_io.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+// Results of the library functions (every failure is negative)
+enum FAT32Error {
+    FAT32_OK = 0,
+    FAT32_ERR_NOT_FOUND = -1,        // No such file or directory
+    FAT32_ERR_EXISTS = -2,           // The name is already taken
+    FAT32_ERR_NOT_DIR = -3,          // Expected a directory
+    FAT32_ERR_IS_DIR = -4,           // Expected a file
+    FAT32_ERR_NOT_EMPTY = -5,        // The directory still has entries
+    FAT32_ERR_BUSY = -6,             // The file is open, or the directory is the current one
+    FAT32_ERR_NO_SPACE = -7,         // No free clusters left
+    FAT32_ERR_IO = -8,               // Reading or writing the image failed
+    FAT32_ERR_INVALID = -9,          // Bad argument (mode, offset, name)
+    FAT32_ERR_BAD_HANDLE = -10,      // The handle does not refer to an open file
+    FAT32_ERR_ACCESS = -11,          // The file is not open in a mode that allows this
+    FAT32_ERR_TOO_MANY_OPEN = -12,   // The open file table is at its limit
+    FAT32_ERR_NO_MEMORY = -13,
+    FAT32_ERR_HOST = -14             // Reading or writing a file outside the image failed
+};
+
+// A mounted image. Each volume has its own caches, open files and current directory.
+struct FAT32Volume;
+
+// Geometry and usage of a mounted volume
+struct FAT32VolumeInfo {
+    uint16_t bytesPerSector;
+    uint8_t sectorsPerCluster;
+    uint32_t rootCluster;
+    uint32_t dataClusters;     // Clusters in the data region
+    uint32_t fatEntries;       // Entries in one FAT
+    uint32_t freeClusters;
+    uint64_t imageBytes;
+    const char *backendName;   // I/O backend in use ("mmap", "stdio" or "io_uring")
+    bool journaling;           // Whether write-backs go through the journal
+    uint32_t journalReplayed;  // Journal transactions replayed when the volume was mounted
+    uint64_t journalCommits;   // Journal transactions committed since then
+};
+
+// One entry of a directory listing
+struct FAT32DirInfo {
+    char name[13];             // Name in 8.3 form, such as "FILE.TXT"
+    uint8_t attributes;
+    uint32_t firstCluster;
+    uint32_t size;
+};
+
+// Position in a directory listing (filled in by fat32OpenDir)
+struct FAT32DirCursor {
+    uint32_t cluster;          // Cluster being listed (0xFFFFFFFF at the end)
+    uint32_t index;            // Next entry within that cluster
+    uint32_t limit;            // Entries of that cluster before its end-of-directory marker (0xFFFFFFFF until it is scanned)
+};
+
+// State of an open file
+struct FAT32FileInfo {
+    char name[13];             // Name in 8.3 form
+    char mode[3];              // "r", "w", "rw" or "wr"
+    char path[256];            // Absolute path the file was opened with
+    uint32_t offset;
+    uint32_t size;
+    uint64_t allocatedBytes;   // Bytes the file can grow to without new clusters
+};
+
+// Fragmentation of one file or directory (passed to the fat32FragReport callback)
+struct FAT32FragInfo {
+    const char *path;          // Absolute path
+    uint8_t attributes;
+    uint32_t size;
+    uint32_t clusters;         // Clusters in the chain
+    uint32_t extents;          // Physically contiguous runs the chain is split into
+};
+
+// Fragmentation of a directory tree
+struct FAT32FragSummary {
+    uint64_t files;
+    uint64_t directories;
+    uint64_t clusters;
+    uint64_t extents;
+    uint64_t fragmented;       // Files and directories in more than one run
+    double score;              // Percentage of steps along the chains that jump elsewhere (0 when all are contiguous)
+};
+
+// Limits for one defrag pass (0 means no limit)
+struct FAT32DefragLimits {
+    uint32_t milliseconds;
+    uint64_t bytes;            // Bytes of file and directory data copied
+};
+
+// Outcome of a defrag pass
+struct FAT32DefragStats {
+    uint32_t filesMoved;
+    uint32_t directoriesMoved;
+    uint32_t skipped;          // Fragmented chains left as they are (open, or no free space would help)
+    uint64_t bytesCopied;
+    uint64_t extentsBefore;    // Runs in all chains of the tree before and after the pass
+    uint64_t extentsAfter;
+    bool complete;             // False if the limits ended the pass early
+};
+
+typedef void (*FAT32FragCallback)(const struct FAT32FragInfo *info, void *context);
+
+// Volume functions
+int fat32Mount(const char *path, enum ImageBackend backend, uint32_t cacheCapacity, struct FAT32Volume **volume);
+int fat32Unmount(struct FAT32Volume *volume);
+int fat32Sync(struct FAT32Volume *volume);
+void fat32SetDeferredFlush(struct FAT32Volume *volume, bool deferred);
+int fat32SetJournal(struct FAT32Volume *volume, bool enabled);
+bool fat32HasPendingChanges(struct FAT32Volume *volume);
+void fat32GetVolumeInfo(struct FAT32Volume *volume, struct FAT32VolumeInfo *info);
+const char *fat32StrError(int error);
+
+// Directory functions
+int fat32Chdir(struct FAT32Volume *volume, const char *path);
+const char *fat32Getcwd(struct FAT32Volume *volume);
+int fat32OpenDir(struct FAT32Volume *volume, const char *path, struct FAT32DirCursor *cursor);
+int fat32ReadDir(struct FAT32Volume *volume, struct FAT32DirCursor *cursor, struct FAT32DirInfo *info);
+int fat32Creat(struct FAT32Volume *volume, const char *path);
+int fat32Mkdir(struct FAT32Volume *volume, const char *path);
+int fat32Unlink(struct FAT32Volume *volume, const char *path);
+int fat32Rmdir(struct FAT32Volume *volume, const char *path);
+int fat32RemoveTree(struct FAT32Volume *volume, const char *path);
+
+// File functions
+int fat32Open(struct FAT32Volume *volume, const char *path, const char *mode);
+int fat32Close(struct FAT32Volume *volume, int handle);
+int fat32Seek(struct FAT32Volume *volume, int handle, uint32_t offset);
+int64_t fat32Read(struct FAT32Volume *volume, int handle, void *buffer, uint32_t size);
+int64_t fat32Write(struct FAT32Volume *volume, int handle, const void *data, uint32_t length);
+int fat32FindOpen(struct FAT32Volume *volume, const char *path);
+int fat32NextOpenFile(struct FAT32Volume *volume, int handle);
+int fat32GetFileInfo(struct FAT32Volume *volume, int handle, struct FAT32FileInfo *info);
+
+// Host file transfer functions
+int64_t fat32Import(struct FAT32Volume *volume, const char *hostPath, const char *path);
+int64_t fat32Export(struct FAT32Volume *volume, const char *path, const char *hostPath);
+
+// Fragmentation functions
+int fat32FragReport(struct FAT32Volume *volume, const char *path, FAT32FragCallback callback, void *context,
+                    struct FAT32FragSummary *summary);
+int fat32Defrag(struct FAT32Volume *volume, const char *path, const struct FAT32DefragLimits *limits,
+                struct FAT32DefragStats *stats);
+
+#endif
@@ -0,0 +1,406 @@
+#include "fat32_structs.h"
+#include "fat32_bufcache.h"
+#include "fat32_utils.h"
+#include "fat32_io.h"
+#include "fat32_journal.h"
+#include "globals.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Buffer cache helper functions
+
+// Function to hash a cluster number into a bucket index
+static uint32_t hashCluster(uint32_t cluster) {
+    return (cluster * 2654435761u) & (activeVolume->bufferCache.bucketCount - 1);
+}
+
+// Function to find the buffer holding a cluster, or NULL if it is not cached
+static struct CacheBuffer *lookupBuffer(uint32_t cluster) {
+    if (!activeVolume->bufferCache.buckets) {
+        return NULL;
+    }
+
+    for (struct CacheBuffer *buffer = activeVolume->bufferCache.buckets[hashCluster(cluster)]; buffer; buffer = buffer->hashNext) {
+        if (buffer->cluster == cluster) {
+            return buffer;
+        }
+    }
+    return NULL;
+}
+
+// Function to unlink a buffer from the LRU list
+static void lruRemove(struct CacheBuffer *buffer) {
+    if (buffer->lruPrev) buffer->lruPrev->lruNext = buffer->lruNext;
+    else activeVolume->bufferCache.lruHead = buffer->lruNext;
+
+    if (buffer->lruNext) buffer->lruNext->lruPrev = buffer->lruPrev;
+    else activeVolume->bufferCache.lruTail = buffer->lruPrev;
+
+    buffer->lruPrev = buffer->lruNext = NULL;
+}
+
+// Function to put a buffer at the most recently used end of the LRU list
+static void lruPushHead(struct CacheBuffer *buffer) {
+    buffer->lruPrev = NULL;
+    buffer->lruNext = activeVolume->bufferCache.lruHead;
+    if (activeVolume->bufferCache.lruHead) activeVolume->bufferCache.lruHead->lruPrev = buffer;
+    activeVolume->bufferCache.lruHead = buffer;
+    if (!activeVolume->bufferCache.lruTail) activeVolume->bufferCache.lruTail = buffer;
+}
+
+// Function to put a buffer at the least recently used end of the LRU list (so it is reused first)
+static void lruPushTail(struct CacheBuffer *buffer) {
+    buffer->lruNext = NULL;
+    buffer->lruPrev = activeVolume->bufferCache.lruTail;
+    if (activeVolume->bufferCache.lruTail) activeVolume->bufferCache.lruTail->lruNext = buffer;
+    activeVolume->bufferCache.lruTail = buffer;
+    if (!activeVolume->bufferCache.lruHead) activeVolume->bufferCache.lruHead = buffer;
+}
+
+// Function to take a buffer out of the hash table
+static void unhashBuffer(struct CacheBuffer *buffer) {
+    struct CacheBuffer **link = &activeVolume->bufferCache.buckets[hashCluster(buffer->cluster)];
+    while (*link && *link != buffer) {
+        link = &(*link)->hashNext;
+    }
+    if (*link) {
+        *link = buffer->hashNext;
+    }
+    buffer->hashNext = NULL;
+}
+
+// Function to write a single dirty buffer back to the image
+static int writeBackBuffer(struct CacheBuffer *buffer) {
+    if (!buffer->dirty) {
+        return 0;
+    }
+
+    buffer->dirty = false;
+    activeVolume->bufferCache.dirtyCount--;
+    return journalWrite(getClusterOffset(buffer->cluster), buffer->data, activeVolume->bufferCache.clusterSize);
+}
+
+// Function to claim a buffer for a cluster, evicting the least recently used one (writing it back if dirty)
+static struct CacheBuffer *claimBuffer(uint32_t cluster) {
+    struct CacheBuffer *buffer = activeVolume->bufferCache.lruTail;
+
+    if (buffer->cluster != 0) {
+        writeBackBuffer(buffer);
+        unhashBuffer(buffer);
+    }
+
+    buffer->cluster = cluster;
+    buffer->dirty = false;
+
+    uint32_t bucket = hashCluster(cluster);
+    buffer->hashNext = activeVolume->bufferCache.buckets[bucket];
+    activeVolume->bufferCache.buckets[bucket] = buffer;
+
+    lruRemove(buffer);
+    lruPushHead(buffer);
+    return buffer;
+}
+
+// Function to order dirty buffers by cluster number so they can be written in ascending runs
+static int compareBuffers(const void *a, const void *b) {
+    uint32_t first = (*(struct CacheBuffer * const *)a)->cluster;
+    uint32_t second = (*(struct CacheBuffer * const *)b)->cluster;
+    return (first > second) - (first < second);
+}
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Buffer cache implementations
+
+// Function to allocate a cache able to hold 'capacity' clusters
+int initBufferCache(uint32_t capacity) {
+    freeBufferCache();
+
+    if (capacity < 2) {
+        capacity = 2;
+    }
+
+    activeVolume->bufferCache.capacity = capacity;
+    activeVolume->bufferCache.clusterSize = activeVolume->bootSector.sectorsPerCluster * activeVolume->bootSector.bytesPerSector;
+    activeVolume->bufferCache.bucketCount = 1;
+    while (activeVolume->bufferCache.bucketCount < capacity * 2) {
+        activeVolume->bufferCache.bucketCount <<= 1;
+    }
+
+    activeVolume->bufferCache.buffers = calloc(capacity, sizeof(struct CacheBuffer));
+    activeVolume->bufferCache.memory = malloc((size_t)capacity * activeVolume->bufferCache.clusterSize);
+    activeVolume->bufferCache.buckets = calloc(activeVolume->bufferCache.bucketCount, sizeof(struct CacheBuffer *));
+    if (!activeVolume->bufferCache.buffers || !activeVolume->bufferCache.memory || !activeVolume->bufferCache.buckets) {
+        freeBufferCache();
+        return -1;
+    }
+
+    // Every buffer starts out unused and on the LRU list
+    for (uint32_t i = 0; i < capacity; i++) {
+        activeVolume->bufferCache.buffers[i].data = activeVolume->bufferCache.memory + (size_t)i * activeVolume->bufferCache.clusterSize;
+        lruPushTail(&activeVolume->bufferCache.buffers[i]);
+    }
+    return 0;
+}
+
+// Function to release the cache (dirty buffers must be flushed first)
+void freeBufferCache() {
+    free(activeVolume->bufferCache.buffers);
+    free(activeVolume->bufferCache.memory);
+    free(activeVolume->bufferCache.buckets);
+    memset(&activeVolume->bufferCache, 0, sizeof(activeVolume->bufferCache));
+}
+
+// Function to get the contents of a cluster, reading it from the image if it is not cached.
+// The pointer stays valid until the next call that may evict a buffer.
+uint8_t *getCluster(uint32_t cluster) {
+    if (cluster < 2 || !activeVolume->bufferCache.buffers) {
+        return NULL;
+    }
+
+    struct CacheBuffer *buffer = lookupBuffer(cluster);
+    if (buffer) {
+        activeVolume->bufferCache.hits++;
+        lruRemove(buffer);
+        lruPushHead(buffer);
+        return buffer->data;
+    }
+
+    activeVolume->bufferCache.misses++;
+    buffer = claimBuffer(cluster);
+    if (readImage(getClusterOffset(cluster), buffer->data, activeVolume->bufferCache.clusterSize) != activeVolume->bufferCache.clusterSize) {
+        invalidateCluster(cluster);
+        return NULL;
+    }
+    return buffer->data;
+}
+
+// Function to look at a cluster without modifying it. A cached copy is used if there is one (it may be newer than
+// the image); otherwise a mapped image is read in place, with no copy and without filling the cache. Backends
+// without a mapping fall back to getCluster. The pointer stays valid until the next call that may change the cache.
+const uint8_t *peekCluster(uint32_t cluster) {
+    if (cluster < 2 || !activeVolume->bufferCache.buffers) {
+        return NULL;
+    }
+    if (lookupBuffer(cluster)) {
+        return getCluster(cluster);
+    }
+
+    const uint8_t *data = mapImage(getClusterOffset(cluster), activeVolume->bufferCache.clusterSize);
+    return data ? data : getCluster(cluster);
+}
+
+// Function to get a zero-filled, dirty buffer for a cluster whose old contents do not matter (no read is done)
+uint8_t *getNewCluster(uint32_t cluster) {
+    if (cluster < 2 || !activeVolume->bufferCache.buffers) {
+        return NULL;
+    }
+
+    struct CacheBuffer *buffer = lookupBuffer(cluster);
+    if (buffer) {
+        lruRemove(buffer);
+        lruPushHead(buffer);
+    }
+    else {
+        buffer = claimBuffer(cluster);
+    }
+
+    memset(buffer->data, 0, activeVolume->bufferCache.clusterSize);
+    if (!buffer->dirty) {
+        buffer->dirty = true;
+        activeVolume->bufferCache.dirtyCount++;
+    }
+    return buffer->data;
+}
+
+// Function to bring a list of clusters into the cache. The missing ones are read straight into their buffers,
+// neighbours sharing one request, and all requests go to the image as a single batch. Returns the number of
+// clusters now cached from the start of the list.
+int loadClusters(const uint32_t *clusters, uint32_t count) {
+    uint32_t clusterSize = activeVolume->bufferCache.clusterSize;
+
+    if (!activeVolume->bufferCache.buffers || count == 0) {
+        return 0;
+    }
+
+    // Never let one batch push out more than half of the cache
+    if (count > activeVolume->bufferCache.capacity / 2) {
+        count = activeVolume->bufferCache.capacity / 2 ? activeVolume->bufferCache.capacity / 2 : 1;
+    }
+
+    struct CacheBuffer **claimed = malloc(count * sizeof(struct CacheBuffer *));
+    struct iovec *iov = malloc(count * sizeof(struct iovec));
+    struct ImageRequest *requests = malloc(count * sizeof(struct ImageRequest));
+    if (!claimed || !iov || !requests) {
+        free(claimed);
+        free(iov);
+        free(requests);
+        return 0;
+    }
+
+    uint32_t claimedCount = 0;
+    int requestCount = 0;
+    uint32_t loaded = 0;
+    for (; loaded < count; loaded++) {
+        uint32_t cluster = clusters[loaded];
+        if (cluster < 2) {
+            break;
+        }
+
+        struct CacheBuffer *buffer = lookupBuffer(cluster);
+        if (buffer) {
+            lruRemove(buffer);
+            lruPushHead(buffer);
+            activeVolume->bufferCache.hits++;
+            continue;
+        }
+
+        // The buffer is claimed now and filled when the batch completes
+        buffer = claimBuffer(cluster);
+        claimed[claimedCount] = buffer;
+        iov[claimedCount].iov_base = buffer->data;
+        iov[claimedCount].iov_len = clusterSize;
+
+        struct ImageRequest *last = requestCount ? &requests[requestCount - 1] : NULL;
+        if (last && last->count < IMAGE_IOV_MAX && claimed[claimedCount - 1]->cluster + 1 == cluster) {
+            last->count++;
+        }
+        else {
+            requests[requestCount].offset = getClusterOffset(cluster);
+            requests[requestCount].iov = &iov[claimedCount];
+            requests[requestCount].count = 1;
+            requestCount++;
+        }
+        claimedCount++;
+    }
+    activeVolume->bufferCache.misses += claimedCount;
+
+    if (readImageBatch(requests, requestCount) != 0) {
+        // Nothing read by the batch can be trusted, so none of it stays cached
+        for (uint32_t i = 0; i < claimedCount; i++) {
+            invalidateCluster(claimed[i]->cluster);
+        }
+        loaded = 0;
+    }
+
+    free(claimed);
+    free(iov);
+    free(requests);
+    return loaded;
+}
+
+// Function to bring a run of physically contiguous clusters into the cache with one batch.
+// Returns the number of clusters now cached from the start of the run.
+int loadClusterRun(uint32_t firstCluster, uint32_t count) {
+    if (!activeVolume->bufferCache.buffers || firstCluster < 2) {
+        return 0;
+    }
+
+    if (count > activeVolume->bufferCache.capacity / 2) {
+        count = activeVolume->bufferCache.capacity / 2 ? activeVolume->bufferCache.capacity / 2 : 1;
+    }
+
+    uint32_t *clusters = malloc(count * sizeof(uint32_t));
+    if (!clusters) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        clusters[i] = firstCluster + i;
+    }
+
+    int loaded = loadClusters(clusters, count);
+    free(clusters);
+    return loaded;
+}
+
+// Function to mark a cached cluster as modified so it is written back on the next flush
+void markClusterDirty(uint32_t cluster) {
+    struct CacheBuffer *buffer = lookupBuffer(cluster);
+    if (buffer && !buffer->dirty) {
+        buffer->dirty = true;
+        activeVolume->bufferCache.dirtyCount++;
+    }
+}
+
+// Function to drop a cluster from the cache without writing it back
+void invalidateCluster(uint32_t cluster) {
+    struct CacheBuffer *buffer = lookupBuffer(cluster);
+    if (!buffer) {
+        return;
+    }
+
+    if (buffer->dirty) {
+        buffer->dirty = false;
+        activeVolume->bufferCache.dirtyCount--;
+    }
+    unhashBuffer(buffer);
+    buffer->cluster = 0;
+    lruRemove(buffer);
+    lruPushTail(buffer);
+}
+
+// Function to write every dirty cluster back to the image in ascending order. Neighbours share one vectored request
+// that writes straight from their buffers, and every request goes to the image as a single batch.
+int flushBufferCache() {
+    int result = 0;
+
+    if (activeVolume->bufferCache.dirtyCount == 0) {
+        return 0;
+    }
+
+    struct CacheBuffer **dirty = malloc(activeVolume->bufferCache.dirtyCount * sizeof(struct CacheBuffer *));
+    struct iovec *iov = malloc(activeVolume->bufferCache.dirtyCount * sizeof(struct iovec));
+    struct ImageRequest *requests = malloc(activeVolume->bufferCache.dirtyCount * sizeof(struct ImageRequest));
+    if (!dirty || !iov || !requests) {
+        free(dirty);
+        free(iov);
+        free(requests);
+
+        // Without scratch memory, fall back to writing the buffers one at a time
+        for (uint32_t i = 0; i < activeVolume->bufferCache.capacity; i++) {
+            if (activeVolume->bufferCache.buffers[i].dirty && writeBackBuffer(&activeVolume->bufferCache.buffers[i]) != 0) {
+                result = -1;
+            }
+        }
+        return result;
+    }
+
+    uint32_t dirtyCount = 0;
+    for (uint32_t i = 0; i < activeVolume->bufferCache.capacity; i++) {
+        if (activeVolume->bufferCache.buffers[i].dirty) {
+            dirty[dirtyCount++] = &activeVolume->bufferCache.buffers[i];
+        }
+    }
+    qsort(dirty, dirtyCount, sizeof(struct CacheBuffer *), compareBuffers);
+
+    int requestCount = 0;
+    for (uint32_t i = 0; i < dirtyCount; i++) {
+        iov[i].iov_base = dirty[i]->data;
+        iov[i].iov_len = activeVolume->bufferCache.clusterSize;
+        dirty[i]->dirty = false;
+
+        // Extend the previous request while the cluster numbers stay consecutive
+        struct ImageRequest *last = requestCount ? &requests[requestCount - 1] : NULL;
+        if (last && last->count < IMAGE_IOV_MAX && dirty[i - 1]->cluster + 1 == dirty[i]->cluster) {
+            last->count++;
+            continue;
+        }
+        requests[requestCount].offset = getClusterOffset(dirty[i]->cluster);
+        requests[requestCount].iov = &iov[i];
+        requests[requestCount].count = 1;
+        requestCount++;
+    }
+
+    if (journalWriteBatch(requests, requestCount) != 0) {
+        result = -1;
+    }
+
+    activeVolume->bufferCache.dirtyCount = 0;
+    free(dirty);
+    free(iov);
+    free(requests);
+    return result;
+}
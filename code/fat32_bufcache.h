@@ -0,0 +1,46 @@
+#ifndef FAT32_BUFCACHE_H
+#define FAT32_BUFCACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define BUFFER_CACHE_DEFAULT_CAPACITY 1024
+
+// One cached cluster of the image
+struct CacheBuffer {
+    uint32_t cluster;               // Cluster held in this buffer (0 when the buffer is unused)
+    uint8_t *data;                  // Contents of the cluster
+    bool dirty;                     // Whether the contents differ from the image
+    struct CacheBuffer *lruPrev;    // Neighbour towards the most recently used end
+    struct CacheBuffer *lruNext;    // Neighbour towards the least recently used end
+    struct CacheBuffer *hashNext;   // Next buffer in the same hash bucket
+};
+
+// Cluster buffer cache with LRU eviction and write-back of dirty clusters
+struct BufferCache {
+    struct CacheBuffer *buffers;    // Every buffer, allocated up front
+    uint8_t *memory;                // Backing memory for the contents of all buffers
+    struct CacheBuffer **buckets;   // Hash table from cluster number to buffer
+    uint32_t bucketCount;
+    uint32_t capacity;              // Number of clusters the cache can hold
+    uint32_t clusterSize;           // Size of one cluster in bytes
+    struct CacheBuffer *lruHead;    // Most recently used buffer
+    struct CacheBuffer *lruTail;    // Least recently used buffer (next to be evicted)
+    uint32_t dirtyCount;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+// Buffer cache functions
+int initBufferCache(uint32_t capacity);
+void freeBufferCache();
+uint8_t *getCluster(uint32_t cluster);
+const uint8_t *peekCluster(uint32_t cluster);
+uint8_t *getNewCluster(uint32_t cluster);
+int loadClusters(const uint32_t *clusters, uint32_t count);
+int loadClusterRun(uint32_t firstCluster, uint32_t count);
+void markClusterDirty(uint32_t cluster);
+void invalidateCluster(uint32_t cluster);
+int flushBufferCache();
+
+#endif
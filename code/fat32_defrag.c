@@ -0,0 +1,541 @@
+#include "fat32_structs.h"
+#include "fat32_api.h"
+#include "fat32_utils.h"
+#include "fat32_alloc.h"
+#include "fat32_extent.h"
+#include "fat32_io.h"
+#include "fat32_bufcache.h"
+#include "fat32_dirindex.h"
+#include "fat32_dirscan.h"
+#include "fat32_path.h"
+#include "fat32_filetable.h"
+#include "fat32_mount.h"
+#include "globals.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
+
+// Most bytes moved by one copy, and the alignment of the staging buffer
+#define DEFRAG_CHUNK_SIZE (4u << 20)
+#define DEFRAG_ALIGNMENT 4096
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+// A directory of the tree being examined
+struct FragDir {
+    uint32_t cluster;          // First cluster of the directory
+    char *path;                // Absolute path of the directory
+};
+
+// A chain of the tree being examined: a file, or a directory's own clusters
+struct FragItem {
+    uint32_t dirIndex;         // Directory holding the file, or the directory itself
+    char name[11];             // Short name of the file (unused for directories)
+    uint8_t attributes;
+    uint32_t entryCluster;     // Where the file's directory entry lives
+    uint32_t entryIndex;
+    uint32_t firstCluster;
+    uint32_t size;
+    uint32_t clusters;         // Clusters in the chain
+    uint32_t extents;          // Physically contiguous runs in the chain
+};
+
+// Every directory and chain under a directory
+struct FragTree {
+    struct FragDir *dirs;
+    uint32_t dirCount;
+    uint32_t dirCapacity;
+    struct FragItem *items;
+    uint32_t itemCount;
+    uint32_t itemCapacity;
+};
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Defrag helper functions
+
+// Function to count the clusters of a chain and the contiguous runs they form, walking the cached FAT
+static void measureChain(uint32_t firstCluster, uint32_t *clusters, uint32_t *extents) {
+    uint32_t previous = 0;
+
+    *clusters = 0;
+    *extents = 0;
+    for (uint32_t cluster = firstCluster; cluster >= 2 && cluster < 0x0FFFFFF8; cluster = getNextCluster(cluster)) {
+        if (cluster != previous + 1) {
+            (*extents)++;
+        }
+        previous = cluster;
+
+        // A chain can never be longer than the volume, which also stops one that loops back on itself
+        if (++(*clusters) >= activeVolume->allocator.clusterCount) {
+            break;
+        }
+    }
+}
+
+// Function to add a directory to the tree, taking ownership of 'path'
+static int addFragDir(struct FragTree *tree, uint32_t cluster, char *path) {
+    if (!path) {
+        return FAT32_ERR_NO_MEMORY;
+    }
+    if (tree->dirCount == tree->dirCapacity) {
+        uint32_t capacity = tree->dirCapacity ? tree->dirCapacity * 2 : 64;
+        struct FragDir *grown = realloc(tree->dirs, capacity * sizeof(struct FragDir));
+        if (!grown) {
+            free(path);
+            return FAT32_ERR_NO_MEMORY;
+        }
+        tree->dirs = grown;
+        tree->dirCapacity = capacity;
+    }
+    tree->dirs[tree->dirCount].cluster = cluster;
+    tree->dirs[tree->dirCount].path = path;
+    tree->dirCount++;
+    return FAT32_OK;
+}
+
+// Function to add a chain to the tree
+static int addFragItem(struct FragTree *tree, const struct FragItem *item) {
+    if (tree->itemCount == tree->itemCapacity) {
+        uint32_t capacity = tree->itemCapacity ? tree->itemCapacity * 2 : 256;
+        struct FragItem *grown = realloc(tree->items, capacity * sizeof(struct FragItem));
+        if (!grown) {
+            return FAT32_ERR_NO_MEMORY;
+        }
+        tree->items = grown;
+        tree->itemCapacity = capacity;
+    }
+    tree->items[tree->itemCount++] = *item;
+    return FAT32_OK;
+}
+
+// Function to add a directory and the chain of its own clusters to the tree
+static int addDirectory(struct FragTree *tree, uint32_t cluster, char *path) {
+    struct FragItem item;
+
+    int result = addFragDir(tree, cluster, path);
+    if (result != FAT32_OK) {
+        return result;
+    }
+    memset(&item, 0, sizeof(item));
+    item.dirIndex = tree->dirCount - 1;
+    item.attributes = ATTR_DIRECTORY;
+    item.firstCluster = cluster;
+    measureChain(cluster, &item.clusters, &item.extents);
+    return addFragItem(tree, &item);
+}
+
+// Function to build the path of a child from the path of its directory
+static char *childPath(const char *parentPath, const char *formattedName) {
+    size_t length = strlen(parentPath) + strlen(formattedName) + 2;
+    char *path = malloc(length);
+    if (path) {
+        snprintf(path, length, "%s%s%s", parentPath, strcmp(parentPath, "/") == 0 ? "" : "/", formattedName);
+    }
+    return path;
+}
+
+// Function to measure the chain of one file or directory found by the tree walk. Directories are added in the order
+// the walk queues them, so the walk's directory index is also the index into tree->dirs.
+static int collectFragEntry(const struct FAT32DirectoryEntry *dirEntry, uint32_t dir, uint32_t dirCluster,
+                            uint32_t entryCluster, uint32_t entryIndex, void *context) {
+    struct FragTree *tree = context;
+    uint32_t childCluster = (dirEntry->firstClusterHi << 16) | dirEntry->firstClusterLo;
+    (void)dirCluster;
+
+    if (dirEntry->attributes & ATTR_DIRECTORY) {
+        if (childCluster < 2) {
+            return FAT32_OK;
+        }
+        char formattedName[13];
+        formatDirName((const char *)dirEntry->name, formattedName);
+        return addDirectory(tree, childCluster, childPath(tree->dirs[dir].path, formattedName));
+    }
+
+    struct FragItem item;
+    memset(&item, 0, sizeof(item));
+    item.dirIndex = dir;
+    memcpy(item.name, dirEntry->name, 11);
+    item.attributes = dirEntry->attributes;
+    item.entryCluster = entryCluster;
+    item.entryIndex = entryIndex;
+    item.firstCluster = childCluster;
+    item.size = dirEntry->fileSize;
+    measureChain(childCluster, &item.clusters, &item.extents);
+    return addFragItem(tree, &item);
+}
+
+// Function to release a tree
+static void freeFragTree(struct FragTree *tree) {
+    for (uint32_t d = 0; d < tree->dirCount; d++) {
+        free(tree->dirs[d].path);
+    }
+    free(tree->dirs);
+    free(tree->items);
+    memset(tree, 0, sizeof(*tree));
+}
+
+// Function to resolve the directory a report or pass starts from and collect the tree under it (NULL is the current
+// directory)
+static int loadFragTree(const char *path, struct FragTree *tree) {
+    char absolutePath[256];
+
+    memset(tree, 0, sizeof(*tree));
+    uint32_t cluster = path ? resolveDirectory(activeVolume->currentDirCluster, path) : activeVolume->currentDirCluster;
+    if (cluster == 0xFFFFFFFF) {
+        return FAT32_ERR_NOT_FOUND;
+    }
+    joinPath(activeVolume->currentPath, path ? path : ".", absolutePath, sizeof(absolutePath));
+
+    struct ClusterList dirs = { NULL, 0, 0 };
+    int result = addDirectory(tree, cluster, strdup(absolutePath));
+    if (result == FAT32_OK) {
+        result = appendClusterList(&dirs, cluster) == 0 ? walkDirectoryTree(&dirs, collectFragEntry, tree) : FAT32_ERR_NO_MEMORY;
+    }
+    free(dirs.clusters);
+    if (result != FAT32_OK) {
+        freeFragTree(tree);
+    }
+    return result;
+}
+
+// Function to order chains with the most runs first, so a limited pass spends its budget where it helps most
+static int compareFragItems(const void *a, const void *b) {
+    const struct FragItem *x = *(const struct FragItem * const *)a, *y = *(const struct FragItem * const *)b;
+    return (x->extents < y->extents) - (x->extents > y->extents);
+}
+
+// Function to check whether any open file has its directory entry in a directory
+static bool directoryHasOpenFile(uint32_t dirCluster) {
+    for (int handle = nextOpenFile(-1); handle >= 0; handle = nextOpenFile(handle)) {
+        if (getOpenFile(handle)->dirCluster == dirCluster) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Function to claim new clusters for the part of a chain being moved: right after the kept first cluster when the
+// clusters there are free, else one contiguous run, else as few runs as the volume has. Returns the first new cluster.
+static uint32_t allocateTarget(uint32_t firstCluster, bool keepFirst, uint32_t count) {
+    if (keepFirst) {
+        uint32_t free = 0;
+        while (free < count && firstCluster + 1 + free < activeVolume->allocator.clusterCount && isClusterFree(firstCluster + 1 + free)) {
+            free++;
+        }
+        if (free == count) {
+            return allocateExtent(firstCluster, count);
+        }
+    }
+
+    uint32_t target = allocateRun(count);
+    if (target == 0xFFFFFFFF) {
+        target = allocateExtent(0, count);
+    }
+    return target;
+}
+
+// Function to copy clusters from one chain to another, one run (or staging buffer) at a time. Cached copies of the
+// target clusters are dropped, since they no longer match the image.
+static int copyClusters(const struct OpenFile *source, uint32_t sourceStart, const struct OpenFile *target, uint32_t count,
+                        uint8_t *buffer, uint32_t bufferClusters, uint64_t *bytesCopied) {
+    uint32_t clusterSize = activeVolume->bootSector.sectorsPerCluster * activeVolume->bootSector.bytesPerSector;
+
+    for (uint32_t done = 0; done < count; ) {
+        uint32_t sourceRun, targetRun;
+        uint32_t from = lookupCluster(source, sourceStart + done, &sourceRun);
+        uint32_t to = lookupCluster(target, done, &targetRun);
+        if (from == 0xFFFFFFFF || to == 0xFFFFFFFF) {
+            return FAT32_ERR_IO;
+        }
+
+        uint32_t clusters = min(min(sourceRun, targetRun), min(bufferClusters, count - done));
+        size_t length = (size_t)clusters * clusterSize;
+        struct iovec iov = { buffer, length };
+        if (readImageVector(getClusterOffset(from), &iov, 1) != length || writeImageVector(getClusterOffset(to), &iov, 1) != length) {
+            return FAT32_ERR_IO;
+        }
+        for (uint32_t i = 0; i < clusters; i++) {
+            invalidateCluster(to + i);
+        }
+
+        *bytesCopied += length;
+        done += clusters;
+    }
+    return FAT32_OK;
+}
+
+// Function to move a chain into fewer runs: the whole chain for a file, or all but the first cluster for a directory
+// (so nothing that refers to the directory by its first cluster changes). The data is copied with bulk vectored I/O and
+// the new clusters are linked in with one FAT update; the old clusters are added to 'oldChains' to be freed later.
+// Returns the new first cluster of the moved part through 'newFirst'.
+static int relocateChain(const struct FragItem *item, bool keepFirst, uint8_t *buffer, uint32_t bufferClusters,
+                         struct ClusterList *oldChains, uint32_t *newFirst, uint64_t *bytesCopied) {
+    struct OpenFile source, target;
+    uint32_t skip = keepFirst ? 1 : 0;
+
+    memset(&source, 0, sizeof(source));
+    memset(&target, 0, sizeof(target));
+    source.fileCluster = item->firstCluster;
+    if (buildExtentMap(&source) != 0) {
+        freeExtentMap(&source);
+        return FAT32_ERR_NO_MEMORY;
+    }
+    uint32_t count = source.clusterCount - skip;
+
+    target.fileCluster = allocateTarget(item->firstCluster, keepFirst, count);
+    if (target.fileCluster == 0xFFFFFFFF) {
+        freeExtentMap(&source);
+        return FAT32_ERR_NO_SPACE;
+    }
+    if (buildExtentMap(&target) != 0 || target.clusterCount != count) {
+        freeClusters(target.fileCluster);
+        freeExtentMap(&source);
+        freeExtentMap(&target);
+        return FAT32_ERR_NO_MEMORY;
+    }
+
+    // Only move the chain if that leaves it in fewer runs than it has now
+    uint32_t extentsAfter = target.extentCount;
+    if (keepFirst && target.extents[0].physicalCluster != item->firstCluster + 1) {
+        extentsAfter++;
+    }
+    int result = extentsAfter < source.extentCount ? FAT32_OK : FAT32_ERR_NO_SPACE;
+    if (result == FAT32_OK) {
+        result = copyClusters(&source, skip, &target, count, buffer, bufferClusters, bytesCopied);
+    }
+    if (result != FAT32_OK) {
+        freeClusters(target.fileCluster);
+        freeExtentMap(&source);
+        freeExtentMap(&target);
+        return result;
+    }
+
+    // The old clusters must not be written back from the cache over whatever takes their place
+    for (uint32_t e = 0; e < source.extentCount; e++) {
+        for (uint32_t i = 0; i < source.extents[e].length; i++) {
+            if (source.extents[e].logicalCluster + i >= skip) {
+                invalidateCluster(source.extents[e].physicalCluster + i);
+            }
+        }
+    }
+
+    uint32_t oldFirst = item->firstCluster;
+    if (keepFirst) {
+        oldFirst = getNextCluster(item->firstCluster);
+        updateFATChain(item->firstCluster, target.fileCluster);
+    }
+    result = appendClusterList(oldChains, oldFirst) == 0 ? FAT32_OK : FAT32_ERR_NO_MEMORY;
+
+    *newFirst = target.fileCluster;
+    freeExtentMap(&source);
+    freeExtentMap(&target);
+    return result;
+}
+
+// Function to point a file's directory entry (and the index of its directory) at its new first cluster
+static int setEntryFirstCluster(const struct FragTree *tree, const struct FragItem *item, uint32_t firstCluster) {
+    struct FAT32DirectoryEntry *entries = (struct FAT32DirectoryEntry *)getCluster(item->entryCluster);
+    if (!entries) {
+        return FAT32_ERR_IO;
+    }
+
+    entries[item->entryIndex].firstClusterHi = (firstCluster >> 16) & 0xFFFF;
+    entries[item->entryIndex].firstClusterLo = firstCluster & 0xFFFF;
+    markClusterDirty(item->entryCluster);
+
+    char fat32Name[12];
+    memcpy(fat32Name, item->name, 11);
+    fat32Name[11] = '\0';
+    setDirIndexFirstCluster(tree->dirs[item->dirIndex].cluster, fat32Name, firstCluster);
+    return FAT32_OK;
+}
+
+// Function to get the milliseconds elapsed since a start time
+static uint64_t elapsedMilliseconds(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Defrag implementations
+
+// Function to report how fragmented the files and directories under a directory are (NULL is the current directory).
+// The callback (if given) is called once per chain; 'summary' receives the totals and the fragmentation score, which
+// is the percentage of cluster-to-cluster steps in all chains that jump elsewhere on the volume (0 when every chain
+// is contiguous, 100 when no two clusters of any chain are adjacent).
+int fat32FragReport(struct FAT32Volume *volume, const char *path, FAT32FragCallback callback, void *context,
+                    struct FAT32FragSummary *summary) {
+    struct FragTree tree;
+
+    selectVolume(volume);
+    memset(summary, 0, sizeof(*summary));
+
+    int result = loadFragTree(path, &tree);
+    if (result != FAT32_OK) {
+        return result;
+    }
+
+    uint64_t chains = 0;
+    for (uint32_t i = 0; i < tree.itemCount; i++) {
+        const struct FragItem *item = &tree.items[i];
+        struct FAT32FragInfo info;
+        char *itemPath = NULL;
+
+        if (item->attributes & ATTR_DIRECTORY) {
+            summary->directories++;
+            info.path = tree.dirs[item->dirIndex].path;
+        }
+        else {
+            char formattedName[13];
+            formatDirName(item->name, formattedName);
+            itemPath = childPath(tree.dirs[item->dirIndex].path, formattedName);
+            summary->files++;
+            info.path = itemPath ? itemPath : formattedName;
+        }
+
+        summary->clusters += item->clusters;
+        summary->extents += item->extents;
+        chains += item->clusters > 0;
+        summary->fragmented += item->extents > 1;
+
+        if (callback) {
+            info.attributes = item->attributes;
+            info.size = item->size;
+            info.clusters = item->clusters;
+            info.extents = item->extents;
+            callback(&info, context);
+        }
+        free(itemPath);
+    }
+
+    // Each chain has clusters - 1 steps, and each run after the first is one step that is a jump
+    uint64_t steps = summary->clusters - chains;
+    summary->score = steps > 0 ? 100.0 * (summary->extents - chains) / steps : 0.0;
+
+    freeFragTree(&tree);
+    return FAT32_OK;
+}
+
+// Function to defragment the files and directories under a directory (NULL is the current directory). Fragmented file
+// chains are moved into contiguous runs, and directories have their clusters after the first gathered behind it.
+// The most fragmented chains go first, and the pass stops early once 'limits' (if given) are used up, so it can be
+// run a little at a time between other work. Open files and directories holding them are left alone.
+int fat32Defrag(struct FAT32Volume *volume, const char *path, const struct FAT32DefragLimits *limits,
+                struct FAT32DefragStats *stats) {
+    struct FragTree tree;
+    struct ClusterList oldChains = { NULL, 0, 0 };
+    struct timespec start;
+    void *buffer = NULL;
+
+    selectVolume(volume);
+    memset(stats, 0, sizeof(*stats));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Chains are copied straight from the image, so everything cached or buffered has to be there first
+    if (checkpointImage() != 0) {
+        return FAT32_ERR_IO;
+    }
+
+    int result = loadFragTree(path, &tree);
+    if (result != FAT32_OK) {
+        return result;
+    }
+
+    // Files first, then directories (moving a directory's clusters moves the entries in them), each most runs first
+    struct FragItem **queue = malloc((size_t)tree.itemCount * sizeof(struct FragItem *));
+    uint32_t clusterSize = activeVolume->bootSector.sectorsPerCluster * activeVolume->bootSector.bytesPerSector;
+    uint32_t bufferClusters = DEFRAG_CHUNK_SIZE / clusterSize ? DEFRAG_CHUNK_SIZE / clusterSize : 1;
+    if (!queue || posix_memalign(&buffer, DEFRAG_ALIGNMENT, (size_t)bufferClusters * clusterSize) != 0) {
+        free(queue);
+        freeFragTree(&tree);
+        return FAT32_ERR_NO_MEMORY;
+    }
+
+    uint32_t fileCount = 0, queued = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t passStart = queued;
+        for (uint32_t i = 0; i < tree.itemCount; i++) {
+            struct FragItem *item = &tree.items[i];
+            stats->extentsBefore += pass == 0 ? item->extents : 0;
+            if (item->extents > 1 && ((item->attributes & ATTR_DIRECTORY) != 0) == (pass == 1)) {
+                queue[queued++] = item;
+            }
+        }
+        qsort(queue + passStart, queued - passStart, sizeof(struct FragItem *), compareFragItems);
+        if (pass == 0) {
+            fileCount = queued;
+        }
+    }
+    stats->extentsAfter = stats->extentsBefore;
+    stats->complete = true;
+
+    for (uint32_t q = 0; q < queued && result == FAT32_OK; q++) {
+        struct FragItem *item = queue[q];
+        bool isDirectory = q >= fileCount;
+        uint64_t itemBytes = (uint64_t)(item->clusters - (isDirectory ? 1 : 0)) * clusterSize;
+
+        // Stop once the time is up, or before a chain that would go past the I/O budget (the first always runs)
+        if (limits && ((limits->milliseconds && elapsedMilliseconds(&start) >= limits->milliseconds) ||
+                       (limits->bytes && stats->bytesCopied > 0 && stats->bytesCopied + itemBytes > limits->bytes))) {
+            stats->complete = false;
+            break;
+        }
+
+        // The directory entries updated for moved files must be on the image before directory clusters are copied
+        if (q == fileCount && flushBufferCache() != 0) {
+            result = FAT32_ERR_IO;
+            break;
+        }
+
+        char fat32Name[12];
+        memcpy(fat32Name, item->name, 11);
+        fat32Name[11] = '\0';
+        bool busy = isDirectory ? directoryHasOpenFile(item->firstCluster)
+                                : isEntryOpen(tree.dirs[item->dirIndex].cluster, fat32Name);
+        if (busy) {
+            stats->skipped++;
+            continue;
+        }
+
+        uint32_t newFirst;
+        uint64_t copied = 0;
+        int moved = relocateChain(item, isDirectory, buffer, bufferClusters, &oldChains, &newFirst, &copied);
+        stats->bytesCopied += copied;
+        if (moved == FAT32_ERR_NO_SPACE) {
+            // No free space would leave the chain in fewer runs
+            stats->skipped++;
+            continue;
+        }
+        if (moved != FAT32_OK) {
+            result = moved;
+            break;
+        }
+
+        uint32_t clusters, extents;
+        if (isDirectory) {
+            dropDirIndex(item->firstCluster);
+            stats->directoriesMoved++;
+        }
+        else {
+            result = setEntryFirstCluster(&tree, item, newFirst);
+            stats->filesMoved++;
+        }
+        measureChain(isDirectory ? item->firstCluster : newFirst, &clusters, &extents);
+        stats->extentsAfter -= item->extents - extents;
+    }
+
+    // The old chains are only freed once every move is done, so no move reuses clusters another one just left
+    freeClusterChains(oldChains.clusters, oldChains.count);
+    flushImage();
+
+    free(oldChains.clusters);
+    free(buffer);
+    free(queue);
+    freeFragTree(&tree);
+    return result;
+}
@@ -0,0 +1,419 @@
+#include "fat32_structs.h"
+#include "fat32_dirindex.h"
+#include "fat32_utils.h"
+#include "fat32_fatcache.h"
+#include "fat32_bufcache.h"
+#include "fat32_dirscan.h"
+#include "globals.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Directory index helper functions
+
+// Function to hash an 11-byte short name (FNV-1a)
+static uint32_t hashName(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 11; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Function to release everything held by an index and mark it unused
+static void resetIndex(struct DirIndex *index) {
+    free(index->records);
+    free(index->buckets);
+    free(index->freeSlots);
+    memset(index, 0, sizeof(*index));
+}
+
+// Function to find the index of a directory only if it is already in memory
+static struct DirIndex *findIndex(uint32_t dirCluster) {
+    if (dirCluster < 2) {
+        return NULL;
+    }
+
+    for (int i = 0; i < DIR_INDEX_MAX_DIRECTORIES; i++) {
+        if (activeVolume->dirIndexCache.indexes[i].dirCluster == dirCluster) {
+            activeVolume->dirIndexCache.indexes[i].lastUsed = ++activeVolume->dirIndexCache.useCounter;
+            return &activeVolume->dirIndexCache.indexes[i];
+        }
+    }
+    return NULL;
+}
+
+// Function to find the link pointing at the record for a name, or NULL if the name is not indexed
+static int32_t *findRecordLink(struct DirIndex *index, const char *fat32Name) {
+    int32_t *link = &index->buckets[hashName(fat32Name) & (index->bucketCount - 1)];
+    while (*link != -1) {
+        if (memcmp(index->records[*link].name, fat32Name, 11) == 0) {
+            return link;
+        }
+        link = &index->records[*link].next;
+    }
+    return NULL;
+}
+
+// Function to double the hash table and chain every live record into it again
+static int growBuckets(struct DirIndex *index) {
+    uint32_t bucketCount = index->bucketCount ? index->bucketCount * 2 : 64;
+    int32_t *buckets = malloc(bucketCount * sizeof(int32_t));
+    if (!buckets) {
+        return -1;
+    }
+
+    memset(buckets, 0xFF, bucketCount * sizeof(int32_t));
+    for (uint32_t i = 0; i < index->recordCount; i++) {
+        if (index->records[i].name[0] == 0) {
+            continue;
+        }
+        uint32_t bucket = hashName(index->records[i].name) & (bucketCount - 1);
+        index->records[i].next = buckets[bucket];
+        buckets[bucket] = i;
+    }
+
+    free(index->buckets);
+    index->buckets = buckets;
+    index->bucketCount = bucketCount;
+    return 0;
+}
+
+// Function to add a name to an index (the first entry with a given name wins, as in a linear scan)
+static int insertRecord(struct DirIndex *index, const char *fat32Name, uint8_t attributes,
+                        uint32_t entryCluster, uint32_t entryIndex, uint32_t firstCluster) {
+    if (index->liveCount >= index->bucketCount && growBuckets(index) != 0) {
+        return -1;
+    }
+    if (findRecordLink(index, fat32Name)) {
+        return 0;
+    }
+
+    // Reuse a record freed by a removal before growing the array
+    int32_t record = index->freeRecord;
+    if (record != -1) {
+        index->freeRecord = index->records[record].next;
+    }
+    else {
+        if (index->recordCount == index->recordCapacity) {
+            uint32_t capacity = index->recordCapacity ? index->recordCapacity * 2 : 64;
+            struct DirIndexEntry *records = realloc(index->records, capacity * sizeof(struct DirIndexEntry));
+            if (!records) {
+                return -1;
+            }
+            index->records = records;
+            index->recordCapacity = capacity;
+        }
+        record = index->recordCount++;
+    }
+
+    struct DirIndexEntry *entry = &index->records[record];
+    memcpy(entry->name, fat32Name, 11);
+    entry->attributes = attributes;
+    entry->entryCluster = entryCluster;
+    entry->entryIndex = entryIndex;
+    entry->firstCluster = firstCluster;
+
+    uint32_t bucket = hashName(fat32Name) & (index->bucketCount - 1);
+    entry->next = index->buckets[bucket];
+    index->buckets[bucket] = record;
+    index->liveCount++;
+    return 0;
+}
+
+// Function to remember a deleted entry so a later create can reuse it
+static int pushFreeSlot(struct DirIndex *index, uint32_t cluster, uint32_t entryIndex) {
+    if (index->freeSlotCount == index->freeSlotCapacity) {
+        uint32_t capacity = index->freeSlotCapacity ? index->freeSlotCapacity * 2 : 16;
+        struct DirSlot *slots = realloc(index->freeSlots, capacity * sizeof(struct DirSlot));
+        if (!slots) {
+            return -1;
+        }
+        index->freeSlots = slots;
+        index->freeSlotCapacity = capacity;
+    }
+
+    index->freeSlots[index->freeSlotCount].cluster = cluster;
+    index->freeSlots[index->freeSlotCount].index = entryIndex;
+    index->freeSlotCount++;
+    return 0;
+}
+
+// Function to scan a directory's cluster chain once and index every name in it
+static int buildIndex(struct DirIndex *index, uint32_t dirCluster) {
+    uint32_t entriesPerCluster = activeVolume->bootSector.sectorsPerCluster * (activeVolume->bootSector.bytesPerSector / sizeof(struct FAT32DirectoryEntry));
+    uint32_t currentCluster = dirCluster;
+    uint32_t clustersVisited = 0;
+    bool foundEnd = false;
+    uint64_t nameMask[DIR_SCAN_MASK_WORDS(entriesPerCluster)];
+    uint64_t deletedMask[DIR_SCAN_MASK_WORDS(entriesPerCluster)];
+
+    index->dirCluster = dirCluster;
+    index->freeRecord = -1;
+    if (growBuckets(index) != 0) {
+        return -1;
+    }
+
+    loadDirectoryClusters(dirCluster);
+    do {
+        index->lastCluster = currentCluster;
+
+        // Everything after the end-of-directory marker is free, so only the rest of the chain needs walking
+        if (!foundEnd) {
+            const struct FAT32DirectoryEntry *entries = (const struct FAT32DirectoryEntry *)peekCluster(currentCluster);
+            if (!entries) {
+                return -1;
+            }
+
+            // One pass of the scan kernel finds the end marker and which entries are names or deleted
+            struct DirScanResult scan;
+            scanDirEntries(entries, entriesPerCluster, NULL, nameMask, deletedMask, &scan);
+            if (scan.endIndex != -1) {
+                index->endCluster = currentCluster;
+                index->endIndex = scan.endIndex;
+                foundEnd = true;
+            }
+
+            for (uint32_t word = 0; word < DIR_SCAN_MASK_WORDS(entriesPerCluster); word++) {
+                for (uint64_t bits = deletedMask[word]; bits; bits &= bits - 1) {
+                    if (pushFreeSlot(index, currentCluster, word * 64 + __builtin_ctzll(bits)) != 0) return -1;
+                }
+
+                // Long name pieces and the volume label are not in the name mask, as they are not names that can be looked up
+                for (uint64_t bits = nameMask[word]; bits; bits &= bits - 1) {
+                    uint32_t i = word * 64 + __builtin_ctzll(bits);
+                    uint32_t firstCluster = (entries[i].firstClusterHi << 16) | entries[i].firstClusterLo;
+                    if (insertRecord(index, (const char *)entries[i].name, entries[i].attributes, currentCluster, i, firstCluster) != 0) {
+                        return -1;
+                    }
+                }
+            }
+        }
+
+        // Guard against a chain that loops back on itself
+        if (++clustersVisited > activeVolume->fatCache.clusterCount) {
+            break;
+        }
+        currentCluster = getNextCluster(currentCluster);
+    } while (currentCluster != 0xFFFFFFFF);
+
+    return 0;
+}
+
+// Function to look a name up by scanning the directory with the name as the scan key, for when no index can be built.
+// The result is kept in the index cache until the next such lookup.
+static const struct DirIndexEntry *scanForName(uint32_t dirCluster, const char *fat32Name) {
+    uint32_t entriesPerCluster = activeVolume->bootSector.sectorsPerCluster * (activeVolume->bootSector.bytesPerSector / sizeof(struct FAT32DirectoryEntry));
+    uint32_t clustersVisited = 0;
+    struct DirScanKey key;
+
+    packDirScanKey(fat32Name, &key);
+    for (uint32_t cluster = dirCluster; cluster >= 2 && cluster < 0x0FFFFFF8; cluster = getNextCluster(cluster)) {
+        const struct FAT32DirectoryEntry *entries = (const struct FAT32DirectoryEntry *)peekCluster(cluster);
+        if (!entries || ++clustersVisited > activeVolume->fatCache.clusterCount) {
+            return NULL;
+        }
+
+        struct DirScanResult scan;
+        scanDirEntries(entries, entriesPerCluster, &key, NULL, NULL, &scan);
+        if (scan.matchIndex != -1) {
+            struct DirIndexEntry *entry = &activeVolume->dirIndexCache.scanned;
+            const struct FAT32DirectoryEntry *dirEntry = &entries[scan.matchIndex];
+            memcpy(entry->name, dirEntry->name, 11);
+            entry->attributes = dirEntry->attributes;
+            entry->entryCluster = cluster;
+            entry->entryIndex = scan.matchIndex;
+            entry->firstCluster = (dirEntry->firstClusterHi << 16) | dirEntry->firstClusterLo;
+            entry->next = -1;
+            return entry;
+        }
+        if (scan.endIndex != -1) {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Directory index implementations
+
+// Function to release every directory index
+void freeDirIndexCache() {
+    for (int i = 0; i < DIR_INDEX_MAX_DIRECTORIES; i++) {
+        resetIndex(&activeVolume->dirIndexCache.indexes[i]);
+    }
+    activeVolume->dirIndexCache.useCounter = 0;
+}
+
+// Function to get the index of a directory, scanning the directory to build it on first use
+struct DirIndex *getDirIndex(uint32_t dirCluster) {
+    struct DirIndex *index = findIndex(dirCluster);
+    if (index || dirCluster < 2) {
+        return index;
+    }
+
+    // Take an unused index, or drop the one that has gone unused the longest
+    index = &activeVolume->dirIndexCache.indexes[0];
+    for (int i = 0; i < DIR_INDEX_MAX_DIRECTORIES; i++) {
+        if (activeVolume->dirIndexCache.indexes[i].dirCluster == 0) {
+            index = &activeVolume->dirIndexCache.indexes[i];
+            break;
+        }
+        if (activeVolume->dirIndexCache.indexes[i].lastUsed < index->lastUsed) {
+            index = &activeVolume->dirIndexCache.indexes[i];
+        }
+    }
+
+    resetIndex(index);
+    if (buildIndex(index, dirCluster) != 0) {
+        resetIndex(index);
+        return NULL;
+    }
+    index->lastUsed = ++activeVolume->dirIndexCache.useCounter;
+    return index;
+}
+
+// Function to look up an 11-byte short name in a directory, or NULL if it is not there.
+// The result stays valid until the directory is next changed.
+const struct DirIndexEntry *lookupDirIndex(uint32_t dirCluster, const char *fat32Name) {
+    struct DirIndex *index = getDirIndex(dirCluster);
+    if (!index) {
+        return dirCluster >= 2 ? scanForName(dirCluster, fat32Name) : NULL;
+    }
+
+    int32_t *link = findRecordLink(index, fat32Name);
+    return link ? &index->records[*link] : NULL;
+}
+
+// Function to record a newly written directory entry in the directory's index
+void addDirIndexEntry(uint32_t dirCluster, const char *fat32Name, uint8_t attributes,
+                      uint32_t entryCluster, uint32_t entryIndex, uint32_t firstCluster) {
+    // A directory without an index picks the entry up when it is next scanned
+    struct DirIndex *index = findIndex(dirCluster);
+    if (!index) {
+        return;
+    }
+
+    // An index that missed an update would give wrong answers, so drop it to be rebuilt instead
+    if (insertRecord(index, fat32Name, attributes, entryCluster, entryIndex, firstCluster) != 0) {
+        resetIndex(index);
+    }
+}
+
+// Function to remove a deleted name from the directory's index and keep its slot for reuse
+void removeDirIndexEntry(uint32_t dirCluster, const char *fat32Name) {
+    struct DirIndex *index = findIndex(dirCluster);
+    if (!index) {
+        return;
+    }
+
+    int32_t *link = findRecordLink(index, fat32Name);
+    if (!link) {
+        return;
+    }
+
+    int32_t record = *link;
+    struct DirIndexEntry *entry = &index->records[record];
+    if (pushFreeSlot(index, entry->entryCluster, entry->entryIndex) != 0) {
+        resetIndex(index);
+        return;
+    }
+
+    *link = entry->next;
+    entry->name[0] = 0;
+    entry->next = index->freeRecord;
+    index->freeRecord = record;
+    index->liveCount--;
+}
+
+// Function to update the first cluster recorded for a name (a file gets its first cluster on its first write)
+void setDirIndexFirstCluster(uint32_t dirCluster, const char *fat32Name, uint32_t firstCluster) {
+    struct DirIndex *index = findIndex(dirCluster);
+    if (!index) {
+        return;
+    }
+
+    int32_t *link = findRecordLink(index, fat32Name);
+    if (link) {
+        index->records[*link].firstCluster = firstCluster;
+    }
+}
+
+// Function to claim a free entry slot in a directory, preferring deleted entries over the end of the directory.
+// Returns -1 when every cluster of the directory is full.
+int takeDirSlot(uint32_t dirCluster, struct DirSlot *slot) {
+    uint32_t entriesPerCluster = activeVolume->bootSector.sectorsPerCluster * (activeVolume->bootSector.bytesPerSector / sizeof(struct FAT32DirectoryEntry));
+    struct DirIndex *index = getDirIndex(dirCluster);
+    if (!index) {
+        return -1;
+    }
+
+    if (index->freeSlotCount > 0) {
+        *slot = index->freeSlots[--index->freeSlotCount];
+        return 0;
+    }
+
+    if (index->endCluster == 0) {
+        return -1;
+    }
+
+    slot->cluster = index->endCluster;
+    slot->index = index->endIndex;
+
+    // Move the end-of-directory marker past the slot just handed out
+    if (++index->endIndex == entriesPerCluster) {
+        uint32_t nextCluster = getNextCluster(index->endCluster);
+        index->endCluster = (nextCluster == 0xFFFFFFFF) ? 0 : nextCluster;
+        index->endIndex = 0;
+    }
+    return 0;
+}
+
+// Function to give back a slot claimed with takeDirSlot when the entry could not be written. A slot taken from the end
+// of the directory moves the end-of-directory marker back onto it, so entries written later are not hidden behind it.
+void returnDirSlot(uint32_t dirCluster, const struct DirSlot *slot) {
+    uint32_t entriesPerCluster = activeVolume->bootSector.sectorsPerCluster * (activeVolume->bootSector.bytesPerSector / sizeof(struct FAT32DirectoryEntry));
+    struct DirIndex *index = findIndex(dirCluster);
+    if (!index) {
+        return;
+    }
+
+    bool endOfCluster = slot->index + 1 == entriesPerCluster;
+    if ((index->endCluster == slot->cluster && index->endIndex == slot->index + 1) ||
+        (endOfCluster && index->endCluster == 0) ||
+        (endOfCluster && index->endIndex == 0 && getNextCluster(slot->cluster) == index->endCluster)) {
+        index->endCluster = slot->cluster;
+        index->endIndex = slot->index;
+        return;
+    }
+
+    // Otherwise it was a deleted entry, which can be reused as before (without memory for it, the index is rebuilt)
+    if (pushFreeSlot(index, slot->cluster, slot->index) != 0) {
+        resetIndex(index);
+    }
+}
+
+// Function to record a zeroed cluster that was just linked onto the end of a directory
+void appendDirIndexCluster(uint32_t dirCluster, uint32_t newCluster) {
+    struct DirIndex *index = findIndex(dirCluster);
+    if (!index) {
+        return;
+    }
+
+    index->lastCluster = newCluster;
+    if (index->endCluster == 0) {
+        index->endCluster = newCluster;
+        index->endIndex = 0;
+    }
+}
+
+// Function to forget the index of a directory (its clusters were freed and may be reused)
+void dropDirIndex(uint32_t dirCluster) {
+    struct DirIndex *index = findIndex(dirCluster);
+    if (index) {
+        resetIndex(index);
+    }
+}
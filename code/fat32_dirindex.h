@@ -0,0 +1,65 @@
+#ifndef FAT32_DIRINDEX_H
+#define FAT32_DIRINDEX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Number of directories whose indexes are kept in memory at once
+#define DIR_INDEX_MAX_DIRECTORIES 64
+
+// Where a name lives in a directory and what it points to
+struct DirIndexEntry {
+    char name[11];           // Short name exactly as stored in the directory entry (name[0] is 0 when the record is unused)
+    uint8_t attributes;
+    uint32_t entryCluster;   // Directory cluster holding the entry
+    uint32_t entryIndex;     // Index of the entry within that cluster
+    uint32_t firstCluster;   // First cluster of the file or directory
+    int32_t next;            // Next record in the same hash bucket (or in the list of unused records)
+};
+
+// Location of an entry slot in a directory
+struct DirSlot {
+    uint32_t cluster;
+    uint32_t index;
+};
+
+// Hash index of the names in one directory, together with the slots new entries can be written to
+struct DirIndex {
+    uint32_t dirCluster;             // First cluster of the indexed directory (0 when unused)
+    uint64_t lastUsed;               // Use stamp for choosing which index to drop
+    struct DirIndexEntry *records;
+    uint32_t recordCount;            // Number of records handed out, live or unused
+    uint32_t recordCapacity;
+    uint32_t liveCount;              // Number of names in the index
+    int32_t freeRecord;              // First unused record, or -1
+    int32_t *buckets;                // Hash table from name to first record (-1 when empty)
+    uint32_t bucketCount;
+    struct DirSlot *freeSlots;       // Deleted (0xE5) entries that can be reused
+    uint32_t freeSlotCount;
+    uint32_t freeSlotCapacity;
+    uint32_t endCluster;             // Cluster of the end-of-directory marker (0 when every cluster is full)
+    uint32_t endIndex;               // Index of the end-of-directory marker within endCluster
+    uint32_t lastCluster;            // Last cluster in the directory's chain
+};
+
+// Indexes of the most recently used directories
+struct DirIndexCache {
+    struct DirIndex indexes[DIR_INDEX_MAX_DIRECTORIES];
+    uint64_t useCounter;
+    struct DirIndexEntry scanned;    // Result of the last lookup made by scanning, when the directory could not be indexed
+};
+
+// Directory index functions
+void freeDirIndexCache();
+struct DirIndex *getDirIndex(uint32_t dirCluster);
+const struct DirIndexEntry *lookupDirIndex(uint32_t dirCluster, const char *fat32Name);
+void addDirIndexEntry(uint32_t dirCluster, const char *fat32Name, uint8_t attributes,
+                      uint32_t entryCluster, uint32_t entryIndex, uint32_t firstCluster);
+void removeDirIndexEntry(uint32_t dirCluster, const char *fat32Name);
+void setDirIndexFirstCluster(uint32_t dirCluster, const char *fat32Name, uint32_t firstCluster);
+int takeDirSlot(uint32_t dirCluster, struct DirSlot *slot);
+void returnDirSlot(uint32_t dirCluster, const struct DirSlot *slot);
+void appendDirIndexCluster(uint32_t dirCluster, uint32_t newCluster);
+void dropDirIndex(uint32_t dirCluster);
+
+#endif
@@ -0,0 +1,241 @@
+#include "fat32_structs.h"
+#include "fat32_dirscan.h"
+#include "globals.h"
+#include <string.h>
+
+// SSE2 is part of every x86-64 target; AVX2 is compiled in separately and only used if the processor has it
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define DIR_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+// Classes of up to 64 consecutive entries, one bit per entry in each word
+struct EntryClasses {
+    uint64_t ends;      // name[0] is the end-of-directory marker
+    uint64_t deleted;   // name[0] marks a deleted entry
+    uint64_t labels;    // Volume label or long name piece (not a name that can be looked up)
+    uint64_t keys;      // Raw 11-byte name equals the key
+};
+
+// The 11-byte name and the attributes byte as three little-endian words: name[0-3], name[4-7] and name[8-10]
+// with the attributes in the top byte. The kernels compare these words for several entries at once.
+#define NAME_TAIL_MASK   0x00FFFFFFu
+#define LABEL_WORD_BIT   ((uint32_t)ATTR_VOLUME_ID << 24)
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Directory scan helper functions
+
+// Function to read the word at byte 'offset' of an entry (or of a key)
+static inline uint32_t loadWord(const void *base, uint32_t offset) {
+    uint32_t word;
+    memcpy(&word, (const uint8_t *)base + offset, sizeof(word));
+    return word;
+}
+
+// Function to classify entries one at a time (for processors without SSE2, and for entries left over by the kernels)
+static void classifyScalar(const struct FAT32DirectoryEntry *entries, uint32_t first, uint32_t count, const uint8_t *key,
+                           struct EntryClasses *classes) {
+    for (uint32_t i = first; i < count; i++) {
+        uint64_t bit = 1ULL << i;
+        if (entries[i].name[0] == 0) classes->ends |= bit;
+        if (entries[i].name[0] == 0xE5) classes->deleted |= bit;
+        if (entries[i].attributes & ATTR_VOLUME_ID) classes->labels |= bit;
+        if (memcmp(entries[i].name, key, 11) == 0) classes->keys |= bit;
+    }
+}
+
+#ifdef DIR_SCAN_X86
+
+// Function to classify entries four at a time, with the same word of four entries in one 128-bit register
+static uint32_t classifySSE2(const struct FAT32DirectoryEntry *entries, uint32_t count, const uint8_t *key, struct EntryClasses *classes) {
+    const __m128i byteMask = _mm_set1_epi32(0xFF);
+    const __m128i deleted = _mm_set1_epi32(0xE5);
+    const __m128i tailMask = _mm_set1_epi32((int)NAME_TAIL_MASK);
+    const __m128i labelBit = _mm_set1_epi32((int)LABEL_WORD_BIT);
+    const __m128i key0 = _mm_set1_epi32((int)loadWord(key, 0));
+    const __m128i key4 = _mm_set1_epi32((int)loadWord(key, 4));
+    const __m128i key8 = _mm_set1_epi32((int)(loadWord(key, 8) & NAME_TAIL_MASK));
+    uint64_t ends = 0, deletes = 0, labels = 0, keys = 0;
+    uint32_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        // Load the first 16 bytes of four entries and transpose them so each register holds one word of every entry
+        __m128i entry0 = _mm_loadu_si128((const __m128i *)&entries[i]);
+        __m128i entry1 = _mm_loadu_si128((const __m128i *)&entries[i + 1]);
+        __m128i entry2 = _mm_loadu_si128((const __m128i *)&entries[i + 2]);
+        __m128i entry3 = _mm_loadu_si128((const __m128i *)&entries[i + 3]);
+        __m128i low01 = _mm_unpacklo_epi32(entry0, entry1);
+        __m128i low23 = _mm_unpacklo_epi32(entry2, entry3);
+        __m128i high01 = _mm_unpackhi_epi32(entry0, entry1);
+        __m128i high23 = _mm_unpackhi_epi32(entry2, entry3);
+        __m128i word0 = _mm_unpacklo_epi64(low01, low23);
+        __m128i word4 = _mm_unpackhi_epi64(low01, low23);
+        __m128i word8 = _mm_unpacklo_epi64(high01, high23);
+        __m128i firstByte = _mm_and_si128(word0, byteMask);
+
+        __m128i isEnd = _mm_cmpeq_epi32(firstByte, _mm_setzero_si128());
+        __m128i isDeleted = _mm_cmpeq_epi32(firstByte, deleted);
+        __m128i isLabel = _mm_cmpeq_epi32(_mm_and_si128(word8, labelBit), labelBit);
+        __m128i isKey = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi32(word0, key0), _mm_cmpeq_epi32(word4, key4)),
+                                      _mm_cmpeq_epi32(_mm_and_si128(word8, tailMask), key8));
+
+        ends |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(isEnd)) << i;
+        deletes |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(isDeleted)) << i;
+        labels |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(isLabel)) << i;
+        keys |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(isKey)) << i;
+    }
+
+    classes->ends = ends;
+    classes->deleted = deletes;
+    classes->labels = labels;
+    classes->keys = keys;
+    return i;
+}
+
+// Function to load the first 16 bytes of two entries into the two halves of a 256-bit register
+__attribute__((target("avx2")))
+static inline __m256i loadEntryPair(const struct FAT32DirectoryEntry *low, const struct FAT32DirectoryEntry *high) {
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)low)), _mm_loadu_si128((const __m128i *)high), 1);
+}
+
+// Function to classify entries eight at a time, doing the SSE2 transpose in both halves of 256-bit registers
+__attribute__((target("avx2")))
+static uint32_t classifyAVX2(const struct FAT32DirectoryEntry *entries, uint32_t count, const uint8_t *key, struct EntryClasses *classes) {
+    const __m256i byteMask = _mm256_set1_epi32(0xFF);
+    const __m256i deleted = _mm256_set1_epi32(0xE5);
+    const __m256i tailMask = _mm256_set1_epi32((int)NAME_TAIL_MASK);
+    const __m256i labelBit = _mm256_set1_epi32((int)LABEL_WORD_BIT);
+    const __m256i key0 = _mm256_set1_epi32((int)loadWord(key, 0));
+    const __m256i key4 = _mm256_set1_epi32((int)loadWord(key, 4));
+    const __m256i key8 = _mm256_set1_epi32((int)(loadWord(key, 8) & NAME_TAIL_MASK));
+    uint64_t ends = 0, deletes = 0, labels = 0, keys = 0;
+    uint32_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        // Entries i to i+3 go in the low halves and i+4 to i+7 in the high halves, so the lanes end up in entry order
+        __m256i entry0 = loadEntryPair(&entries[i], &entries[i + 4]);
+        __m256i entry1 = loadEntryPair(&entries[i + 1], &entries[i + 5]);
+        __m256i entry2 = loadEntryPair(&entries[i + 2], &entries[i + 6]);
+        __m256i entry3 = loadEntryPair(&entries[i + 3], &entries[i + 7]);
+        __m256i low01 = _mm256_unpacklo_epi32(entry0, entry1);
+        __m256i low23 = _mm256_unpacklo_epi32(entry2, entry3);
+        __m256i high01 = _mm256_unpackhi_epi32(entry0, entry1);
+        __m256i high23 = _mm256_unpackhi_epi32(entry2, entry3);
+        __m256i word0 = _mm256_unpacklo_epi64(low01, low23);
+        __m256i word4 = _mm256_unpackhi_epi64(low01, low23);
+        __m256i word8 = _mm256_unpacklo_epi64(high01, high23);
+        __m256i firstByte = _mm256_and_si256(word0, byteMask);
+
+        __m256i isEnd = _mm256_cmpeq_epi32(firstByte, _mm256_setzero_si256());
+        __m256i isDeleted = _mm256_cmpeq_epi32(firstByte, deleted);
+        __m256i isLabel = _mm256_cmpeq_epi32(_mm256_and_si256(word8, labelBit), labelBit);
+        __m256i isKey = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi32(word0, key0), _mm256_cmpeq_epi32(word4, key4)),
+                                         _mm256_cmpeq_epi32(_mm256_and_si256(word8, tailMask), key8));
+
+        ends |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(isEnd)) << i;
+        deletes |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(isDeleted)) << i;
+        labels |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(isLabel)) << i;
+        keys |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(isKey)) << i;
+    }
+
+    classes->ends = ends;
+    classes->deleted = deletes;
+    classes->labels = labels;
+    classes->keys = keys;
+    return i;
+}
+
+#endif
+
+// Function to classify a block of up to 64 entries with the widest kernel the processor supports
+static void classifyBlock(const struct FAT32DirectoryEntry *entries, uint32_t count, const uint8_t *key, struct EntryClasses *classes) {
+    uint32_t done = 0;
+
+    memset(classes, 0, sizeof(*classes));
+#ifdef DIR_SCAN_X86
+    done = __builtin_cpu_supports("avx2") ? classifyAVX2(entries, count, key, classes) : classifySSE2(entries, count, key, classes);
+#endif
+    classifyScalar(entries, done, count, key, classes);
+}
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Directory scan implementations
+
+// Function to pack an 11-byte short name into a key for scanDirEntries
+void packDirScanKey(const char *fat32Name, struct DirScanKey *key) {
+    memset(key->name, 0, sizeof(key->name));
+    memcpy(key->name, fat32Name, 11);
+}
+
+// Function to scan a run of directory entries (normally a whole cluster) in one pass. It finds the end-of-directory
+// marker, the first free slot and the first name entry matching 'key' (which may be NULL). Unless NULL, 'nameMask'
+// gets a bit for every entry before the end marker that holds a name (not deleted, not a label or long name piece)
+// and 'deletedMask' one for every deleted entry before it; both need DIR_SCAN_MASK_WORDS(count) words.
+// With a key and no masks the scan stops at the first match, so endIndex and freeIndex only cover the entries up to it.
+void scanDirEntries(const struct FAT32DirectoryEntry *entries, uint32_t count, const struct DirScanKey *key,
+                    uint64_t *nameMask, uint64_t *deletedMask, struct DirScanResult *result) {
+    // Entries before the end marker never start with a zero byte, so an all-zero key matches nothing
+    static const struct DirScanKey noKey;
+    const uint8_t *keyName = key ? key->name : noKey.name;
+
+    result->endIndex = -1;
+    result->freeIndex = -1;
+    result->matchIndex = -1;
+    if (nameMask) memset(nameMask, 0, DIR_SCAN_MASK_WORDS(count) * sizeof(uint64_t));
+    if (deletedMask) memset(deletedMask, 0, DIR_SCAN_MASK_WORDS(count) * sizeof(uint64_t));
+
+    for (uint32_t base = 0; base < count; base += 64) {
+        uint32_t blockSize = count - base < 64 ? count - base : 64;
+        struct EntryClasses classes;
+        classifyBlock(&entries[base], blockSize, keyName, &classes);
+
+        // Only the entries before the first end marker belong to the directory
+        uint64_t endBit = classes.ends & (~classes.ends + 1);
+        uint64_t valid = endBit ? endBit - 1 : (blockSize == 64 ? ~0ULL : (1ULL << blockSize) - 1);
+        uint64_t deleted = classes.deleted & valid;
+        uint64_t names = valid & ~classes.deleted & ~classes.labels;
+        uint64_t matches = names & classes.keys;
+
+        if (nameMask) nameMask[base / 64] = names;
+        if (deletedMask) deletedMask[base / 64] = deleted;
+
+        if (result->freeIndex == -1 && (deleted | endBit)) {
+            result->freeIndex = base + __builtin_ctzll(deleted | endBit);
+        }
+        if (result->matchIndex == -1 && matches) {
+            result->matchIndex = base + __builtin_ctzll(matches);
+            if (!nameMask && !deletedMask) {
+                return;
+            }
+        }
+        if (endBit) {
+            result->endIndex = base + __builtin_ctzll(endBit);
+            return;
+        }
+    }
+}
+
+// Function to find the first entry at or after 'from' whose bit is set in a scan mask, or 'count' if there is none
+uint32_t nextDirScanEntry(const uint64_t *mask, uint32_t count, uint32_t from) {
+    for (uint32_t word = from / 64; word * 64 < count; word++) {
+        uint64_t bits = mask[word];
+        if (word == from / 64) {
+            bits &= ~0ULL << (from % 64);
+        }
+        if (bits) {
+            return word * 64 + __builtin_ctzll(bits);
+        }
+    }
+    return count;
+}
+
+// Function to name the kernel scanDirEntries runs with on this processor
+const char *dirScanKernel() {
+#ifdef DIR_SCAN_X86
+    return __builtin_cpu_supports("avx2") ? "avx2" : "sse2";
+#else
+    return "scalar";
+#endif
+}
@@ -0,0 +1,29 @@
+#ifndef FAT32_DIRSCAN_H
+#define FAT32_DIRSCAN_H
+
+#include "fat32_structs.h"
+#include <stdint.h>
+
+// Number of 64-bit words in a mask with one bit per entry
+#define DIR_SCAN_MASK_WORDS(count) (((count) + 63) / 64)
+
+// Short name to look for, padded so the kernels can read it in whole words
+struct DirScanKey {
+    uint8_t name[16];
+};
+
+// What one pass over a run of directory entries found (indexes are relative to the first entry scanned)
+struct DirScanResult {
+    int32_t endIndex;     // End-of-directory marker, or -1 if the scan did not reach one
+    int32_t freeIndex;    // First slot a new entry can go in (a deleted entry or the end marker), or -1
+    int32_t matchIndex;   // First name entry whose raw 11-byte name equals the key, or -1
+};
+
+// Directory scan functions
+void packDirScanKey(const char *fat32Name, struct DirScanKey *key);
+void scanDirEntries(const struct FAT32DirectoryEntry *entries, uint32_t count, const struct DirScanKey *key,
+                    uint64_t *nameMask, uint64_t *deletedMask, struct DirScanResult *result);
+uint32_t nextDirScanEntry(const uint64_t *mask, uint32_t count, uint32_t from);
+const char *dirScanKernel();
+
+#endif
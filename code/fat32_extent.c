@@ -0,0 +1,95 @@
+#include "fat32_structs.h"
+#include "fat32_extent.h"
+#include "fat32_utils.h"
+#include "globals.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Extent map implementations
+
+// Function to add one cluster to the end of the map, merging it into the last run when contiguous
+static int addClusterToMap(struct OpenFile *file, uint32_t cluster) {
+    if (file->extentCount > 0) {
+        struct FileExtent *last = &file->extents[file->extentCount - 1];
+        if (last->physicalCluster + last->length == cluster) {
+            last->length++;
+            file->clusterCount++;
+            return 0;
+        }
+    }
+
+    // Start a new run, growing the array if it is full
+    if (file->extentCount == file->extentCapacity) {
+        uint32_t newCapacity = file->extentCapacity ? file->extentCapacity * 2 : 4;
+        struct FileExtent *grown = realloc(file->extents, newCapacity * sizeof(struct FileExtent));
+        if (!grown) {
+            return -1;
+        }
+        file->extents = grown;
+        file->extentCapacity = newCapacity;
+    }
+
+    file->extents[file->extentCount].logicalCluster = file->clusterCount;
+    file->extents[file->extentCount].physicalCluster = cluster;
+    file->extents[file->extentCount].length = 1;
+    file->extentCount++;
+    file->clusterCount++;
+    return 0;
+}
+
+// Function to append a chain of clusters (newly linked onto the file) to its extent map
+int appendExtentChain(struct OpenFile *file, uint32_t firstCluster) {
+    for (uint32_t cluster = firstCluster; cluster >= 2 && cluster < 0x0FFFFFF8; cluster = getNextCluster(cluster)) {
+        if (addClusterToMap(file, cluster) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to walk a file's cluster chain once and record it as a list of contiguous runs
+int buildExtentMap(struct OpenFile *file) {
+    freeExtentMap(file);
+    return appendExtentChain(file, file->fileCluster);
+}
+
+// Function to release the extent map of a file
+void freeExtentMap(struct OpenFile *file) {
+    free(file->extents);
+    file->extents = NULL;
+    file->extentCount = 0;
+    file->extentCapacity = 0;
+    file->clusterCount = 0;
+}
+
+// Function to find the physical cluster holding a logical cluster of the file with a binary search.
+// runRemaining (if given) receives how many clusters from there on are physically contiguous.
+uint32_t lookupCluster(const struct OpenFile *file, uint32_t logicalCluster, uint32_t *runRemaining) {
+    uint32_t low = 0, high = file->extentCount;
+
+    if (logicalCluster >= file->clusterCount) {
+        return 0xFFFFFFFF;
+    }
+
+    // Find the last extent starting at or before the logical cluster
+    while (high - low > 1) {
+        uint32_t middle = low + (high - low) / 2;
+        if (file->extents[middle].logicalCluster <= logicalCluster) {
+            low = middle;
+        }
+        else {
+            high = middle;
+        }
+    }
+
+    const struct FileExtent *extent = &file->extents[low];
+    uint32_t delta = logicalCluster - extent->logicalCluster;
+
+    if (runRemaining) {
+        *runRemaining = extent->length - delta;
+    }
+    return extent->physicalCluster + delta;
+}
@@ -0,0 +1,13 @@
+#ifndef FAT32_EXTENT_H
+#define FAT32_EXTENT_H
+
+#include "fat32_structs.h"
+#include <stdint.h>
+
+// Extent map functions
+int buildExtentMap(struct OpenFile *file);
+int appendExtentChain(struct OpenFile *file, uint32_t firstCluster);
+void freeExtentMap(struct OpenFile *file);
+uint32_t lookupCluster(const struct OpenFile *file, uint32_t logicalCluster, uint32_t *runRemaining);
+
+#endif
@@ -0,0 +1,182 @@
+#include "fat32_structs.h"
+#include "fat32_fatcache.h"
+#include "fat32_io.h"
+#include "fat32_journal.h"
+#include "globals.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+// ------------------------------------------------------------------------------------------------ //
+
+// FAT cache implementations
+
+// Function to read the whole active FAT into memory (called once when the image is mounted). Unless extFlags
+// turns mirroring off, the first FAT is the active one and every copy is kept identical to it.
+int loadFATCache() {
+    uint32_t bytesPerSector = activeVolume->bootSector.bytesPerSector;
+    uint64_t fatBytes = (uint64_t)activeVolume->bootSector.FATSize32 * bytesPerSector;
+    uint64_t dataSectors = activeVolume->bootSector.totalSectors32 - activeVolume->bootSector.reservedSectorCount - ((uint64_t)activeVolume->bootSector.numFATs * activeVolume->bootSector.FATSize32);
+
+    freeFATCache();
+
+    activeVolume->fatCache.entries = malloc(fatBytes);
+    activeVolume->fatCache.dirtySectors = calloc(activeVolume->bootSector.FATSize32, 1);
+    if (!activeVolume->fatCache.entries || !activeVolume->fatCache.dirtySectors) {
+        freeFATCache();
+        return -1;
+    }
+
+    // An active FAT number past the last copy is treated as if mirroring were on
+    activeVolume->fatCache.mirrored = !(activeVolume->bootSector.extFlags & EXT_FLAGS_NO_MIRRORING);
+    activeVolume->fatCache.activeFAT = activeVolume->fatCache.mirrored ? 0 : activeVolume->bootSector.extFlags & EXT_FLAGS_ACTIVE_FAT;
+    if (activeVolume->fatCache.activeFAT >= activeVolume->bootSector.numFATs) {
+        activeVolume->fatCache.activeFAT = 0;
+        activeVolume->fatCache.mirrored = true;
+    }
+
+    // Read the entire table with a single request
+    uint64_t fatStart = ((uint64_t)activeVolume->bootSector.reservedSectorCount + (uint64_t)activeVolume->fatCache.activeFAT * activeVolume->bootSector.FATSize32) * bytesPerSector;
+    if (readImage(fatStart, activeVolume->fatCache.entries, fatBytes) != fatBytes) {
+        freeFATCache();
+        return -1;
+    }
+
+    activeVolume->fatCache.entryCount = fatBytes / 4;
+    activeVolume->fatCache.sectorCount = activeVolume->bootSector.FATSize32;
+    activeVolume->fatCache.dirtyCount = 0;
+
+    // Clusters past the end of the data region exist in the FAT but can never be used
+    activeVolume->fatCache.clusterCount = dataSectors / activeVolume->bootSector.sectorsPerCluster + 2;
+    if (activeVolume->fatCache.clusterCount > activeVolume->fatCache.entryCount) {
+        activeVolume->fatCache.clusterCount = activeVolume->fatCache.entryCount;
+    }
+
+    activeVolume->fatCache.loaded = true;
+    return 0;
+}
+
+// Function to release the memory held by the FAT cache (dirty sectors must be flushed first)
+void freeFATCache() {
+    free(activeVolume->fatCache.entries);
+    free(activeVolume->fatCache.dirtySectors);
+    memset(&activeVolume->fatCache, 0, sizeof(activeVolume->fatCache));
+}
+
+// Function to get the raw 28-bit FAT entry of a cluster
+uint32_t getFATEntry(uint32_t cluster) {
+    if (cluster >= activeVolume->fatCache.entryCount) {
+        return 0x0FFFFFFF;
+    }
+    return activeVolume->fatCache.entries[cluster] & 0x0FFFFFFF;
+}
+
+// Function to set the FAT entry of a cluster and mark its sector as dirty
+void setFATEntry(uint32_t cluster, uint32_t value) {
+    if (cluster >= activeVolume->fatCache.entryCount) {
+        return;
+    }
+
+    // The upper 4 bits of an entry are reserved and must be preserved
+    activeVolume->fatCache.entries[cluster] = (activeVolume->fatCache.entries[cluster] & 0xF0000000) | (value & 0x0FFFFFFF);
+
+    uint32_t sector = (cluster * 4) / activeVolume->bootSector.bytesPerSector;
+    if (!activeVolume->fatCache.dirtySectors[sector]) {
+        activeVolume->fatCache.dirtySectors[sector] = 1;
+        activeVolume->fatCache.dirtyCount++;
+    }
+}
+
+// Function to mark a run of FAT sectors clean once they have been written to every copy
+static void cleanSectors(uint32_t start, uint32_t end) {
+    for (uint32_t sector = start; sector < end; sector++) {
+        activeVolume->fatCache.dirtySectors[sector] = 0;
+    }
+    activeVolume->fatCache.dirtyCount -= end - start;
+}
+
+// Function to write every dirty FAT sector back to the image, to every FAT copy (or only the active one when
+// mirroring is off). Neighbouring sectors are merged into one request per copy, and the requests for all copies go
+// to the image as a single batch, each copy in ascending order (one write at a time if there is no memory for it).
+// Sectors stay dirty if their write fails, so the next flush tries them again.
+int flushFATCache() {
+    uint32_t bytesPerSector = activeVolume->bootSector.bytesPerSector;
+    uint32_t firstCopy = activeVolume->fatCache.mirrored ? 0 : activeVolume->fatCache.activeFAT;
+    uint32_t copies = activeVolume->fatCache.mirrored ? activeVolume->bootSector.numFATs : 1;
+    uint32_t sector = 0;
+    int result = 0;
+
+    if (!activeVolume->fatCache.loaded || activeVolume->fatCache.dirtyCount == 0) {
+        return 0;
+    }
+
+    // There are never more runs than dirty sectors
+    struct iovec *iov = malloc(activeVolume->fatCache.dirtyCount * sizeof(struct iovec));
+    uint32_t *runStarts = malloc(activeVolume->fatCache.dirtyCount * sizeof(uint32_t));
+    uint32_t *runEnds = malloc(activeVolume->fatCache.dirtyCount * sizeof(uint32_t));
+    struct ImageRequest *requests = malloc((size_t)activeVolume->fatCache.dirtyCount * copies * sizeof(struct ImageRequest));
+    bool batched = iov && runStarts && runEnds && requests;
+    uint32_t runCount = 0;
+
+    while (sector < activeVolume->fatCache.sectorCount) {
+        if (!activeVolume->fatCache.dirtySectors[sector]) {
+            sector++;
+            continue;
+        }
+
+        // Find the end of this run of dirty sectors
+        uint32_t runStart = sector;
+        while (sector < activeVolume->fatCache.sectorCount && activeVolume->fatCache.dirtySectors[sector]) {
+            sector++;
+        }
+
+        uint64_t runBytes = (uint64_t)(sector - runStart) * bytesPerSector;
+        uint8_t *data = (uint8_t *)activeVolume->fatCache.entries + (uint64_t)runStart * bytesPerSector;
+
+        if (batched) {
+            iov[runCount].iov_base = data;
+            iov[runCount].iov_len = runBytes;
+            runStarts[runCount] = runStart;
+            runEnds[runCount] = sector;
+            runCount++;
+            continue;
+        }
+        bool written = true;
+        for (uint32_t copy = firstCopy; copy < firstCopy + copies; copy++) {
+            uint64_t position = ((uint64_t)activeVolume->bootSector.reservedSectorCount + (uint64_t)copy * activeVolume->bootSector.FATSize32 + runStart) * bytesPerSector;
+            if (journalWrite(position, data, runBytes) != 0) {
+                written = false;
+            }
+        }
+        if (written) {
+            cleanSectors(runStart, sector);
+        }
+        else {
+            result = -1;
+        }
+    }
+
+    // Every copy gets the same runs, pointing at the same cached sectors
+    int requestCount = 0;
+    for (uint32_t copy = firstCopy; batched && copy < firstCopy + copies; copy++) {
+        for (uint32_t run = 0; run < runCount; run++) {
+            requests[requestCount].offset = ((uint64_t)activeVolume->bootSector.reservedSectorCount + (uint64_t)copy * activeVolume->bootSector.FATSize32 + runStarts[run]) * bytesPerSector;
+            requests[requestCount].iov = &iov[run];
+            requests[requestCount].count = 1;
+            requestCount++;
+        }
+    }
+    if (requestCount > 0 && journalWriteBatch(requests, requestCount) != 0) {
+        result = -1;
+    }
+    else {
+        for (uint32_t run = 0; run < runCount; run++) {
+            cleanSectors(runStarts[run], runEnds[run]);
+        }
+    }
+    free(iov);
+    free(runStarts);
+    free(runEnds);
+    free(requests);
+    return result;
+}
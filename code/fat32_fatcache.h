@@ -0,0 +1,31 @@
+#ifndef FAT32_FATCACHE_H
+#define FAT32_FATCACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Bits of extFlags in the boot sector: with mirroring disabled, only the active FAT is used and kept up to date
+#define EXT_FLAGS_ACTIVE_FAT   0x000F
+#define EXT_FLAGS_NO_MIRRORING 0x0080
+
+// In-memory copy of the File Allocation Table, loaded once at mount and written back in batches
+struct FATCache {
+    uint32_t *entries;       // Every 4-byte entry of the active FAT
+    uint32_t entryCount;     // Number of entries held in one FAT
+    uint32_t clusterCount;   // Highest usable cluster number + 1 (bounded by the data region)
+    uint32_t sectorCount;    // Size of one FAT in sectors
+    uint8_t *dirtySectors;   // One flag per FAT sector modified since the last flush
+    uint32_t dirtyCount;     // Number of flags currently set in dirtySectors
+    uint32_t activeFAT;      // FAT the table was loaded from (the first one unless extFlags picks another)
+    bool mirrored;           // Whether dirty sectors are written to every FAT copy or only to the active one
+    bool loaded;
+};
+
+// FAT cache functions
+int loadFATCache();
+void freeFATCache();
+uint32_t getFATEntry(uint32_t cluster);
+void setFATEntry(uint32_t cluster, uint32_t value);
+int flushFATCache();
+
+#endif
@@ -0,0 +1,239 @@
+#include "fat32_structs.h"
+#include "fat32_filetable.h"
+#include "fat32_extent.h"
+#include "fat32_utils.h"
+#include "fat32_writebuf.h"
+#include "globals.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Open file table helper functions
+
+// Function to hash the formatted name of a file (FNV-1a)
+static uint32_t hashFileName(const char *formattedName) {
+    uint32_t hash = 2166136261u;
+    while (*formattedName) {
+        hash = (hash ^ (uint8_t)*formattedName++) * 16777619u;
+    }
+    return hash;
+}
+
+// Function to double the table, putting the new slots on the free list and chaining the open files into a
+// hash table of the new size
+static int growTable() {
+    uint32_t oldCapacity = activeVolume->openFileTable.capacity;
+    uint32_t newCapacity = oldCapacity ? oldCapacity * 2 : OPEN_FILE_TABLE_INITIAL;
+    if (newCapacity > OPEN_FILE_TABLE_MAX) {
+        return FAT32_ERR_TOO_MANY_OPEN;
+    }
+
+    struct OpenFile *files = realloc(activeVolume->openFileTable.files, newCapacity * sizeof(struct OpenFile));
+    if (!files) {
+        return FAT32_ERR_NO_MEMORY;
+    }
+    activeVolume->openFileTable.files = files;
+
+    // Every handle can be queued for a sync at most once, so the queue never needs more room than the table
+    int32_t *syncQueue = realloc(activeVolume->openFileTable.syncQueue, newCapacity * sizeof(int32_t));
+    int32_t *buckets = malloc(newCapacity * sizeof(int32_t));
+    if (syncQueue) {
+        activeVolume->openFileTable.syncQueue = syncQueue;
+    }
+    if (!syncQueue || !buckets) {
+        free(buckets);
+        return FAT32_ERR_NO_MEMORY;
+    }
+
+    // The new slots go on the free list so the lowest handles are handed out first
+    memset(&files[oldCapacity], 0, (newCapacity - oldCapacity) * sizeof(struct OpenFile));
+    for (uint32_t i = newCapacity; i > oldCapacity; i--) {
+        files[i - 1].next = activeVolume->openFileTable.freeHead;
+        activeVolume->openFileTable.freeHead = i - 1;
+    }
+
+    for (uint32_t i = 0; i < newCapacity; i++) {
+        buckets[i] = -1;
+    }
+    for (uint32_t i = 0; i < oldCapacity; i++) {
+        if (files[i].isOpen) {
+            uint32_t bucket = hashFileName(files[i].filename) & (newCapacity - 1);
+            files[i].next = buckets[bucket];
+            buckets[bucket] = i;
+        }
+    }
+
+    free(activeVolume->openFileTable.buckets);
+    activeVolume->openFileTable.buckets = buckets;
+    activeVolume->openFileTable.capacity = newCapacity;
+    return FAT32_OK;
+}
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Open file table implementations
+
+// Function to release every open file and the table itself
+void freeOpenFileTable() {
+    for (uint32_t i = 0; i < activeVolume->openFileTable.capacity; i++) {
+        freeExtentMap(&activeVolume->openFileTable.files[i]);
+        freeWriteBuffer(&activeVolume->openFileTable.files[i]);
+    }
+    free(activeVolume->openFileTable.files);
+    free(activeVolume->openFileTable.buckets);
+    free(activeVolume->openFileTable.syncQueue);
+    memset(&activeVolume->openFileTable, 0, sizeof(activeVolume->openFileTable));
+    activeVolume->openFileTable.freeHead = -1;
+}
+
+// Function to claim an unused slot, growing the table if every slot is taken. Returns its handle, or a negative
+// error code. The slot is not found by name until it is filled in and passed to insertOpenFile.
+int allocOpenFile() {
+    if (activeVolume->openFileTable.capacity == 0) {
+        activeVolume->openFileTable.freeHead = -1;
+    }
+    if (activeVolume->openFileTable.freeHead == -1) {
+        int result = growTable();
+        if (result != FAT32_OK) {
+            return result;
+        }
+    }
+
+    int handle = activeVolume->openFileTable.freeHead;
+    struct OpenFile *file = &activeVolume->openFileTable.files[handle];
+    activeVolume->openFileTable.freeHead = file->next;
+
+    // A slot can still be waiting in the sync queue from its previous file; keep that mark so it is not queued twice
+    bool syncQueued = file->syncQueued;
+    memset(file, 0, sizeof(*file));
+    file->syncQueued = syncQueued;
+    file->next = -1;
+    return handle;
+}
+
+// Function to mark a filled-in slot as open and add it to the name hash
+void insertOpenFile(int handle) {
+    struct OpenFile *file = &activeVolume->openFileTable.files[handle];
+    uint32_t bucket = hashFileName(file->filename) & (activeVolume->openFileTable.capacity - 1);
+
+    file->isOpen = true;
+    file->next = activeVolume->openFileTable.buckets[bucket];
+    activeVolume->openFileTable.buckets[bucket] = handle;
+    activeVolume->openFileTable.openCount++;
+}
+
+// Function to remove a file from the name hash and put its slot back on the free list
+void releaseOpenFile(int handle) {
+    struct OpenFile *file = &activeVolume->openFileTable.files[handle];
+
+    if (file->isOpen) {
+        int32_t *link = &activeVolume->openFileTable.buckets[hashFileName(file->filename) & (activeVolume->openFileTable.capacity - 1)];
+        while (*link != handle) {
+            link = &activeVolume->openFileTable.files[*link].next;
+        }
+        *link = file->next;
+        activeVolume->openFileTable.openCount--;
+    }
+
+    freeExtentMap(file);
+    freeWriteBuffer(file);
+    file->filename[0] = '\0';
+    file->mode[0] = '\0';
+    file->path[0] = '\0';
+    file->isOpen = false;
+    file->entryDirty = false;
+    file->next = activeVolume->openFileTable.freeHead;
+    activeVolume->openFileTable.freeHead = handle;
+}
+
+// Function to get the open file behind a handle (NULL if the handle is not open)
+struct OpenFile *getOpenFile(int handle) {
+    if (handle < 0 || (uint32_t)handle >= activeVolume->openFileTable.capacity || !activeVolume->openFileTable.files[handle].isOpen) {
+        return NULL;
+    }
+    return &activeVolume->openFileTable.files[handle];
+}
+
+// Function to find an open file by its formatted name in a directory. With 'anyDirectory' a file of that name in
+// another directory also matches, though one in the given directory is preferred.
+int findOpenFileByName(uint32_t dirCluster, const char *formattedName, bool anyDirectory) {
+    if (activeVolume->openFileTable.openCount == 0) {
+        return -1;
+    }
+
+    int found = -1;
+    int32_t handle = activeVolume->openFileTable.buckets[hashFileName(formattedName) & (activeVolume->openFileTable.capacity - 1)];
+    while (handle != -1) {
+        struct OpenFile *file = &activeVolume->openFileTable.files[handle];
+        if (strcmp(file->filename, formattedName) == 0) {
+            if (file->dirCluster == dirCluster) {
+                return handle;
+            }
+            if (anyDirectory && found == -1) {
+                found = handle;
+            }
+        }
+        handle = file->next;
+    }
+    return found;
+}
+
+// Function to get the first open handle after the one given (-1 to start), or -1 when there are no more
+int nextOpenFile(int handle) {
+    for (uint32_t i = handle + 1; i < activeVolume->openFileTable.capacity; i++) {
+        if (activeVolume->openFileTable.files[i].isOpen) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Function to note that the size or first cluster of an open file changed and must reach its directory entry
+void queueOpenFileSync(struct OpenFile *file) {
+    file->entryDirty = true;
+    if (!file->syncQueued) {
+        file->syncQueued = true;
+        activeVolume->openFileTable.syncQueue[activeVolume->openFileTable.syncCount++] = file - activeVolume->openFileTable.files;
+    }
+}
+
+// Function to write the directory entries of every queued open file back (only files that changed are visited; a file
+// with buffered data always is, since buffering it grew the file). With 'flushWriteBuffers' the buffered data is
+// written out first; otherwise files that still hold buffered data stay queued.
+int syncOpenFiles(bool flushWriteBuffers) {
+    uint32_t count = activeVolume->openFileTable.syncCount;
+    uint32_t kept = 0;
+    int result = 0;
+
+    // A file stays marked as queued while it is synced, so a flush that queues it again does not add it twice
+    for (uint32_t i = 0; i < count; i++) {
+        int32_t handle = activeVolume->openFileTable.syncQueue[i];
+        struct OpenFile *file = &activeVolume->openFileTable.files[handle];
+        if (!file->isOpen) {
+            file->syncQueued = false;
+            continue;
+        }
+
+        if (flushWriteBuffers) {
+            result |= flushWriteBuffer(file) != FAT32_OK;
+        }
+        result |= syncOpenFile(file);
+
+        if (file->writeBufferLength > 0) {
+            file->entryDirty = true;
+            activeVolume->openFileTable.syncQueue[kept++] = handle;
+        }
+        else {
+            file->syncQueued = false;
+        }
+    }
+
+    // Files queued while the loop ran were added after 'count' and stay queued
+    for (uint32_t i = count; i < activeVolume->openFileTable.syncCount; i++) {
+        activeVolume->openFileTable.syncQueue[kept++] = activeVolume->openFileTable.syncQueue[i];
+    }
+    activeVolume->openFileTable.syncCount = kept;
+    return result;
+}
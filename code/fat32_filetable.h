@@ -0,0 +1,35 @@
+#ifndef FAT32_FILETABLE_H
+#define FAT32_FILETABLE_H
+
+#include "fat32_structs.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+// Number of slots the table starts with, and the most files that can be open at once
+#define OPEN_FILE_TABLE_INITIAL 16
+#define OPEN_FILE_TABLE_MAX (1 << 20)
+
+// Growable table of open files indexed by handle. Unused slots are kept on a free list, and open files are chained
+// in a hash on their name so name-based lookups never scan the table.
+struct OpenFileTable {
+    struct OpenFile *files;
+    uint32_t capacity;
+    uint32_t openCount;
+    int32_t freeHead;          // First unused slot, or -1
+    int32_t *buckets;          // Hash table from name to first open file (-1 when empty)
+    int32_t *syncQueue;        // Open files whose directory entries need writing back at the next checkpoint
+    uint32_t syncCount;
+};
+
+// Open file table functions
+void freeOpenFileTable();
+int allocOpenFile();
+void insertOpenFile(int handle);
+void releaseOpenFile(int handle);
+struct OpenFile *getOpenFile(int handle);
+int findOpenFileByName(uint32_t dirCluster, const char *formattedName, bool anyDirectory);
+int nextOpenFile(int handle);
+void queueOpenFileSync(struct OpenFile *file);
+int syncOpenFiles(bool flushWriteBuffers);
+
+#endif
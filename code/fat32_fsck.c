@@ -0,0 +1,895 @@
+#include "fat32_structs.h"
+#include "fat32_fsck.h"
+#include "fat32_utils.h"
+#include "fat32_alloc.h"
+#include "globals.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// FAT entry values (the top four bits of an entry are reserved and ignored)
+#define FAT_ENTRY_MASK   0x0FFFFFFF
+#define FAT_BAD_CLUSTER  0x0FFFFFF7
+#define FAT_END_OF_CHAIN 0x0FFFFFF8
+
+// Most bytes read or written by one call when the FATs are loaded, compared and written back
+#define FSCK_CHUNK_SIZE (4u << 20)
+
+// Upper bound on the worker pool, and on the problems printed one by one (the totals are always printed)
+#define FSCK_MAX_THREADS 64
+#define FSCK_MAX_MESSAGES 100
+
+#define FSCK_PATH_MAX 1024
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+// How the walk along a cluster chain ended
+enum ChainEnd {
+    CHAIN_END,       // End of chain marker
+    CHAIN_CROSS,     // A cluster that already belongs to another chain (or earlier to this one)
+    CHAIN_FREE,      // A free cluster
+    CHAIN_INVALID    // A reserved, bad or out of range cluster
+};
+
+// Cut a chain after 'keep' clusters and free the 'drop' clusters that followed
+struct ChainRepair {
+    uint32_t first;
+    uint32_t keep;
+    uint32_t drop;
+};
+
+// New first cluster and size for a directory entry, or remove it
+struct EntryRepair {
+    uint64_t offset;
+    uint32_t firstCluster;
+    uint32_t fileSize;
+    bool remove;
+};
+
+// A directory waiting to be read by a worker
+struct FsckTask {
+    uint32_t cluster;
+    uint32_t clusterCount;
+    char *path;
+};
+
+// State shared by the workers of one check
+struct FsckState {
+    int fd;
+    bool repair;
+    struct FAT32BootSector bs;
+    uint32_t clusterSize;
+    uint32_t clusterCount;       // Entries in the FAT that map data clusters, including the two reserved ones
+    uint64_t fatBytes;           // Bytes of each FAT copy
+    uint64_t dataOffset;
+    uint32_t activeFAT;          // Copy the check trusts (FAT 0 unless mirroring is off)
+    bool mirrored;               // Whether every copy is meant to match the active one
+    uint32_t *fat;               // Active FAT, loaded whole
+    atomic_uint_fast64_t *owned; // One bit per cluster, set by the first chain to reach it
+    uint64_t *fatDirty;          // One bit per FAT sector changed by a repair
+    bool *copyDiffers;           // Per FAT copy: whether it has to be rewritten in full
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct FsckTask *tasks;
+    size_t taskCount;
+    size_t taskCapacity;
+    size_t pending;              // Tasks queued or being worked on
+    struct ChainRepair *chainRepairs;
+    size_t chainRepairCount;
+    size_t chainRepairCapacity;
+    struct EntryRepair *entryRepairs;
+    size_t entryRepairCount;
+    size_t entryRepairCapacity;
+    struct FsckReport *report;
+    uint32_t messages;
+    bool failed;
+};
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Fsck helper functions
+
+// Function to move a buffer to or from the image at an offset, retrying short transfers
+static int transferImage(int fd, bool writing, uint64_t offset, void *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t result = writing ? pwrite(fd, buffer, length, (off_t)offset) : pread(fd, buffer, length, (off_t)offset);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return -1;
+        }
+        buffer = (uint8_t *)buffer + result;
+        offset += result;
+        length -= result;
+    }
+    return 0;
+}
+
+// Function to grow an array so it holds at least 'needed' items
+static bool growArray(void **items, size_t *capacity, size_t needed, size_t itemSize) {
+    if (needed <= *capacity) {
+        return true;
+    }
+    size_t newCapacity = *capacity ? *capacity * 2 : 64;
+    while (newCapacity < needed) {
+        newCapacity *= 2;
+    }
+    void *grown = realloc(*items, newCapacity * itemSize);
+    if (!grown) {
+        return false;
+    }
+    *items = grown;
+    *capacity = newCapacity;
+    return true;
+}
+
+// Function to count a problem and print it, unless enough problems have been printed already
+static void reportProblem(struct FsckState *state, uint64_t *counter, uint64_t amount, const char *format, ...) {
+    va_list args;
+
+    pthread_mutex_lock(&state->lock);
+    *counter += amount;
+    if (state->messages++ < FSCK_MAX_MESSAGES) {
+        va_start(args, format);
+        vprintf(format, args);
+        va_end(args);
+    }
+    else if (state->messages == FSCK_MAX_MESSAGES + 1) {
+        printf("Further problems are counted but not listed.\n");
+    }
+    pthread_mutex_unlock(&state->lock);
+}
+
+// Function to mark a check as failed (an I/O or memory error, not a problem with the file system)
+static void reportFailure(struct FsckState *state, const char *message, const char *path) {
+    pthread_mutex_lock(&state->lock);
+    if (!state->failed) {
+        printf("%s '%s'.\n", message, path);
+    }
+    state->failed = true;
+    pthread_mutex_unlock(&state->lock);
+}
+
+// Function to claim a cluster for the chain being walked, returning whether it was already owned
+static bool claimCluster(struct FsckState *state, uint32_t cluster) {
+    uint64_t bit = 1ull << (cluster & 63);
+    return (atomic_fetch_or_explicit(&state->owned[cluster >> 6], bit, memory_order_relaxed) & bit) != 0;
+}
+
+// Function to check whether a cluster is owned (only used once the workers have finished)
+static bool isOwned(struct FsckState *state, uint32_t cluster) {
+    return (atomic_load_explicit(&state->owned[cluster >> 6], memory_order_relaxed) >> (cluster & 63)) & 1;
+}
+
+// Function to test a bit of a plain bitmap
+static bool testBit(const uint64_t *bitmap, uint32_t index) {
+    return (bitmap[index >> 6] >> (index & 63)) & 1;
+}
+
+// Function to set a bit of a plain bitmap
+static void setBit(uint64_t *bitmap, uint32_t index) {
+    bitmap[index >> 6] |= 1ull << (index & 63);
+}
+
+// Function to walk a chain from its first cluster, claiming every cluster on the way. Returns the number of clusters
+// claimed; the walk stops at the end of the chain or at the first cluster that cannot belong to it ('stop').
+static uint32_t claimChain(struct FsckState *state, uint32_t first, enum ChainEnd *end, uint32_t *stop) {
+    uint32_t count = 0;
+    uint32_t cluster = first;
+
+    *end = CHAIN_END;
+    *stop = 0;
+    if (first == 0) {
+        return 0;
+    }
+
+    for (;;) {
+        *stop = cluster;
+        if (cluster < 2 || cluster >= state->clusterCount) {
+            *end = CHAIN_INVALID;
+            return count;
+        }
+        uint32_t next = state->fat[cluster] & FAT_ENTRY_MASK;
+        if (next == 0) {
+            *end = CHAIN_FREE;
+            return count;
+        }
+        if (next == FAT_BAD_CLUSTER) {
+            *end = CHAIN_INVALID;
+            return count;
+        }
+        if (claimCluster(state, cluster)) {
+            *end = CHAIN_CROSS;
+            return count;
+        }
+        count++;
+        if (next >= FAT_END_OF_CHAIN) {
+            return count;
+        }
+        cluster = next;
+    }
+}
+
+// Function to report why a chain walk stopped early
+static void reportChainEnd(struct FsckState *state, const char *path, enum ChainEnd end, uint32_t count, uint32_t stop) {
+    struct FsckReport *report = state->report;
+
+    switch (end) {
+        case CHAIN_END:
+            break;
+        case CHAIN_CROSS:
+            reportProblem(state, &report->crossLinks, 1, "%s: cluster %u is cross-linked.\n", path, stop);
+            break;
+        case CHAIN_FREE:
+            if (count == 0) {
+                reportProblem(state, &report->freeReferences, 1, "%s: first cluster %u is free.\n", path, stop);
+            }
+            else {
+                reportProblem(state, &report->brokenChains, 1, "%s: chain runs into free cluster %u.\n", path, stop);
+            }
+            break;
+        case CHAIN_INVALID:
+            reportProblem(state, &report->brokenChains, 1, "%s: chain holds invalid cluster %u.\n", path, stop);
+            break;
+    }
+}
+
+// Function to queue a repair to a chain
+static void addChainRepair(struct FsckState *state, uint32_t first, uint32_t keep, uint32_t drop) {
+    if (!state->repair) {
+        return;
+    }
+    pthread_mutex_lock(&state->lock);
+    if (growArray((void **)&state->chainRepairs, &state->chainRepairCapacity, state->chainRepairCount + 1, sizeof(struct ChainRepair))) {
+        state->chainRepairs[state->chainRepairCount++] = (struct ChainRepair){ first, keep, drop };
+    }
+    else {
+        state->failed = true;
+    }
+    pthread_mutex_unlock(&state->lock);
+}
+
+// Function to queue a repair to a directory entry
+static void addEntryRepair(struct FsckState *state, uint64_t offset, uint32_t firstCluster, uint32_t fileSize, bool remove) {
+    if (!state->repair) {
+        return;
+    }
+    pthread_mutex_lock(&state->lock);
+    if (growArray((void **)&state->entryRepairs, &state->entryRepairCapacity, state->entryRepairCount + 1, sizeof(struct EntryRepair))) {
+        state->entryRepairs[state->entryRepairCount++] = (struct EntryRepair){ offset, firstCluster, fileSize, remove };
+    }
+    else {
+        state->failed = true;
+    }
+    pthread_mutex_unlock(&state->lock);
+}
+
+// Function to queue a directory for the workers (takes ownership of 'path')
+static void pushTask(struct FsckState *state, uint32_t cluster, uint32_t clusterCount, char *path) {
+    pthread_mutex_lock(&state->lock);
+    if (growArray((void **)&state->tasks, &state->taskCapacity, state->taskCount + 1, sizeof(struct FsckTask))) {
+        state->tasks[state->taskCount++] = (struct FsckTask){ cluster, clusterCount, path };
+        state->pending++;
+        pthread_cond_signal(&state->ready);
+    }
+    else {
+        state->failed = true;
+        free(path);
+    }
+    pthread_mutex_unlock(&state->lock);
+}
+
+// Function to check one directory entry: claim its chain, compare the chain with the size, and queue subdirectories
+static void checkEntry(struct FsckState *state, const char *parentPath, const struct FAT32DirectoryEntry *entry, uint64_t offset) {
+    char name[13];
+    char path[FSCK_PATH_MAX];
+    enum ChainEnd end;
+    uint32_t stop;
+
+    formatDirName((const char *)entry->name, name);
+    snprintf(path, sizeof(path), "%s/%s", parentPath, name);
+
+    uint32_t first = ((uint32_t)entry->firstClusterHi << 16) | entry->firstClusterLo;
+    uint32_t count = claimChain(state, first, &end, &stop);
+    reportChainEnd(state, path, end, count, stop);
+
+    if (entry->attributes & ATTR_DIRECTORY) {
+        if (count == 0) {
+            // A directory needs at least one cluster; one that has none (or shares it) cannot be kept
+            if (first == 0) {
+                reportProblem(state, &state->report->brokenChains, 1, "%s: directory has no clusters.\n", path);
+            }
+            addEntryRepair(state, offset, 0, 0, true);
+            return;
+        }
+        if (end != CHAIN_END) {
+            addChainRepair(state, first, count, 0);
+        }
+
+        char *taskPath = strdup(path);
+        if (!taskPath) {
+            reportFailure(state, "Out of memory while checking", path);
+            return;
+        }
+        pushTask(state, first, count, taskPath);
+        return;
+    }
+
+    // Files: the chain has to hold exactly the clusters the size needs
+    uint32_t needed = (uint32_t)(((uint64_t)entry->fileSize + state->clusterSize - 1) / state->clusterSize);
+    if (count != needed) {
+        reportProblem(state, &state->report->sizeMismatches, 1, "%s: chain of %u clusters, but a size of %u bytes needs %u.\n",
+                      path, count, entry->fileSize, needed);
+    }
+
+    uint32_t keep = min(count, needed);
+    uint32_t drop = count - keep;
+    if (end != CHAIN_END || drop > 0) {
+        addChainRepair(state, first, keep, drop);
+    }
+
+    uint32_t newFirst = keep > 0 ? first : 0;
+    uint32_t newSize = (uint32_t)min((uint64_t)entry->fileSize, (uint64_t)keep * state->clusterSize);
+    if (newFirst != first || newSize != entry->fileSize) {
+        addEntryRepair(state, offset, newFirst, newSize, false);
+    }
+}
+
+// Function to read every cluster of a directory and check its entries
+static void checkDirectory(struct FsckState *state, const struct FsckTask *task, uint8_t *buffer, uint64_t *files) {
+    uint32_t entriesPerCluster = state->clusterSize / sizeof(struct FAT32DirectoryEntry);
+    uint32_t cluster = task->cluster;
+
+    for (uint32_t n = 0; n < task->clusterCount; n++) {
+        uint64_t offset = state->dataOffset + (uint64_t)(cluster - 2) * state->clusterSize;
+        if (transferImage(state->fd, false, offset, buffer, state->clusterSize) != 0) {
+            reportFailure(state, "Unable to read the directory", task->path[0] ? task->path : "/");
+            return;
+        }
+
+        for (uint32_t i = 0; i < entriesPerCluster; i++) {
+            struct FAT32DirectoryEntry *entry = (struct FAT32DirectoryEntry *)(buffer + i * sizeof(struct FAT32DirectoryEntry));
+
+            // Stop at the end of the directory; skip deleted entries, long name entries, the volume label, '.' and '..'
+            if (entry->name[0] == 0x00) {
+                return;
+            }
+            if (entry->name[0] == 0xE5 || (entry->attributes & ATTR_VOLUME_ID) || entry->name[0] == '.') {
+                continue;
+            }
+            if (!(entry->attributes & ATTR_DIRECTORY)) {
+                (*files)++;
+            }
+            checkEntry(state, task->path, entry, offset + i * sizeof(struct FAT32DirectoryEntry));
+        }
+        cluster = state->fat[cluster] & FAT_ENTRY_MASK;
+    }
+}
+
+// Worker: take directories off the queue until the queue is empty and no other worker can add to it
+static void *fsckWorker(void *arg) {
+    struct FsckState *state = arg;
+    uint64_t directories = 0;
+    uint64_t files = 0;
+
+    uint8_t *buffer = malloc(state->clusterSize);
+    if (!buffer) {
+        pthread_mutex_lock(&state->lock);
+        state->failed = true;
+        pthread_mutex_unlock(&state->lock);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&state->lock);
+    for (;;) {
+        while (state->taskCount == 0 && state->pending > 0) {
+            pthread_cond_wait(&state->ready, &state->lock);
+        }
+        if (state->taskCount == 0) {
+            break;
+        }
+        struct FsckTask task = state->tasks[--state->taskCount];
+        pthread_mutex_unlock(&state->lock);
+
+        checkDirectory(state, &task, buffer, &files);
+        directories++;
+        free(task.path);
+
+        pthread_mutex_lock(&state->lock);
+        if (--state->pending == 0) {
+            pthread_cond_broadcast(&state->ready);
+        }
+    }
+    state->report->directories += directories;
+    state->report->files += files;
+    pthread_mutex_unlock(&state->lock);
+
+    free(buffer);
+    return NULL;
+}
+
+// Function to compare every other FAT copy with the active one while the workers walk the tree
+static void compareFATCopies(struct FsckState *state) {
+    uint64_t mappedBytes = (uint64_t)state->clusterCount * 4;
+
+    if (!state->mirrored) {
+        return;
+    }
+    uint8_t *chunk = malloc(FSCK_CHUNK_SIZE);
+    if (!chunk) {
+        reportFailure(state, "Out of memory while comparing the FATs of", "the image");
+        return;
+    }
+
+    for (uint32_t copy = 0; copy < state->bs.numFATs; copy++) {
+        if (copy == state->activeFAT) {
+            continue;
+        }
+        uint64_t start = ((uint64_t)state->bs.reservedSectorCount + (uint64_t)copy * state->bs.FATSize32) * state->bs.bytesPerSector;
+        uint64_t differences = 0;
+
+        for (uint64_t done = 0; done < mappedBytes; done += FSCK_CHUNK_SIZE) {
+            uint32_t length = (uint32_t)min((uint64_t)FSCK_CHUNK_SIZE, mappedBytes - done);
+            if (transferImage(state->fd, false, start + done, chunk, length) != 0) {
+                reportFailure(state, "Unable to read a FAT copy of", "the image");
+                free(chunk);
+                return;
+            }
+            // Compare whole chunks first; only a chunk that differs is compared entry by entry
+            const uint32_t *entries = (const uint32_t *)chunk;
+            const uint32_t *active = state->fat + done / 4;
+            if (memcmp(entries, active, length) != 0) {
+                for (uint32_t i = 0; i < length / 4; i++) {
+                    differences += entries[i] != active[i];
+                }
+            }
+        }
+
+        if (differences > 0) {
+            state->copyDiffers[copy] = true;
+            reportProblem(state, &state->report->fatMismatches, differences, "FAT %u differs from FAT %u in %llu entries.\n",
+                          copy + 1, state->activeFAT + 1, (unsigned long long)differences);
+        }
+    }
+    free(chunk);
+}
+
+// Function to find chains that no directory entry leads to. Each chain is reported from its head; chains that loop
+// back on themselves have no head and are reported afterwards. Marks the lost clusters in 'lost'.
+static void findLostChains(struct FsckState *state, uint64_t *lost) {
+    uint64_t words = ((uint64_t)state->clusterCount + 63) / 64;
+    uint64_t *linked = calloc(words, sizeof(uint64_t));
+    if (!linked) {
+        reportFailure(state, "Out of memory while looking for lost chains in", "the image");
+        return;
+    }
+
+    // Lost clusters are in use but owned by nothing; note which of them another lost cluster points at
+    for (uint32_t cluster = 2; cluster < state->clusterCount; cluster++) {
+        uint32_t next = state->fat[cluster] & FAT_ENTRY_MASK;
+        if (next == 0 || next == FAT_BAD_CLUSTER || isOwned(state, cluster)) {
+            continue;
+        }
+        setBit(lost, cluster);
+        if (next >= 2 && next < state->clusterCount) {
+            setBit(linked, next);
+        }
+    }
+
+    // Walk each chain from its head (then from any cluster left over), claiming its clusters so each is counted once
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t cluster = 2; cluster < state->clusterCount; cluster++) {
+            if (!testBit(lost, cluster) || isOwned(state, cluster) || (pass == 0 && testBit(linked, cluster))) {
+                continue;
+            }
+            uint32_t length = 0;
+            uint32_t current = cluster;
+            while (current >= 2 && current < state->clusterCount && testBit(lost, current) && !claimCluster(state, current)) {
+                length++;
+                current = state->fat[current] & FAT_ENTRY_MASK;
+            }
+            state->report->lostClusters += length;
+            reportProblem(state, &state->report->lostChains, 1, "Lost chain of %u clusters at cluster %u.\n", length, cluster);
+        }
+    }
+    free(linked);
+}
+
+// Function to count the free clusters and find the first one
+static uint32_t countFreeClusters(struct FsckState *state, uint32_t *firstFree) {
+    uint32_t freeCount = 0;
+
+    *firstFree = 0xFFFFFFFF;
+    for (uint32_t cluster = 2; cluster < state->clusterCount; cluster++) {
+        if ((state->fat[cluster] & FAT_ENTRY_MASK) == 0) {
+            if (freeCount++ == 0) {
+                *firstFree = cluster;
+            }
+        }
+    }
+    return freeCount;
+}
+
+// Function to change an entry of the loaded FAT, keeping its reserved bits and marking its sector for writing
+static void setEntry(struct FsckState *state, uint32_t cluster, uint32_t value) {
+    state->fat[cluster] = (state->fat[cluster] & ~FAT_ENTRY_MASK) | value;
+    setBit(state->fatDirty, (uint32_t)((uint64_t)cluster * 4 / state->bs.bytesPerSector));
+}
+
+// Function to apply one chain repair to the loaded FAT
+static void applyChainRepair(struct FsckState *state, const struct ChainRepair *repair) {
+    uint32_t cluster = repair->first;
+
+    if (repair->keep > 0) {
+        for (uint32_t i = 1; i < repair->keep; i++) {
+            cluster = state->fat[cluster] & FAT_ENTRY_MASK;
+        }
+        uint32_t next = state->fat[cluster] & FAT_ENTRY_MASK;
+        setEntry(state, cluster, FAT_END_OF_CHAIN);
+        cluster = next;
+    }
+    for (uint32_t i = 0; i < repair->drop; i++) {
+        uint32_t next = state->fat[cluster] & FAT_ENTRY_MASK;
+        setEntry(state, cluster, 0);
+        cluster = next;
+    }
+}
+
+// Function to rewrite one directory entry in the image
+static int applyEntryRepair(struct FsckState *state, const struct EntryRepair *repair) {
+    struct FAT32DirectoryEntry entry;
+
+    if (transferImage(state->fd, false, repair->offset, &entry, sizeof(entry)) != 0) {
+        return -1;
+    }
+    if (repair->remove) {
+        entry.name[0] = 0xE5;
+    }
+    else {
+        entry.firstClusterHi = (uint16_t)(repair->firstCluster >> 16);
+        entry.firstClusterLo = (uint16_t)(repair->firstCluster & 0xFFFF);
+        entry.fileSize = repair->fileSize;
+    }
+    return transferImage(state->fd, true, repair->offset, &entry, sizeof(entry));
+}
+
+// Function to write the loaded FAT back: in full to copies that differed, otherwise only the sectors that changed
+static int writeFATs(struct FsckState *state) {
+    uint32_t bytesPerSector = state->bs.bytesPerSector;
+    uint64_t mappedBytes = (uint64_t)state->clusterCount * 4;
+    uint32_t sectors = (uint32_t)((mappedBytes + bytesPerSector - 1) / bytesPerSector);
+
+    for (uint32_t copy = 0; copy < state->bs.numFATs; copy++) {
+        if (copy != state->activeFAT && !state->mirrored) {
+            continue;
+        }
+        uint64_t start = ((uint64_t)state->bs.reservedSectorCount + (uint64_t)copy * state->bs.FATSize32) * bytesPerSector;
+
+        // Write runs of consecutive changed sectors with one call each
+        uint32_t sector = 0;
+        while (sector < sectors) {
+            if (!state->copyDiffers[copy] && !testBit(state->fatDirty, sector)) {
+                sector++;
+                continue;
+            }
+            uint32_t runEnd = sector + 1;
+            while (runEnd < sectors && (state->copyDiffers[copy] || testBit(state->fatDirty, runEnd)) &&
+                   (uint64_t)(runEnd - sector) * bytesPerSector < FSCK_CHUNK_SIZE) {
+                runEnd++;
+            }
+            uint64_t offset = (uint64_t)sector * bytesPerSector;
+            uint64_t length = min((uint64_t)(runEnd - sector) * bytesPerSector, mappedBytes - offset);
+            if (transferImage(state->fd, true, start + offset, (uint8_t *)state->fat + offset, length) != 0) {
+                return -1;
+            }
+            sector = runEnd;
+        }
+    }
+    return 0;
+}
+
+// Function to check the FSInfo sector against the real free count, rewriting it if asked to
+static int checkFSInfo(struct FsckState *state, bool write) {
+    struct FAT32FSInfo fsInfo;
+    uint32_t firstFree;
+    uint32_t freeCount = countFreeClusters(state, &firstFree);
+    uint64_t position = (uint64_t)state->bs.FSInfo * state->bs.bytesPerSector;
+
+    // Volumes without an FSInfo sector have nothing to keep up to date
+    if (state->bs.FSInfo == 0 || state->bs.FSInfo == 0xFFFF || state->bs.FSInfo >= state->bs.reservedSectorCount) {
+        return 0;
+    }
+    if (transferImage(state->fd, false, position, &fsInfo, sizeof(fsInfo)) != 0) {
+        return -1;
+    }
+
+    bool valid = fsInfo.leadSignature == FSINFO_LEAD_SIGNATURE && fsInfo.structSignature == FSINFO_STRUCT_SIGNATURE &&
+                 fsInfo.trailSignature == FSINFO_TRAIL_SIGNATURE;
+    if (!write) {
+        // A free count of 0xFFFFFFFF means unknown, which is allowed
+        if (!valid) {
+            state->report->staleFSInfo = true;
+            printf("The FSInfo sector is damaged.\n");
+        }
+        else if (fsInfo.freeCount != 0xFFFFFFFF && fsInfo.freeCount != freeCount) {
+            state->report->staleFSInfo = true;
+            printf("FSInfo records %u free clusters, but the FAT has %u.\n", fsInfo.freeCount, freeCount);
+        }
+        return 0;
+    }
+
+    if (!valid) {
+        memset(&fsInfo, 0, sizeof(fsInfo));
+        fsInfo.leadSignature = FSINFO_LEAD_SIGNATURE;
+        fsInfo.structSignature = FSINFO_STRUCT_SIGNATURE;
+        fsInfo.trailSignature = FSINFO_TRAIL_SIGNATURE;
+    }
+    fsInfo.freeCount = freeCount;
+    fsInfo.nextFree = firstFree;
+    return transferImage(state->fd, true, position, &fsInfo, sizeof(fsInfo));
+}
+
+// Function to apply every queued repair, free the lost chains and bring the FATs and FSInfo up to date
+static int repairImage(struct FsckState *state, const uint64_t *lost) {
+    for (size_t i = 0; i < state->chainRepairCount; i++) {
+        applyChainRepair(state, &state->chainRepairs[i]);
+    }
+    for (uint32_t cluster = 2; cluster < state->clusterCount; cluster++) {
+        if (testBit(lost, cluster)) {
+            setEntry(state, cluster, 0);
+        }
+    }
+    for (size_t i = 0; i < state->entryRepairCount; i++) {
+        if (applyEntryRepair(state, &state->entryRepairs[i]) != 0) {
+            return -1;
+        }
+    }
+    if (writeFATs(state) != 0 || checkFSInfo(state, true) != 0) {
+        return -1;
+    }
+    return fsync(state->fd);
+}
+
+// Function to read the boot sector and work out the layout of the volume, refusing anything that is not FAT32
+static int loadLayout(struct FsckState *state) {
+    struct FAT32BootSector *bs = &state->bs;
+
+    if (transferImage(state->fd, false, 0, bs, sizeof(*bs)) != 0) {
+        printf("Unable to read the boot sector.\n");
+        return -1;
+    }
+
+    uint32_t bytesPerSector = bs->bytesPerSector;
+    uint32_t sectorsPerCluster = bs->sectorsPerCluster;
+    if (bytesPerSector < 512 || bytesPerSector > 4096 || (bytesPerSector & (bytesPerSector - 1)) != 0 ||
+        sectorsPerCluster == 0 || (sectorsPerCluster & (sectorsPerCluster - 1)) != 0 ||
+        bs->numFATs == 0 || bs->FATSize32 == 0 || bs->reservedSectorCount == 0) {
+        printf("The boot sector does not describe a FAT32 volume.\n");
+        return -1;
+    }
+
+    uint64_t totalSectors = bs->totalSectors32 ? bs->totalSectors32 : bs->totalSectors16;
+    uint64_t firstDataSector = bs->reservedSectorCount + (uint64_t)bs->numFATs * bs->FATSize32;
+    if (totalSectors <= firstDataSector) {
+        printf("The boot sector does not describe a FAT32 volume.\n");
+        return -1;
+    }
+
+    // The FAT may have spare entries past the last cluster; only the ones that map clusters are checked
+    uint64_t clusterCount = (totalSectors - firstDataSector) / sectorsPerCluster + 2;
+    uint64_t fatEntries = (uint64_t)bs->FATSize32 * bytesPerSector / 4;
+    state->clusterCount = (uint32_t)min(min(clusterCount, fatEntries), (uint64_t)FAT_BAD_CLUSTER);
+    state->clusterSize = bytesPerSector * sectorsPerCluster;
+    state->fatBytes = (uint64_t)bs->FATSize32 * bytesPerSector;
+    state->dataOffset = firstDataSector * bytesPerSector;
+
+    // With mirroring off (bit 7 of extFlags) only the FAT named in the low bits is in use
+    state->mirrored = !(bs->extFlags & 0x80);
+    state->activeFAT = state->mirrored ? 0 : (bs->extFlags & 0x0F);
+    if (state->activeFAT >= bs->numFATs || bs->rootCluster < 2 || bs->rootCluster >= state->clusterCount) {
+        printf("The boot sector does not describe a FAT32 volume.\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to load the active FAT into memory with large sequential reads
+static int loadFAT(struct FsckState *state) {
+    uint64_t mappedBytes = (uint64_t)state->clusterCount * 4;
+    uint64_t start = ((uint64_t)state->bs.reservedSectorCount + (uint64_t)state->activeFAT * state->bs.FATSize32) * state->bs.bytesPerSector;
+
+    for (uint64_t done = 0; done < mappedBytes; done += FSCK_CHUNK_SIZE) {
+        uint32_t length = (uint32_t)min((uint64_t)FSCK_CHUNK_SIZE, mappedBytes - done);
+        if (transferImage(state->fd, false, start + done, (uint8_t *)state->fat + done, length) != 0) {
+            printf("Unable to read the FAT.\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to walk the directory tree with a pool of workers, comparing the FAT copies on this thread meanwhile
+static void walkTree(struct FsckState *state, uint32_t threads) {
+    pthread_t workers[FSCK_MAX_THREADS];
+    uint32_t started = 0;
+
+    while (started < threads && pthread_create(&workers[started], NULL, fsckWorker, state) == 0) {
+        started++;
+    }
+    compareFATCopies(state);
+
+    // Without any worker threads the tree is walked here instead
+    if (started == 0) {
+        fsckWorker(state);
+    }
+    for (uint32_t i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+}
+
+// Function to free everything a check allocated
+static void freeFsckState(struct FsckState *state) {
+    for (size_t i = 0; i < state->taskCount; i++) {
+        free(state->tasks[i].path);
+    }
+    free(state->tasks);
+    free(state->chainRepairs);
+    free(state->entryRepairs);
+    free(state->fat);
+    free(state->owned);
+    free(state->fatDirty);
+    free(state->copyDiffers);
+    pthread_mutex_destroy(&state->lock);
+    pthread_cond_destroy(&state->ready);
+}
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Fsck implementations
+
+// Function to fill in the default settings (report only, one worker per CPU)
+void defaultFsckOptions(struct FsckOptions *options) {
+    memset(options, 0, sizeof(*options));
+}
+
+// Function to check the file system in an image that is not mounted, and repair it if asked to. Every cluster is
+// claimed in a shared bitmap by the first chain that reaches it, so a second claim is a cross-link and a used
+// cluster nobody claimed is lost. Returns one of the FSCK_* codes; 'report' (if given) receives the counts.
+int checkImage(const char *path, const struct FsckOptions *options, struct FsckReport *report) {
+    struct FsckState state;
+    struct FsckReport localReport;
+    struct timespec started, finished;
+
+    memset(&state, 0, sizeof(state));
+    if (!report) {
+        report = &localReport;
+    }
+    memset(report, 0, sizeof(*report));
+    state.report = report;
+    state.repair = options->repair;
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.ready, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    state.fd = open(path, options->repair ? O_RDWR : O_RDONLY);
+    if (state.fd < 0) {
+        printf("Unable to open the image '%s'.\n", path);
+        freeFsckState(&state);
+        return FSCK_FAILED;
+    }
+
+    if (loadLayout(&state) != 0) {
+        close(state.fd);
+        freeFsckState(&state);
+        return FSCK_FAILED;
+    }
+
+    uint64_t words = ((uint64_t)state.clusterCount + 63) / 64;
+    uint64_t sectorWords = ((uint64_t)state.clusterCount * 4 / state.bs.bytesPerSector + 64) / 64;
+    uint64_t *lost = calloc(words, sizeof(uint64_t));
+    state.fat = malloc((uint64_t)state.clusterCount * 4);
+    state.owned = calloc(words, sizeof(atomic_uint_fast64_t));
+    state.fatDirty = calloc(sectorWords, sizeof(uint64_t));
+    state.copyDiffers = calloc(state.bs.numFATs, sizeof(bool));
+    if (!lost || !state.fat || !state.owned || !state.fatDirty || !state.copyDiffers) {
+        printf("Unable to allocate memory to check '%s'.\n", path);
+        free(lost);
+        close(state.fd);
+        freeFsckState(&state);
+        return FSCK_FAILED;
+    }
+    if (loadFAT(&state) != 0) {
+        free(lost);
+        close(state.fd);
+        freeFsckState(&state);
+        return FSCK_FAILED;
+    }
+
+    // The root directory is claimed here; everything under it is claimed by the workers
+    enum ChainEnd end;
+    uint32_t stop;
+    uint32_t rootClusters = claimChain(&state, state.bs.rootCluster, &end, &stop);
+    reportChainEnd(&state, "/", end, rootClusters, stop);
+    if (rootClusters == 0) {
+        printf("The root directory has no usable clusters; '%s' cannot be checked.\n", path);
+        free(lost);
+        close(state.fd);
+        freeFsckState(&state);
+        return FSCK_FAILED;
+    }
+    if (end != CHAIN_END) {
+        addChainRepair(&state, state.bs.rootCluster, rootClusters, 0);
+    }
+    pushTask(&state, state.bs.rootCluster, rootClusters, strdup(""));
+
+    uint32_t threads = options->threads;
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (uint32_t)cpus : 1;
+    }
+    threads = min(threads, FSCK_MAX_THREADS);
+    walkTree(&state, threads);
+
+    if (!state.failed) {
+        findLostChains(&state, lost);
+    }
+    if (!state.failed && checkFSInfo(&state, false) != 0) {
+        printf("Unable to read the FSInfo sector.\n");
+        state.failed = true;
+    }
+
+    uint64_t problems = report->lostChains + report->crossLinks + report->freeReferences + report->brokenChains +
+                        report->sizeMismatches + report->fatMismatches + (report->staleFSInfo ? 1 : 0);
+    int result = problems == 0 ? FSCK_CLEAN : FSCK_UNCORRECTED;
+
+    if (state.failed) {
+        result = FSCK_FAILED;
+    }
+    else if (problems > 0 && options->repair) {
+        if (repairImage(&state, lost) == 0) {
+            result = FSCK_CORRECTED;
+        }
+        else {
+            printf("Error writing the repairs to '%s'.\n", path);
+            result = FSCK_FAILED;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    double elapsed = (finished.tv_sec - started.tv_sec) * 1e3 + (finished.tv_nsec - started.tv_nsec) / 1e6;
+    printf("Checked '%s' with %u threads in %.1f ms: %llu directories, %llu files.\n", path, threads, elapsed,
+           (unsigned long long)report->directories, (unsigned long long)report->files);
+    if (problems > 0) {
+        printf("%llu lost chains (%llu clusters), %llu cross-links, %llu entries pointing at free clusters, %llu broken chains, "
+               "%llu size mismatches, %llu differing FAT entries, FSInfo %s.\n",
+               (unsigned long long)report->lostChains, (unsigned long long)report->lostClusters,
+               (unsigned long long)report->crossLinks, (unsigned long long)report->freeReferences,
+               (unsigned long long)report->brokenChains, (unsigned long long)report->sizeMismatches,
+               (unsigned long long)report->fatMismatches, report->staleFSInfo ? "stale" : "up to date");
+    }
+    if (result == FSCK_CLEAN) {
+        printf("No problems found.\n");
+    }
+    else if (result == FSCK_CORRECTED) {
+        printf("The problems were repaired.\n");
+    }
+    else if (result == FSCK_UNCORRECTED) {
+        printf("Run the check again with '-fsck repair' to fix them.\n");
+    }
+
+    free(lost);
+    if (close(state.fd) != 0 && result == FSCK_CORRECTED) {
+        result = FSCK_FAILED;
+    }
+    freeFsckState(&state);
+    return result;
+}
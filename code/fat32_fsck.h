@@ -0,0 +1,37 @@
+#ifndef FAT32_FSCK_H
+#define FAT32_FSCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Exit codes of a check (the same values fsck programs usually return)
+#define FSCK_CLEAN       0   // No problems found
+#define FSCK_CORRECTED   1   // Problems were found and repaired
+#define FSCK_UNCORRECTED 4   // Problems were found and left in place
+#define FSCK_FAILED      8   // The image could not be checked
+
+// Settings for a check
+struct FsckOptions {
+    bool repair;                 // Write fixes back to the image instead of only reporting
+    uint32_t threads;            // Workers walking the directory tree (0 picks one per CPU)
+};
+
+// Problems found by a check
+struct FsckReport {
+    uint64_t directories;        // Directories walked
+    uint64_t files;              // Files checked
+    uint64_t lostChains;         // Chains no directory entry leads to
+    uint64_t lostClusters;       // Clusters in those chains
+    uint64_t crossLinks;         // Clusters reached from more than one entry (or twice from one)
+    uint64_t freeReferences;     // Directory entries whose first cluster is free
+    uint64_t brokenChains;       // Chains running into a free, reserved or out of range cluster
+    uint64_t sizeMismatches;     // Files whose chain is shorter or longer than the size recorded
+    uint64_t fatMismatches;      // FAT entries that differ between the copies
+    bool staleFSInfo;            // FSInfo free count does not match the FAT (or the sector is damaged)
+};
+
+// Fsck functions
+void defaultFsckOptions(struct FsckOptions *options);
+int checkImage(const char *path, const struct FsckOptions *options, struct FsckReport *report);
+
+#endif
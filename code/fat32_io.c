@@ -0,0 +1,594 @@
+#include "fat32_structs.h"
+#include "fat32_io.h"
+#include "globals.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Vectored transfers go straight to the descriptor with preadv/pwritev, whatever the backend
+
+// Function to move a list of buffers to or from the file at an offset, retrying until everything is moved or the
+// file ends. Returns the number of bytes moved.
+static size_t transferVectorAt(int fd, bool writing, uint64_t offset, const struct iovec *iov, int count) {
+    struct iovec pending[IMAGE_IOV_MAX];
+    size_t moved = 0;
+
+    if (count <= 0 || count > IMAGE_IOV_MAX) {
+        return 0;
+    }
+    memcpy(pending, iov, count * sizeof(struct iovec));
+
+    struct iovec *current = pending;
+    while (count > 0) {
+        ssize_t result = writing ? pwritev(fd, current, count, (off_t)(offset + moved))
+                                 : preadv(fd, current, count, (off_t)(offset + moved));
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            break;
+        }
+        moved += result;
+
+        // Skip the buffers that were moved completely and trim the one that was moved in part
+        while (count > 0 && (size_t)result >= current->iov_len) {
+            result -= current->iov_len;
+            current++;
+            count--;
+        }
+        if (count > 0) {
+            current->iov_base = (uint8_t *)current->iov_base + result;
+            current->iov_len -= result;
+        }
+    }
+    return moved;
+}
+
+// Function to run a batch one request after another through the backend's own vectored transfers (used by the
+// backends that have no way to overlap them). Returns 0 if every byte of every request was moved.
+static int stepBatch(struct ImageIO *io, bool writing, const struct ImageRequest *requests, int count) {
+    int result = 0;
+
+    for (int i = 0; i < count; i++) {
+        size_t length = 0;
+        for (int j = 0; j < requests[i].count; j++) {
+            length += requests[i].iov[j].iov_len;
+        }
+        size_t moved = writing ? io->ops->writeVectorAt(io, requests[i].offset, requests[i].iov, requests[i].count)
+                               : io->ops->readVectorAt(io, requests[i].offset, requests[i].iov, requests[i].count);
+        if (moved != length) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+static int stepReadBatch(struct ImageIO *io, const struct ImageRequest *requests, int count) {
+    return stepBatch(io, false, requests, count);
+}
+
+static int stepWriteBatch(struct ImageIO *io, const struct ImageRequest *requests, int count) {
+    return stepBatch(io, true, requests, count);
+}
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Stdio backend: buffered FILE* access with a seek before every transfer
+
+static int stdioOpen(struct ImageIO *io, const char *path) {
+    io->file = fopen(path, "r+");
+    if (!io->file) {
+        return -1;
+    }
+
+    io->fd = fileno(io->file);
+    fseeko(io->file, 0, SEEK_END);
+    io->size = ftello(io->file);
+    return 0;
+}
+
+static size_t stdioReadAt(struct ImageIO *io, uint64_t offset, void *buffer, size_t length) {
+    if (fseeko(io->file, (off_t)offset, SEEK_SET) != 0) {
+        return 0;
+    }
+    return fread(buffer, 1, length, io->file);
+}
+
+static size_t stdioWriteAt(struct ImageIO *io, uint64_t offset, const void *buffer, size_t length) {
+    if (fseeko(io->file, (off_t)offset, SEEK_SET) != 0) {
+        return 0;
+    }
+    return fwrite(buffer, 1, length, io->file);
+}
+
+// The stream is flushed first so buffered writes land before the descriptor is used, and again after a write so
+// any read-ahead it holds of the overwritten range is dropped
+static size_t stdioReadVectorAt(struct ImageIO *io, uint64_t offset, const struct iovec *iov, int count) {
+    fflush(io->file);
+    return transferVectorAt(io->fd, false, offset, iov, count);
+}
+
+static size_t stdioWriteVectorAt(struct ImageIO *io, uint64_t offset, const struct iovec *iov, int count) {
+    fflush(io->file);
+    size_t written = transferVectorAt(io->fd, true, offset, iov, count);
+    fflush(io->file);
+    return written;
+}
+
+static uint8_t *stdioMap(struct ImageIO *io, uint64_t offset, size_t length) {
+    // A stream cannot hand out pointers into the image
+    return NULL;
+}
+
+static int stdioFlush(struct ImageIO *io) {
+    return fflush(io->file);
+}
+
+static void stdioClose(struct ImageIO *io) {
+    fclose(io->file);
+    io->file = NULL;
+}
+
+static const struct ImageIOOps stdioOps = {
+    "stdio", stdioOpen, stdioReadAt, stdioWriteAt, stdioReadVectorAt, stdioWriteVectorAt, stepReadBatch, stepWriteBatch, stdioMap, stdioFlush, stdioClose
+};
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Mmap backend: the whole image is mapped shared and read-write, so every cluster access is a plain memory copy
+
+static int mmapOpen(struct ImageIO *io, const char *path) {
+    struct stat st;
+
+    io->fd = open(path, O_RDWR);
+    if (io->fd < 0) {
+        return -1;
+    }
+
+    if (fstat(io->fd, &st) != 0 || st.st_size == 0) {
+        close(io->fd);
+        io->fd = -1;
+        return -1;
+    }
+
+    io->size = st.st_size;
+    io->mapping = mmap(NULL, io->size, PROT_READ | PROT_WRITE, MAP_SHARED, io->fd, 0);
+    if (io->mapping == MAP_FAILED) {
+        io->mapping = NULL;
+        close(io->fd);
+        io->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to clamp a transfer so it never runs off the end of the mapping
+static size_t mmapClamp(struct ImageIO *io, uint64_t offset, size_t length) {
+    if (offset >= io->size) {
+        return 0;
+    }
+    return io->size - offset < length ? io->size - offset : length;
+}
+
+static size_t mmapReadAt(struct ImageIO *io, uint64_t offset, void *buffer, size_t length) {
+    length = mmapClamp(io, offset, length);
+    memcpy(buffer, io->mapping + offset, length);
+    return length;
+}
+
+static size_t mmapWriteAt(struct ImageIO *io, uint64_t offset, const void *buffer, size_t length) {
+    length = mmapClamp(io, offset, length);
+    memcpy(io->mapping + offset, buffer, length);
+    return length;
+}
+
+// The mapping is shared, so it sees what preadv/pwritev move through the descriptor without any copying here
+static size_t mmapReadVectorAt(struct ImageIO *io, uint64_t offset, const struct iovec *iov, int count) {
+    return transferVectorAt(io->fd, false, offset, iov, count);
+}
+
+static size_t mmapWriteVectorAt(struct ImageIO *io, uint64_t offset, const struct iovec *iov, int count) {
+    return transferVectorAt(io->fd, true, offset, iov, count);
+}
+
+static uint8_t *mmapMap(struct ImageIO *io, uint64_t offset, size_t length) {
+    if (mmapClamp(io, offset, length) != length) {
+        return NULL;
+    }
+    return io->mapping + offset;
+}
+
+static int mmapFlush(struct ImageIO *io) {
+    return msync(io->mapping, io->size, MS_SYNC);
+}
+
+static void mmapClose(struct ImageIO *io) {
+    munmap(io->mapping, io->size);
+    close(io->fd);
+    io->mapping = NULL;
+    io->fd = -1;
+}
+
+static const struct ImageIOOps mmapOps = {
+    "mmap", mmapOpen, mmapReadAt, mmapWriteAt, mmapReadVectorAt, mmapWriteVectorAt, stepReadBatch, stepWriteBatch, mmapMap, mmapFlush, mmapClose
+};
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Io_uring backend: single transfers go straight to the descriptor, and every request of a batch is put on the
+// submission queue at once so the kernel can keep them all in flight. The rings are set up with raw system calls.
+
+// Submission and completion queues shared with the kernel
+struct ImageRing {
+    int fd;
+    uint32_t entries;
+    uint32_t *sqHead;
+    uint32_t *sqTail;
+    uint32_t sqMask;
+    uint32_t *sqArray;
+    struct io_uring_sqe *sqes;
+    uint32_t *cqHead;
+    uint32_t *cqTail;
+    uint32_t cqMask;
+    struct io_uring_cqe *cqes;
+    void *sqMap;
+    size_t sqMapSize;
+    void *cqMap;
+    size_t cqMapSize;
+    size_t sqesSize;
+};
+
+// Function to unmap the rings and close the ring descriptor
+static void freeRing(struct ImageRing *ring) {
+    if (ring->sqes && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqMap && ring->cqMap != MAP_FAILED && ring->cqMap != ring->sqMap) munmap(ring->cqMap, ring->cqMapSize);
+    if (ring->sqMap && ring->sqMap != MAP_FAILED) munmap(ring->sqMap, ring->sqMapSize);
+    if (ring->fd >= 0) close(ring->fd);
+    free(ring);
+}
+
+// Function to create a ring and map its queues, or return NULL if the kernel does not offer io_uring
+static struct ImageRing *setupRing(uint32_t entries) {
+    struct io_uring_params params;
+    struct ImageRing *ring = calloc(1, sizeof(struct ImageRing));
+    if (!ring) {
+        return NULL;
+    }
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(SYS_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+    ring->entries = params.sq_entries;
+
+    // Newer kernels put both queues in one mapping
+    ring->sqMapSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqMapSize > ring->sqMapSize) ring->sqMapSize = ring->cqMapSize;
+        ring->cqMapSize = ring->sqMapSize;
+    }
+
+    ring->sqMap = mmap(NULL, ring->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqMap == MAP_FAILED) {
+        freeRing(ring);
+        return NULL;
+    }
+    ring->cqMap = (params.features & IORING_FEAT_SINGLE_MMAP) ? ring->sqMap :
+                  mmap(NULL, ring->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->cqMap == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        freeRing(ring);
+        return NULL;
+    }
+
+    uint8_t *sq = ring->sqMap, *cq = ring->cqMap;
+    ring->sqHead = (uint32_t *)(sq + params.sq_off.head);
+    ring->sqTail = (uint32_t *)(sq + params.sq_off.tail);
+    ring->sqMask = *(uint32_t *)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (uint32_t *)(sq + params.sq_off.array);
+    ring->cqHead = (uint32_t *)(cq + params.cq_off.head);
+    ring->cqTail = (uint32_t *)(cq + params.cq_off.tail);
+    ring->cqMask = *(uint32_t *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return ring;
+}
+
+// Function to submit 'count' queued requests and wait until 'count' completions are available
+static int enterRing(struct ImageRing *ring, uint32_t submit, uint32_t wait) {
+    for (;;) {
+        long result = syscall(SYS_io_uring_enter, ring->fd, submit, wait, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (result >= 0) {
+            return (int)result;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return -1;
+        }
+    }
+}
+
+// Function to finish a request the ring moved only part of (or refused), with plain vectored transfers
+static int finishRequest(struct ImageIO *io, bool writing, const struct ImageRequest *request, size_t done) {
+    struct iovec rest[IMAGE_IOV_MAX];
+    size_t length = 0;
+    int count = 0;
+
+    // Skip what was already moved and trim the buffer it stopped in
+    for (int i = 0; i < request->count; i++) {
+        size_t bufferLength = request->iov[i].iov_len;
+        if (done >= bufferLength) {
+            done -= bufferLength;
+            continue;
+        }
+        rest[count].iov_base = (uint8_t *)request->iov[i].iov_base + done;
+        rest[count].iov_len = bufferLength - done;
+        length += rest[count].iov_len;
+        done = 0;
+        count++;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    uint64_t offset = request->offset;
+    for (int i = 0; i < request->count; i++) offset += request->iov[i].iov_len;
+    offset -= length;
+    return transferVectorAt(io->fd, writing, offset, rest, count) == length ? 0 : -1;
+}
+
+// Function to run a batch through the ring: up to a ring's worth of requests is queued and submitted with one
+// system call, then the completions are reaped together. Returns 0 if every byte of every request was moved.
+static int ringBatch(struct ImageIO *io, bool writing, const struct ImageRequest *requests, int count) {
+    struct ImageRing *ring = io->ring;
+    int result = 0;
+
+    for (int start = 0; start < count; start += ring->entries) {
+        uint32_t round = (uint32_t)(count - start) < ring->entries ? (uint32_t)(count - start) : ring->entries;
+
+        // Only this thread produces submissions, so the tail can be read plainly
+        uint32_t tail = *ring->sqTail;
+        for (uint32_t i = 0; i < round; i++) {
+            const struct ImageRequest *request = &requests[start + i];
+            uint32_t slot = (tail + i) & ring->sqMask;
+            struct io_uring_sqe *sqe = &ring->sqes[slot];
+
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = writing ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd = io->fd;
+            sqe->off = request->offset;
+            sqe->addr = (uint64_t)(uintptr_t)request->iov;
+            sqe->len = request->count;
+            sqe->user_data = start + i;
+            ring->sqArray[slot] = slot;
+        }
+        __atomic_store_n(ring->sqTail, tail + round, __ATOMIC_RELEASE);
+
+        int submitted = enterRing(ring, round, round);
+        if (submitted < 0) {
+            // Take back what the kernel did not accept and fall back to plain transfers for this round
+            __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+            if (stepBatch(io, writing, requests + start, round) != 0) {
+                result = -1;
+            }
+            continue;
+        }
+
+        // Take back the entries the kernel left in the ring, so a later submission does not send them again
+        if ((uint32_t)submitted < round) {
+            __atomic_store_n(ring->sqTail, tail + submitted, __ATOMIC_RELEASE);
+        }
+
+        // Reap every completion of the round; short or failed requests are finished without the ring
+        uint32_t reaped = 0;
+        while (reaped < (uint32_t)submitted) {
+            uint32_t head = *ring->cqHead;
+            if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+                if (enterRing(ring, 0, submitted - reaped) < 0) {
+                    return -1;
+                }
+                continue;
+            }
+
+            struct io_uring_cqe *cqe = &ring->cqes[head & ring->cqMask];
+            const struct ImageRequest *request = &requests[cqe->user_data];
+            size_t length = 0;
+            for (int j = 0; j < request->count; j++) {
+                length += request->iov[j].iov_len;
+            }
+            if (cqe->res < 0 || (size_t)cqe->res < length) {
+                if (finishRequest(io, writing, request, cqe->res > 0 ? (size_t)cqe->res : 0) != 0) {
+                    result = -1;
+                }
+            }
+            __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+            reaped++;
+        }
+
+        // Requests the kernel did not take are moved without the ring
+        if ((uint32_t)submitted < round && stepBatch(io, writing, requests + start + submitted, round - submitted) != 0) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+static int uringOpen(struct ImageIO *io, const char *path) {
+    struct stat st;
+
+    io->fd = open(path, O_RDWR);
+    if (io->fd < 0) {
+        return -1;
+    }
+    if (fstat(io->fd, &st) != 0) {
+        close(io->fd);
+        io->fd = -1;
+        return -1;
+    }
+    io->size = st.st_size;
+
+    io->ring = setupRing(IMAGE_RING_ENTRIES);
+    if (!io->ring) {
+        close(io->fd);
+        io->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static size_t uringReadAt(struct ImageIO *io, uint64_t offset, void *buffer, size_t length) {
+    struct iovec iov = { buffer, length };
+    return transferVectorAt(io->fd, false, offset, &iov, 1);
+}
+
+static size_t uringWriteAt(struct ImageIO *io, uint64_t offset, const void *buffer, size_t length) {
+    struct iovec iov = { (void *)buffer, length };
+    return transferVectorAt(io->fd, true, offset, &iov, 1);
+}
+
+static size_t uringReadVectorAt(struct ImageIO *io, uint64_t offset, const struct iovec *iov, int count) {
+    return transferVectorAt(io->fd, false, offset, iov, count);
+}
+
+static size_t uringWriteVectorAt(struct ImageIO *io, uint64_t offset, const struct iovec *iov, int count) {
+    return transferVectorAt(io->fd, true, offset, iov, count);
+}
+
+static int uringReadBatch(struct ImageIO *io, const struct ImageRequest *requests, int count) {
+    return ringBatch(io, false, requests, count);
+}
+
+static int uringWriteBatch(struct ImageIO *io, const struct ImageRequest *requests, int count) {
+    return ringBatch(io, true, requests, count);
+}
+
+static uint8_t *uringMap(struct ImageIO *io, uint64_t offset, size_t length) {
+    // Everything goes through the descriptor, so there are no pointers into the image
+    return NULL;
+}
+
+static int uringFlush(struct ImageIO *io) {
+    // Nothing is buffered in user space; writes are with the kernel once their batch completes
+    return 0;
+}
+
+static void uringClose(struct ImageIO *io) {
+    freeRing(io->ring);
+    close(io->fd);
+    io->ring = NULL;
+    io->fd = -1;
+}
+
+static const struct ImageIOOps uringOps = {
+    "io_uring", uringOpen, uringReadAt, uringWriteAt, uringReadVectorAt, uringWriteVectorAt, uringReadBatch, uringWriteBatch,
+    uringMap, uringFlush, uringClose
+};
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Image I/O implementations
+
+// Function to open the image with the requested backend, falling back to stdio if it cannot be used (for io_uring,
+// when the kernel does not offer it)
+int openImage(const char *path, enum ImageBackend backend) {
+    memset(&activeVolume->imageIO, 0, sizeof(activeVolume->imageIO));
+    activeVolume->imageIO.fd = -1;
+
+    if (backend == IO_BACKEND_MMAP || backend == IO_BACKEND_URING) {
+        activeVolume->imageIO.ops = backend == IO_BACKEND_MMAP ? &mmapOps : &uringOps;
+        if (activeVolume->imageIO.ops->open(&activeVolume->imageIO, path) == 0) {
+            return 0;
+        }
+    }
+
+    activeVolume->imageIO.ops = &stdioOps;
+    if (activeVolume->imageIO.ops->open(&activeVolume->imageIO, path) == 0) {
+        return 0;
+    }
+
+    activeVolume->imageIO.ops = NULL;
+    return -1;
+}
+
+// Function to close the image
+void closeImage() {
+    if (activeVolume->imageIO.ops) {
+        activeVolume->imageIO.ops->close(&activeVolume->imageIO);
+        activeVolume->imageIO.ops = NULL;
+    }
+}
+
+// Function to read bytes from the image at an absolute offset, returning how many were read
+size_t readImage(uint64_t offset, void *buffer, size_t length) {
+    return activeVolume->imageIO.ops->readAt(&activeVolume->imageIO, offset, buffer, length);
+}
+
+// Function to write bytes to the image at an absolute offset, returning how many were written
+size_t writeImage(uint64_t offset, const void *buffer, size_t length) {
+    return activeVolume->imageIO.ops->writeAt(&activeVolume->imageIO, offset, buffer, length);
+}
+
+// Function to read a run of the image into several buffers with one call, returning how many bytes were read
+size_t readImageVector(uint64_t offset, const struct iovec *iov, int count) {
+    return activeVolume->imageIO.ops->readVectorAt(&activeVolume->imageIO, offset, iov, count);
+}
+
+// Function to write several buffers to a run of the image with one call, returning how many bytes were written
+size_t writeImageVector(uint64_t offset, const struct iovec *iov, int count) {
+    return activeVolume->imageIO.ops->writeVectorAt(&activeVolume->imageIO, offset, iov, count);
+}
+
+// Function to read a batch of runs of the image, letting the backend overlap them. Returns 0 if everything was read.
+int readImageBatch(const struct ImageRequest *requests, int count) {
+    return count > 0 ? activeVolume->imageIO.ops->readBatch(&activeVolume->imageIO, requests, count) : 0;
+}
+
+// Function to write a batch of runs of the image, letting the backend overlap them. Returns 0 if everything was written.
+int writeImageBatch(const struct ImageRequest *requests, int count) {
+    return count > 0 ? activeVolume->imageIO.ops->writeBatch(&activeVolume->imageIO, requests, count) : 0;
+}
+
+// Function to get a pointer directly into the image, or NULL if the backend cannot provide one
+uint8_t *mapImage(uint64_t offset, size_t length) {
+    return activeVolume->imageIO.ops->map(&activeVolume->imageIO, offset, length);
+}
+
+// Function to tell whether the backend maps the image, so clusters can be read in place with mapImage
+bool isImageMapped() {
+    return activeVolume->imageIO.ops->map(&activeVolume->imageIO, 0, 0) != NULL;
+}
+
+// Function to push all written data down to the image file
+int syncImage() {
+    return activeVolume->imageIO.ops->flush(&activeVolume->imageIO);
+}
+
+// Function to convert a backend name given on the command line into a backend
+int parseImageBackend(const char *name, enum ImageBackend *backend) {
+    if (strcmp(name, "stdio") == 0) {
+        *backend = IO_BACKEND_STDIO;
+        return 0;
+    }
+    if (strcmp(name, "mmap") == 0) {
+        *backend = IO_BACKEND_MMAP;
+        return 0;
+    }
+    if (strcmp(name, "uring") == 0) {
+        *backend = IO_BACKEND_URING;
+        return 0;
+    }
+    return -1;
+}
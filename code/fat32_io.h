@@ -0,0 +1,72 @@
+#ifndef FAT32_IO_H
+#define FAT32_IO_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+// Most buffers one vectored transfer can be given
+#define IMAGE_IOV_MAX 64
+
+// Requests the io_uring backend keeps in flight at once (larger batches are submitted in rounds)
+#define IMAGE_RING_ENTRIES 64
+
+// Backends available for accessing the image file
+enum ImageBackend {
+    IO_BACKEND_STDIO,
+    IO_BACKEND_MMAP,
+    IO_BACKEND_URING
+};
+
+// One vectored transfer of a batch: 'count' buffers (at most IMAGE_IOV_MAX) moved to or from a run of the image
+struct ImageRequest {
+    uint64_t offset;
+    const struct iovec *iov;
+    int count;
+};
+
+struct ImageIO;
+struct ImageRing;
+
+// Operations every image backend provides
+struct ImageIOOps {
+    const char *name;
+    int (*open)(struct ImageIO *io, const char *path);
+    size_t (*readAt)(struct ImageIO *io, uint64_t offset, void *buffer, size_t length);
+    size_t (*writeAt)(struct ImageIO *io, uint64_t offset, const void *buffer, size_t length);
+    size_t (*readVectorAt)(struct ImageIO *io, uint64_t offset, const struct iovec *iov, int count);
+    size_t (*writeVectorAt)(struct ImageIO *io, uint64_t offset, const struct iovec *iov, int count);
+    int (*readBatch)(struct ImageIO *io, const struct ImageRequest *requests, int count);
+    int (*writeBatch)(struct ImageIO *io, const struct ImageRequest *requests, int count);
+    uint8_t *(*map)(struct ImageIO *io, uint64_t offset, size_t length);
+    int (*flush)(struct ImageIO *io);
+    void (*close)(struct ImageIO *io);
+};
+
+// State of the open image, shared by whichever backend is in use
+struct ImageIO {
+    const struct ImageIOOps *ops;
+    FILE *file;           // Stream the image was opened with (stdio backend only)
+    int fd;               // Descriptor of the image (underlying the stream for the stdio backend)
+    uint8_t *mapping;     // Shared read-write mapping of the whole image (mmap backend only)
+    struct ImageRing *ring;  // Submission and completion queues (io_uring backend only)
+    uint64_t size;        // Size of the image in bytes
+};
+
+// Image I/O functions
+int openImage(const char *path, enum ImageBackend backend);
+void closeImage();
+size_t readImage(uint64_t offset, void *buffer, size_t length);
+size_t writeImage(uint64_t offset, const void *buffer, size_t length);
+size_t readImageVector(uint64_t offset, const struct iovec *iov, int count);
+size_t writeImageVector(uint64_t offset, const struct iovec *iov, int count);
+int readImageBatch(const struct ImageRequest *requests, int count);
+int writeImageBatch(const struct ImageRequest *requests, int count);
+uint8_t *mapImage(uint64_t offset, size_t length);
+bool isImageMapped();
+int syncImage();
+int parseImageBackend(const char *name, enum ImageBackend *backend);
+
+#endif
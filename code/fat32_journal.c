@@ -0,0 +1,474 @@
+#include "fat32_structs.h"
+#include "fat32_journal.h"
+#include "fat32_io.h"
+#include "fat32_utils.h"
+#include "globals.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Journal helper functions
+
+// Function to fold bytes into a running FNV-1a hash
+static uint64_t hashBytes(uint64_t hash, const void *data, size_t length) {
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Function to compute the checksum a commit record carries for a transaction
+static uint64_t transactionChecksum(const struct JournalHeader *header, const struct JournalBlock *blocks, const uint8_t *data) {
+    uint64_t hash = 14695981039346656037ull;
+    hash = hashBytes(hash, header, sizeof(*header));
+    hash = hashBytes(hash, blocks, (size_t)header->blockCount * sizeof(struct JournalBlock));
+    return hashBytes(hash, data, header->dataLength);
+}
+
+// Function to write a list of buffers to the journal file at an offset, retrying until everything is written
+static int writeRecord(uint64_t offset, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t result = pwritev(activeVolume->journal.fd, iov, count, (off_t)offset);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return -1;
+        }
+        offset += result;
+
+        // Skip the buffers that were written completely and trim the one that was written in part
+        while (count > 0 && (size_t)result >= iov->iov_len) {
+            result -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + result;
+            iov->iov_len -= result;
+        }
+    }
+    return 0;
+}
+
+// Function to write the blocks of a transaction to their places in the image with one batch
+static int applyBlocks(const struct JournalBlock *blocks, uint32_t blockCount, const uint8_t *data) {
+    struct iovec *iov = malloc(blockCount * sizeof(struct iovec));
+    struct ImageRequest *requests = malloc(blockCount * sizeof(struct ImageRequest));
+    int result = 0;
+
+    if (!iov || !requests) {
+        free(iov);
+        free(requests);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < blockCount; i++) {
+        iov[i].iov_base = (void *)data;
+        iov[i].iov_len = blocks[i].length;
+        requests[i].offset = blocks[i].offset;
+        requests[i].iov = &iov[i];
+        requests[i].count = 1;
+        data += blocks[i].length;
+    }
+    if (writeImageBatch(requests, (int)blockCount) != 0) {
+        result = -1;
+    }
+
+    free(iov);
+    free(requests);
+    return result;
+}
+
+// Function to make everything written to the image so far durable
+static int syncImageData() {
+    int result = syncImage();
+    if (fdatasync(activeVolume->imageIO.fd) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+// Function to get the clusters of the data region a run of the image overlaps. Returns false if it overlaps none.
+static bool journalClusterRange(uint64_t offset, uint64_t length, uint32_t *first, uint32_t *last) {
+    uint64_t clusterSize = (uint64_t)activeVolume->bootSector.sectorsPerCluster * activeVolume->bootSector.bytesPerSector;
+    uint64_t dataStart = getClusterOffset(2);
+    uint64_t limit = (uint64_t)activeVolume->journal.journaledWords * 64;
+
+    if (length == 0 || offset + length <= dataStart) {
+        return false;
+    }
+    uint64_t start = (offset > dataStart ? offset - dataStart : 0) / clusterSize + 2;
+    uint64_t end = (offset + length - 1 - dataStart) / clusterSize + 2;
+    if (start >= limit) {
+        return false;
+    }
+    *first = (uint32_t)start;
+    *last = (uint32_t)(end < limit ? end : limit - 1);
+    return true;
+}
+
+// Function to record the clusters a committed transaction wrote, which now have a copy in the journal file
+static void markJournaled(const struct JournalBlock *blocks, uint32_t blockCount) {
+    uint32_t first, last;
+    for (uint32_t i = 0; i < blockCount; i++) {
+        if (journalClusterRange(blocks[i].offset, blocks[i].length, &first, &last)) {
+            for (uint32_t cluster = first; cluster <= last; cluster++) {
+                activeVolume->journal.journaled[cluster / 64] |= (uint64_t)1 << (cluster % 64);
+            }
+        }
+    }
+}
+
+// Function to tell whether a run of the image overlaps a cluster that has a copy in the journal file
+static bool isJournaled(uint64_t offset, uint64_t length) {
+    uint32_t first, last;
+    if (!journalClusterRange(offset, length, &first, &last)) {
+        return false;
+    }
+    for (uint32_t cluster = first; cluster <= last; cluster++) {
+        if (activeVolume->journal.journaled[cluster / 64] & ((uint64_t)1 << (cluster % 64))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Function to write bytes straight to the image, bypassing the journal. Replay would overwrite them with whatever
+// a transaction still in the journal file wrote to the same clusters (say, a freed directory cluster now reused for
+// file data), so the journal is checkpointed first if it holds any of them. Returns 0 on success.
+static int writeUnjournaled(uint64_t offset, const void *buffer, size_t length) {
+    if (activeVolume->journal.size > 0 && isJournaled(offset, length) && checkpointJournal() != 0) {
+        return -1;
+    }
+    return writeImage(offset, buffer, length) == length ? 0 : -1;
+}
+
+// Function to replay every complete transaction of a journal file onto the image, in order. Replay stops at the
+// first transaction that is torn, damaged or out of sequence (a crash while it was being written).
+// Returns the number of transactions replayed, or -1 if the image could not be written.
+static int replayTransactions(FILE *file, uint64_t fileSize) {
+    int fd = fileno(file);
+    uint64_t position = 0;
+    int replayed = 0;
+
+    while (position + sizeof(struct JournalHeader) <= fileSize) {
+        struct JournalHeader header;
+        if (pread(fd, &header, sizeof(header), (off_t)position) != sizeof(header) || header.magic != JOURNAL_HEADER_MAGIC) {
+            break;
+        }
+        if (replayed > 0 && header.sequence != activeVolume->journal.sequence) {
+            break;
+        }
+
+        // The sizes come from the file, so they are checked against it before anything is allocated
+        uint64_t bodyLength = (uint64_t)header.blockCount * sizeof(struct JournalBlock) + header.dataLength;
+        if (header.blockCount == 0 || header.dataLength > fileSize || bodyLength + sizeof(struct JournalCommit) > fileSize - position - sizeof(header)) {
+            break;
+        }
+
+        uint8_t *body = malloc(bodyLength + sizeof(struct JournalCommit));
+        if (!body) {
+            return -1;
+        }
+        if (pread(fd, body, bodyLength + sizeof(struct JournalCommit), (off_t)(position + sizeof(header))) != (ssize_t)(bodyLength + sizeof(struct JournalCommit))) {
+            free(body);
+            break;
+        }
+
+        const struct JournalBlock *blocks = (const struct JournalBlock *)body;
+        const uint8_t *data = body + (size_t)header.blockCount * sizeof(struct JournalBlock);
+        struct JournalCommit commit;
+        memcpy(&commit, body + bodyLength, sizeof(commit));
+
+        bool valid = commit.magic == JOURNAL_COMMIT_MAGIC && commit.sequence == header.sequence &&
+                     commit.checksum == transactionChecksum(&header, blocks, data);
+        uint64_t total = 0;
+        for (uint32_t i = 0; valid && i < header.blockCount; i++) {
+            total += blocks[i].length;
+            valid = blocks[i].offset + blocks[i].length <= activeVolume->imageIO.size;
+        }
+        if (!valid || total != header.dataLength) {
+            free(body);
+            break;
+        }
+
+        if (applyBlocks(blocks, header.blockCount, data) != 0) {
+            free(body);
+            return -1;
+        }
+        free(body);
+
+        position += sizeof(header) + bodyLength + sizeof(struct JournalCommit);
+        activeVolume->journal.sequence = header.sequence + 1;
+        replayed++;
+    }
+    return replayed;
+}
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Journal implementations
+
+// Function to set up the journal of a newly opened image and replay any transactions a crash left in its
+// journal file. The journal file is removed afterwards; journaling itself stays off until startJournal.
+int initJournal(const char *imagePath) {
+    struct stat st;
+
+    memset(&activeVolume->journal, 0, sizeof(activeVolume->journal));
+    activeVolume->journal.fd = -1;
+    activeVolume->journal.path = malloc(strlen(imagePath) + sizeof(".journal"));
+    if (!activeVolume->journal.path) {
+        return -1;
+    }
+    sprintf(activeVolume->journal.path, "%s.journal", imagePath);
+
+    FILE *file = fopen(activeVolume->journal.path, "r");
+    if (!file) {
+        return 0;
+    }
+    if (fstat(fileno(file), &st) != 0) {
+        fclose(file);
+        return -1;
+    }
+
+    int replayed = replayTransactions(file, st.st_size);
+    fclose(file);
+    if (replayed < 0) {
+        return -1;
+    }
+
+    // Everything replayed must be on disk before the journal holding it is thrown away
+    if (replayed > 0 && syncImageData() != 0) {
+        return -1;
+    }
+    activeVolume->journal.replayed = replayed;
+    remove(activeVolume->journal.path);
+    return 0;
+}
+
+// Function to release the journal (stopJournal must have been called first if journaling was on)
+void freeJournal() {
+    free(activeVolume->journal.path);
+    free(activeVolume->journal.journaled);
+    free(activeVolume->journal.blocks);
+    free(activeVolume->journal.data);
+    memset(&activeVolume->journal, 0, sizeof(activeVolume->journal));
+    activeVolume->journal.fd = -1;
+}
+
+// Function to turn journaling on: from now on every write-back is first committed to the journal file
+int startJournal() {
+    if (activeVolume->journal.file) {
+        return 0;
+    }
+
+    activeVolume->journal.journaled = calloc(activeVolume->allocator.wordCount, sizeof(uint64_t));
+    if (!activeVolume->journal.journaled) {
+        return -1;
+    }
+    activeVolume->journal.file = fopen(activeVolume->journal.path, "w+");
+    if (!activeVolume->journal.file) {
+        free(activeVolume->journal.journaled);
+        activeVolume->journal.journaled = NULL;
+        return -1;
+    }
+    activeVolume->journal.journaledWords = activeVolume->allocator.wordCount;
+    activeVolume->journal.fd = fileno(activeVolume->journal.file);
+    activeVolume->journal.size = 0;
+    return 0;
+}
+
+// Function to turn journaling off: the image is synced and the journal file removed
+int stopJournal() {
+    if (!activeVolume->journal.file) {
+        return 0;
+    }
+
+    // A transaction that could not be committed gets one more try before the journal goes away
+    int result = 0;
+    if (activeVolume->journal.uncommitted) {
+        beginJournalTransaction();
+        result = commitJournalTransaction();
+    }
+    if (checkpointJournal() != 0) {
+        result = -1;
+    }
+    fclose(activeVolume->journal.file);
+    activeVolume->journal.file = NULL;
+    activeVolume->journal.fd = -1;
+    free(activeVolume->journal.journaled);
+    activeVolume->journal.journaled = NULL;
+    activeVolume->journal.journaledWords = 0;
+    if (result == 0) {
+        remove(activeVolume->journal.path);
+    }
+    return result;
+}
+
+// Function to start collecting the writes of a write-back into one transaction (nothing happens with journaling off).
+// The writes of a transaction that could not be committed are kept, so they are committed with this one.
+void beginJournalTransaction() {
+    activeVolume->journal.active = activeVolume->journal.file != NULL;
+    if (!activeVolume->journal.uncommitted) {
+        activeVolume->journal.blockCount = 0;
+        activeVolume->journal.dataLength = 0;
+    }
+}
+
+// Function to commit the open transaction: it is appended to the journal file and made durable with a single
+// fdatasync, then written to its place in the image. The image itself is only synced when the journal is
+// checkpointed, so a crash before then is repaired by replaying the journal at the next mount.
+// If the transaction cannot be made durable the image is left untouched and -1 is returned; the transaction is kept
+// and committed along with the next one.
+int commitJournalTransaction() {
+    int result = 0;
+
+    if (!activeVolume->journal.active) {
+        return 0;
+    }
+    activeVolume->journal.active = false;
+    if (activeVolume->journal.blockCount == 0) {
+        return 0;
+    }
+
+    struct JournalHeader header = { JOURNAL_HEADER_MAGIC, activeVolume->journal.blockCount, activeVolume->journal.sequence, activeVolume->journal.dataLength };
+    struct JournalCommit commit = { JOURNAL_COMMIT_MAGIC, 0, activeVolume->journal.sequence, transactionChecksum(&header, activeVolume->journal.blocks, activeVolume->journal.data) };
+    struct iovec iov[4] = {
+        { &header, sizeof(header) },
+        { activeVolume->journal.blocks, (size_t)activeVolume->journal.blockCount * sizeof(struct JournalBlock) },
+        { activeVolume->journal.data, activeVolume->journal.dataLength },
+        { &commit, sizeof(commit) }
+    };
+    uint64_t recordLength = sizeof(header) + iov[1].iov_len + iov[2].iov_len + sizeof(commit);
+
+    // Nothing may reach the image without a durable commit record, or a crash could leave it half updated
+    if (writeRecord(activeVolume->journal.size, iov, 4) != 0 || fdatasync(activeVolume->journal.fd) != 0) {
+        activeVolume->journal.uncommitted = true;
+        return -1;
+    }
+    activeVolume->journal.uncommitted = false;
+    activeVolume->journal.size += recordLength;
+    activeVolume->journal.sequence++;
+    activeVolume->journal.commits++;
+    markJournaled(activeVolume->journal.blocks, activeVolume->journal.blockCount);
+
+    if (applyBlocks(activeVolume->journal.blocks, activeVolume->journal.blockCount, activeVolume->journal.data) != 0) {
+        result = -1;
+    }
+    activeVolume->journal.blockCount = 0;
+    activeVolume->journal.dataLength = 0;
+
+    if (activeVolume->journal.size >= JOURNAL_CHECKPOINT_BYTES && checkpointJournal() != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+// Function to write bytes to the image through the journal: inside a transaction they are collected (and written
+// when it commits), otherwise they go straight to the image. While a transaction is waiting to be committed again,
+// writes join it so they cannot reach the image ahead of older changes. Returns 0 on success.
+int journalWrite(uint64_t offset, const void *buffer, size_t length) {
+    if (!activeVolume->journal.active && !activeVolume->journal.uncommitted) {
+        return writeUnjournaled(offset, buffer, length);
+    }
+    if (length == 0) {
+        return 0;
+    }
+    if (length > UINT32_MAX) {
+        return -1;
+    }
+
+    // Without memory for the copy the write goes to the image at once, unprotected but not lost
+    if (activeVolume->journal.dataLength + length > activeVolume->journal.dataCapacity) {
+        uint64_t capacity = activeVolume->journal.dataCapacity ? activeVolume->journal.dataCapacity : 65536;
+        while (capacity < activeVolume->journal.dataLength + length) {
+            capacity *= 2;
+        }
+        uint8_t *grown = realloc(activeVolume->journal.data, capacity);
+        if (!grown) {
+            return writeUnjournaled(offset, buffer, length);
+        }
+        activeVolume->journal.data = grown;
+        activeVolume->journal.dataCapacity = capacity;
+    }
+    memcpy(activeVolume->journal.data + activeVolume->journal.dataLength, buffer, length);
+    activeVolume->journal.dataLength += length;
+
+    // A write that carries on where the previous one stopped just extends its block
+    struct JournalBlock *last = activeVolume->journal.blockCount ? &activeVolume->journal.blocks[activeVolume->journal.blockCount - 1] : NULL;
+    if (last && last->offset + last->length == offset && (uint64_t)last->length + length <= UINT32_MAX) {
+        last->length += length;
+        return 0;
+    }
+
+    if (activeVolume->journal.blockCount == activeVolume->journal.blockCapacity) {
+        uint32_t capacity = activeVolume->journal.blockCapacity ? activeVolume->journal.blockCapacity * 2 : 64;
+        struct JournalBlock *grown = realloc(activeVolume->journal.blocks, capacity * sizeof(struct JournalBlock));
+        if (!grown) {
+            activeVolume->journal.dataLength -= length;
+            return writeUnjournaled(offset, buffer, length);
+        }
+        activeVolume->journal.blocks = grown;
+        activeVolume->journal.blockCapacity = capacity;
+    }
+    activeVolume->journal.blocks[activeVolume->journal.blockCount].offset = offset;
+    activeVolume->journal.blocks[activeVolume->journal.blockCount].length = length;
+    activeVolume->journal.blocks[activeVolume->journal.blockCount].reserved = 0;
+    activeVolume->journal.blockCount++;
+    return 0;
+}
+
+// Function to write a batch of runs through the journal (see journalWrite). Returns 0 on success.
+int journalWriteBatch(const struct ImageRequest *requests, int count) {
+    if (!activeVolume->journal.active && !activeVolume->journal.uncommitted) {
+        // Replay must not overwrite these runs either (see writeUnjournaled)
+        for (int i = 0; i < count && activeVolume->journal.size > 0; i++) {
+            uint64_t length = 0;
+            for (int j = 0; j < requests[i].count; j++) {
+                length += requests[i].iov[j].iov_len;
+            }
+            if (isJournaled(requests[i].offset, length) && checkpointJournal() != 0) {
+                return -1;
+            }
+        }
+        return writeImageBatch(requests, count);
+    }
+
+    int result = 0;
+    for (int i = 0; i < count; i++) {
+        uint64_t offset = requests[i].offset;
+        for (int j = 0; j < requests[i].count; j++) {
+            if (journalWrite(offset, requests[i].iov[j].iov_base, requests[i].iov[j].iov_len) != 0) {
+                result = -1;
+            }
+            offset += requests[i].iov[j].iov_len;
+        }
+    }
+    return result;
+}
+
+// Function to sync the image and empty the journal, once everything it protects is safely in place
+int checkpointJournal() {
+    if (!activeVolume->journal.file || activeVolume->journal.size == 0) {
+        return 0;
+    }
+
+    if (syncImageData() != 0) {
+        return -1;
+    }
+    if (ftruncate(activeVolume->journal.fd, 0) != 0 || fdatasync(activeVolume->journal.fd) != 0) {
+        return -1;
+    }
+    activeVolume->journal.size = 0;
+    memset(activeVolume->journal.journaled, 0, (size_t)activeVolume->journal.journaledWords * sizeof(uint64_t));
+    return 0;
+}
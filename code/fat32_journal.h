@@ -0,0 +1,73 @@
+#ifndef FAT32_JOURNAL_H
+#define FAT32_JOURNAL_H
+
+#include "fat32_io.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Markers at the start and end of every transaction in the journal
+#define JOURNAL_HEADER_MAGIC 0x4E52524A   // "JRRN"
+#define JOURNAL_COMMIT_MAGIC 0x54494D43   // "CMIT"
+
+// Size the journal may grow to before the image is synced and the journal emptied
+#define JOURNAL_CHECKPOINT_BYTES (16u << 20)
+
+#pragma pack(push, 1)
+// Start of a transaction: the block descriptors and their data follow it
+struct JournalHeader {
+    uint32_t magic;
+    uint32_t blockCount;
+    uint64_t sequence;
+    uint64_t dataLength;      // Bytes of block data after the descriptors
+};
+
+// One run of the image written by a transaction (its data follows the descriptors, in order)
+struct JournalBlock {
+    uint64_t offset;
+    uint32_t length;
+    uint32_t reserved;
+};
+
+// End of a transaction; only transactions with a matching commit record are replayed
+struct JournalCommit {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t sequence;
+    uint64_t checksum;        // FNV-1a over the header, the descriptors and the data
+};
+#pragma pack(pop)
+
+// Write-ahead journal of the metadata written back to the image, kept in a file next to it
+struct Journal {
+    char *path;               // Path of the journal file ("<image>.journal")
+    FILE *file;               // Journal file while journaling is on (NULL when it is off)
+    int fd;                   // Descriptor underlying the stream
+    uint64_t size;            // Bytes of committed transactions in the journal file
+    uint64_t sequence;        // Sequence number of the next transaction
+    bool active;              // Whether writes are being collected into a transaction
+    struct JournalBlock *blocks;   // Runs written by the open transaction
+    uint32_t blockCount;
+    uint32_t blockCapacity;
+    uint8_t *data;            // Copies of their contents, back to back
+    uint64_t dataLength;
+    uint64_t dataCapacity;
+    bool uncommitted;         // Whether the last transaction could not be committed (it is retried with the next one)
+    uint64_t *journaled;      // One bit per cluster written by a transaction still in the journal file
+    uint32_t journaledWords;
+    uint32_t replayed;        // Transactions replayed when the volume was mounted
+    uint64_t commits;         // Transactions committed since the volume was mounted
+};
+
+// Journal functions
+int initJournal(const char *imagePath);
+void freeJournal();
+int startJournal();
+int stopJournal();
+void beginJournalTransaction();
+int commitJournalTransaction();
+int journalWrite(uint64_t offset, const void *buffer, size_t length);
+int journalWriteBatch(const struct ImageRequest *requests, int count);
+int checkpointJournal();
+
+#endif
@@ -0,0 +1,251 @@
+#include "fat32_structs.h"
+#include "fat32_mkfs.h"
+#include "fat32_alloc.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <time.h>
+
+// Size of the zero buffer used when the FATs are written out in full
+#define MKFS_ZERO_CHUNK (1 << 20)
+
+// Smallest and largest number of clusters a FAT32 volume may have
+#define FAT32_MIN_CLUSTERS 65525
+#define FAT32_MAX_CLUSTERS 0x0FFFFFF5
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Mkfs helper functions
+
+// Function to pick a cluster size from the volume size (the same steps the usual FAT32 formatters use)
+static uint8_t pickSectorsPerCluster(uint64_t sizeBytes, uint16_t bytesPerSector) {
+    uint32_t clusterBytes;
+
+    if (sizeBytes <= (260ull << 20)) clusterBytes = 512;
+    else if (sizeBytes <= (8ull << 30)) clusterBytes = 4096;
+    else if (sizeBytes <= (16ull << 30)) clusterBytes = 8192;
+    else if (sizeBytes <= (32ull << 30)) clusterBytes = 16384;
+    else clusterBytes = 32768;
+
+    return clusterBytes <= bytesPerSector ? 1 : clusterBytes / bytesPerSector;
+}
+
+// Function to write 'length' zero bytes at an offset with large sequential writes
+static int writeZeroes(FILE *image, uint64_t offset, uint64_t length) {
+    static uint8_t zeroes[MKFS_ZERO_CHUNK];
+
+    if (fseeko(image, (off_t)offset, SEEK_SET) != 0) {
+        return -1;
+    }
+    while (length > 0) {
+        size_t chunk = length < sizeof(zeroes) ? length : sizeof(zeroes);
+        if (fwrite(zeroes, 1, chunk, image) != chunk) {
+            return -1;
+        }
+        length -= chunk;
+    }
+    return 0;
+}
+
+// Function to write a buffer at an absolute offset in the image
+static int writeAt(FILE *image, uint64_t offset, const void *buffer, size_t length) {
+    if (fseeko(image, (off_t)offset, SEEK_SET) != 0 || fwrite(buffer, 1, length, image) != length) {
+        return -1;
+    }
+    return 0;
+}
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Mkfs implementations
+
+// Function to fill in the default settings (512-byte sectors, two FATs, cluster size picked from the size)
+void defaultMkfsOptions(struct MkfsOptions *options) {
+    memset(options, 0, sizeof(*options));
+    options->bytesPerSector = 512;
+    options->numFATs = 2;
+    options->reservedSectors = 32;
+    strcpy(options->volumeLabel, "NO NAME");
+}
+
+// Function to convert a size such as 512M, 64G or 2T (K, M, G and T are powers of 1024) into bytes
+int parseSize(const char *text, uint64_t *bytes) {
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+
+    if (end == text) {
+        return -1;
+    }
+
+    switch (toupper((unsigned char)*end)) {
+        case '\0': break;
+        case 'K': value <<= 10; end++; break;
+        case 'M': value <<= 20; end++; break;
+        case 'G': value <<= 30; end++; break;
+        case 'T': value <<= 40; end++; break;
+        default: return -1;
+    }
+
+    if (*end != '\0' && !(toupper((unsigned char)*end) == 'B' && end[1] == '\0')) {
+        return -1;
+    }
+    *bytes = value;
+    return 0;
+}
+
+// Function to write a new, empty FAT32 file system to an image file of the requested size.
+// Regular files are created sparse: only the boot sectors, FSInfo sectors and the first FAT entries are written,
+// so even a multi-terabyte image formats in a moment.
+int formatImage(const char *path, const struct MkfsOptions *options) {
+    uint32_t bytesPerSector = options->bytesPerSector;
+    uint32_t reservedSectors = options->reservedSectors;
+    uint32_t numFATs = options->numFATs;
+
+    // Check the geometry before touching the file
+    if (bytesPerSector != 512 && bytesPerSector != 1024 && bytesPerSector != 2048 && bytesPerSector != 4096) {
+        printf("Bytes per sector must be 512, 1024, 2048 or 4096.\n");
+        return -1;
+    }
+
+    uint32_t sectorsPerCluster = options->sectorsPerCluster ? options->sectorsPerCluster : pickSectorsPerCluster(options->sizeBytes, bytesPerSector);
+    if (sectorsPerCluster == 0 || sectorsPerCluster > 128 || (sectorsPerCluster & (sectorsPerCluster - 1)) != 0) {
+        printf("Sectors per cluster must be a power of two between 1 and 128.\n");
+        return -1;
+    }
+    if (numFATs < 1 || numFATs > 4) {
+        printf("The number of FATs must be between 1 and 4.\n");
+        return -1;
+    }
+    if (reservedSectors < 8) {
+        printf("At least 8 reserved sectors are needed for the boot and FSInfo sectors and their backups.\n");
+        return -1;
+    }
+
+    uint64_t totalSectors = options->sizeBytes / bytesPerSector;
+    if (totalSectors > 0xFFFFFFFFull) {
+        printf("An image of %llu bytes has more sectors than FAT32 can address; use larger sectors.\n",
+               (unsigned long long)options->sizeBytes);
+        return -1;
+    }
+
+    // The FAT has to cover every data cluster, and the data region shrinks as the FAT grows
+    uint64_t fatSectors = 1;
+    uint64_t clusterCount = 0;
+    for (;;) {
+        if (reservedSectors + numFATs * fatSectors + sectorsPerCluster > totalSectors) {
+            printf("The image is too small to hold a FAT32 file system.\n");
+            return -1;
+        }
+        clusterCount = (totalSectors - reservedSectors - numFATs * fatSectors) / sectorsPerCluster;
+        uint64_t needed = ((clusterCount + 2) * 4 + bytesPerSector - 1) / bytesPerSector;
+        if (needed <= fatSectors) break;
+        fatSectors = needed;
+    }
+
+    if (clusterCount > FAT32_MAX_CLUSTERS) {
+        printf("%llu clusters is more than FAT32 allows; use larger clusters.\n", (unsigned long long)clusterCount);
+        return -1;
+    }
+    if (clusterCount < FAT32_MIN_CLUSTERS) {
+        printf("Warning: %llu clusters is below the FAT32 minimum of %u; other systems may not accept this image.\n",
+               (unsigned long long)clusterCount, FAT32_MIN_CLUSTERS);
+    }
+
+    // Boot sector
+    uint8_t *sector = calloc(1, bytesPerSector);
+    if (!sector) {
+        printf("Unable to allocate memory for the boot sector.\n");
+        return -1;
+    }
+
+    struct FAT32BootSector *bs = (struct FAT32BootSector *)sector;
+    memcpy(bs->jmpBoot, "\xEB\x58\x90", 3);
+    memcpy(bs->OEMName, "MSWIN4.1", 8);
+    bs->bytesPerSector = bytesPerSector;
+    bs->sectorsPerCluster = sectorsPerCluster;
+    bs->reservedSectorCount = reservedSectors;
+    bs->numFATs = numFATs;
+    bs->media = 0xF8;
+    bs->sectorsPerTrack = 63;
+    bs->numHeads = 255;
+    bs->totalSectors32 = (uint32_t)totalSectors;
+    bs->FATSize32 = (uint32_t)fatSectors;
+    bs->extFlags = 0;            // Every FAT is kept up to date (mirroring on)
+    bs->rootCluster = 2;
+    bs->FSInfo = 1;
+    bs->backupBootSect = 6;
+    bs->driveNumber = 0x80;
+    bs->bootSignature = 0x29;
+    bs->volumeID = (uint32_t)time(NULL);
+    memset(bs->volumeLabel, ' ', 11);
+    for (size_t i = 0; i < 11 && options->volumeLabel[i] != '\0'; i++) {
+        bs->volumeLabel[i] = toupper((unsigned char)options->volumeLabel[i]);
+    }
+    memcpy(bs->fileSystemType, "FAT32   ", 8);
+    sector[510] = 0x55;
+    sector[511] = 0xAA;
+
+    // FSInfo sector (the root directory already holds cluster 2, so the search starts at 3)
+    struct FAT32FSInfo fsInfo;
+    memset(&fsInfo, 0, sizeof(fsInfo));
+    fsInfo.leadSignature = FSINFO_LEAD_SIGNATURE;
+    fsInfo.structSignature = FSINFO_STRUCT_SIGNATURE;
+    fsInfo.freeCount = (uint32_t)clusterCount - 1;
+    fsInfo.nextFree = 3;
+    fsInfo.trailSignature = FSINFO_TRAIL_SIGNATURE;
+
+    // A regular file is truncated here, so everything that is not written below reads back as zero
+    FILE *image = fopen(path, "w+");
+    if (!image) {
+        printf("Unable to create the image '%s'.\n", path);
+        free(sector);
+        return -1;
+    }
+
+    uint64_t fatBytes = fatSectors * bytesPerSector;
+    uint64_t firstDataByte = (reservedSectors + numFATs * fatSectors) * (uint64_t)bytesPerSector;
+    uint32_t fatHead[3] = { 0x0FFFFF00 | bs->media, 0x0FFFFFFF, 0x0FFFFFFF };
+    int result = 0;
+
+    // Boot sector and FSInfo, then their backups at sectors 6 and 7
+    result |= writeAt(image, 0, sector, bytesPerSector);
+    result |= writeAt(image, (uint64_t)bytesPerSector, &fsInfo, sizeof(fsInfo));
+    result |= writeAt(image, 6ull * bytesPerSector, sector, bytesPerSector);
+    result |= writeAt(image, 7ull * bytesPerSector, &fsInfo, sizeof(fsInfo));
+
+    // Each FAT holds the two reserved entries and the end of the root directory's chain; the rest stays a hole
+    for (uint32_t i = 0; i < numFATs && result == 0; i++) {
+        uint64_t fatStart = (reservedSectors + i * fatSectors) * (uint64_t)bytesPerSector;
+        if (options->zeroFill) {
+            result |= writeZeroes(image, fatStart, fatBytes);
+        }
+        result |= writeAt(image, fatStart, fatHead, sizeof(fatHead));
+    }
+
+    // The root directory must start out empty
+    if (options->zeroFill && result == 0) {
+        result |= writeZeroes(image, firstDataByte, (uint64_t)sectorsPerCluster * bytesPerSector);
+    }
+
+    // Extend the file to its full size without writing the data region
+    uint64_t imageBytes = totalSectors * bytesPerSector;
+    if (result == 0 && (fseeko(image, (off_t)(imageBytes - 1), SEEK_SET) != 0 || fputc(0, image) == EOF)) {
+        result = -1;
+    }
+
+    if (fclose(image) != 0) {
+        result = -1;
+    }
+    free(sector);
+
+    if (result != 0) {
+        printf("Error writing the file system to '%s'.\n", path);
+        return -1;
+    }
+
+    printf("Formatted '%s': %llu bytes, %u-byte sectors, %u-byte clusters, %llu clusters, %u FATs of %llu sectors.\n",
+           path, (unsigned long long)imageBytes, bytesPerSector, sectorsPerCluster * bytesPerSector,
+           (unsigned long long)clusterCount, numFATs, (unsigned long long)fatSectors);
+    return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef FAT32_MKFS_H
+#define FAT32_MKFS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Geometry and settings for a new file system
+struct MkfsOptions {
+    uint64_t sizeBytes;          // Total size of the image
+    uint16_t bytesPerSector;     // 512, 1024, 2048 or 4096
+    uint8_t sectorsPerCluster;   // Power of two up to 128 (0 picks one from the size)
+    uint8_t numFATs;             // Number of FAT copies
+    uint16_t reservedSectors;    // Sectors before the first FAT (boot sector, FSInfo and their backups)
+    char volumeLabel[12];
+    bool zeroFill;               // Write zeroes over the FATs and root directory instead of leaving sparse holes
+};
+
+// Mkfs functions
+void defaultMkfsOptions(struct MkfsOptions *options);
+int parseSize(const char *text, uint64_t *bytes);
+int formatImage(const char *path, const struct MkfsOptions *options);
+
+#endif
@@ -0,0 +1,105 @@
+#include "fat32_structs.h"
+#include "fat32_mount.h"
+#include "fat32_utils.h"
+#include "fat32_fatcache.h"
+#include "fat32_alloc.h"
+#include "fat32_extent.h"
+#include "fat32_io.h"
+#include "fat32_bufcache.h"
+#include "fat32_dirindex.h"
+#include "fat32_path.h"
+#include "fat32_filetable.h"
+#include "fat32_journal.h"
+#include "globals.h"
+#include <stdio.h>
+#include <string.h>
+
+// ------------------------------------------------------------------------------------------------ //
+
+// The volume the file system functions of this thread are working on
+__thread struct FAT32Volume *activeVolume;
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Mount implementations
+
+// Function to make a volume the one the file system functions work on
+void selectVolume(struct FAT32Volume *volume) {
+    activeVolume = volume;
+}
+
+// Function to open an image and load everything needed to work on it into a zeroed volume, starting in the root
+// directory. The volume is left selected.
+int mountImage(struct FAT32Volume *volume, const char *path, enum ImageBackend backend, uint32_t cacheCapacity) {
+    selectVolume(volume);
+
+    // Open the fat32 image file with the chosen backend (mmap falls back to stdio if the image cannot be mapped)
+    if (openImage(path, backend) != 0) {
+        return FAT32_ERR_NOT_FOUND;
+    }
+
+    // Replay whatever a crash left in the journal before anything is read from the image
+    if (initJournal(path) != 0) {
+        freeJournal();
+        closeImage();
+        return FAT32_ERR_IO;
+    }
+
+    // Load the boot sector into the volume
+    if (readImage(0, &activeVolume->bootSector, sizeof(struct FAT32BootSector)) != sizeof(struct FAT32BootSector)) {
+        freeJournal();
+        closeImage();
+        return FAT32_ERR_IO;
+    }
+
+    // Load the FAT into memory so cluster chains can be walked without touching the image
+    if (loadFATCache() != 0) {
+        freeJournal();
+        closeImage();
+        return FAT32_ERR_IO;
+    }
+
+    // Build the free-cluster bitmap used for allocation
+    if (initAllocator() != 0) {
+        freeFATCache();
+        freeJournal();
+        closeImage();
+        return FAT32_ERR_NO_MEMORY;
+    }
+
+    // Set up the cluster cache that directory and file data is read and written through
+    if (initBufferCache(cacheCapacity) != 0) {
+        freeAllocator();
+        freeFATCache();
+        freeJournal();
+        closeImage();
+        return FAT32_ERR_NO_MEMORY;
+    }
+
+    activeVolume->currentDirCluster = activeVolume->bootSector.rootCluster;
+    strcpy(activeVolume->currentPath, "/");
+    return FAT32_OK;
+}
+
+// Function to write back every pending change of a volume, close all of its open files and release the image
+int unmountImage(struct FAT32Volume *volume) {
+    selectVolume(volume);
+
+    // Write back any dirty clusters, FAT sectors and the FSInfo sector, then close the file
+    int result = checkpointImage() == 0 ? FAT32_OK : FAT32_ERR_IO;
+
+    // With everything in place the journal is no longer needed
+    if (stopJournal() != 0) {
+        result = FAT32_ERR_IO;
+    }
+
+    freeOpenFileTable();
+    memset(&activeVolume->dentryCache, 0, sizeof(activeVolume->dentryCache));
+    freeDirIndexCache();
+    freeBufferCache();
+    freeAllocator();
+    freeFATCache();
+    freeJournal();
+    closeImage();
+    return result;
+}
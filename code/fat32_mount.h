@@ -0,0 +1,39 @@
+#ifndef FAT32_MOUNT_H
+#define FAT32_MOUNT_H
+
+#include "fat32_structs.h"
+#include "fat32_api.h"
+#include "fat32_io.h"
+#include "fat32_utils.h"
+#include "fat32_fatcache.h"
+#include "fat32_alloc.h"
+#include "fat32_bufcache.h"
+#include "fat32_dirindex.h"
+#include "fat32_path.h"
+#include "fat32_filetable.h"
+#include "fat32_journal.h"
+#include <stdint.h>
+
+// Everything known about one mounted image. The file system functions work on the active volume
+// (see globals.h), so several volumes can be mounted at once and switched between.
+struct FAT32Volume {
+    struct ImageIO imageIO;
+    struct FAT32BootSector bootSector;
+    uint32_t currentDirCluster;
+    char currentPath[256];
+    struct OpenFileTable openFileTable;
+    struct FATCache fatCache;
+    struct ClusterAllocator allocator;
+    struct BufferCache bufferCache;
+    struct DirIndexCache dirIndexCache;
+    struct DentryCache dentryCache;
+    struct FlushPolicy flushPolicy;
+    struct Journal journal;
+};
+
+// Mount functions
+void selectVolume(struct FAT32Volume *volume);
+int mountImage(struct FAT32Volume *volume, const char *path, enum ImageBackend backend, uint32_t cacheCapacity);
+int unmountImage(struct FAT32Volume *volume);
+
+#endif
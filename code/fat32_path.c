@@ -0,0 +1,226 @@
+#include "fat32_structs.h"
+#include "fat32_path.h"
+#include "fat32_dirindex.h"
+#include "fat32_utils.h"
+#include "globals.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Dentry cache helper functions
+
+// Function to pick the cache slot for a (parent, name) pair (FNV-1a over both)
+static struct Dentry *dentrySlot(uint32_t parentCluster, const char *fat32Name) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 4; i++) {
+        hash = (hash ^ ((parentCluster >> (i * 8)) & 0xFF)) * 16777619u;
+    }
+    for (int i = 0; i < 11; i++) {
+        hash = (hash ^ (uint8_t)fat32Name[i]) * 16777619u;
+    }
+    return &activeVolume->dentryCache.entries[hash & (DENTRY_CACHE_SIZE - 1)];
+}
+
+// Function to order directory clusters for bsearch
+static int compareDirClusters(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Function to copy the next component of a path into 'component', returning a pointer past it (NULL at the end)
+static const char *nextComponent(const char *path, char *component, size_t size) {
+    while (*path == '/') {
+        path++;
+    }
+    if (*path == '\0') {
+        return NULL;
+    }
+
+    size_t length = strcspn(path, "/");
+    if (length >= size) {
+        length = size - 1;
+    }
+    memcpy(component, path, length);
+    component[length] = '\0';
+    return path + strcspn(path, "/");
+}
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Dentry cache and path resolution implementations
+
+// Function to forget the cached component for a name that was removed from a directory
+void invalidateDentry(uint32_t parentCluster, const char *fat32Name) {
+    struct Dentry *dentry = dentrySlot(parentCluster, fat32Name);
+    if (dentry->parentCluster == parentCluster && memcmp(dentry->name, fat32Name, 11) == 0) {
+        dentry->parentCluster = 0;
+    }
+}
+
+// Function to forget every cached component inside or pointing at a directory whose clusters were freed
+void dropDentriesUnder(uint32_t dirCluster) {
+    for (int i = 0; i < DENTRY_CACHE_SIZE; i++) {
+        if (activeVolume->dentryCache.entries[i].parentCluster == dirCluster || activeVolume->dentryCache.entries[i].cluster == dirCluster) {
+            activeVolume->dentryCache.entries[i].parentCluster = 0;
+        }
+    }
+}
+
+// Function to forget every cached component inside or pointing at any of a sorted list of freed directories, with
+// a single pass over the cache
+void dropDentriesUnderAll(const uint32_t *sortedDirClusters, uint32_t count) {
+    for (int i = 0; i < DENTRY_CACHE_SIZE; i++) {
+        struct Dentry *dentry = &activeVolume->dentryCache.entries[i];
+        if (dentry->parentCluster == 0) {
+            continue;
+        }
+        if (bsearch(&dentry->parentCluster, sortedDirClusters, count, sizeof(uint32_t), compareDirClusters) ||
+            bsearch(&dentry->cluster, sortedDirClusters, count, sizeof(uint32_t), compareDirClusters)) {
+            dentry->parentCluster = 0;
+        }
+    }
+}
+
+// Function to find the first cluster of the directory a single path component names (".", ".." or a name)
+// under a parent directory. Returns 0xFFFFFFFF if it does not exist or is not a directory.
+uint32_t lookupChildDirectory(uint32_t parentCluster, const char *component) {
+    char fat32Name[12];
+
+    if (strcmp(component, ".") == 0) {
+        return parentCluster;
+    }
+    if (strcmp(component, "..") == 0) {
+        // In FAT32, root's parent is considered as root itself
+        if (parentCluster == activeVolume->bootSector.rootCluster) {
+            return activeVolume->bootSector.rootCluster;
+        }
+        memcpy(fat32Name, "..         ", 12);
+    }
+    else {
+        toFAT32Name(component, fat32Name);
+    }
+
+    struct Dentry *dentry = dentrySlot(parentCluster, fat32Name);
+    if (dentry->parentCluster == parentCluster && memcmp(dentry->name, fat32Name, 11) == 0) {
+        activeVolume->dentryCache.hits++;
+        return dentry->cluster;
+    }
+    activeVolume->dentryCache.misses++;
+
+    const struct DirIndexEntry *indexed = lookupDirIndex(parentCluster, fat32Name);
+    if (!indexed || !(indexed->attributes & ATTR_DIRECTORY)) {
+        return 0xFFFFFFFF;
+    }
+
+    // A ".." entry pointing at cluster 0 means the parent is the root directory
+    uint32_t cluster = indexed->firstCluster;
+    if (cluster == 0) {
+        cluster = activeVolume->bootSector.rootCluster;
+    }
+
+    dentry->parentCluster = parentCluster;
+    memcpy(dentry->name, fat32Name, 11);
+    dentry->attributes = indexed->attributes;
+    dentry->cluster = cluster;
+    return cluster;
+}
+
+// Function to resolve an absolute or relative path to the first cluster of the directory it names.
+// Returns 0xFFFFFFFF if any component does not exist or is not a directory.
+uint32_t resolveDirectory(uint32_t startCluster, const char *path) {
+    uint32_t cluster = (path[0] == '/') ? activeVolume->bootSector.rootCluster : startCluster;
+    char component[256];
+
+    while ((path = nextComponent(path, component, sizeof(component))) != NULL) {
+        cluster = lookupChildDirectory(cluster, component);
+        if (cluster == 0xFFFFFFFF) {
+            return 0xFFFFFFFF;
+        }
+    }
+    return cluster;
+}
+
+// Function to split a path into the directory holding its last component and the last component itself.
+// Returns -1 if a directory along the way does not exist or the path does not end in a name.
+int resolveParent(uint32_t startCluster, const char *path, uint32_t *parentCluster, char *leaf, size_t leafSize) {
+    char directory[256];
+
+    // Ignore trailing slashes, then split at the last remaining one
+    size_t length = strlen(path);
+    while (length > 1 && path[length - 1] == '/') {
+        length--;
+    }
+
+    const char *lastSlash = NULL;
+    for (size_t i = 0; i < length; i++) {
+        if (path[i] == '/') lastSlash = path + i;
+    }
+
+    const char *name = lastSlash ? lastSlash + 1 : path;
+    size_t nameLength = length - (name - path);
+    if (nameLength == 0 || nameLength >= leafSize) {
+        return -1;
+    }
+    memcpy(leaf, name, nameLength);
+    leaf[nameLength] = '\0';
+    if (strcmp(leaf, ".") == 0 || strcmp(leaf, "..") == 0) {
+        return -1;
+    }
+
+    // A name without any slash lives in the starting directory
+    if (!lastSlash) {
+        *parentCluster = startCluster;
+        return 0;
+    }
+
+    size_t directoryLength = lastSlash - path;
+    if (directoryLength >= sizeof(directory)) {
+        return -1;
+    }
+    memcpy(directory, path, directoryLength);
+    directory[directoryLength] = '\0';
+
+    // "/name" lives in the root directory
+    *parentCluster = (directoryLength == 0) ? activeVolume->bootSector.rootCluster : resolveDirectory(startCluster, directory);
+    return (*parentCluster == 0xFFFFFFFF) ? -1 : 0;
+}
+
+// Function to combine a base path with an absolute or relative path, folding away "." and ".." components
+void joinPath(const char *base, const char *path, char *out, size_t outSize) {
+    char result[512] = "";
+    char component[256];
+
+    if (path[0] != '/') {
+        strncpy(result, base, sizeof(result) - 1);
+    }
+
+    while ((path = nextComponent(path, component, sizeof(component))) != NULL) {
+        if (strcmp(component, ".") == 0) {
+            continue;
+        }
+
+        // Step back to the parent, never above the root
+        if (strcmp(component, "..") == 0) {
+            char *lastSlash = strrchr(result, '/');
+            if (lastSlash) *lastSlash = '\0';
+            continue;
+        }
+
+        // Stop growing the path once it no longer fits
+        if (strlen(result) + strlen(component) + 2 > sizeof(result)) {
+            break;
+        }
+        if (strcmp(result, "/") == 0) result[0] = '\0';
+        strcat(result, "/");
+        strcat(result, component);
+    }
+
+    if (result[0] == '\0') {
+        strcpy(result, "/");
+    }
+
+    strncpy(out, result, outSize - 1);
+    out[outSize - 1] = '\0';
+}
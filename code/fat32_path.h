@@ -0,0 +1,34 @@
+#ifndef FAT32_PATH_H
+#define FAT32_PATH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Number of (parent, name) pairs the dentry cache can hold (must be a power of two)
+#define DENTRY_CACHE_SIZE 4096
+
+// One cached path component: a directory found under a parent directory
+struct Dentry {
+    uint32_t parentCluster;   // First cluster of the directory the name was found in (0 when unused)
+    char name[11];            // Short name of the component
+    uint8_t attributes;
+    uint32_t cluster;         // First cluster of the directory the name refers to
+};
+
+// Direct-mapped cache of resolved directory components, so hot paths resolve without any directory lookups
+struct DentryCache {
+    struct Dentry entries[DENTRY_CACHE_SIZE];
+    uint64_t hits;
+    uint64_t misses;
+};
+
+// Dentry cache and path resolution functions
+void invalidateDentry(uint32_t parentCluster, const char *fat32Name);
+void dropDentriesUnder(uint32_t dirCluster);
+void dropDentriesUnderAll(const uint32_t *sortedDirClusters, uint32_t count);
+uint32_t lookupChildDirectory(uint32_t parentCluster, const char *component);
+uint32_t resolveDirectory(uint32_t startCluster, const char *path);
+int resolveParent(uint32_t startCluster, const char *path, uint32_t *parentCluster, char *leaf, size_t leafSize);
+void joinPath(const char *base, const char *path, char *out, size_t outSize);
+
+#endif
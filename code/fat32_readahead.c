@@ -0,0 +1,85 @@
+#include "fat32_structs.h"
+#include "fat32_readahead.h"
+#include "fat32_extent.h"
+#include "fat32_bufcache.h"
+#include "globals.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Read-ahead implementations
+
+// Function to bring the logical clusters [first, end) of a file into the cache. The clusters of every run are
+// gathered into one list so the whole range, however fragmented, is read as a single batch.
+// Returns the first logical cluster that could not be loaded (end when everything was).
+uint32_t loadFileClusters(struct OpenFile *file, uint32_t first, uint32_t end) {
+    if (first >= end) {
+        return first;
+    }
+
+    // The cache takes at most half of its capacity in one batch, so there is no point in listing more
+    uint32_t count = min(end - first, activeVolume->bufferCache.capacity / 2 ? activeVolume->bufferCache.capacity / 2 : 1);
+    uint32_t *clusters = malloc(count * sizeof(uint32_t));
+    if (!clusters) {
+        return first;
+    }
+
+    uint32_t listed = 0;
+    while (listed < count) {
+        uint32_t runRemaining;
+        uint32_t cluster = lookupCluster(file, first + listed, &runRemaining);
+        if (cluster == 0xFFFFFFFF) {
+            break;
+        }
+        for (uint32_t i = 0; i < runRemaining && listed < count; i++) {
+            clusters[listed++] = cluster + i;
+        }
+    }
+
+    int loaded = listed ? loadClusters(clusters, listed) : 0;
+    free(clusters);
+    return first + (loaded > 0 ? loaded : 0);
+}
+
+// Function to follow the reads of an open file and keep a sequential reader ahead of itself. A read that starts
+// where the last one stopped continues a stream: once fewer than half a window of clusters are left cached ahead
+// of it, the window doubles and the next window of clusters is loaded into the cache, so the reads that follow are
+// served from memory. Any other read ends the stream.
+void readAhead(struct OpenFile *file, uint32_t readStart, uint32_t readEnd) {
+    uint32_t clusterSize = activeVolume->bootSector.sectorsPerCluster * activeVolume->bootSector.bytesPerSector;
+    bool sequential = readStart == file->lastReadEnd;
+
+    // Reads of a mapped image do not go through the cache, so there is nothing to load ahead into it
+    if (isImageMapped()) {
+        return;
+    }
+
+    file->lastReadEnd = readEnd;
+    if (!sequential || readEnd == readStart) {
+        file->readAheadWindow = 0;
+        file->readAheadNext = 0;
+        return;
+    }
+
+    // Never read ahead past the data of the file, or far enough to push a quarter of the cache out
+    uint32_t fileClusters = (uint32_t)(((uint64_t)file->fileSize + clusterSize - 1) / clusterSize);
+    uint32_t maxWindow = min(READ_AHEAD_MAX_CLUSTERS, activeVolume->bufferCache.capacity / 4);
+    if (maxWindow == 0) {
+        return;
+    }
+
+    uint32_t nextCluster = (readEnd - 1) / clusterSize + 1;
+    if (file->readAheadNext < nextCluster) {
+        file->readAheadNext = nextCluster;
+    }
+    if (file->readAheadNext - nextCluster > file->readAheadWindow / 2 || file->readAheadNext >= fileClusters) {
+        return;
+    }
+
+    file->readAheadWindow = file->readAheadWindow ? min(file->readAheadWindow * 2, maxWindow) : min(READ_AHEAD_MIN_CLUSTERS, maxWindow);
+    uint32_t end = min(nextCluster + file->readAheadWindow, fileClusters);
+    file->readAheadNext = loadFileClusters(file, file->readAheadNext, end);
+}
@@ -0,0 +1,15 @@
+#ifndef FAT32_READAHEAD_H
+#define FAT32_READAHEAD_H
+
+#include "fat32_structs.h"
+#include <stdint.h>
+
+// Window a detected stream starts with, and the most clusters ever read ahead of one reader
+#define READ_AHEAD_MIN_CLUSTERS 4
+#define READ_AHEAD_MAX_CLUSTERS 256
+
+// Read-ahead functions
+uint32_t loadFileClusters(struct OpenFile *file, uint32_t first, uint32_t end);
+void readAhead(struct OpenFile *file, uint32_t readStart, uint32_t readEnd);
+
+#endif
@@ -0,0 +1,472 @@
+#include "fat32_shell.h"
+#include "fat32_api.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define ATTR_DIRECTORY   0x10
+#define ATTR_ARCHIVE     0x20
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Helper function implementations
+
+// Function to convert a char* to a uni32_t (used for lseek function when taking in input)
+uint32_t convertToUint32(const char *str) {
+    char *endptr;
+    uint32_t value = (uint32_t)strtoul(str, &endptr, 10);
+
+    if (*endptr != '\0') {
+        printf("Conversion error, non-numeric data found: %s\n", endptr);
+        return 0;
+    }
+
+    return value;
+}
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Function implementations for the shell
+
+// Function to print the info of the boot sector
+void shellInfo(struct FAT32Volume *volume) {
+    struct FAT32VolumeInfo info;
+    fat32GetVolumeInfo(volume, &info);
+
+    printf("Bytes Per Sector: %d\n", info.bytesPerSector);
+    printf("Sectors Per Cluster: %d\n", info.sectorsPerCluster);
+    printf("Root Cluster: %d\n", info.rootCluster);
+    printf("Total # of Clusters in Data Region: %d\n", info.dataClusters);
+    printf("# of Entries in One FAT: %d\n", info.fatEntries);
+    printf("Size of Image (in bytes): %llu\n", (unsigned long long)info.imageBytes);
+}
+
+// Function to list the directories and files in a directory (the current one when no path is given)
+void shellLs(struct FAT32Volume *volume, const char *dirName) {
+    struct FAT32DirCursor cursor;
+    struct FAT32DirInfo entry;
+
+    if (fat32OpenDir(volume, dirName, &cursor) != FAT32_OK) {
+        printf("Directory %s does not exist.\n", dirName ? dirName : ".");
+        return;
+    }
+
+    // Print the name if it is a directory or a file only
+    while (fat32ReadDir(volume, &cursor, &entry) > 0) {
+        if (entry.attributes == ATTR_DIRECTORY || entry.attributes == ATTR_ARCHIVE) {
+            printf("%s\n", entry.name);
+        }
+    }
+}
+
+// Function to change the current directory to an absolute or relative directory path
+int shellCd(struct FAT32Volume *volume, const char *dirName) {
+    if (fat32Chdir(volume, dirName) != FAT32_OK) {
+        printf("Directory %s does not exist.\n", dirName);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to creat a new file with the given path (relative to the current directory unless it starts with /)
+void shellCreat(struct FAT32Volume *volume, const char *filename) {
+    int result = fat32Creat(volume, filename);
+
+    if (result == FAT32_ERR_NOT_FOUND) {
+        printf("Unable to find the directory to create %s in.\n", filename);
+    }
+    else if (result == FAT32_ERR_EXISTS) {
+        fprintf(stderr, "A file or directory named %s already exists.\n", filename);
+    }
+    else if (result == FAT32_ERR_NO_SPACE) {
+        printf("No free cluster available.\n");
+    }
+    else if (result != FAT32_OK) {
+        printf("Unable to read the directory to create %s.\n", filename);
+    }
+    else {
+        printf("File %s created successfully.\n", filename);
+    }
+}
+
+// Function to create a new directory with the given path (relative to the current directory unless it starts with /)
+void shellMkdir(struct FAT32Volume *volume, const char *dirName) {
+    int result = fat32Mkdir(volume, dirName);
+
+    if (result == FAT32_ERR_NOT_FOUND) {
+        printf("Unable to find the directory to create %s in.\n", dirName);
+    }
+    else if (result == FAT32_ERR_EXISTS) {
+        fprintf(stderr, "A file or directory named %s already exists.\n", dirName);
+    }
+    else if (result == FAT32_ERR_NO_SPACE) {
+        printf("No free cluster available.\n");
+    }
+    else if (result != FAT32_OK) {
+        printf("Unable to read the directory to create %s.\n", dirName);
+    }
+    else {
+        printf("Directory %s created successfully.\n", dirName);
+    }
+}
+
+// Function to open a file from a path relative to the current directory or the root (reads in the mode to open the file)
+int shellOpen(struct FAT32Volume *volume, char *filename, char *mode) {
+    // Modes are given as -r, -w, -rw or -wr
+    int result = (mode[0] == '-') ? fat32Open(volume, filename, mode + 1) : FAT32_ERR_INVALID;
+
+    if (result == FAT32_ERR_INVALID) {
+        printf("Invalid mode specified.\n");
+    }
+    else if (result == FAT32_ERR_NOT_FOUND || result == FAT32_ERR_IS_DIR) {
+        printf("File '%s' does not exist.\n", filename);
+    }
+    else if (result == FAT32_ERR_BUSY) {
+        printf("File '%s' is already open.\n", filename);
+    }
+    else if (result == FAT32_ERR_TOO_MANY_OPEN) {
+        printf("Max open files limit reached.\n");
+    }
+    else if (result == FAT32_ERR_NO_MEMORY) {
+        printf("Unable to allocate memory to open '%s'.\n", filename);
+    }
+    else if (result < 0) {
+        printf("Unable to read the directory entry of '%s'.\n", filename);
+    }
+    else {
+        printf("File '%s' opened in mode '%s'.\n", filename, mode);
+        return 0;
+    }
+    return -1;
+}
+
+// Function to find and close an open file by its name or path
+int shellClose(struct FAT32Volume *volume, char *filename) {
+    int handle = fat32FindOpen(volume, filename);
+
+    // If the file is not open, it was either never opened or does not exist
+    if (handle < 0) {
+        printf("File '%s' is not open or does not exist in the directory.\n", filename);
+        return -1;
+    }
+
+    if (fat32Close(volume, handle) != FAT32_OK) {
+        printf("Error writing the directory entry of '%s'.\n", filename);
+    }
+    printf("File '%s' closed successfully.\n", filename);
+    return 0;
+}
+
+// Function to list all opened files
+void shellLsof(struct FAT32Volume *volume) {
+    struct FAT32FileInfo info;
+    bool anyOpen = false;
+
+    // Header for the list
+    printf("%-10s %-12s %-10s %-10s %s\n", "Index", "Filename", "Mode", "Offset", "Path");
+
+    // Loop through the open file handles and print out the details
+    for (int i = fat32NextOpenFile(volume, -1); i >= 0; i = fat32NextOpenFile(volume, i)) {
+        if (fat32GetFileInfo(volume, i, &info) == FAT32_OK) {
+            anyOpen = true;
+
+            // Print details of each opened file
+            printf("%-10d %-12s %-10s %-10u %s\n", i, info.name, info.mode, info.offset, info.path);
+        }
+    }
+
+    // If none are open, print that
+    if (!anyOpen) {
+        printf("No files are currently opened.\n");
+    }
+}
+
+// Function to set the file offset for reading/writing
+int shellLseek(struct FAT32Volume *volume, char *filename, uint32_t offset) {
+    struct FAT32FileInfo info;
+    int handle = fat32FindOpen(volume, filename);
+
+    // Make sure the file is open
+    if (handle < 0 || fat32GetFileInfo(volume, handle, &info) != FAT32_OK) {
+        printf("File '%s' is not open or does not exist in the directory.\n", filename);
+        return -1;
+    }
+
+    // If the offset is too large, error
+    if (fat32Seek(volume, handle, offset) != FAT32_OK) {
+        printf("Offset %u is larger than the size of the file '%s' (%u bytes).\n", offset, filename, info.size);
+        return -1;
+    }
+
+    printf("Offset of file '%s' set to %u bytes.\n", filename, offset);
+    return 0;
+}
+
+// Function to read a certain amount of characters from a specified file
+int shellRead(struct FAT32Volume *volume, char *filename, uint32_t size) {
+    struct FAT32FileInfo info;
+    int handle = fat32FindOpen(volume, filename);
+
+    // Make sure the file we want to read is open
+    if (handle < 0 || fat32GetFileInfo(volume, handle, &info) != FAT32_OK) {
+        printf("File '%s' is not found or not open for read.\n", filename);
+        return -1;
+    }
+
+    // First check if the file has read access
+    if (strchr(info.mode, 'r') == NULL) {
+        printf("File '%s' is not opened for read.\n", filename);
+        return -1;
+    }
+
+    // If we cannot read any more
+    if (info.offset >= info.size) {
+        printf("Read position is beyond the end of the file.\n");
+        return -1;
+    }
+
+    // Create a buffer for the most that can be read
+    uint32_t readSize = min(size, info.size - info.offset);
+    uint8_t *buffer = malloc(readSize ? readSize : 1);
+    if (!buffer) {
+        printf("Unable to allocate memory for read buffer.\n");
+        return -1;
+    }
+
+    int64_t bytesRead = fat32Read(volume, handle, buffer, readSize);
+    if (bytesRead < 0) {
+        printf("Unable to read from '%s'.\n", filename);
+        free(buffer);
+        return -1;
+    }
+
+    // Output the read data within the range of the buffer
+    printf("%.*s", (int)bytesRead, buffer);
+    printf("\n");
+    free(buffer);
+    return 0;
+}
+
+// Function to write a string to a given file at the current offset
+int shellWrite(struct FAT32Volume *volume, char *filename, char *string) {
+    struct FAT32FileInfo info;
+    int handle = fat32FindOpen(volume, filename);
+
+    // Make sure the file is open and we can write to it
+    if (handle < 0 || fat32GetFileInfo(volume, handle, &info) != FAT32_OK) {
+        printf("File '%s' is not open.\n", filename);
+        return -1;
+    }
+
+    if (strchr(info.mode, 'w') == NULL) {
+        printf("File '%s' is not opened for writing.\n", filename);
+        return -1;
+    }
+
+    uint32_t writeSize = strlen(string);
+    if ((uint64_t)info.offset + writeSize > info.allocatedBytes) {
+        printf("Extending file size...\n");
+    }
+
+    int64_t result = fat32Write(volume, handle, string, writeSize);
+    if (result == FAT32_ERR_NO_SPACE) {
+        printf("Error: No free clusters available.\n");
+        printf("Unable to extend file size.\n");
+        return -1;
+    }
+    else if (result == FAT32_ERR_INVALID) {
+        printf("Writing to '%s' would make it larger than a FAT32 file can be.\n", filename);
+        return -1;
+    }
+    else if (result < 0) {
+        printf("Unable to write to '%s'.\n", filename);
+        return -1;
+    }
+
+    printf("%s written to '%s'.\n", string, filename);
+    return 0;
+}
+
+// Function to remove a file entry
+int shellRm(struct FAT32Volume *volume, const char *filename) {
+    int result = fat32Unlink(volume, filename);
+
+    if (result == FAT32_ERR_BUSY) {
+        printf("File '%s' is currently open and cannot be deleted.\n", filename);
+        return -3;
+    }
+    if (result == FAT32_ERR_IS_DIR) {
+        printf("'%s' is a directory, not a file.\n", filename);
+        return -2;
+    }
+    if (result != FAT32_OK) {
+        printf("File '%s' does not exist.\n", filename);
+        return -1;
+    }
+
+    printf("File '%s' successfully deleted.\n", filename);
+    return 0;
+}
+
+// Function to remove a directory entry
+int shellRmdir(struct FAT32Volume *volume, const char *dirname) {
+    int result = fat32Rmdir(volume, dirname);
+
+    if (result == FAT32_ERR_NOT_DIR) {
+        printf("'%s' is not a directory.\n", dirname);
+    }
+    else if (result == FAT32_ERR_NOT_EMPTY) {
+        printf("Directory '%s' is not empty.\n", dirname);
+    }
+    else if (result == FAT32_ERR_BUSY) {
+        printf("Directory '%s' is the current directory.\n", dirname);
+    }
+    else if (result != FAT32_OK) {
+        printf("Directory '%s' does not exist.\n", dirname);
+    }
+    else {
+        printf("Directory '%s' successfully removed.\n", dirname);
+        return 0;
+    }
+    return -1;
+}
+
+// Rm -r recursive function to remove a directory and its contents
+void shellRmr(struct FAT32Volume *volume, const char *dirname) {
+    int result = fat32RemoveTree(volume, dirname);
+
+    if (result == FAT32_ERR_NOT_DIR) {
+        printf("'%s' is not a directory.\n", dirname);
+    }
+    else if (result == FAT32_ERR_BUSY) {
+        printf("Directory '%s' is or holds the current directory or an open file.\n", dirname);
+    }
+    else if (result == FAT32_ERR_IO) {
+        printf("Unable to read the contents of directory '%s'.\n", dirname);
+    }
+    else if (result != FAT32_OK) {
+        printf("Directory '%s' does not exist.\n", dirname);
+    }
+    else {
+        printf("Directory '%s' removed successfully.\n", dirname);
+    }
+}
+
+// Function to copy a file from the host into a new file of the image
+int shellImport(struct FAT32Volume *volume, const char *hostPath, const char *filename) {
+    int64_t result = fat32Import(volume, hostPath, filename);
+
+    if (result == FAT32_ERR_HOST) {
+        printf("Unable to read host file '%s'.\n", hostPath);
+    }
+    else if (result == FAT32_ERR_EXISTS) {
+        printf("A file or directory named %s already exists.\n", filename);
+    }
+    else if (result == FAT32_ERR_INVALID) {
+        printf("Host file '%s' is larger than a FAT32 file can be.\n", hostPath);
+    }
+    else if (result == FAT32_ERR_NO_SPACE) {
+        printf("Error: No free clusters available.\n");
+    }
+    else if (result < 0) {
+        printf("Unable to import '%s' into '%s': %s.\n", hostPath, filename, fat32StrError((int)result));
+    }
+    else {
+        printf("Imported %lld bytes from '%s' into '%s'.\n", (long long)result, hostPath, filename);
+        return 0;
+    }
+    return -1;
+}
+
+// Function to copy a file of the image out to a file on the host
+int shellExport(struct FAT32Volume *volume, const char *filename, const char *hostPath) {
+    int64_t result = fat32Export(volume, filename, hostPath);
+
+    if (result == FAT32_ERR_HOST) {
+        printf("Unable to write host file '%s'.\n", hostPath);
+    }
+    else if (result == FAT32_ERR_NOT_FOUND || result == FAT32_ERR_IS_DIR) {
+        printf("File '%s' does not exist.\n", filename);
+    }
+    else if (result < 0) {
+        printf("Unable to export '%s' to '%s': %s.\n", filename, hostPath, fat32StrError((int)result));
+    }
+    else {
+        printf("Exported %lld bytes from '%s' to '%s'.\n", (long long)result, filename, hostPath);
+        return 0;
+    }
+    return -1;
+}
+
+// Function to print one fragmented chain of the frag report
+static void printFragmented(const struct FAT32FragInfo *info, void *context) {
+    if (info->extents > 1) {
+        printf("%-10u %-10u %s\n", info->extents, info->clusters, info->path);
+    }
+}
+
+// Function to report how fragmented the files and directories under a directory (the current one by default) are
+void shellFrag(struct FAT32Volume *volume, const char *dirName) {
+    struct FAT32FragSummary summary;
+
+    printf("%-10s %-10s %s\n", "Extents", "Clusters", "Path");
+    if (fat32FragReport(volume, dirName, printFragmented, NULL, &summary) != FAT32_OK) {
+        printf("Directory %s does not exist.\n", dirName ? dirName : ".");
+        return;
+    }
+
+    printf("%llu files and %llu directories, %llu clusters in %llu extents, %llu fragmented.\n",
+           (unsigned long long)summary.files, (unsigned long long)summary.directories, (unsigned long long)summary.clusters,
+           (unsigned long long)summary.extents, (unsigned long long)summary.fragmented);
+    printf("Fragmentation score: %.1f%%\n", summary.score);
+}
+
+// Function to defragment the files and directories under a directory. The arguments are an optional directory and
+// the optional limits "-time MILLISECONDS" and "-io MEGABYTES", in any order.
+int shellDefrag(struct FAT32Volume *volume, char *argument, char *options) {
+    struct FAT32DefragLimits limits = { 0, 0 };
+    struct FAT32DefragStats stats;
+    const char *dirName = NULL;
+    char *rest = options;
+
+    for (char *token = argument; token != NULL; token = rest ? strtok_r(rest, " ", &rest) : NULL) {
+        if (strcmp(token, "-time") == 0 || strcmp(token, "-io") == 0) {
+            char *value = rest ? strtok_r(rest, " ", &rest) : NULL;
+            if (value == NULL) {
+                printf("No value given for %s.\n", token);
+                return -1;
+            }
+            if (strcmp(token, "-time") == 0) {
+                limits.milliseconds = convertToUint32(value);
+            }
+            else {
+                limits.bytes = (uint64_t)convertToUint32(value) << 20;
+            }
+        }
+        else {
+            dirName = token;
+        }
+    }
+
+    int result = fat32Defrag(volume, dirName, &limits, &stats);
+    if (result == FAT32_ERR_NOT_FOUND) {
+        printf("Directory %s does not exist.\n", dirName ? dirName : ".");
+        return -1;
+    }
+    if (result != FAT32_OK) {
+        printf("Defragmenting stopped: %s.\n", fat32StrError(result));
+    }
+
+    printf("Moved %u files and %u directories, copied %llu bytes; %llu extents are now %llu.\n",
+           stats.filesMoved, stats.directoriesMoved, (unsigned long long)stats.bytesCopied,
+           (unsigned long long)stats.extentsBefore, (unsigned long long)stats.extentsAfter);
+    if (stats.skipped > 0) {
+        printf("%u fragmented files or directories were left as they are (open, or not enough free space).\n", stats.skipped);
+    }
+    if (!stats.complete) {
+        printf("The limits were reached; run defrag again to continue.\n");
+    }
+    return result == FAT32_OK ? 0 : -1;
+}
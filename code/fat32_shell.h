@@ -0,0 +1,30 @@
+#ifndef FAT32_SHELL_H
+#define FAT32_SHELL_H
+
+#include "fat32_api.h"
+#include <stdint.h>
+
+// Helper functions
+uint32_t convertToUint32(const char *str);
+
+// Main implementation shell functions (each one runs a library call on the volume and prints the outcome)
+void shellInfo(struct FAT32Volume *volume);
+void shellLs(struct FAT32Volume *volume, const char *dirName);
+int shellCd(struct FAT32Volume *volume, const char *dirName);
+void shellCreat(struct FAT32Volume *volume, const char *filename);
+void shellMkdir(struct FAT32Volume *volume, const char *dirName);
+int shellOpen(struct FAT32Volume *volume, char *filename, char *mode);
+int shellClose(struct FAT32Volume *volume, char *filename);
+void shellLsof(struct FAT32Volume *volume);
+int shellLseek(struct FAT32Volume *volume, char *filename, uint32_t offset);
+int shellRead(struct FAT32Volume *volume, char *filename, uint32_t size);
+int shellWrite(struct FAT32Volume *volume, char *filename, char *string);
+int shellRm(struct FAT32Volume *volume, const char *filename);
+int shellRmdir(struct FAT32Volume *volume, const char *dirname);
+void shellRmr(struct FAT32Volume *volume, const char *dirname);
+int shellImport(struct FAT32Volume *volume, const char *hostPath, const char *filename);
+int shellExport(struct FAT32Volume *volume, const char *filename, const char *hostPath);
+void shellFrag(struct FAT32Volume *volume, const char *dirName);
+int shellDefrag(struct FAT32Volume *volume, char *argument, char *options);
+
+#endif
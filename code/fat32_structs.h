@@ -39,6 +39,21 @@ struct FAT32BootSector {
 
 // ------------------------------------------------------------------------------------------------ // 
 
+// Structure for the FAT32 FSInfo sector (free cluster count and next free cluster hint)
+#pragma pack(push, 1)
+struct FAT32FSInfo {
+    uint32_t leadSignature;
+    uint8_t  reserved1[480];
+    uint32_t structSignature;
+    uint32_t freeCount;
+    uint32_t nextFree;
+    uint8_t  reserved2[12];
+    uint32_t trailSignature;
+};
+#pragma pack(pop)
+
+// ------------------------------------------------------------------------------------------------ // 
+
 // Structure for a FAT32 Directory Entry (used mainly for ls and cd)
 #pragma pack(push, 1)
 struct FAT32DirectoryEntry {
@@ -59,15 +74,40 @@ struct FAT32DirectoryEntry {
 
 // ------------------------------------------------------------------------------------------------ // 
 
-#pragma pack(push, 1)
+// Structure for one run of physically contiguous clusters in a file's cluster chain
+struct FileExtent {
+    uint32_t logicalCluster;   // Index of the first cluster of the run within the file
+    uint32_t physicalCluster;  // Cluster number of the first cluster of the run on the volume
+    uint32_t length;           // Number of clusters in the run
+};
+
+// ------------------------------------------------------------------------------------------------ // 
+
+// In-memory state of an open file (not stored on disk, so it is not packed)
 struct OpenFile {
-    char filename[12];
+    char filename[13];
     char mode[3];
     uint32_t fileCluster;
     uint32_t offset;
     bool isOpen;
     char path[256];
+    struct FileExtent *extents;
+    uint32_t extentCount;
+    uint32_t extentCapacity;
+    uint32_t clusterCount;
+    uint32_t fileSize;
+    uint32_t dirCluster;
+    uint32_t entryCluster;
+    uint32_t entryIndex;
+    bool entryDirty;
+    bool syncQueued;           // Whether the file is waiting in the open file table's sync queue
+    int32_t next;              // Next file with the same name hash, or next unused slot
+    uint32_t lastReadEnd;      // Offset the previous read stopped at (a read starting here is sequential)
+    uint32_t readAheadWindow;  // Clusters read ahead of a sequential reader (0 until a stream is detected)
+    uint32_t readAheadNext;    // First logical cluster not read ahead yet
+    uint8_t *writeBuffer;      // Data appended past the allocated clusters, not given clusters yet
+    uint32_t writeBufferLength;
+    uint32_t writeBufferCapacity;
 };
-#pragma pack(pop)
 
 #endif 
@@ -0,0 +1,229 @@
+#include "fat32_structs.h"
+#include "fat32_api.h"
+#include "fat32_utils.h"
+#include "fat32_extent.h"
+#include "fat32_io.h"
+#include "fat32_bufcache.h"
+#include "fat32_path.h"
+#include "fat32_filetable.h"
+#include "fat32_writebuf.h"
+#include "fat32_mount.h"
+#include "globals.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+// Most bytes moved by one transfer, and the alignment of the staging buffer
+#define TRANSFER_CHUNK_SIZE (4u << 20)
+#define TRANSFER_ALIGNMENT 4096
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Transfer helper functions
+
+// Function to move one buffer to or from a host file at an offset, retrying short transfers
+static int transferHost(int fd, bool writing, uint64_t offset, void *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t result = writing ? pwrite(fd, buffer, length, (off_t)offset) : pread(fd, buffer, length, (off_t)offset);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return FAT32_ERR_HOST;
+        }
+        buffer = (uint8_t *)buffer + result;
+        offset += result;
+        length -= result;
+    }
+    return FAT32_OK;
+}
+
+// Function to allocate the staging buffer: a whole number of clusters, page aligned
+static uint8_t *allocTransferBuffer(uint32_t clusterSize, uint32_t *bufferSize) {
+    void *buffer = NULL;
+
+    *bufferSize = TRANSFER_CHUNK_SIZE / clusterSize * clusterSize;
+    if (*bufferSize == 0) {
+        *bufferSize = clusterSize;
+    }
+    if (posix_memalign(&buffer, TRANSFER_ALIGNMENT, *bufferSize) != 0) {
+        return NULL;
+    }
+    return buffer;
+}
+
+// Function to copy a host file into an open, already extended file, one staging buffer at a time. Each buffer is
+// written out with a single vectored write per physically contiguous run of clusters.
+static int importRuns(struct OpenFile *file, int hostFd, uint64_t size) {
+    uint32_t clusterSize = activeVolume->bootSector.sectorsPerCluster * activeVolume->bootSector.bytesPerSector;
+    uint32_t bufferSize;
+    int result = FAT32_OK;
+
+    uint8_t *buffer = allocTransferBuffer(clusterSize, &bufferSize);
+    if (!buffer) {
+        return FAT32_ERR_NO_MEMORY;
+    }
+
+    // Every buffer but the last is a whole number of clusters, so each one starts on a cluster boundary
+    for (uint64_t done = 0; done < size && result == FAT32_OK; done += bufferSize) {
+        uint32_t length = (uint32_t)min((uint64_t)bufferSize, size - done);
+        result = transferHost(hostFd, false, done, buffer, length);
+        if (result == FAT32_OK) {
+            result = writeFileClusters(file, (uint32_t)(done / clusterSize), buffer, length);
+        }
+    }
+
+    free(buffer);
+    return result;
+}
+
+// Function to copy a file of the image out to a host file, reading each physically contiguous run of clusters
+// with a single vectored read
+static int exportRuns(struct OpenFile *file, int hostFd, uint64_t size) {
+    uint32_t clusterSize = activeVolume->bootSector.sectorsPerCluster * activeVolume->bootSector.bytesPerSector;
+    uint32_t bufferSize;
+    int result = FAT32_OK;
+
+    uint8_t *buffer = allocTransferBuffer(clusterSize, &bufferSize);
+    if (!buffer) {
+        return FAT32_ERR_NO_MEMORY;
+    }
+
+    uint64_t done = 0;
+    while (done < size && result == FAT32_OK) {
+        uint32_t runRemaining;
+        uint32_t cluster = lookupCluster(file, done / clusterSize, &runRemaining);
+        if (cluster == 0xFFFFFFFF) {
+            result = FAT32_ERR_IO;
+            break;
+        }
+
+        uint32_t length = (uint32_t)min((uint64_t)runRemaining * clusterSize, bufferSize);
+        length = (uint32_t)min((uint64_t)length, size - done);
+        struct iovec iov = { buffer, length };
+        if (readImageVector(getClusterOffset(cluster), &iov, 1) != length) {
+            result = FAT32_ERR_IO;
+            break;
+        }
+
+        result = transferHost(hostFd, true, done, buffer, length);
+        done += length;
+    }
+
+    free(buffer);
+    return result;
+}
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Transfer implementations
+
+// Function to copy a host file into a new file of the image, returning the number of bytes copied.
+// The file data goes straight to the image; only the FAT and directory entry pass through the caches.
+int64_t fat32Import(struct FAT32Volume *volume, const char *hostPath, const char *path) {
+    struct stat st;
+
+    selectVolume(volume);
+
+    int host = open(hostPath, O_RDONLY);
+    if (host < 0) {
+        return FAT32_ERR_HOST;
+    }
+    if (fstat(host, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(host);
+        return FAT32_ERR_HOST;
+    }
+
+    // FAT32 file sizes are 32-bit
+    uint64_t size = st.st_size;
+    if (size > 0xFFFFFFFFull) {
+        close(host);
+        return FAT32_ERR_INVALID;
+    }
+
+    int result = fat32Creat(volume, path);
+    if (result != FAT32_OK) {
+        close(host);
+        return result;
+    }
+    int handle = fat32Open(volume, path, "w");
+    if (handle < 0) {
+        close(host);
+        return handle;
+    }
+
+    // Claim every cluster up front so the allocator can hand out the longest runs it has
+    struct OpenFile *file = getOpenFile(handle);
+    if (size > 0 && !extendFileSize(file, (uint32_t)size)) {
+        result = FAT32_ERR_NO_SPACE;
+    }
+    else {
+        result = importRuns(file, host, size);
+    }
+    close(host);
+
+    if (result == FAT32_OK) {
+        file->fileSize = (uint32_t)size;
+        file->offset = (uint32_t)size;
+        queueOpenFileSync(file);
+        result = fat32Close(volume, handle);
+    }
+    else {
+        // Do not leave a partly imported file behind
+        fat32Close(volume, handle);
+        fat32Unlink(volume, path);
+    }
+    return result == FAT32_OK ? (int64_t)size : result;
+}
+
+// Function to copy a file of the image out to a host file (created or truncated), returning the number of bytes copied
+int64_t fat32Export(struct FAT32Volume *volume, const char *path, const char *hostPath) {
+    uint32_t parentCluster;
+    char leaf[256];
+    struct FAT32DirectoryEntry dirEntry;
+
+    selectVolume(volume);
+
+    // Write every pending change out first so the image itself holds the latest contents and size of the file
+    if (checkpointImage() != 0) {
+        return FAT32_ERR_IO;
+    }
+
+    if (resolveParent(activeVolume->currentDirCluster, path, &parentCluster, leaf, sizeof(leaf)) != 0 ||
+        findDirectoryEntry(parentCluster, leaf, &dirEntry) != 0) {
+        return FAT32_ERR_NOT_FOUND;
+    }
+    if (dirEntry.attributes & ATTR_DIRECTORY) {
+        return FAT32_ERR_IS_DIR;
+    }
+
+    // Map out the cluster chain the same way an open file would
+    struct OpenFile file;
+    memset(&file, 0, sizeof(file));
+    file.fileCluster = (dirEntry.firstClusterHi << 16) | dirEntry.firstClusterLo;
+    file.fileSize = dirEntry.fileSize;
+    if (buildExtentMap(&file) != 0) {
+        freeExtentMap(&file);
+        return FAT32_ERR_NO_MEMORY;
+    }
+
+    int host = open(hostPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (host < 0) {
+        freeExtentMap(&file);
+        return FAT32_ERR_HOST;
+    }
+
+    int result = exportRuns(&file, host, file.fileSize);
+    if (close(host) != 0 && result == FAT32_OK) {
+        result = FAT32_ERR_HOST;
+    }
+    freeExtentMap(&file);
+    return result == FAT32_OK ? (int64_t)file.fileSize : result;
+}
@@ -1,5 +1,15 @@
 #include "fat32_structs.h"
 #include "fat32_utils.h" 
+#include "fat32_fatcache.h"
+#include "fat32_alloc.h"
+#include "fat32_extent.h"
+#include "fat32_io.h"
+#include "fat32_bufcache.h"
+#include "fat32_dirindex.h"
+#include "fat32_dirscan.h"
+#include "fat32_path.h"
+#include "fat32_filetable.h"
+#include "fat32_journal.h"
 #include "globals.h"
 #include <stdio.h>
 #include <string.h>
@@ -74,56 +84,19 @@ void toFAT32Name(const char* input, char* fat32Name) {
 }
 
 
-// Find a free cluster in the FAT and return its number
-uint32_t findFreeCluster() {
-    uint32_t fatOffset = bootSector.reservedSectorCount;
-    uint32_t fatSector = fatOffset;
-    uint32_t fatEntryValue;
-
-    for (uint32_t i = 2; i < bootSector.FATSize32 * bootSector.bytesPerSector / 4; i++) {
-        if (fatOffset >= fatSector * bootSector.bytesPerSector + bootSector.bytesPerSector) {
-            fatSector++;
-            fatOffset = bootSector.reservedSectorCount + fatSector;
-        }
-
-        fseek(imgFile, fatOffset, SEEK_SET);
-        fread(&fatEntryValue, sizeof(uint32_t), 1, imgFile);
-
-        // Move to the next FAT entry
-        fatOffset += 4;  
-
-        if (fatEntryValue == 0) {
-            return i;
-        }
-    }
-    // If this far, no free cluster found
-    return 0xFFFFFFFF; 
-}
-
 // Function to get the first sector of a cluster
 uint32_t getFirstSectorOfCluster(uint32_t clusterNumber) {
-    return ((clusterNumber - 2) * bootSector.sectorsPerCluster) + bootSector.reservedSectorCount + (bootSector.numFATs * bootSector.FATSize32);
+    return ((clusterNumber - 2) * activeVolume->bootSector.sectorsPerCluster) + activeVolume->bootSector.reservedSectorCount + (activeVolume->bootSector.numFATs * activeVolume->bootSector.FATSize32);
+}
+
+// Function to get the byte offset of a cluster within the image (64-bit so large images work)
+uint64_t getClusterOffset(uint32_t clusterNumber) {
+    return (uint64_t)getFirstSectorOfCluster(clusterNumber) * activeVolume->bootSector.bytesPerSector;
 }
 
 // Function to get the next cluster given the current one
 uint32_t getNextCluster(uint32_t currentCluster) {
-    uint32_t fatOffset = currentCluster * 4; // Each FAT entry is 4 bytes
-    uint32_t fatSector = bootSector.reservedSectorCount + (fatOffset / bootSector.bytesPerSector);
-    uint32_t entOffset = fatOffset % bootSector.bytesPerSector;
-
-    uint32_t fatTablePosition = (fatSector * bootSector.bytesPerSector) + entOffset;
-
-    fseek(imgFile, fatTablePosition, SEEK_SET);
-    uint32_t nextCluster;
-    if (fread(&nextCluster, sizeof(uint32_t), 1, imgFile) != 1) {
-        perror("Error reading next cluster"); // Error handling if read fails
-        return 0xFFFFFFFF; // Indicate an error or end-of-chain if reading fails
-    }
-
-    nextCluster &= 0x0FFFFFFF; // Mask to get 28 lower bits
-
-    //printf("Current Cluster: %u, Next Cluster: %u, Position: %u\n",
-    //        currentCluster, nextCluster, fatTablePosition);
+    uint32_t nextCluster = getFATEntry(currentCluster);
 
     // Handling end-of-chain or erroneous zero cluster (which should not happen unless it's the start of the data region)
     if (nextCluster >= 0x0FFFFFF8 || nextCluster == 0) {
@@ -135,978 +108,394 @@ uint32_t getNextCluster(uint32_t currentCluster) {
 
 // Update the FAT chain by setting the next cluster for the given cluster
 void updateFATChain(uint32_t cluster, uint32_t nextCluster) {
-    uint32_t fatOffset = cluster * 4 + bootSector.reservedSectorCount * bootSector.bytesPerSector;
-    uint32_t fatSector = fatOffset / bootSector.bytesPerSector;
-    uint32_t entOffset = fatOffset % bootSector.bytesPerSector;
-
-    fseek(imgFile, fatSector * bootSector.bytesPerSector + entOffset, SEEK_SET);
-    fwrite(&nextCluster, sizeof(uint32_t), 1, imgFile);
-}
-
-// Function to check if mode for opening a file is valid
-bool isValidMode(const char *mode) {
-    return strcmp(mode, "-r") == 0 || strcmp(mode, "-w") == 0 ||
-           strcmp(mode, "-rw") == 0 || strcmp(mode, "-wr") == 0;
-}
+    setFATEntry(cluster, nextCluster);
 
-// Function to check if file is already open (At max 10 files can be opened)
-int findOpenFile(const char *filename) {
-    for (int i = 0; i < 10; i++) {
-        if (openFiles[i].isOpen && strcmp(openFiles[i].filename, filename) == 0) {
-            return i;
-        }
+    // Keep the free-space bitmap in step with the FAT
+    if (nextCluster == 0) {
+        markClusterFree(cluster);
     }
-    return -1;
-}
-
-// Function to calculate the file size based on its starting cluster
-uint32_t getFileSize(uint32_t firstCluster) {
-    uint32_t clusterSize = bootSector.sectorsPerCluster * bootSector.bytesPerSector;
-    uint32_t fileSize = 0;
-    uint32_t currentCluster = firstCluster;
-
-    // While we are not at the end of the chain, add up the cluster sizes
-    while (currentCluster < 0x0FFFFFF8) { 
-        fileSize += clusterSize;
-        currentCluster = getNextCluster(currentCluster);
+    else {
+        markClusterUsed(cluster);
     }
-
-    return fileSize;
 }
 
-// Function to convert a char* to a uni32_t (used for lseek function when taking in input)
-uint32_t convertToUint32(const char *str) {
-    char *endptr;
-    uint32_t value = (uint32_t)strtoul(str, &endptr, 10);
+// Function to fill a cluster with zeroes (new directory clusters must not contain stale entries)
+void zeroCluster(uint32_t cluster) {
+    // The zeroed buffer is written out with the next flush, so no read or write happens now
+    getNewCluster(cluster);
+}
 
-    if (*endptr != '\0') {
-        printf("Conversion error, non-numeric data found: %s\n", endptr);
+// Function to write the cached size and first cluster of an open file back to its directory entry
+int syncOpenFile(struct OpenFile *file) {
+    if (!file->entryDirty) {
         return 0;
     }
 
-    return value;
-}
-
-// Function to extend the file size by allocating new clusters as needed (used for write function)
-bool extendFileSize(struct OpenFile *file, uint32_t newSize) {
-    uint32_t currentCluster = file->fileCluster;
-    uint32_t clusterSize = bootSector.sectorsPerCluster * bootSector.bytesPerSector;
-    uint32_t fileSize = getFileSize(currentCluster);
-    uint32_t lastCluster = currentCluster;
-    bool foundFreeCluster = false;
-
-    // Check if the current size is already sufficient
-    if (fileSize >= newSize) {
-        return true;
+    struct FAT32DirectoryEntry *entries = (struct FAT32DirectoryEntry *)getCluster(file->entryCluster);
+    if (!entries) {
+        return -1;
     }
 
-    // Calculate how many additional clusters are needed
-    while (fileSize < newSize) {
-        uint32_t nextCluster = getNextCluster(currentCluster);
-
-        // If the current cluster is the end of the chain, find a new cluster
-        if (nextCluster >= 0x0FFFFFF8) {
-            foundFreeCluster = false;
-            uint32_t newCluster = findFreeCluster();
-            if (newCluster == 0xFFFFFFFF) {
-                printf("Error: No free clusters available.\n");
-                return false;
-            }
+    // Data still in the write buffer has no clusters yet, so the entry only covers what is allocated
+    uint32_t clusterSize = activeVolume->bootSector.sectorsPerCluster * activeVolume->bootSector.bytesPerSector;
+    entries[file->entryIndex].fileSize = file->writeBufferLength ? file->clusterCount * clusterSize : file->fileSize;
+    entries[file->entryIndex].firstClusterHi = (file->fileCluster >> 16) & 0xFFFF;
+    entries[file->entryIndex].firstClusterLo = file->fileCluster & 0xFFFF;
+    markClusterDirty(file->entryCluster);
+    setDirIndexFirstCluster(file->dirCluster, (const char *)entries[file->entryIndex].name, file->fileCluster);
 
-            // Update the FAT to link the new cluster
-            updateFATChain(currentCluster, newCluster);
-            updateFATChain(newCluster, 0x0FFFFFF8);
-            foundFreeCluster = true;
-            nextCluster = newCluster;
-        }
+    file->entryDirty = false;
+    return 0;
+}
 
-        currentCluster = nextCluster;
-        fileSize += clusterSize;
+// Function to write cached clusters, the FAT, FSInfo and open file sizes back to the image and flush all pending
+// writes. Data in the write buffers of open files is only given clusters and written out when 'flushWriteBuffers' is set.
+// With journaling on, the cached clusters, FAT sectors and FSInfo go to the image as one journal transaction, and the
+// image is only synced when the journal is checkpointed.
+static int writeBackImage(bool flushWriteBuffers) {
+    int result = 0;
 
-        if (!foundFreeCluster) {
-            lastCluster = currentCluster;
-        }
-    }
+    result |= syncOpenFiles(flushWriteBuffers);
 
-    // Update the last cluster if it wasn't already updated
-    if (!foundFreeCluster) {
-        updateFATChain(lastCluster, 0x0FFFFFF8);
+    beginJournalTransaction();
+    result |= flushBufferCache();
+    result |= flushFATCache();
+    result |= flushFSInfo();
+    if (activeVolume->journal.file) {
+        result |= commitJournalTransaction();
     }
-
-    return true;
-}
-
-// Helper function to determine if a directory is empty
-int isDirectoryEmpty(uint32_t cluster) {
-    uint32_t firstSector = getFirstSectorOfCluster(cluster);
-    struct FAT32DirectoryEntry dirEntry;
-
-    fseek(imgFile, firstSector * bootSector.bytesPerSector, SEEK_SET);
-    for (int i = 0; i < bootSector.sectorsPerCluster * (bootSector.bytesPerSector / sizeof(dirEntry)); ++i) {
-        fread(&dirEntry, sizeof(dirEntry), 1, imgFile);
-        if (dirEntry.name[0] == 0) break;  // End of directory
-        if (dirEntry.name[0] == 0xE5) continue;  // Skip deleted entries
-        if (strncmp(dirEntry.name, ".          ", 11) == 0 || strncmp(dirEntry.name, "..         ", 11) == 0) {
-            continue;  // Skip '.' and '..' entries
-        }
-        return 0;  // Found a valid entry, directory is not empty
+    else {
+        result |= syncImage();
     }
-    return 1;  // No valid entries found, directory is empty
-}
-
-
-int findDirectoryEntry(const char *filename, struct FAT32DirectoryEntry *entry) {
-    uint32_t currentCluster = currentDirCluster;
-    struct FAT32DirectoryEntry dirEntry;
-
-    char fat32Name[12];
-    toFAT32Name(filename, fat32Name);
-
-    do {
-        uint32_t firstSector = getFirstSectorOfCluster(currentCluster);
-        fseek(imgFile, firstSector * bootSector.bytesPerSector, SEEK_SET);
-
-        for (int i = 0; i < bootSector.sectorsPerCluster * (bootSector.bytesPerSector / sizeof(dirEntry)); ++i) {
-            fread(&dirEntry, sizeof(dirEntry), 1, imgFile);
-
-            if (dirEntry.name[0] == 0) {  // End of directory entries
-                return -1;
-            }
-            if (dirEntry.name[0] == 0xE5) continue;  // Skip deleted entries
-
-            if (strncmp(dirEntry.name, fat32Name, 11) == 0) {
-                *entry = dirEntry;
-                return 0;  // Found entry
-            }
-        }
 
-        currentCluster = getNextCluster(currentCluster);
-    } while (currentCluster != 0xFFFFFFFF);
-
-    return -1;  // Entry not found
+    // Files whose write buffers were kept stay queued
+    activeVolume->flushPolicy.pending = activeVolume->openFileTable.syncCount > 0;
+    return result != 0 ? -1 : 0;
 }
 
-void removeDirectoryEntry(const char *filename) {
-    uint32_t currentCluster = currentDirCluster;
-    struct FAT32DirectoryEntry dirEntry;
-
-    do {
-        uint32_t firstSector = getFirstSectorOfCluster(currentCluster);
-        fseek(imgFile, firstSector * bootSector.bytesPerSector, SEEK_SET);
-
-        for (int i = 0; i < bootSector.sectorsPerCluster * (bootSector.bytesPerSector / sizeof(dirEntry)); ++i) {
-            fread(&dirEntry, sizeof(dirEntry), 1, imgFile);
-
-            char formattedName[12];
-            memcpy(formattedName, dirEntry.name, 11);
-            formattedName[11] = '\0'; // Ensure null termination
-
-            if (strncmp(formattedName, filename, 11) == 0) {
-                fseek(imgFile, -((long)sizeof(dirEntry)), SEEK_CUR);
-                dirEntry.name[0] = 0xE5; // Mark as deleted
-                fwrite(&dirEntry, sizeof(dirEntry), 1, imgFile);
-                fflush(imgFile);  // Ensure the change is written immediately
-                return;
-            }
-        }
-
-        currentCluster = getNextCluster(currentCluster);
-    } while (currentCluster != 0xFFFFFFFF);
+// Function to write every change back to the image, including the buffered data of open files
+int checkpointImage() {
+    return writeBackImage(true);
 }
 
-void freeClusters(uint32_t clusterNumber) {
-    uint32_t currentCluster = clusterNumber;
-    uint32_t nextCluster;
-
-    while (currentCluster < 0x0FFFFFF8) {
-        nextCluster = getNextCluster(currentCluster);
-        updateFATChain(currentCluster, 0x00000000); // Mark the cluster as free in the FAT
-        currentCluster = nextCluster;
+// Function to write all changes back to the image after an operation (in batch mode this waits for the next checkpoint).
+// Buffered file data stays buffered until the file is closed, the volume is synced or the buffer fills up.
+void flushImage() {
+    if (activeVolume->flushPolicy.deferred) {
+        activeVolume->flushPolicy.pending = true;
+        return;
     }
+    writeBackImage(false);
 }
 
-// Helper function to delete all files and subdirectories recursively
-void deleteDirectoryContents(uint32_t cluster) {
-    struct FAT32DirectoryEntry dirEntry;
-    uint32_t firstSector = getFirstSectorOfCluster(cluster);
-
-    fseek(imgFile, firstSector * bootSector.bytesPerSector, SEEK_SET);
-
-    for (int i = 0; i < bootSector.sectorsPerCluster * (bootSector.bytesPerSector / sizeof(dirEntry)); i++) {
-        fread(&dirEntry, sizeof(dirEntry), 1, imgFile);
-
-        // If we reach the end of the directory, break
-        if (dirEntry.name[0] == 0) {
-            break; 
-        }
-
-        // Skip deleted entries and current/parent directory references
-        if (dirEntry.name[0] == 0xE5 || strncmp(dirEntry.name, ".          ", 11) == 0 || strncmp(dirEntry.name, "..         ", 11) == 0) {
-            continue;
-        }
+// Function to find an open file from a name or path. A plain name matches an open file of that name in any
+// directory, while a path only matches the file in the directory it leads to.
+int findOpenFilePath(const char *path) {
+    uint32_t parentCluster;
+    char leaf[256];
+    char fat32Name[12];
+    char formattedName[13];
 
-        char name[12];
-        formatDirName(dirEntry.name, name);
-
-        // If it is a subdirectory, recursively call the delete function
-        if (dirEntry.attributes & ATTR_DIRECTORY) {
-            deleteDirectoryContents((dirEntry.firstClusterHi << 16) | dirEntry.firstClusterLo);
-            rmdir(name);
-        } 
-        // If it is a file, delete it
-        else {
-            rm(name);
-        }
+    if (resolveParent(activeVolume->currentDirCluster, path, &parentCluster, leaf, sizeof(leaf)) != 0) {
+        return -1;
     }
-}
 
-// ------------------------------------------------------------------------------------------------ //
+    // Open files are tracked by their formatted name
+    toFAT32Name(leaf, fat32Name);
+    formatDirName(fat32Name, formattedName);
 
-// Function implementations for the shell
-
-// Function to print the info of the boot sector
-void printInfo(const struct FAT32BootSector *bs) {
-    printf("Bytes Per Sector: %d\n", bs->bytesPerSector);
-    printf("Sectors Per Cluster: %d\n", bs->sectorsPerCluster);
-    printf("Root Cluster: %d\n", bs->rootCluster);
-    // Assuming the calculation for total # of clusters in data region is correct
-    printf("Total # of Clusters in Data Region: %d\n", (bs->totalSectors32 - bs->reservedSectorCount - (bs->numFATs * bs->FATSize32)) / bs->sectorsPerCluster);
-    printf("# of Entries in One FAT: %d\n", bs->FATSize32 * bs->bytesPerSector / 4); // Each FAT entry is 4 bytes
-    printf("Size of Image (in bytes): %d\n", bs->totalSectors32 * bs->bytesPerSector);
+    // A plain name prefers the file in the current directory, which is what parentCluster is then
+    return findOpenFileByName(parentCluster, formattedName, strchr(path, '/') == NULL);
 }
 
-// Function to list the available directories and files from the current cluster
-void ls(int currentClusterNumber) {
-    uint32_t currentCluster = currentClusterNumber;
-    struct FAT32DirectoryEntry dirEntry;
-
-    // While we are in our range of accessible clusters, search for all of the directories and files
-    do {
-        uint32_t firstSector = getFirstSectorOfCluster(currentCluster);
-        fseek(imgFile, firstSector * bootSector.bytesPerSector, SEEK_SET);
-
-        for (int i = 0; i < bootSector.sectorsPerCluster * (bootSector.bytesPerSector / sizeof(dirEntry)); ++i) {
-            fread(&dirEntry, sizeof(dirEntry), 1, imgFile);
-
-            // If we reach the end of the directory, break
-            if (dirEntry.name[0] == 0) break; 
-
-            // If not a deleted directory or file, get and print the name
-            if (dirEntry.name[0] != 0xE5) {
-                char name[12];
-                memcpy(name, dirEntry.name, 11);
-                name[11] = '\0';
-                formatDirName(name, name);
-
-                // Print the name if it is a directory or a file only
-                if (dirEntry.attributes == 0x10 || dirEntry.attributes == 0x20) {
-                    printf("%s\n", name);
-                } 
-            }
-        }
-        // Move to next cluster in the chain
-        currentCluster = getNextCluster(currentCluster);
-    } while (currentCluster < 0x0FFFFFF8);
+// Function to check if the entry with the given FAT32 name in a directory is currently open
+bool isEntryOpen(uint32_t dirCluster, const char *fat32Name) {
+    char formattedName[13];
+    formatDirName(fat32Name, formattedName);
+    return findOpenFileByName(dirCluster, formattedName, false) != -1;
 }
 
-// Function to change the current directory given the current cluster and the directory name
-int cd(int currentDirCluster, const char *dirName) {
-    struct FAT32DirectoryEntry dirEntry;
-    uint32_t currentCluster = currentDirCluster;
-
-    // If cd .. we must go to the parent directory
-    if (strcmp(dirName, "..") == 0) {
-        // If we are already at the root directory, simply return the current cluster
-        if (currentDirCluster == bootSector.rootCluster) {
-            return bootSector.rootCluster;
-        }
-
-        // Navigate to the parent directory by finding the ".." entry in the current directory
-        uint32_t firstSector = getFirstSectorOfCluster(currentCluster);
-        fseek(imgFile, firstSector * bootSector.bytesPerSector, SEEK_SET);
-
-        for (int i = 0; i < bootSector.sectorsPerCluster * (bootSector.bytesPerSector / sizeof(dirEntry)); ++i) {
-            fread(&dirEntry, sizeof(dirEntry), 1, imgFile);
-
-            // Check if this is the ".." entry by comparing the first 11 characters
-            if (strncmp(dirEntry.name, "..         ", 11) == 0) {
-                // Calculate the parent directory's cluster number
-                uint32_t parentCluster = (dirEntry.firstClusterHi << 16) | dirEntry.firstClusterLo;
-
-                // In FAT32, root's parent is considered as root itself
-                if (parentCluster == 0) {
-                    parentCluster = bootSector.rootCluster;
-                }
-
-                return parentCluster;
-            }
-        }
-        // If we got here, something went wrong, return -1
-        return -1;
-    }
+// Function to calculate the file size based on its starting cluster
+uint32_t getFileSize(uint32_t firstCluster) {
+    uint32_t clusterSize = activeVolume->bootSector.sectorsPerCluster * activeVolume->bootSector.bytesPerSector;
+    uint32_t fileSize = 0;
+    uint32_t currentCluster = firstCluster;
 
-    // Get the uppercase of the name for comparison to FAT32 directories
-    char upperDirName[12];
-    strncpy(upperDirName, dirName, sizeof(upperDirName) - 1);
-    upperDirName[11] = '\0';
-    strtoupper(upperDirName);
-
-    // While we are in our range of accessible clusters, search through all the directories
-    do {
-        uint32_t firstSector = getFirstSectorOfCluster(currentCluster);
-        fseek(imgFile, firstSector * bootSector.bytesPerSector, SEEK_SET);
-
-        // Search through all entries in the current cluster
-        for (int i = 0; i < bootSector.sectorsPerCluster * (bootSector.bytesPerSector / sizeof(dirEntry)); ++i) {
-            fread(&dirEntry, sizeof(dirEntry), 1, imgFile);
-
-            // If we reach the end of the directory, break
-            if (dirEntry.name[0] == 0) break; 
-
-            // If directory has been deleted or does not exist, continue
-            if (dirEntry.name[0] == 0xE5 || !(dirEntry.attributes & 0x10)) continue;
-
-            // Otherwise, get the directory name and check if it's what we are looking for
-            char formattedName[12];
-            formatDirName(dirEntry.name, formattedName);
-
-            // If we found the directory, move to it, and return successful change
-            if (strcmp(formattedName, upperDirName) == 0) {
-                // Check if this is a directory or a file
-                if (dirEntry.attributes & 0x10) {
-                    return (dirEntry.firstClusterHi << 16) | dirEntry.firstClusterLo;
-                } 
-                // Found, but it's not a directory
-                else {
-                    return -2; 
-                }
-            }
-        }
-        // Update our current cluster
+    // While we are not at the end of the chain, add up the cluster sizes (an empty file has no chain at all)
+    while (currentCluster >= 2 && currentCluster < 0x0FFFFFF8) { 
+        fileSize += clusterSize;
         currentCluster = getNextCluster(currentCluster);
-    } while (currentCluster < 0x0FFFFFF8);
+    }
 
-    // If this far, directory does not exist
-    return -1; 
+    return fileSize;
 }
 
-// Function to creat a new file in the current dirctory with the given name
-void creat(const char *filename) {
-    struct FAT32DirectoryEntry dirEntry;
-    uint32_t currentCluster = currentDirCluster;
-    int foundEmpty = 0;
-    long emptyEntryPos = -1;
-    uint32_t lastClusterInChain = 0;
-
-    // Convert the filename to FAT32 format
-    char formattedName[12];
-    toFAT32Name(filename, formattedName);
-
-    // Checker to see if we have already found an available position
-    int foundPos = 0;
-
-    // Scan through the avaiable clusters
-    do {
-        uint32_t firstSector = getFirstSectorOfCluster(currentCluster);
-        
-        // Scan through all of the entries in each available cluster
-        for (int i = 0; i < bootSector.sectorsPerCluster * (bootSector.bytesPerSector / sizeof(dirEntry)); ++i) {
-            fseek(imgFile, firstSector * bootSector.bytesPerSector + (i * sizeof(dirEntry)), SEEK_SET);
-            fread(&dirEntry, sizeof(dirEntry), 1, imgFile);
-
-            // If we have not found an available position yet, keep looking
-            if (!foundPos) {
-                // If we are at the end of the directory, mark this position
-                if (dirEntry.name[0] == 0x00) {
-                    if (!foundEmpty) {
-                        foundEmpty = 1;
-                        emptyEntryPos = ftell(imgFile) - sizeof(dirEntry);
-                        foundPos = 1;
-                    }
-                    break;
-                }
-
-                // If we found an empty entry, we can create a new file here
-                if (dirEntry.name[0] == 0xE5 && !foundEmpty) {
-                    foundEmpty = 1;
-                    emptyEntryPos = ftell(imgFile) - sizeof(dirEntry);
-                    foundPos = 1;
-                }
-            }
-
-            // Check if a file or directory with the same name already exists
-            char existingName[12];
-            toFAT32Name((char *)dirEntry.name, existingName);
-            toFAT32Name(filename, formattedName);
-            if (strcmp(formattedName, existingName) == 0) {
-                fprintf(stderr, "A file or directory named %s already exists.\n", filename);
-                return;
-            }
-        }
-
-        // If empty entry in a cluster, break so we can create the new file at the currentpos
-        if (foundEmpty) {
-            break;
-        }
-
-        lastClusterInChain = currentCluster;
-        currentCluster = getNextCluster(currentCluster);
-    } while (currentCluster < 0x0FFFFFF8);
-
-    // Convert the filename to FAT32 format again (it gets emptied in the loop)
-    toFAT32Name(filename, formattedName);
-
-    // If no empty entry found, allocate a new cluster for the directory
-    if (!foundEmpty) {
-        uint32_t newCluster = findFreeCluster();
-        if (newCluster == 0xFFFFFFFF) {
-            printf("No free cluster available.\n");
-            return;
-        }
+// Function to extend the file size by allocating new clusters as needed (used for write function)
+bool extendFileSize(struct OpenFile *file, uint32_t newSize) {
+    uint32_t clusterSize = activeVolume->bootSector.sectorsPerCluster * activeVolume->bootSector.bytesPerSector;
+    uint32_t clustersNeeded = (uint32_t)(((uint64_t)newSize + clusterSize - 1) / clusterSize);
+    uint32_t clusterCount = file->clusterCount;
+    uint32_t lastCluster = 0;
 
-        // Update the FAT chain
-        updateFATChain(lastClusterInChain, newCluster);
-        updateFATChain(newCluster, 0x0FFFFFF8);
+    // The last cluster of the file is the end of its last extent
+    if (file->extentCount > 0) {
+        struct FileExtent *last = &file->extents[file->extentCount - 1];
+        lastCluster = last->physicalCluster + last->length - 1;
+    }
 
-        // Set emptyEntryPos to the beginning of the new cluster
-        emptyEntryPos = getFirstSectorOfCluster(newCluster) * bootSector.bytesPerSector;
+    // Check if the current size is already sufficient
+    if (clusterCount >= clustersNeeded) {
+        return true;
     }
 
-    // Construct the new directory entry for the file
-    memset(&dirEntry, 0, sizeof(dirEntry));
-    memcpy(dirEntry.name, formattedName, 11);
-    dirEntry.attributes = 0x20;
-    dirEntry.firstClusterHi = 0x00;
-    dirEntry.firstClusterLo = 0x00;
-    dirEntry.fileSize = 0;
+    // Claim all of the missing clusters at once, as close to the end of the file as possible
+    uint32_t newCluster = allocateExtent(lastCluster, clustersNeeded - clusterCount);
+    if (newCluster == 0xFFFFFFFF) {
+        return false;
+    }
 
-    // Write the new directory entry to the found position
-    fseek(imgFile, emptyEntryPos, SEEK_SET);
-    fwrite(&dirEntry, sizeof(dirEntry), 1, imgFile);
-    fflush(imgFile);
+    // Link the new clusters onto the end of the chain (or make them the chain of an empty file)
+    if (lastCluster == 0) {
+        file->fileCluster = newCluster;
+        queueOpenFileSync(file);
+    }
+    else {
+        updateFATChain(lastCluster, newCluster);
+    }
 
-    printf("File %s created successfully.\n", filename);
+    // Record the new clusters in the extent map
+    return appendExtentChain(file, newCluster) == 0;
 }
 
-// Function to create a new directory with the given name in the current directory
-void mkdir(const char *dirName) {
-    struct FAT32DirectoryEntry dirEntry;
-    uint32_t currentCluster = currentDirCluster;
-    int foundEmpty = 0;
-    long emptyEntryPos = -1;
-    uint32_t lastClusterInChain = 0;
-    uint32_t newClusterNum = 0;
-
-    // Convert the filename to FAT32 format
-    char formattedName[12];
-    toFAT32Name(dirName, formattedName);
-
-    // Checker to see if we have already found an available position
-    int foundPos = 0;
-
-    // Scan through the avaiable clusters
-    do {
-        uint32_t firstSector = getFirstSectorOfCluster(currentCluster);
-        fseek(imgFile, firstSector * bootSector.bytesPerSector, SEEK_SET);
-
-        // Scan through all of the entries in each available cluster
-        for (int i = 0; i < bootSector.sectorsPerCluster * (bootSector.bytesPerSector / sizeof(dirEntry)); ++i) {
-            fread(&dirEntry, sizeof(dirEntry), 1, imgFile);
-
-            // If we have not found an available position yet, keep looking
-            if (!foundPos) {
-                // If we are at the end of the directory, mark this position
-                if (dirEntry.name[0] == 0x00) {
-                    if (!foundEmpty) {
-                        foundEmpty = 1;
-                        emptyEntryPos = ftell(imgFile) - sizeof(dirEntry);
-                        foundPos = 1;
-                    }
-                    break;
-                }
-
-                // If we found an empty entry, we can create a new file here
-                if (dirEntry.name[0] == 0xE5 && !foundEmpty) {
-                    foundEmpty = 1;
-                    emptyEntryPos = ftell(imgFile) - sizeof(dirEntry);
-                    foundPos = 1;
-                }
-            }
-
-            // Check if a file or directory with the same name already exists
-            char existingName[12];
-            toFAT32Name((char *)dirEntry.name, existingName);
-            toFAT32Name(dirName, formattedName);
-            if (strcmp(formattedName, existingName) == 0) {
-                fprintf(stderr, "A file or directory named %s already exists.\n", dirName);
-                return;
+// Helper function to determine if a directory is empty
+int isDirectoryEmpty(uint32_t cluster) {
+    uint32_t entriesPerCluster = activeVolume->bootSector.sectorsPerCluster * (activeVolume->bootSector.bytesPerSector / sizeof(struct FAT32DirectoryEntry));
+    struct FAT32DirectoryEntry *entries = (struct FAT32DirectoryEntry *)getCluster(cluster);
+    uint64_t deletedMask[DIR_SCAN_MASK_WORDS(entriesPerCluster)];
+    struct DirScanResult scan;
+
+    if (!entries) return 0;  // Treat an unreadable directory as not empty so it is never deleted
+
+    // Every entry before the end of the directory that is not deleted has to be '.' or '..'
+    scanDirEntries(entries, entriesPerCluster, NULL, NULL, deletedMask, &scan);
+    uint32_t end = scan.endIndex != -1 ? (uint32_t)scan.endIndex : entriesPerCluster;
+    for (uint32_t word = 0; word * 64 < end; word++) {
+        uint32_t remaining = end - word * 64;
+        uint64_t used = ~deletedMask[word] & (remaining >= 64 ? ~0ULL : (1ULL << remaining) - 1);
+        for (; used; used &= used - 1) {
+            const char *name = (const char *)entries[word * 64 + __builtin_ctzll(used)].name;
+            if (strncmp(name, ".          ", 11) != 0 && strncmp(name, "..         ", 11) != 0) {
+                return 0;  // Found a valid entry, directory is not empty
             }
         }
-
-        // If empty entry in a cluster, break so we can create the new file at the currentpos
-        if (foundEmpty) {
-            break;
-        }
-
-        lastClusterInChain = currentCluster;
-        currentCluster = getNextCluster(currentCluster);
-    } while (currentCluster < 0x0FFFFFF8);
-
-    // Convert the filename to FAT32 format again (it gets emptied in the loop)
-    toFAT32Name(dirName, formattedName);
-
-    // If no empty entry found, allocate a new cluster for the directory
-    if (!foundEmpty) {
-        newClusterNum = findFreeCluster();
-        if (newClusterNum == 0xFFFFFFFF) {
-            printf("No free cluster available.\n");
-            return;
-        }
-
-        // Update the FAT chain
-        updateFATChain(lastClusterInChain, newClusterNum);
-        updateFATChain(newClusterNum, 0x0FFFFFF8);
-
-        // Set emptyEntryPos to the beginning of the new cluster
-        emptyEntryPos = getFirstSectorOfCluster(newClusterNum) * bootSector.bytesPerSector;
     }
-
-    // Construct the new directory entry for the directory
-    memset(&dirEntry, 0, sizeof(dirEntry));
-    memcpy(dirEntry.name, formattedName, 11);
-    dirEntry.attributes = 0x10;
-    dirEntry.firstClusterHi = (newClusterNum >> 16) & 0xFFFF;
-    dirEntry.firstClusterLo = newClusterNum & 0xFFFF;
-    dirEntry.fileSize = 0;
-
-    // Write the new directory entry to the found position
-    fseek(imgFile, emptyEntryPos, SEEK_SET);
-    fwrite(&dirEntry, sizeof(dirEntry), 1, imgFile);
-
-    // Create '.' and '..' entries inside the new directory
-    fseek(imgFile, getFirstSectorOfCluster(newClusterNum) * bootSector.bytesPerSector, SEEK_SET);
-
-    // '.' entry
-    memset(&dirEntry, 0, sizeof(dirEntry));
-    memcpy(dirEntry.name, ".          ", 11);
-    dirEntry.attributes = 0x10;
-    dirEntry.firstClusterHi = (newClusterNum >> 16) & 0xFFFF;
-    dirEntry.firstClusterLo = newClusterNum & 0xFFFF;
-    fwrite(&dirEntry, sizeof(dirEntry), 1, imgFile);
-
-    // '..' entry
-    memset(&dirEntry, 0, sizeof(dirEntry));
-    memcpy(dirEntry.name, "..         ", 11);
-    dirEntry.attributes = 0x10;
-    dirEntry.firstClusterHi = (currentDirCluster >> 16) & 0xFFFF;
-    dirEntry.firstClusterLo = currentDirCluster & 0xFFFF;
-    fwrite(&dirEntry, sizeof(dirEntry), 1, imgFile);
-
-    // Add an End-of-Directory marker after the new entry and commit the changes to the image file
-    struct FAT32DirectoryEntry eodMarker = {0};
-    fwrite(&eodMarker, sizeof(struct FAT32DirectoryEntry), 1, imgFile);
-    fflush(imgFile);
-
-    printf("Directory %s created successfully.\n", dirName);
+    return 1;  // No valid entries found, directory is empty
 }
 
-// Function to open a file from the current directory (reads in the mode to open the file)
-int open(char* filename, char* mode) {
-    // First check if a valid mode was given
-    if (!isValidMode(mode)) {
-        printf("Invalid mode specified.\n");
-        return -1;
+
+// Function to find an entry in a directory by name through the directory index
+int findDirectoryEntry(uint32_t dirCluster, const char *filename, struct FAT32DirectoryEntry *entry) {
+    char fat32Name[12];
+    toFAT32Name(filename, fat32Name);
+
+    const struct DirIndexEntry *indexed = lookupDirIndex(dirCluster, fat32Name);
+    if (!indexed) {
+        return -1;  // Entry not found
     }
 
-    // Next, check if the file is already open
-    if (findOpenFile(filename) != -1) {
-        printf("File '%s' is already open.\n", filename);
+    struct FAT32DirectoryEntry *entries = (struct FAT32DirectoryEntry *)getCluster(indexed->entryCluster);
+    if (!entries) {
         return -1;
     }
 
-    // Get the uppercase of the name for comparison to FAT32 files
-    char upperFileName[12];
-    strncpy(upperFileName, filename, sizeof(upperFileName) - 1);
-    upperFileName[11] = '\0';
-    strtoupper(upperFileName);
-
-    uint32_t currentCluster = currentDirCluster;
-    struct FAT32DirectoryEntry dirEntry;
-
-    // Loop through the clusters in the directory until you find the file
-    do {
-        uint32_t firstSector = getFirstSectorOfCluster(currentCluster);
-        fseek(imgFile, firstSector * bootSector.bytesPerSector, SEEK_SET);
-
-        // Search through all entries in the current cluster
-        for (int i = 0; i < bootSector.sectorsPerCluster * (bootSector.bytesPerSector / sizeof(dirEntry)); ++i) {
-            fread(&dirEntry, sizeof(dirEntry), 1, imgFile);
-
-            // If we reach the end of the directory, break
-            if (dirEntry.name[0] == 0) break;
-
-            // If file has been deleted or does not exist, continue
-            if (dirEntry.name[0] == 0xE5 || !(dirEntry.attributes & 0x20)) continue;
-
-            // Otherwise, get the file name and check if it's what we are looking for
-            char formattedName[12];
-            formatDirName(dirEntry.name, formattedName);
-
-            // If we found the file, open it with the given mode
-            if (strcmp(formattedName, upperFileName) == 0) {
-                // Go through our open files an make sure this one is not already in there
-                for (int j = 0; j < 10; j++) {
-                    if (!openFiles[j].isOpen) {
-                        // Add this file to our open files with the mode opened (without the -)
-                        strcpy(openFiles[j].filename, formattedName);
-                        strcpy(openFiles[j].mode, mode + 1);
-                        openFiles[j].fileCluster = (dirEntry.firstClusterHi << 16) | dirEntry.firstClusterLo;
-                        openFiles[j].offset = 0;
-                        openFiles[j].isOpen = true;
-                        printf("File '%s' opened in mode '%s'.\n", filename, mode);
-                        return 0;
-                    }
-                }
-                printf("Max open files limit reached.\n");
-                return -1;
-            }
-        }
-        // Update our current cluster
-        currentCluster = getNextCluster(currentCluster);
-    } while (currentCluster < 0x0FFFFFF8);
-
-    // If this far, file does not exist
-    printf("File '%s' does not exist.\n", filename);
-    return -1;
+    *entry = entries[indexed->entryIndex];
+    return 0;  // Found entry
 }
 
-// Function to find and close an open file by its filename
-int close(char* filename) {
-
-    // Get the uppercase of the name for comparison to FAT32 files
-    char upperFileName[12];
-    strncpy(upperFileName, filename, sizeof(upperFileName) - 1);
-    upperFileName[11] = '\0';
-    strtoupper(upperFileName);
-
-    // Check if the file is currently open
-    for (int i = 0; i < 10; i++) {
-        // If we find the file, reset all of its parameters so it doesn't take up space in the array
-        if (openFiles[i].isOpen && strcmp(openFiles[i].filename, upperFileName) == 0) {
-            openFiles[i].filename[0] = '\0';
-            openFiles[i].mode[0] = '\0';    
-            openFiles[i].fileCluster = 0;     
-            openFiles[i].offset = 0;          
-            openFiles[i].isOpen = false;
-            printf("File '%s' closed successfully.\n", filename);
-            return 0;
-        }
+// Function to mark the entry with the given FAT32 name in a directory as deleted (the caller writes the change back
+// with flushImage once the rest of its operation is done)
+void removeDirectoryEntry(uint32_t dirCluster, const char *filename) {
+    const struct DirIndexEntry *indexed = lookupDirIndex(dirCluster, filename);
+    if (!indexed) {
+        return;
     }
 
-    // If the function has not returned by now, the file was either not open or does not exist
-    printf("File '%s' is not open or does not exist in the directory.\n", filename);
-    return -1;
-}
-
-// Function to list all opened files
-void lsof() {
-    bool anyOpen = false;
-
-    // Header for the list
-    printf("%-10s %-12s %-10s %-10s %s\n", "Index", "Filename", "Mode", "Offset", "Path");
-    
-    // Loop through the array of open files and print out the details
-    for (int i = 0; i < 10; i++) {
-        if (openFiles[i].isOpen) {
-            anyOpen = true;
-
-            // Print details of each opened file
-            printf("%-10d %-12s %-10s %-10u %s\n",
-                   i, 
-                   openFiles[i].filename,
-                   openFiles[i].mode,
-                   openFiles[i].offset,
-                   openFiles[i].path);
-        }
+    struct FAT32DirectoryEntry *entries = (struct FAT32DirectoryEntry *)getCluster(indexed->entryCluster);
+    if (!entries) {
+        return;
     }
 
-    // If none are open, print that
-    if (!anyOpen) {
-        printf("No files are currently opened.\n");
-    }
+    entries[indexed->entryIndex].name[0] = 0xE5; // Mark as deleted
+    markClusterDirty(indexed->entryCluster);
+    removeDirIndexEntry(dirCluster, filename);
+    invalidateDentry(dirCluster, filename);
 }
 
-// Function to set the file offset for reading/writing
-int lseek(char* filename, uint32_t offset) {
-
-    // Get the uppercase of the name for comparison to FAT32 files
-    char upperFileName[12];
-    strncpy(upperFileName, filename, sizeof(upperFileName) - 1);
-    upperFileName[11] = '\0';
-    strtoupper(upperFileName);
-
-    // Loop through our open files, make sure it is in there and set the offset
-    for (int i = 0; i < 10; i++) {
-        // If we have found the file we are looking for
-        if (openFiles[i].isOpen && strcmp(openFiles[i].filename, upperFileName) == 0) {
-            uint32_t fileSize = getFileSize(openFiles[i].fileCluster);
-
-            // If the offset is too large, error
-            if (offset > fileSize) {
-                printf("Offset %u is larger than the size of the file '%s' (%u bytes).\n", offset, filename, fileSize);
-                return -1;
-            }
+// Function to free the cluster chain starting at a cluster
+void freeClusters(uint32_t clusterNumber) {
+    // Files that were never written have no chain (cluster 0) and nothing to free
+    freeClusterChains(&clusterNumber, 1);
+}
 
-            // Otherwise, set the offset
-            openFiles[i].offset = offset;
-            printf("Offset of file '%s' set to %u bytes.\n", filename, offset);
-            return 0; 
+// Function to add a cluster to a growable list
+int appendClusterList(struct ClusterList *list, uint32_t cluster) {
+    if (list->count == list->capacity) {
+        uint32_t capacity = list->capacity ? list->capacity * 2 : 64;
+        uint32_t *grown = realloc(list->clusters, capacity * sizeof(uint32_t));
+        if (!grown) {
+            return -1;
         }
+        list->clusters = grown;
+        list->capacity = capacity;
     }
-
-    // If we got this far, the file is not currently open
-    printf("File '%s' is not open or does not exist in the directory.\n", filename);
-    return -1;
+    list->clusters[list->count++] = cluster;
+    return 0;
 }
 
-#define min(a, b) ((a) < (b) ? (a) : (b))
-
-
-// Function to read a certain amount of characters from a specified file
-int read(char* filename, uint32_t size) {
+// Function to bring every cluster of a directory into the cache with one batch of reads before it is scanned.
+// Directories of one cluster are left to getCluster, and a mapped image is scanned in place; failures are left for
+// the scan itself to report.
+void loadDirectoryClusters(uint32_t dirCluster) {
+    struct ClusterList chain = { NULL, 0, 0 };
+    uint32_t limit = activeVolume->bufferCache.capacity / 2;
 
-    // Get the uppercase of the name for comparison to FAT32 files
-    char upperFileName[12];
-    strncpy(upperFileName, filename, sizeof(upperFileName) - 1);
-    upperFileName[11] = '\0';
-    strtoupper(upperFileName); 
-
-    // Loop through our open files, make sure the file we want to read is in it
-    for (int i = 0; i < 10; i++) {
-        // Check if file is open and get the total size of the file
-        if (openFiles[i].isOpen && strcmp(openFiles[i].filename, upperFileName) == 0) {
-            // First check if the file has read access
-            if (strchr(openFiles[i].mode, 'r') == NULL) {
-                printf("File '%s' is not opened for read.\n", filename);
-                return -1;
-            }
-
-            uint32_t fileSize = getFileSize(openFiles[i].fileCluster); 
-            // If we cannot read any more 
-            if (openFiles[i].offset >= fileSize) {
-                printf("Read position is beyond the end of the file.\n");
-                return -1;
-            }
-
-            // Create a buffer and determine the maximum readable size
-            uint32_t readSize = min(size, fileSize - openFiles[i].offset); 
-            uint8_t *buffer = calloc(1, readSize);
-            if (!buffer) {
-                printf("Unable to allocate memory for read buffer.\n");
-                return -1;
-            }
-
-            uint32_t currentCluster = openFiles[i].fileCluster;
-            uint32_t currentOffset = openFiles[i].offset;
-            uint32_t clusterSize = bootSector.sectorsPerCluster * bootSector.bytesPerSector;
-            uint32_t bytesLeft = readSize;
-            uint32_t bytesRead = 0;
-
-            // Read data until all requested bytes are read or end of file cluster chain is reached
-            while (bytesLeft > 0 && currentCluster < 0x0FFFFFF8) {
-                uint32_t clusterOffset = currentOffset % clusterSize;
-                uint32_t effectiveClusterSize = clusterSize - clusterOffset;
-                uint32_t bytesToRead = min(bytesLeft, effectiveClusterSize);
-                uint32_t clusterAddress = getFirstSectorOfCluster(currentCluster) * bootSector.bytesPerSector + clusterOffset;
-
-                fseek(imgFile, clusterAddress, SEEK_SET);
-                fread(buffer + bytesRead, 1, bytesToRead, imgFile);
-
-                bytesRead += bytesToRead;
-                bytesLeft -= bytesToRead;
-                currentOffset += bytesToRead;
-
-                // Move to the next cluster if needed
-                if (bytesLeft > 0) {
-                    currentCluster = getNextCluster(currentCluster);
-                    // Check for end of cluster chain, break if we reach the end
-                    if (currentCluster < 2 || currentCluster >= 0x0FFFFFF8) break; 
-                }
-            }
-
-            // Output the read data within the range of the buffer
-            printf("%.*s", bytesRead, buffer); 
-            printf("\n");
-            free(buffer);
+    if (dirCluster < 2 || isImageMapped() || getNextCluster(dirCluster) >= 0x0FFFFFF8) {
+        return;
+    }
 
-            // Update file offset after read and return success
-            openFiles[i].offset += bytesRead; 
-            return 0;
+    // The walk stops at the end of the chain, at a damaged link, or once the batch would be cut short anyway
+    for (uint32_t cluster = dirCluster; cluster >= 2 && cluster < 0x0FFFFFF8 && chain.count < limit; cluster = getNextCluster(cluster)) {
+        if (appendClusterList(&chain, cluster) != 0) {
+            break;
         }
     }
 
-    // If we made it this far, the file could not be found
-    printf("File '%s' is not found or not open for read.\n", filename);
-    return -1;
+    loadClusters(chain.clusters, chain.count);
+    free(chain.clusters);
 }
 
-// Function to write a string to a given file at the current offset
-int write(char *filename, char *string) {
-
-    // Get the uppercase of the name for comparison to FAT32 files
-    char upperFileName[12];
-    strncpy(upperFileName, filename, sizeof(upperFileName) - 1);
-    upperFileName[11] = '\0';
-    strtoupper(upperFileName);
+// Function to order cluster numbers for qsort
+static int compareClusters(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
 
-    // Make sure the file is open and we can write to it
-    int fileIndex = findOpenFile(upperFileName);
-    if (fileIndex == -1) {
-        printf("File '%s' is not open.\n", filename);
-        return -1;
-    }
+// Function to walk a directory tree once, breadth first, calling 'visit' for every entry in it except '.', '..',
+// deleted entries and labels. 'dirs' must hold the top directory; it is also the queue of directories still to scan,
+// and every subdirectory is added to it after it has been visited (so 'dir' indexes the directories in visit order).
+// The walk stops at the first result from 'visit' that is not FAT32_OK and returns it.
+int walkDirectoryTree(struct ClusterList *dirs, DirTreeVisitor visit, void *context) {
+    uint32_t entriesPerCluster = activeVolume->bootSector.sectorsPerCluster * (activeVolume->bootSector.bytesPerSector / sizeof(struct FAT32DirectoryEntry));
+    uint64_t nameMask[DIR_SCAN_MASK_WORDS(entriesPerCluster)];
 
-    if (strchr(openFiles[fileIndex].mode, 'w') == NULL) {
-        printf("File '%s' is not opened for writing.\n", filename);
-        return -1;
-    }
+    for (uint32_t d = 0; d < dirs->count; d++) {
+        uint32_t dirCluster = dirs->clusters[d];
 
-    uint32_t cluster = openFiles[fileIndex].fileCluster;
-    uint32_t offset = openFiles[fileIndex].offset;
-    uint32_t fileSize = getFileSize(cluster);
-    uint32_t clusterSize = bootSector.sectorsPerCluster * bootSector.bytesPerSector;
-    uint32_t writeSize = strlen(string);
-
-    // Extend the size of the file if we need to
-    if (offset + writeSize > fileSize) {
-        printf("Extending file size...\n");
-        // Extend the file to fit the new data
-        if (!extendFileSize(&openFiles[fileIndex], offset + writeSize)) {
-            printf("Unable to extend file size.\n");
-            return -1;
+        // Every directory is scanned once, and a tree can never hold more directories than the volume has clusters
+        if (dirs->count > activeVolume->allocator.clusterCount) {
+            return FAT32_ERR_IO;
         }
-    }
 
-    uint32_t bytesWritten = 0;
+        bool ended = false;
+        loadDirectoryClusters(dirCluster);
+        for (uint32_t cluster = dirCluster; cluster >= 2 && cluster < 0x0FFFFFF8 && !ended; cluster = getNextCluster(cluster)) {
+            const struct FAT32DirectoryEntry *entries = (const struct FAT32DirectoryEntry *)peekCluster(cluster);
+            if (!entries) {
+                return FAT32_ERR_IO;
+            }
 
-    // While we have not written all of the bytes we need to, keep writing
-    while (bytesWritten < writeSize) {
-        uint32_t clusterOffset = offset % clusterSize;
-        uint32_t effectiveClusterSize = clusterSize - clusterOffset;
-        uint32_t bytesToWrite = (writeSize - bytesWritten < effectiveClusterSize) ? writeSize - bytesWritten : effectiveClusterSize;
-        uint32_t clusterAddress = getFirstSectorOfCluster(cluster) * bootSector.bytesPerSector + clusterOffset;
+            // If the cluster holds the end of the directory, we are done with it after this cluster
+            struct DirScanResult scan;
+            scanDirEntries(entries, entriesPerCluster, NULL, nameMask, NULL, &scan);
+            ended = scan.endIndex != -1;
 
-        fseek(imgFile, clusterAddress, SEEK_SET);
-        fwrite(string + bytesWritten, 1, bytesToWrite, imgFile);
+            for (uint32_t i = nextDirScanEntry(nameMask, entriesPerCluster, 0); i < entriesPerCluster;
+                 i = nextDirScanEntry(nameMask, entriesPerCluster, i + 1)) {
+                const struct FAT32DirectoryEntry *dirEntry = &entries[i];
 
-        bytesWritten += bytesToWrite;
-        offset += bytesToWrite;
+                // Skip current/parent directory references (deleted entries and labels are not in the name mask)
+                if (strncmp((const char *)dirEntry->name, ".          ", 11) == 0 || strncmp((const char *)dirEntry->name, "..         ", 11) == 0) {
+                    continue;
+                }
 
-        // Update the file offset in the open file structure
-        openFiles[fileIndex].offset = offset;
+                int result = visit(dirEntry, d, dirCluster, cluster, i, context);
+                if (result != FAT32_OK) {
+                    return result;
+                }
 
-        // If we are not at the end of writing, see if we are at the end of the cluster
-        if (bytesWritten < writeSize) {
-            uint32_t nextCluster = getNextCluster(cluster);
-            if (nextCluster < 2 || nextCluster >= 0x0FFFFFF8) { 
-                printf("No additional clusters available.\n");
-                return -1;
+                uint32_t childCluster = (dirEntry->firstClusterHi << 16) | dirEntry->firstClusterLo;
+                if ((dirEntry->attributes & ATTR_DIRECTORY) && childCluster >= 2 && appendClusterList(dirs, childCluster) != 0) {
+                    return FAT32_ERR_NO_MEMORY;
+                }
             }
-            cluster = nextCluster;
         }
     }
-
-    // Flush the file to make sure data was written to the disk and print success message
-    fflush(imgFile); 
-    printf("%s written to '%s'.\n", string, filename);
-
-    return 0;
+    return FAT32_OK;
 }
 
-// Function to remove a file entry
-int rm(const char *filename) {
-    struct FAT32DirectoryEntry dirEntry;
+// Function to collect the first cluster of every file chain in a tree being deleted. Nothing is deleted if the tree
+// holds the current directory or an open file.
+static int collectTreeEntry(const struct FAT32DirectoryEntry *dirEntry, uint32_t dir, uint32_t dirCluster,
+                            uint32_t entryCluster, uint32_t entryIndex, void *context) {
+    struct ClusterList *chains = context;
+    uint32_t childCluster = (dirEntry->firstClusterHi << 16) | dirEntry->firstClusterLo;
+    (void)dir;
+    (void)entryCluster;
+    (void)entryIndex;
 
-    if (findOpenFile(filename) != -1) {
-        printf("File '%s' is currently open and cannot be deleted.\n", filename);
-        return -3;
+    if (dirEntry->attributes & ATTR_DIRECTORY) {
+        return childCluster == activeVolume->currentDirCluster ? FAT32_ERR_BUSY : FAT32_OK;
     }
 
-    if (findDirectoryEntry(filename, &dirEntry) != 0) {
-        return -1;
+    char fat32Name[12];
+    memcpy(fat32Name, dirEntry->name, 11);
+    fat32Name[11] = '\0';
+    if (isEntryOpen(dirCluster, fat32Name)) {
+        return FAT32_ERR_BUSY;
     }
-
-    if ((dirEntry.attributes & ATTR_DIRECTORY) == ATTR_DIRECTORY) {
-        printf("'%s' is a directory, not a file.\n", filename);
-        return -2;
+    if (childCluster >= 2 && appendClusterList(chains, childCluster) != 0) {
+        return FAT32_ERR_NO_MEMORY;
     }
-
-    // Proceed with deletion if it's a file
-    char fat32Name[12];
-    toFAT32Name(filename, fat32Name);
-    removeDirectoryEntry(fat32Name);
-    freeClusters((dirEntry.firstClusterHi << 16) | dirEntry.firstClusterLo);
-    printf("File '%s' successfully deleted.\n", filename);
-    return 0;
+    return FAT32_OK;
 }
 
-// Function to remove a directory entry
-int rmdir(const char *dirname) {
-
-    struct FAT32DirectoryEntry dirEntry;
+// Function to delete a directory and everything under it in one pass. The tree is walked once to collect every
+// cluster chain in it; if it holds the current directory or an open file nothing is deleted and FAT32_ERR_BUSY is
+// returned. Otherwise all chains are freed in one batched FAT update, and the only directory entry written is the
+// one for the directory in its parent (entries inside the tree go away with the clusters holding them).
+int deleteTree(uint32_t parentCluster, const char *fat32Name, uint32_t dirCluster) {
+    struct ClusterList dirs = { NULL, 0, 0 };
+    struct ClusterList chains = { NULL, 0, 0 };
 
-    if (findDirectoryEntry(dirname, &dirEntry) != 0) {
-        printf("Directory '%s' does not exist.\n", dirname);
-        return -1;
-    }
-
-    if ((dirEntry.attributes & ATTR_DIRECTORY) != ATTR_DIRECTORY) {
-        printf("'%s' is not a directory.\n", dirname);
-        return -1;
-    }
+    int result = appendClusterList(&dirs, dirCluster) == 0 ? walkDirectoryTree(&dirs, collectTreeEntry, &chains) : FAT32_ERR_NO_MEMORY;
 
-    // Check if the directory is empty
-    uint32_t cluster = (dirEntry.firstClusterHi << 16) | dirEntry.firstClusterLo;
-    if (!isDirectoryEmpty(cluster)) {
-        printf("Directory '%s' is not empty.\n", dirname);
-        return -1;
+    // The clusters of every directory in the tree are freed along with the file chains
+    for (uint32_t d = 0; d < dirs.count && result == FAT32_OK; d++) {
+        if (appendClusterList(&chains, dirs.clusters[d]) != 0) {
+            result = FAT32_ERR_NO_MEMORY;
+        }
     }
-
-    // Proceed with deletion
-    char fat32Name[12];
-    toFAT32Name(dirname, fat32Name);
-    removeDirectoryEntry(fat32Name);
-    freeClusters(cluster);
-    printf("Directory '%s' successfully removed.\n", dirname);
-    return 0;
-}
-
-// Rm -r recursive function to remove a directory and its contents
-void rmr(const char *dirname) {
-    struct FAT32DirectoryEntry dirEntry;
-
-    // Check if the directory exists
-    if (findDirectoryEntry(dirname, &dirEntry) != 0) {
-        printf("Directory '%s' does not exist.\n", dirname);
-        return;
+    if (result != FAT32_OK) {
+        free(dirs.clusters);
+        free(chains.clusters);
+        return result;
     }
 
-    if ((dirEntry.attributes & ATTR_DIRECTORY) != ATTR_DIRECTORY) {
-        printf("'%s' is not a directory.\n", dirname);
-        return;
+    // The freed directory clusters must not be written back from the cache, and their indexes are stale
+    for (uint32_t d = 0; d < dirs.count; d++) {
+        for (uint32_t cluster = dirs.clusters[d]; cluster < 0x0FFFFFF8; cluster = getNextCluster(cluster)) {
+            invalidateCluster(cluster);
+        }
+        dropDirIndex(dirs.clusters[d]);
     }
+    qsort(dirs.clusters, dirs.count, sizeof(uint32_t), compareClusters);
+    dropDentriesUnderAll(dirs.clusters, dirs.count);
 
-    // Get the starting cluster for the directory
-    uint32_t cluster = (dirEntry.firstClusterHi << 16) | dirEntry.firstClusterLo;
-
-    // Recursively delete all files and subdirectories
-    deleteDirectoryContents(cluster);
-
-    // After deleting contents, remove the directory itself
-    char fat32Name[12];
-    toFAT32Name(dirname, fat32Name);
-    removeDirectoryEntry(fat32Name);
-    freeClusters(cluster);
+    freeClusterChains(chains.clusters, chains.count);
+    removeDirectoryEntry(parentCluster, fat32Name);
+    flushImage();
 
-    printf("Directory '%s' removed successfully.\n", dirname);
+    free(dirs.clusters);
+    free(chains.clusters);
+    return FAT32_OK;
 }
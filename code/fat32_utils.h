@@ -2,42 +2,50 @@
 #define FAT32_UTILS_H
 
 #include "fat32_structs.h"
+#include "fat32_api.h"
 #include <stdio.h>
 
+// When changes made by shell operations are written back to the image
+struct FlushPolicy {
+    bool deferred;   // Whether operations leave their changes cached until the next checkpoint (batch mode)
+    bool pending;    // Whether there are changes waiting for a checkpoint
+};
+
+// Growable list of cluster numbers
+struct ClusterList {
+    uint32_t *clusters;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+// Called for every entry of a directory tree walk; 'dir' is the position of its directory in the walk (0 for the top)
+typedef int (*DirTreeVisitor)(const struct FAT32DirectoryEntry *entry, uint32_t dir, uint32_t dirCluster,
+                              uint32_t entryCluster, uint32_t entryIndex, void *context);
+
 // Helper functions
 void strtoupper(char *str);
 void formatDirName(const char *entryName, char *formattedName);
 void toFAT32Name(const char* input, char* fat32Name);
 uint32_t getFirstSectorOfCluster(uint32_t clusterNumber);
+uint64_t getClusterOffset(uint32_t clusterNumber);
 uint32_t getNextCluster(uint32_t currentCluster);
-uint32_t findFreeCluster();
 void updateFATChain(uint32_t cluster, uint32_t nextCluster);
-bool isValidMode(const char *mode);
-int findOpenFile(const char *filename);
+void zeroCluster(uint32_t cluster);
+int syncOpenFile(struct OpenFile *file);
+int checkpointImage();
+void flushImage();
+int findOpenFilePath(const char *path);
+bool isEntryOpen(uint32_t dirCluster, const char *fat32Name);
 uint32_t getFileSize(uint32_t firstCluster);
-uint32_t convertToUint32(const char *str);
 bool extendFileSize(struct OpenFile *file, uint32_t newSize);
 int isDirectoryEmpty(uint32_t cluster);
-void removeDirectoryEntry(const char *filename);
+void removeDirectoryEntry(uint32_t dirCluster, const char *filename);
 void freeClusters(uint32_t clusterNumber);
-int findDirectoryEntry(const char *filename, struct FAT32DirectoryEntry *entry);
-void deleteDirectoryContents(uint32_t cluster);
-
+int findDirectoryEntry(uint32_t dirCluster, const char *filename, struct FAT32DirectoryEntry *entry);
+int appendClusterList(struct ClusterList *list, uint32_t cluster);
+void loadDirectoryClusters(uint32_t dirCluster);
+int walkDirectoryTree(struct ClusterList *dirs, DirTreeVisitor visit, void *context);
+int deleteTree(uint32_t parentCluster, const char *fat32Name, uint32_t dirCluster);
 
-// Main implementation shell functions
-void printInfo(const struct FAT32BootSector *bs);
-void ls(int currentClusterNumber);
-int cd(int currentDirCluster, const char *dirName);
-void creat(const char *filename);
-void mkdir(const char *dirName);
-int open(char* filename, char* mode);
-int close(char* filename);
-void lsof();
-int lseek(char* filename, uint32_t offset);
-int read(char* filename, uint32_t size);
-int write(char *filename, char *string);
-int rm(const char *filename);
-int rmdir(const char *filename);
-void rmr(const char* dirname);
 
-#endif 
+#endif
@@ -0,0 +1,169 @@
+#include "fat32_structs.h"
+#include "fat32_writebuf.h"
+#include "fat32_api.h"
+#include "fat32_utils.h"
+#include "fat32_extent.h"
+#include "fat32_alloc.h"
+#include "fat32_io.h"
+#include "fat32_journal.h"
+#include "fat32_bufcache.h"
+#include "fat32_filetable.h"
+#include "globals.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+// ------------------------------------------------------------------------------------------------ //
+
+// Write buffer implementations
+
+// Function to get the number of clusters the buffered data of a file will need (these are kept reserved)
+uint32_t writeBufferClusters(const struct OpenFile *file) {
+    uint32_t clusterSize = activeVolume->bootSector.sectorsPerCluster * activeVolume->bootSector.bytesPerSector;
+    return (uint32_t)(((uint64_t)file->writeBufferLength + clusterSize - 1) / clusterSize);
+}
+
+// Function to write data straight to the image, starting at a logical cluster of a file that already has the
+// clusters. Each physically contiguous run becomes one vectored request, the last cluster is padded with zeroes,
+// and all runs go to the image as a single batch (through the journal, which keeps replay from overwriting them).
+int writeFileClusters(struct OpenFile *file, uint32_t logicalCluster, const void *data, uint32_t length) {
+    uint32_t clusterSize = activeVolume->bootSector.sectorsPerCluster * activeVolume->bootSector.bytesPerSector;
+    struct ImageRequest *requests = NULL;
+    struct iovec *iov = NULL;
+    uint8_t *zeroes = NULL;
+    int requestCount = 0, requestCapacity = 0;
+    int result = FAT32_OK;
+
+    uint32_t done = 0;
+    while (done < length) {
+        uint32_t runRemaining;
+        uint32_t cluster = lookupCluster(file, logicalCluster + done / clusterSize, &runRemaining);
+        if (cluster == 0xFFFFFFFF) {
+            result = FAT32_ERR_IO;
+            break;
+        }
+
+        uint32_t runLength = (uint32_t)min((uint64_t)runRemaining * clusterSize, (uint64_t)(length - done));
+        uint32_t clusters = (runLength + clusterSize - 1) / clusterSize;
+        uint32_t padding = clusters * clusterSize - runLength;
+        if (padding && !zeroes && !(zeroes = calloc(1, clusterSize))) {
+            result = FAT32_ERR_NO_MEMORY;
+            break;
+        }
+
+        // Every request has room for the data and the padding, and keeps pointing into the same iovec array
+        if (requestCount == requestCapacity) {
+            int capacity = requestCapacity ? requestCapacity * 2 : 16;
+            struct ImageRequest *grownRequests = realloc(requests, capacity * sizeof(struct ImageRequest));
+            if (grownRequests) requests = grownRequests;
+            struct iovec *grownIov = realloc(iov, capacity * 2 * sizeof(struct iovec));
+            if (grownIov) iov = grownIov;
+            if (!grownRequests || !grownIov) {
+                result = FAT32_ERR_NO_MEMORY;
+                break;
+            }
+            requestCapacity = capacity;
+        }
+
+        // Cached copies of these clusters would be stale once the image is written underneath them
+        for (uint32_t c = 0; c < clusters; c++) {
+            invalidateCluster(cluster + c);
+        }
+
+        iov[requestCount * 2].iov_base = (uint8_t *)data + done;
+        iov[requestCount * 2].iov_len = runLength;
+        iov[requestCount * 2 + 1].iov_base = zeroes;
+        iov[requestCount * 2 + 1].iov_len = padding;
+        requests[requestCount].offset = getClusterOffset(cluster);
+        requests[requestCount].count = padding ? 2 : 1;
+        requestCount++;
+        done += runLength;
+    }
+
+    // The iovec array may have moved while growing, so the requests are pointed at it only now
+    for (int i = 0; i < requestCount; i++) {
+        requests[i].iov = &iov[i * 2];
+    }
+    if (result == FAT32_OK && journalWriteBatch(requests, requestCount) != 0) {
+        result = FAT32_ERR_IO;
+    }
+
+    free(requests);
+    free(iov);
+    free(zeroes);
+    return result;
+}
+
+// Function to put data into the write buffer of a file at a position relative to the end of its allocated clusters
+// (at most the buffered length, so the buffer never has holes). Clusters for the data are reserved, not allocated.
+int bufferWrite(struct OpenFile *file, uint32_t position, const void *data, uint32_t length) {
+    uint32_t clusterSize = activeVolume->bootSector.sectorsPerCluster * activeVolume->bootSector.bytesPerSector;
+    uint32_t newLength = position + length > file->writeBufferLength ? position + length : file->writeBufferLength;
+
+    if (newLength > WRITE_BUFFER_MAX) {
+        return FAT32_ERR_INVALID;
+    }
+
+    // Reserve the clusters the buffer grows into so allocating them later cannot fail
+    uint32_t oldClusters = writeBufferClusters(file);
+    uint32_t newClusters = (uint32_t)(((uint64_t)newLength + clusterSize - 1) / clusterSize);
+    if (newClusters > oldClusters && !reserveClusters(newClusters - oldClusters)) {
+        return FAT32_ERR_NO_SPACE;
+    }
+
+    if (newLength > file->writeBufferCapacity) {
+        uint32_t capacity = file->writeBufferCapacity ? file->writeBufferCapacity : WRITE_BUFFER_INITIAL;
+        while (capacity < newLength) {
+            capacity *= 2;
+        }
+        capacity = min(capacity, WRITE_BUFFER_MAX);
+
+        uint8_t *grown = realloc(file->writeBuffer, capacity);
+        if (!grown) {
+            releaseClusters(newClusters - oldClusters);
+            return FAT32_ERR_NO_MEMORY;
+        }
+        file->writeBuffer = grown;
+        file->writeBufferCapacity = capacity;
+    }
+
+    memcpy(file->writeBuffer + position, data, length);
+    file->writeBufferLength = newLength;
+    return FAT32_OK;
+}
+
+// Function to allocate clusters for everything in the write buffer of a file at once, as one extent where the
+// volume allows it, and write the data out with as few large writes as possible
+int flushWriteBuffer(struct OpenFile *file) {
+    uint32_t clusterSize = activeVolume->bootSector.sectorsPerCluster * activeVolume->bootSector.bytesPerSector;
+
+    if (file->writeBufferLength == 0) {
+        return FAT32_OK;
+    }
+
+    // The reservation is turned into a real allocation now that the full size is known
+    uint32_t firstNewCluster = file->clusterCount;
+    uint32_t reserved = writeBufferClusters(file);
+    releaseClusters(reserved);
+    if (!extendFileSize(file, (uint32_t)((uint64_t)firstNewCluster * clusterSize + file->writeBufferLength))) {
+        reserveClusters(reserved);
+        return FAT32_ERR_NO_SPACE;
+    }
+
+    int result = writeFileClusters(file, firstNewCluster, file->writeBuffer, file->writeBufferLength);
+    file->writeBufferLength = 0;
+    queueOpenFileSync(file);
+    return result;
+}
+
+// Function to drop the write buffer of a file along with its reservation
+void freeWriteBuffer(struct OpenFile *file) {
+    releaseClusters(writeBufferClusters(file));
+    free(file->writeBuffer);
+    file->writeBuffer = NULL;
+    file->writeBufferLength = 0;
+    file->writeBufferCapacity = 0;
+}
@@ -0,0 +1,18 @@
+#ifndef FAT32_WRITEBUF_H
+#define FAT32_WRITEBUF_H
+
+#include "fat32_structs.h"
+#include <stdint.h>
+
+// First size of a file's write buffer, and the most it holds before it is allocated and written out
+#define WRITE_BUFFER_INITIAL (64u << 10)
+#define WRITE_BUFFER_MAX (8u << 20)
+
+// Write buffer functions
+int writeFileClusters(struct OpenFile *file, uint32_t logicalCluster, const void *data, uint32_t length);
+int bufferWrite(struct OpenFile *file, uint32_t position, const void *data, uint32_t length);
+int flushWriteBuffer(struct OpenFile *file);
+void freeWriteBuffer(struct OpenFile *file);
+uint32_t writeBufferClusters(const struct OpenFile *file);
+
+#endif
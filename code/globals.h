@@ -3,11 +3,11 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include "fat32_mount.h"
 
-extern FILE *imgFile;
-extern struct FAT32BootSector bootSector;
-extern uint32_t currentDirCluster;
-extern struct OpenFile openFiles[10];
+// The volume every file system function works on in this thread (set with selectVolume), so threads working on
+// different volumes do not get in each other's way
+extern __thread struct FAT32Volume *activeVolume;
 
 #define ATTR_READ_ONLY   0x01
 #define ATTR_HIDDEN      0x02
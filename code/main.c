@@ -3,40 +3,48 @@
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
-#include "fat32_structs.h"
-#include "fat32_utils.h"
+#include "fat32_api.h"
+#include "fat32_io.h"
+#include "fat32_shell.h"
+#include "fat32_mkfs.h"
+#include "fat32_fsck.h"
 
 // ------------------------------------------------------------------------------------------------ //
 
-// Global variables
-struct FAT32BootSector bootSector;
-FILE *imgFile = NULL;
-uint32_t currentDirCluster;
-struct OpenFile openFiles[10];
+// Longest command line the shell accepts
+#define SHELL_LINE_MAX 4096
 
-// ------------------------------------------------------------------------------------------------ //
+// Size of the stdout buffer used in batch mode
+#define BATCH_OUTPUT_BUFFER (1 << 20)
 
-// Shell function to display the current path and take in user input until "exit"
-void shell(const char *imageName, const struct FAT32BootSector *bs) {
-    char cmd[100];
-    char path[256] = "/";
+// ------------------------------------------------------------------------------------------------ //
 
-    // Initialize the current cluster
-    currentDirCluster = bs->rootCluster;
+// Shell function to display the current path and take in user input until "exit".
+// In batch mode commands come from a script without prompts, and changes are only written back
+// every 'checkpointInterval' commands (0 means only at exit) or on "sync".
+void shell(const char *imageName, struct FAT32Volume *volume, FILE *input, bool batch, uint32_t checkpointInterval) {
+    char cmd[SHELL_LINE_MAX];
+    uint32_t commandsRun = 0;
 
-    printf("%s%s> ", imageName, path);
-    while (fgets(cmd, sizeof(cmd), stdin)) {
+    if (!batch) printf("%s%s> ", imageName, fat32Getcwd(volume));
+    while (fgets(cmd, sizeof(cmd), input)) {
         // Remove newline character from cmd
-        cmd[strcspn(cmd, "\n")] = 0;
+        cmd[strcspn(cmd, "\r\n")] = 0;
 
         // Split command from potential arguments
         char *command = strtok(cmd, " ");
         char *argument = strtok(NULL, " ");
         char *remainingArguments = strtok(NULL, "");
 
+        // Skip blank lines and comments
+        if (command == NULL || command[0] == '#') {
+            if (!batch) printf("%s%s> ", imageName, fat32Getcwd(volume));
+            continue;
+        }
+
         // Info command
         if (strcmp(command, "info") == 0) {
-            printInfo(bs);
+            shellInfo(volume);
         }
 
         // Exit command
@@ -45,58 +53,29 @@ void shell(const char *imageName, const struct FAT32BootSector *bs) {
             break;
         }
 
+        // Sync command (write every pending change back to the image now)
+        else if (strcmp(command, "sync") == 0) {
+            if (fat32Sync(volume) != FAT32_OK) {
+                printf("Error writing changes back to the image.\n");
+            }
+        }
+
         // Cd command
         else if (strcmp(command, "cd") == 0) {
             // If no directory given
             if (argument == NULL) {
                 printf("No directory specified.\n");
             }
-            // As long as not cd . 
-            else if (strcmp(argument, ".") != 0) {
-                // Call the cd command to get our new cluster
-                int newCluster = cd(currentDirCluster, argument);
-                if (newCluster != -1) {
-                    currentDirCluster = newCluster;
-                    // If cd ..
-                    if (strcmp(argument, "..") == 0) {
-                        // Handle path update
-                        if (strcmp(path, "/") != 0) {
-                            char *lastSlash = strrchr(path, '/');
-                            if (lastSlash != NULL) {
-                                if (lastSlash == path) {
-                                    // If the only slash is at the beginning, ensure root path remains
-                                    *(lastSlash + 1) = '\0';
-                                } else {
-                                    // If there's more than one slash, terminate the path at the last slash
-                                    *lastSlash = '\0';
-                                }
-                            }
-                        }
-                    }
-                    // For any other valid cd command, go to that directory
-                    else {
-                        // Update path, ensure no buffer overflow
-                        if (strlen(path) + strlen(argument) < sizeof(path) - 2) {
-                            if (strcmp(path, "/") != 0) strcat(path, "/");
-                            strcat(path, argument);
-                        }
-                    }
-                } 
-                // Otherwise, the directory could not be found
-                else {
-                    if (newCluster == -1) {
-                        printf("Directory %s does not exist.\n", argument);
-                    }
-                    else if (newCluster == -2) {
-                        printf("%s is not a directory.\n", argument);
-                    }
-                }
+            // Otherwise move to the directory (the current path follows "..", "." and absolute paths)
+            else {
+                shellCd(volume, argument);
             }
         }
 
         // Ls command
         else if (strcmp(command, "ls") == 0) {
-            ls(currentDirCluster);
+            // List the current directory, or the directory at the path given
+            shellLs(volume, argument);
         }
 
         // Mkdir command
@@ -105,7 +84,7 @@ void shell(const char *imageName, const struct FAT32BootSector *bs) {
                 printf("No directory name specified.\n");
             } 
             else {
-                mkdir(argument);
+                shellMkdir(volume, argument);
             }
         }
 
@@ -115,7 +94,7 @@ void shell(const char *imageName, const struct FAT32BootSector *bs) {
                 printf("No file name specified.\n");
             } 
             else {
-                creat(argument);
+                shellCreat(volume, argument);
             }
         }
 
@@ -128,7 +107,7 @@ void shell(const char *imageName, const struct FAT32BootSector *bs) {
                 printf("No mode specified.\n");
             } 
             else {
-                open(argument, remainingArguments);
+                shellOpen(volume, argument, remainingArguments);
             }
 
         }
@@ -139,13 +118,13 @@ void shell(const char *imageName, const struct FAT32BootSector *bs) {
                 printf("No file name specified.\n");
             } 
             else {
-                close(argument);
+                shellClose(volume, argument);
             }
         }
 
         // Lsof command
         else if (strcmp(command, "lsof") == 0) {
-            lsof();
+            shellLsof(volume);
         }
 
         // Lseek command
@@ -158,7 +137,7 @@ void shell(const char *imageName, const struct FAT32BootSector *bs) {
             } 
             else {
                 uint32_t offset = convertToUint32(remainingArguments);
-                lseek(argument, offset);
+                shellLseek(volume, argument, offset);
             }
 
         }
@@ -175,7 +154,7 @@ void shell(const char *imageName, const struct FAT32BootSector *bs) {
 
             else{
                 uint32_t size = convertToUint32(remainingArguments);
-                read(argument,size);
+                shellRead(volume, argument, size);
             }
         }
 
@@ -190,10 +169,46 @@ void shell(const char *imageName, const struct FAT32BootSector *bs) {
             }
 
             else{
-                write(argument, remainingArguments);
+                shellWrite(volume, argument, remainingArguments);
+            }
+        }
+
+
+        // Import command (copy a host file into the image)
+        else if (strcmp(command, "import") == 0) {
+            if (argument == NULL) {
+                printf("No host file specified.\n");
+            }
+            else if (remainingArguments == NULL) {
+                printf("No file name specified.\n");
+            }
+            else {
+                shellImport(volume, argument, remainingArguments);
+            }
+        }
+
+        // Export command (copy a file of the image out to the host)
+        else if (strcmp(command, "export") == 0) {
+            if (argument == NULL) {
+                printf("No file name specified.\n");
+            }
+            else if (remainingArguments == NULL) {
+                printf("No host file specified.\n");
+            }
+            else {
+                shellExport(volume, argument, remainingArguments);
             }
         }
 
+        // Frag command (report how fragmented the files under a directory are)
+        else if (strcmp(command, "frag") == 0) {
+            shellFrag(volume, argument);
+        }
+
+        // Defrag command (move fragmented files into contiguous runs, within optional time and I/O limits)
+        else if (strcmp(command, "defrag") == 0) {
+            shellDefrag(volume, argument, remainingArguments);
+        }
 
         // Rm and rm -r commands
         else if (strcmp(command, "rm") == 0) {
@@ -206,15 +221,12 @@ void shell(const char *imageName, const struct FAT32BootSector *bs) {
                     printf("No file name specified.\n");
                 }
                 else {
-                    rmr(remainingArguments);
+                    shellRmr(volume, remainingArguments);
                 }
             }
             // If just rm
             else {
-                int ret = rm(argument);
-                if (ret == -1) {
-                    printf("File '%s' does not exist.\n", argument);
-                }
+                shellRm(volume, argument);
             }
         }
 
@@ -223,7 +235,7 @@ void shell(const char *imageName, const struct FAT32BootSector *bs) {
             if (argument == NULL) {
                 printf("No directory name specified.\n");            
             } else {
-                rmdir(argument);
+                shellRmdir(volume, argument);
             }
         }
 
@@ -232,8 +244,14 @@ void shell(const char *imageName, const struct FAT32BootSector *bs) {
             printf("Unknown command.\n");
         }
 
+        // Write deferred changes back once enough commands have run since the last checkpoint
+        commandsRun++;
+        if (batch && checkpointInterval != 0 && commandsRun % checkpointInterval == 0 && fat32HasPendingChanges(volume)) {
+            fat32Sync(volume);
+        }
+
         // Print the image name and path after each input
-        printf("%s%s> ", imageName, path);
+        if (!batch) printf("%s%s> ", imageName, fat32Getcwd(volume));
     }
 }
 
@@ -241,32 +259,150 @@ void shell(const char *imageName, const struct FAT32BootSector *bs) {
 
 // Main function
 int main(int argc, char *argv[]) {
+    enum ImageBackend backend = IO_BACKEND_MMAP;
+    uint32_t cacheCapacity = 0;
+    const char *scriptName = NULL;
+    uint32_t checkpointInterval = 0;
+    struct MkfsOptions mkfsOptions;
+    bool format = false;
+    struct FsckOptions fsckOptions;
+    bool check = false;
+    bool journaled = false;
+
+    defaultMkfsOptions(&mkfsOptions);
+    defaultFsckOptions(&fsckOptions);
+
     // Check if the code is being run properly with the fat32 image
-    if (argc != 2) {
-        printf("To run this program, try: ./code fat32.img\n");
+    if (argc < 2 || argc % 2 != 0) {
+        printf("To run this program, try: ./code fat32.img [-io mmap|stdio|uring] [-cache CLUSTERS] [-f SCRIPT|-] [-checkpoint COMMANDS] [-journal yes|no]\n");
+        printf("To create a new image, try: ./code fat32.img -mkfs SIZE [-bps BYTES] [-spc SECTORS] [-fats N] [-label NAME] [-zero yes|no]\n");
+        printf("To check an image, try: ./code fat32.img -fsck check|repair [-threads N]\n");
         return 1;
     }
 
-    // Open the fat32 image file and assign it to the global imgFile
-    imgFile = fopen(argv[1], "r+");
-    if (!imgFile) {
+    // Read the optional settings that follow the image name
+    for (int i = 2; i < argc; i += 2) {
+        if (strcmp(argv[i], "-io") == 0) {
+            if (parseImageBackend(argv[i + 1], &backend) != 0) {
+                printf("Unknown I/O backend '%s', expected mmap, stdio or uring.\n", argv[i + 1]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-cache") == 0) {
+            cacheCapacity = convertToUint32(argv[i + 1]);
+            if (cacheCapacity == 0) {
+                printf("The cache size must be a positive number of clusters.\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-f") == 0) {
+            scriptName = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-checkpoint") == 0) {
+            checkpointInterval = convertToUint32(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-journal") == 0) {
+            journaled = strcmp(argv[i + 1], "yes") == 0;
+        }
+        else if (strcmp(argv[i], "-mkfs") == 0) {
+            if (parseSize(argv[i + 1], &mkfsOptions.sizeBytes) != 0) {
+                printf("Invalid image size '%s', expected a number with an optional K, M, G or T suffix.\n", argv[i + 1]);
+                return 1;
+            }
+            format = true;
+        }
+        else if (strcmp(argv[i], "-bps") == 0) {
+            mkfsOptions.bytesPerSector = convertToUint32(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-spc") == 0) {
+            mkfsOptions.sectorsPerCluster = convertToUint32(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-fats") == 0) {
+            mkfsOptions.numFATs = convertToUint32(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-label") == 0) {
+            strncpy(mkfsOptions.volumeLabel, argv[i + 1], sizeof(mkfsOptions.volumeLabel) - 1);
+        }
+        else if (strcmp(argv[i], "-zero") == 0) {
+            mkfsOptions.zeroFill = strcmp(argv[i + 1], "yes") == 0;
+        }
+        else if (strcmp(argv[i], "-fsck") == 0) {
+            if (strcmp(argv[i + 1], "check") != 0 && strcmp(argv[i + 1], "repair") != 0) {
+                printf("Unknown fsck mode '%s', expected check or repair.\n", argv[i + 1]);
+                return 1;
+            }
+            fsckOptions.repair = strcmp(argv[i + 1], "repair") == 0;
+            check = true;
+        }
+        else if (strcmp(argv[i], "-threads") == 0) {
+            fsckOptions.threads = convertToUint32(argv[i + 1]);
+        }
+        else {
+            printf("Unknown option '%s'.\n", argv[i]);
+            return 1;
+        }
+    }
+
+    // In mkfs mode, write a new file system to the image and exit
+    if (format) {
+        return formatImage(argv[1], &mkfsOptions) == 0 ? 0 : 1;
+    }
+
+    // In fsck mode, check the image (which must not be open anywhere else) and exit with the fsck status
+    if (check) {
+        return checkImage(argv[1], &fsckOptions, NULL);
+    }
+
+    // Open the image and load the FAT, free-cluster bitmap and cluster cache
+    struct FAT32Volume *volume;
+    int result = fat32Mount(argv[1], backend, cacheCapacity, &volume);
+    if (result == FAT32_ERR_NOT_FOUND) {
         printf("Error: File does not exist.\n");
         return 1;
     }
+    else if (result != FAT32_OK) {
+        printf("Error mounting '%s': %s.\n", argv[1], fat32StrError(result));
+        return 1;
+    }
 
-    fseek(imgFile, 0, SEEK_SET);
-
-    // Load the boot sector into the global bootSector variable
-    if (fread(&bootSector, sizeof(struct FAT32BootSector), 1, imgFile) != 1) {
-        printf("Error reading boot sector: %s.\n", strerror(errno));
-        fclose(imgFile);
+    // Mounting replays whatever a crash left in the journal; from here on, write-backs can be journaled too
+    struct FAT32VolumeInfo volumeInfo;
+    fat32GetVolumeInfo(volume, &volumeInfo);
+    if (volumeInfo.journalReplayed > 0) {
+        printf("Replayed %u journal transactions from an unclean shutdown.\n", volumeInfo.journalReplayed);
+    }
+    if (journaled && (result = fat32SetJournal(volume, true)) != FAT32_OK) {
+        printf("Unable to start the journal for '%s': %s.\n", argv[1], fat32StrError(result));
+        fat32Unmount(volume);
         return 1;
     }
 
+    // In batch mode, read commands from the script (or stdin for "-") and leave changes cached until a checkpoint
+    FILE *input = stdin;
+    bool batch = scriptName != NULL;
+    if (batch) {
+        if (strcmp(scriptName, "-") != 0) {
+            input = fopen(scriptName, "r");
+            if (!input) {
+                printf("Unable to open script '%s': %s.\n", scriptName, strerror(errno));
+                fat32Unmount(volume);
+                return 1;
+            }
+        }
+        setvbuf(stdout, NULL, _IOFBF, BATCH_OUTPUT_BUFFER);
+        fat32SetDeferredFlush(volume, true);
+    }
+
     // Activate the shell with the fat32 image for the remainder of the program
-    shell(argv[1], &bootSector);
+    shell(argv[1], volume, input, batch, checkpointInterval);
+    if (input != stdin) {
+        fclose(input);
+    }
 
-    // Close the file before exiting the program
-    fclose(imgFile);
+    // Write back any dirty clusters, FAT sectors and the FSInfo sector, then close the file before exiting the program
+    if (fat32Unmount(volume) != FAT32_OK) {
+        printf("Error writing changes back to the image.\n");
+        return 1;
+    }
     return 0;
 }